@@ -0,0 +1,101 @@
+"""
+Python binding for the read-only DADA buffer metrics reader.
+
+This wraps libdada_metrics.so (built alongside roach2_udpdb) with ctypes. The structure here must
+match dada_metrics_t in roach2_software/roach2_udpdb/dada_metrics.h; the size is checked against
+the library when it is loaded.
+"""
+import ctypes
+import os
+
+HISTORY = 64
+
+
+class DadaMetricsData(ctypes.Structure):
+    _fields_ = [('time_us', ctypes.c_int64),
+                ('nbufs', ctypes.c_uint64),
+                ('bufsz', ctypes.c_uint64),
+                ('full', ctypes.c_uint64),
+                ('clear', ctypes.c_uint64),
+                ('write_count', ctypes.c_uint64),
+                ('read_count', ctypes.c_uint64)]
+
+    def as_dict(self):
+        return {name: getattr(self, name) for name, _ in self._fields_}
+
+
+_library = None
+
+
+def load_library(path):
+    """Load libdada_metrics.so. Raises OSError if it cannot be used."""
+    global _library
+    if _library is not None:
+        return _library
+    lib = ctypes.CDLL(path)
+    lib.dada_metrics_attach.restype = ctypes.c_void_p
+    lib.dada_metrics_attach.argtypes = [ctypes.c_uint32]
+    lib.dada_metrics_read.restype = ctypes.c_int
+    lib.dada_metrics_read.argtypes = [ctypes.c_void_p, ctypes.POINTER(DadaMetricsData)]
+    lib.dada_metrics_history.restype = ctypes.c_uint64
+    lib.dada_metrics_history.argtypes = [ctypes.c_void_p, ctypes.POINTER(DadaMetricsData), ctypes.c_uint64]
+    lib.dada_metrics_detach.restype = None
+    lib.dada_metrics_detach.argtypes = [ctypes.c_void_p]
+    lib.dada_metrics_size.restype = ctypes.c_uint64
+    lib.dada_metrics_size.argtypes = []
+    if lib.dada_metrics_size() != ctypes.sizeof(DadaMetricsData):
+        raise OSError(f"{path} does not match this version of dada_metrics.py")
+    _library = lib
+    return lib
+
+
+class DadaMetrics:
+    """
+    Reader for the metrics of one DADA data block, identified by its key.
+    """
+
+    def __init__(self, key, library_path):
+        self.lib = load_library(library_path)
+        self.key = int(str(key), 16)
+        self.handle = None
+        self.data = DadaMetricsData()
+        self.samples = (DadaMetricsData * HISTORY)()
+
+    def read(self):
+        """Return the metrics now as a dict, or None if the buffer does not exist."""
+        if self.handle is None:
+            self.handle = self.lib.dada_metrics_attach(self.key)
+            if not self.handle:
+                self.handle = None
+                return None
+        if self.lib.dada_metrics_read(self.handle, ctypes.byref(self.data)) != 0:
+            # the buffer has gone, perhaps to be made again; attach afresh next time.
+            self.close()
+            return None
+        return self.data.as_dict()
+
+    def history(self):
+        """The past reads, oldest first, as a list of dicts."""
+        if self.handle is None:
+            return []
+        count = self.lib.dada_metrics_history(self.handle, self.samples, HISTORY)
+        return [self.samples[i].as_dict() for i in range(count)]
+
+    def rates(self):
+        """Blocks written and read per second over the history, or None if there is not enough of it."""
+        history = self.history()
+        if len(history) < 2 or history[-1]['time_us'] <= history[0]['time_us']:
+            return None
+        seconds = (history[-1]['time_us'] - history[0]['time_us']) * 1e-6
+        return dict(write=(history[-1]['write_count'] - history[0]['write_count']) / seconds,
+                    read=(history[-1]['read_count'] - history[0]['read_count']) / seconds)
+
+    def close(self):
+        if self.handle is not None:
+            self.lib.dada_metrics_detach(self.handle)
+            self.handle = None
+
+
+def default_library_path(roach2_udpdb):
+    """libdada_metrics.so is built in the same directory as roach2_udpdb."""
+    return os.path.join(os.path.dirname(roach2_udpdb), 'libdada_metrics.so')
@@ -161,23 +161,25 @@ class NunaBackend(SubComponent):
             centre_freq=1532)  # Should this be in config or set by telescope system into state?
         config['system_settings'] = {'ncpu': 16}
 
-        low_ringbuffer = dict(label='low_subband', key='1234', bufsz=838860800, hdrsz=4096, nbufs=20)
-        high_ringbuffer = dict(label='high_subband', key='2234', bufsz=838860800, hdrsz=4096, nbufs=20)
+        low_ringbuffer = dict(label='low_subband', key='1234', bufsz=838860800, hdrsz=4096, nbufs=20, interface='ens1f1')
+        high_ringbuffer = dict(label='high_subband', key='2234', bufsz=838860800, hdrsz=4096, nbufs=20, interface='ens1f0')
 
         config['ringbuffers'] = [low_ringbuffer, high_ringbuffer]
 
         config['roach2_settings'] = {
             'low_chans_config': dict(addr='10.0.3.1', port=60000, ctl_fifo='low_chans_control_fifo',
                                      mon_fifo='low_chans_monitor_fifo', interface='ens1f1', priority=-10,
-                                     dada=low_ringbuffer, extra_cmd_options=['-F']),
+                                     dada=low_ringbuffer, extra_cmd_options=['-F', '-A', 'auto']),
             'high_chans_config': dict(addr='10.0.3.2', port=60000, ctl_fifo='high_chans_control_fifo',
                                       mon_fifo='high_chans_monitor_fifo', interface='ens1f0', priority=-10,
-                                      dada=high_ringbuffer, extra_cmd_options=['-F']),
+                                      dada=high_ringbuffer, extra_cmd_options=['-F', '-A', 'auto']),
             'roach2_reprogram_script': '/opt/roach2_control/reprogram.sh',
             'roach2_1pps_sync_script': '/opt/roach2_control/sync_1pps.sh',
             'roach2_network_init_script': '/opt/roach2_control/set_network_params.sh',
             'roach2_udpdb': '/home/mkeith/jumps/roach2_software/roach2_udpdb/roach2_udpdb',
-            'interfaces': ['ens1f0', 'ens1f1']
+            'interfaces': ['ens1f0', 'ens1f1'],
+            # keep roach2_udpdb running between observations, starting each one through the control pipe.
+            'daemon': False
         }
 
         skz_options = "-skz -skzn 5 -skzm 256 -overlap -skz_start 70 -skz_end 490 -skzs 4 -skz_no_fscr -skz_no_tscr".split()
@@ -236,7 +238,16 @@ class NunaBackend(SubComponent):
         # Once the CPU map is set, we can actually start the obseving
 
         # Create the ringbuffers
-        for kwargs in self.config['ringbuffers']:
+        ringbuffers = self.config['ringbuffers']
+        if self.config['roach2_settings'].get('daemon', False):
+            # roach2_udpdb stays attached to the ringbuffers between observations, so only make those that
+            # are missing, after stopping it.
+            ringbuffers = [kwargs for kwargs in ringbuffers
+                           if not state.get('ringbuffer', {}).get(kwargs['label'], {}).get('ready', False)]
+            if ringbuffers:
+                self.digitiser_interface.shutdown()
+                self.digitiser_interface.wait()
+        for kwargs in ringbuffers:
             self.ringbuffer.destroy_buffer(kwargs['label'])
             self.ringbuffer.create_buffer(**kwargs)
         # Wait for the ringbuffers to start.
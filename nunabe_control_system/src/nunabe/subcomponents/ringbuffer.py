@@ -1,7 +1,9 @@
 import subprocess
 import logging
+import shutil
 
 from ..subcomponent import SubComponent, subcomponentmethod
+from .. import dada_metrics
 
 
 class Ringbuffer(SubComponent):
@@ -17,10 +19,16 @@ class Ringbuffer(SubComponent):
         self.backend = backend
         self.keys = {}
         self.states = {}
+        self.metrics = {}
+        self.metrics_library = None
         self.log = logging.getLogger("nunabe.ringbuffer")
 
     @subcomponentmethod
-    def create_buffer(self, label, key, bufsz=524288, hdrsz=4096, nbufs=128):
+    def create_buffer(self, label, key, bufsz=524288, hdrsz=4096, nbufs=128, interface=None, numa_node=None):
+        """
+        Create a dada_db buffer. If numa_node is given, or can be found from the network interface
+        that fills the buffer, it is created on that NUMA node and every page is faulted in there.
+        """
         key = str(key)
         self.log.info(f"create ringbuffer {label} / {key}")
         if label in self.states:
@@ -38,8 +46,18 @@ class Ringbuffer(SubComponent):
             return
 
         cmd = [str(i) for i in ['dada_db', '-k', key, '-b', bufsz, '-a', hdrsz, '-n', nbufs, '-l']]
+        if numa_node is None and interface is not None:
+            numa_node = interface_numa_node(interface)
+        if numa_node is not None and numa_node >= 0:
+            if shutil.which('numactl'):
+                # page in every block (-p) so the memory is allocated under the numactl policy.
+                cmd = ['numactl', f'--preferred={numa_node}'] + cmd + ['-p']
+            else:
+                self.log.warning(f"numactl not found, ringbuffer {label} will not be placed on NUMA node {numa_node}")
+                numa_node = None
         self.keys[label] = key
         self.states[label] = newstate(key)
+        self.states[label]['numa_node'] = -1 if numa_node is None else numa_node
         try:
             self.log.info("! " + " ".join(cmd))
             ret = subprocess.run(cmd, timeout=5.0)
@@ -73,6 +91,7 @@ class Ringbuffer(SubComponent):
             return
 
         key = self.keys[label]
+        self.close_metrics(label)
         self.states[label]['hdrsz'] = 0
         self.states[label]['nbufs'] = 0
         self.states[label]['bufzs'] = 0
@@ -104,24 +123,77 @@ class Ringbuffer(SubComponent):
 
         for label in self.states:
             if self.states[label]['ready']:
-                cmd = ['dada_dbmetric', '-k', self.states[label]['key']]
-                try:
-                    self.log.debug("! " + " ".join(cmd))
-                    ret = subprocess.run(cmd, timeout=0.1, encoding='utf-8',capture_output=True)
-                    self.log.debug(f"dada_dbmetric: '{ret.stderr}'")
-
-                    total, full, clear, _, _, _, _, _, _, _ = [int(e) for e in ret.stderr.split(",")]
-                    self.states[label]['nbufs'] = total
-                    self.states[label]['clear'] = clear
-                    self.states[label]['full'] = full
-                    self.states[label]['used'] = full / total
-
-                except subprocess.TimeoutExpired:
-                    self.backend.logerr("dada_dbmetric timed out")
-                    self.states[label]['error'] = 'Could not monitor: Timeout'
+                if self.open_metrics(label):
+                    self.read_metrics(label)
+                else:
+                    self.run_dbmetric(label)
 
         self.backend.update_state({'ringbuffer': self.states})
 
+    def open_metrics(self, label):
+        """
+        Get a reader for the metrics of a buffer from libdada_metrics.so. Returns False if the
+        library cannot be used, in which case we fall back to running dada_dbmetric.
+        """
+        if label in self.metrics:
+            return True
+        if self.metrics_library == '':
+            return False
+        if self.metrics_library is None:
+            settings = self.backend.config['roach2_settings']
+            self.metrics_library = settings.get('dada_metrics_library',
+                                                dada_metrics.default_library_path(settings['roach2_udpdb']))
+        try:
+            self.metrics[label] = dada_metrics.DadaMetrics(self.states[label]['key'], self.metrics_library)
+        except OSError as e:
+            if self.metrics_library:
+                self.log.warning(f"DADA metrics library not available, using dada_dbmetric ({e})")
+                self.metrics_library = ''
+            return False
+        return True
+
+    def close_metrics(self, label):
+        if label in self.metrics:
+            self.metrics.pop(label).close()
+
+    def read_metrics(self, label):
+        metrics = self.metrics[label].read()
+        if metrics is None:
+            self.states[label]['error'] = 'Could not monitor: no buffer'
+            return
+        if self.states[label]['error'].startswith('Could not monitor'):
+            self.states[label]['error'] = ''
+        total = metrics['nbufs']
+        self.states[label]['nbufs'] = total
+        self.states[label]['clear'] = metrics['clear']
+        self.states[label]['full'] = metrics['full']
+        self.states[label]['used'] = metrics['full'] / total if total else 0.0
+        self.states[label]['write_count'] = metrics['write_count']
+        self.states[label]['read_count'] = metrics['read_count']
+        rates = self.metrics[label].rates()
+        if rates is not None:
+            self.states[label]['write_rate'] = rates['write']
+            self.states[label]['read_rate'] = rates['read']
+        self.states[label]['history'] = [(sample['time_us'], sample['full'])
+                                         for sample in self.metrics[label].history()]
+
+    def run_dbmetric(self, label):
+        cmd = ['dada_dbmetric', '-k', self.states[label]['key']]
+        try:
+            self.log.debug("! " + " ".join(cmd))
+            ret = subprocess.run(cmd, timeout=0.1, encoding='utf-8',capture_output=True)
+            self.log.debug(f"dada_dbmetric: '{ret.stderr}'")
+
+            total, full, clear, _, _, _, _, _, _, _ = [int(e) for e in ret.stderr.split(",")]
+            self.states[label]['nbufs'] = total
+            self.states[label]['clear'] = clear
+            self.states[label]['full'] = full
+            self.states[label]['used'] = full / total
+
+        except subprocess.TimeoutExpired:
+            self.backend.logerr("dada_dbmetric timed out")
+            self.states[label]['error'] = 'Could not monitor: Timeout'
+
     def handle_exception(self, e):
         self.log.critical(f"Exception raised!! '{e}'")
 
@@ -143,6 +215,16 @@ class Ringbuffer(SubComponent):
         self.log.info("Ringbuffer Process Started")
 
 
+def interface_numa_node(interface):
+    """NUMA node of the device behind a network interface, or None if it is not known."""
+    try:
+        with open(f"/sys/class/net/{interface}/device/numa_node") as f:
+            node = int(f.readline())
+    except (OSError, ValueError):
+        return None
+    return node if node >= 0 else None
+
+
 def newstate(key):
     return {'key': key,
             'bufsz': 0,
@@ -151,5 +233,11 @@ def newstate(key):
             'full': 0,
             'used': 0.0,
             'clear': 0,
+            'write_count': 0,
+            'read_count': 0,
+            'write_rate': 0.0,  # blocks per second, over the metrics history
+            'read_rate': 0.0,
+            'history': [],  # (time in microseconds, full blocks) of recent reads
+            'numa_node': -1,
             'error': '',
             'ready': False}
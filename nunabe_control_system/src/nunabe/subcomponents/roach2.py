@@ -5,6 +5,7 @@ import time
 import math
 
 from .kill_processes import kill_processes
+from .. import udpdb_stats
 from ..subcomponent import SubComponent, subcomponentmethod
 
 import uuid
@@ -30,6 +31,13 @@ class Roach2(SubComponent):
         self.low_proc = None
         self.mon_fifo = {}
         self.ctl_fifo = {}
+        self.stats = {}
+        self.stats_pid = {}
+        self.stats_updates = {}
+        # in daemon mode, the command line roach2_udpdb is running with, and the observation count when each
+        # observation was started.
+        self.daemon_cmd = None
+        self.observations_at_start = {}
         self.backend = backend
         self.log = logging.getLogger("nunabe.roach2")
 
@@ -79,7 +87,13 @@ class Roach2(SubComponent):
 
     @subcomponentmethod
     def start_observation(self, observing_time):
-        self.close_pipes()
+        """
+        Launch roach2_udpdb for an observation of observing_time seconds. With 'daemon' set in roach2_settings
+        it is launched with -d and stays running between observations, each of which is started with a START
+        command on the control pipe; it is only relaunched if its command line would change.
+        Daemon mode relies on the shared memory statistics to tell when an observation has finished.
+        """
+        daemon = self.backend.config['roach2_settings'].get('daemon', False)
         low_chans_config = self.backend.config['roach2_settings']['low_chans_config']
         high_chans_config = self.backend.config['roach2_settings']['high_chans_config']
 
@@ -105,14 +119,6 @@ class Roach2(SubComponent):
             nice = config['priority']
             ctl_fifo = os.path.join(self.uwd, config['ctl_fifo'])
             mon_fifo = os.path.join(self.uwd, config['mon_fifo'])
-            # In case we somehow already have a pipe... try to delete it
-            if os.path.exists(ctl_fifo):
-                os.unlink(ctl_fifo)
-            if os.path.exists(mon_fifo):
-                os.unlink(mon_fifo)
-            # make the named pipes for use later
-            os.mkfifo(ctl_fifo)
-            os.mkfifo(mon_fifo)
 
             cmd = ['nice', '-n', str(nice),
                    'taskset', '-c', str(dada_cpu),
@@ -124,17 +130,29 @@ class Roach2(SubComponent):
                    '-M', mon_fifo,
                    '-f', str(freq),
                    '-b', str(bw),
-                   '-c', str(socket_cpu),
-                   '-T', str(observing_time)]
+                   '-c', str(socket_cpu)]
+            # a daemon is given the duration with each START command instead.
+            cmd.extend(['-d'] if daemon else ['-T', str(observing_time)])
             cmd.extend(config['extra_cmd_options'])
             return cmd, ctl_fifo, mon_fifo
 
+        if self.backend.config['roach2_settings'].get('single_process', False):
+            self.start_single_process(low_chans_config, high_chans_config, low_chan_centre_freq,
+                                      high_chan_centre_freq, half_bandwidth, observing_time, daemon)
+            return
+
         # Start the roach2_udpdb programmes to listen.
 
         low_cmd, low_ctl_fifo_f, low_mon_fifo_f = get_commandline(low_chans_config, low_chan_centre_freq,
                                                                   half_bandwidth)
         high_cmd, high_ctl_fifo_f, high_mon_fifo_f = get_commandline(high_chans_config, high_chan_centre_freq,
                                                                      half_bandwidth)
+        if daemon and self.daemon_running(low_cmd + high_cmd):
+            self.start_daemon_observation(observing_time)
+            return
+        self.stop_daemon()
+        self.close_pipes()
+        self.make_fifos([low_ctl_fifo_f, low_mon_fifo_f, high_ctl_fifo_f, high_mon_fifo_f])
 
         self.log.info(f"Starting {roach2_udpdb}")
         self.log.info("! " + " ".join(low_cmd))
@@ -143,12 +161,19 @@ class Roach2(SubComponent):
         self.log.info("! " + " ".join(high_cmd))
         self.high_proc = subprocess.Popen(high_cmd) 
 
+        self.open_stats([('low', low_chans_config['dada']['key'], self.low_proc),
+                         ('high', high_chans_config['dada']['key'], self.high_proc)])
+
         self.mon_fifo = dict(low=os.fdopen(os.open(low_mon_fifo_f, os.O_RDONLY | os.O_NONBLOCK)),
                              high=os.fdopen(os.open(high_mon_fifo_f, os.O_RDONLY | os.O_NONBLOCK)))
         self.ctl_fifo = dict(low=open(low_ctl_fifo_f, 'w'), high=open(high_ctl_fifo_f, 'w'))
 
         self.state['udpdb_low'] = 'Launched'
         self.state['udpdb_high'] = 'Launched'
+        if daemon:
+            self.daemon_cmd = low_cmd + high_cmd
+            self.start_daemon_observation(observing_time)
+            return
         self.state['state'] = 'Running'
         self.backend.update_state({'roach2': self.state})
 
@@ -156,17 +181,148 @@ class Roach2(SubComponent):
 
         return
 
+    def start_single_process(self, low_chans_config, high_chans_config, low_chan_centre_freq, high_chan_centre_freq,
+                             half_bandwidth, observing_time, daemon=False):
+        """
+        Capture both halves of the band with one roach2_udpdb process, one -S option per stream.
+        They share a start time and write a single monitor pipe, with the stream index as the last field.
+        """
+        inv_cpu_map = dict((v, k) for k, v in self.backend.cpu_map.items())
+        roach2_udpdb = self.backend.config['roach2_settings']['roach2_udpdb']
+
+        ctl_fifo = os.path.join(self.uwd, low_chans_config['ctl_fifo'])
+        mon_fifo = os.path.join(self.uwd, low_chans_config['mon_fifo'])
+
+        dada_cpus = []
+        streams = []
+        for config, freq in [(low_chans_config, low_chan_centre_freq), (high_chans_config, high_chan_centre_freq)]:
+            ifce = config['interface']
+            socket_cpu = inv_cpu_map[f"roach2_socket_thread_{ifce}"]
+            dada_cpus.append(str(inv_cpu_map[f"roach2_dada_thread_{ifce}"]))
+            streams.extend(['-S', f"{config['addr']}:{config['port']}:{config['dada']['key']}:{freq}:{socket_cpu}"])
+
+        cmd = ['nice', '-n', str(low_chans_config['priority']),
+               'taskset', '-c', ",".join(dada_cpus),
+               roach2_udpdb]
+        cmd.extend(streams)
+        cmd.extend(['-C', ctl_fifo,
+                    '-M', mon_fifo,
+                    '-b', str(half_bandwidth)])
+        cmd.extend(['-d'] if daemon else ['-T', str(observing_time)])
+        cmd.extend(low_chans_config['extra_cmd_options'])
+
+        if daemon and self.daemon_running(cmd):
+            self.start_daemon_observation(observing_time)
+            return
+        self.stop_daemon()
+        self.close_pipes()
+        self.make_fifos([ctl_fifo, mon_fifo])
+
+        self.log.info(f"Starting {roach2_udpdb}")
+        self.log.info("! " + " ".join(cmd))
+        self.low_proc = subprocess.Popen(cmd)
+        self.high_proc = None
+
+        self.open_stats([('low', low_chans_config['dada']['key'], self.low_proc),
+                         ('high', high_chans_config['dada']['key'], self.low_proc)])
+
+        self.mon_fifo = dict(both=os.fdopen(os.open(mon_fifo, os.O_RDONLY | os.O_NONBLOCK)))
+        self.ctl_fifo = dict(both=open(ctl_fifo, 'w'))
+
+        self.state['udpdb_low'] = 'Launched'
+        self.state['udpdb_high'] = 'Launched'
+        if daemon:
+            self.daemon_cmd = cmd
+            self.start_daemon_observation(observing_time)
+            return
+        self.state['state'] = 'Running'
+        self.backend.update_state({'roach2': self.state})
+
+    def make_fifos(self, fifos):
+        for fifo in fifos:
+            # In case we somehow already have a pipe... try to delete it
+            if os.path.exists(fifo):
+                os.unlink(fifo)
+            os.mkfifo(fifo)
+
+    def daemon_running(self, cmd):
+        """
+        True if roach2_udpdb is already running as a daemon with this command line.
+        """
+        procs = [proc for proc in [self.low_proc, self.high_proc] if proc is not None]
+        return self.daemon_cmd == cmd and len(procs) > 0 and all(proc.poll() is None for proc in procs)
+
+    def send_command(self, command):
+        for key, fifo in self.ctl_fifo.items():
+            try:
+                fifo.write(command + "\n")
+                fifo.flush()
+            except (OSError, ValueError) as e:
+                self.log.warning(f"Could not send {command} to roach2_udpdb ({key}): {e}")
+
+    def start_daemon_observation(self, observing_time):
+        self.observations_at_start = dict(low=self.state.get('udpdb_observations_low', 0),
+                                          high=self.state.get('udpdb_observations_high', 0))
+        self.log.info(f"Starting a {observing_time}s observation with the running roach2_udpdb")
+        self.send_command(f"START DURATION={observing_time}")
+        self.state['state'] = 'Running'
+        self.backend.update_state({'roach2': self.state})
+
+    def daemon_completed(self):
+        """
+        True once every stream is idle again, having finished the observation it was started for.
+        """
+        return all(self.state.get(f'udpdb_{key}') == 'IDLE' and
+                   self.state.get(f'udpdb_observations_{key}', 0) > self.observations_at_start.get(key, 0)
+                   for key in ['low', 'high'])
+
+    def stop_daemon(self):
+        """
+        Ask a roach2_udpdb daemon to quit, and make sure that it has.
+        """
+        if self.daemon_cmd is None:
+            return
+        self.send_command("QUIT")
+        procs = [proc for proc in [self.low_proc, self.high_proc] if proc is not None]
+        for proc in procs:
+            try:
+                # roach2_udpdb gives up waiting for its threads after 5s.
+                proc.wait(timeout=10.0)
+            except subprocess.TimeoutExpired:
+                self.log.warning("roach2_udpdb did not quit when asked")
+        kill_processes(procs)
+        self.low_proc = None
+        self.high_proc = None
+        self.daemon_cmd = None
+        self.close_pipes()
+        self.close_stats()
+
     @subcomponentmethod
     def abort_observation(self):
-        # @todo: Tell the data stream to stop...
+        if self.daemon_cmd is not None:
+            self.send_command("ABORT")
         self.cleanup_observation()
         return
 
+    @subcomponentmethod
+    def shutdown(self):
+        """
+        Stop roach2_udpdb, even if it is running as a daemon.
+        """
+        self.stop_daemon()
+        self.cleanup_observation()
+
     @subcomponentmethod
     def cleanup_observation(self):
+        if self.daemon_cmd is not None:
+            # the daemon stays running for the next observation.
+            self.state['state'] = 'Idle'
+            self.backend.update_state({'roach2': self.state})
+            return
         kill_processes([self.low_proc,self.high_proc]) 
         
         self.close_pipes()
+        self.close_stats()
 
         self.state['udpdb_low'] = 'Stopped'
         self.state['udpdb_high'] = 'Stopped'
@@ -200,38 +356,40 @@ class Roach2(SubComponent):
             # context->packet_count, context->dropped_packets,
             # context->block_count, context->packets_to_read, context->seconds_per_packet,
             # context->buffer_lag, context->max_buffer_lag, context->recent_buffer_lag,context->number_of_overruns,
-            # NUM_PACKET_BUFFERS);
-            for key in self.mon_fifo:
-                while line := self.mon_fifo[key].readline():
+            # NUM_PACKET_BUFFERS, receive_syscalls, packets_per_syscall, stream_index,
+            # reordered_packets, late_packets, duplicate_packets);
+            # The shared memory statistics are read if they are available, otherwise we use the monitor pipe.
+            from_shared_memory = self.read_stats()
+            for fifo_key in self.mon_fifo:
+                while line := self.mon_fifo[fifo_key].readline():
                     e = line.split()
-                    state = e[0]
-                    packet_count = int(e[1])
-                    dropped_packets = int(e[2])
-                    block_count = int(e[3])
-                    packets_to_read = int(e[4])
-                    seconds_per_packet = float(e[5])
-                    buffer_lag = int(e[6])
-                    max_buffer_lag = int(e[7])
-                    recent_buffer_lag = int(e[8])
-                    number_of_overruns = int(e[9])
-                    buffer_size = int(e[10])
-                    self.state[f'udpdb_{key}'] = state
-                    self.state[f'udpdb_progress_{key}'] = dict(recorded=seconds_per_packet * packet_count,
-                                                               remaining=seconds_per_packet * (
-                                                                       packets_to_read - packet_count))
-                    self.state[f'udpdb_buffer_{key}'] = dict(buffer_lag=buffer_lag, max_buffer_lag=max_buffer_lag,
-                                                             recent_buffer_lag=recent_buffer_lag,
-                                                             number_of_overruns=number_of_overruns,
-                                                             buffer_size=buffer_size)
-                    self.state[f'udpdb_packets_{key}'] = dict(packet_count=packet_count,
-                                                              dropped_packets=dropped_packets,
-                                                              block_count=block_count, packets_to_read=packets_to_read,
-                                                              seconds_per_packet=seconds_per_packet)
-                    self.log.info(
-                        f"{state} ({key}) {seconds_per_packet * packet_count}s Dropped packets: {dropped_packets} Overruns: {number_of_overruns}")
+                    key = fifo_key
+                    if fifo_key == 'both':
+                        # one process for both streams, in the order low, high.
+                        key = 'high' if len(e) > 13 and int(e[13]) == 1 else 'low'
+                    if key in from_shared_memory:
+                        continue
+                    # older versions of roach2_udpdb do not report the syscall or reorder counts.
+                    self.update_udpdb_state(key, dict(state=e[0],
+                                                      packet_count=int(e[1]),
+                                                      dropped_packets=int(e[2]),
+                                                      block_count=int(e[3]),
+                                                      packets_to_read=int(e[4]),
+                                                      seconds_per_packet=float(e[5]),
+                                                      buffer_lag=int(e[6]),
+                                                      max_buffer_lag=int(e[7]),
+                                                      recent_buffer_lag=int(e[8]),
+                                                      number_of_overruns=int(e[9]),
+                                                      ring_slots=int(e[10]),
+                                                      receive_syscalls=int(e[11]) if len(e) > 11 else 0,
+                                                      packets_per_syscall=float(e[12]) if len(e) > 12 else 0.0,
+                                                      reordered_packets=int(e[14]) if len(e) > 14 else 0,
+                                                      late_packets=int(e[15]) if len(e) > 15 else 0,
+                                                      duplicate_packets=int(e[16]) if len(e) > 16 else 0))
             completed=0
             errors=0
-            for proc in [self.low_proc, self.high_proc]:
+            procs = [proc for proc in [self.low_proc, self.high_proc] if proc is not None]
+            for proc in procs:
                 ret = proc.poll()
                 if ret is not None:
                     if ret == 0:
@@ -240,11 +398,123 @@ class Roach2(SubComponent):
                         errors +=1
             if errors > 0:
                 self.state['state'] = 'Error'
-            if completed and completed == 2:
+            if self.daemon_cmd is not None:
+                if completed:
+                    # a daemon should only exit when told to quit.
+                    self.state['state'] = 'Error'
+                elif self.daemon_completed():
+                    self.state['state'] = 'Completed'
+            elif completed and completed == len(procs):
                 self.state['state'] = 'Completed'
 
         self.backend.update_state({"roach2": self.state})
 
+    def read_stats(self):
+        """
+        Update the state from the roach2_udpdb shared memory statistics.
+        Returns the streams that were updated this way.
+        """
+        updated = set()
+        for key, reader in self.stats.items():
+            try:
+                stats = reader.read()
+            except OSError as e:
+                self.log.warning(f"Could not read udpdb statistics ({key}): {e}")
+                stats = None
+            # ignore anything left over from a previous observation.
+            if stats is None or stats['pid'] != self.stats_pid.get(key):
+                continue
+            updated.add(key)
+            if stats['updates'] == self.stats_updates.get(key):
+                continue
+            self.stats_updates[key] = stats['updates']
+            syscalls = stats['receive_syscalls']
+            stats['packets_per_syscall'] = stats['packets_received'] / syscalls if syscalls else 0.0
+            self.update_udpdb_state(key, stats)
+        return updated
+
+    def open_stats(self, streams):
+        """
+        Attach to the shared memory statistics for each stream, given as (name, dada key, process).
+        """
+        self.close_stats()
+        roach2_udpdb = self.backend.config['roach2_settings']['roach2_udpdb']
+        library = self.backend.config['roach2_settings'].get('udpdb_stats_library',
+                                                            udpdb_stats.default_library_path(roach2_udpdb))
+        for name, key, proc in streams:
+            try:
+                self.stats[name] = udpdb_stats.UdpdbStats(key, library)
+                self.stats_pid[name] = proc.pid
+            except OSError as e:
+                self.log.warning(f"Shared memory statistics not available, using monitor pipe ({e})")
+                return
+
+    def close_stats(self):
+        for reader in self.stats.values():
+            reader.close()
+        self.stats = {}
+        self.stats_pid = {}
+        self.stats_updates = {}
+
+    def update_udpdb_state(self, key, stats):
+        state = stats['state']
+        packet_count = stats['packet_count']
+        dropped_packets = stats['dropped_packets']
+        packets_to_read = stats['packets_to_read']
+        seconds_per_packet = stats['seconds_per_packet']
+        number_of_overruns = stats['number_of_overruns']
+        self.state[f'udpdb_{key}'] = state
+        if 'observations' in stats:
+            self.state[f'udpdb_observations_{key}'] = stats['observations']
+        self.state[f'udpdb_progress_{key}'] = dict(recorded=seconds_per_packet * packet_count,
+                                                   remaining=seconds_per_packet * (packets_to_read - packet_count))
+        self.state[f'udpdb_buffer_{key}'] = dict(buffer_lag=stats['buffer_lag'],
+                                                 max_buffer_lag=stats['max_buffer_lag'],
+                                                 recent_buffer_lag=stats['recent_buffer_lag'],
+                                                 number_of_overruns=number_of_overruns,
+                                                 buffer_size=stats['ring_slots'],
+                                                 receive_syscalls=stats['receive_syscalls'],
+                                                 packets_per_syscall=stats['packets_per_syscall'])
+        if 'lag_histogram' in stats:
+            self.state[f'udpdb_buffer_{key}']['lag_histogram'] = stats['lag_histogram']
+            self.state[f'udpdb_threads_{key}'] = dict(capture_cpu=stats['capture_cpu'],
+                                                      capture_cpu_time=stats['capture_cpu_time_ns'] / 1e9,
+                                                      socket_cpu=stats['socket_cpu'],
+                                                      socket_cpu_time=stats['socket_cpu_time_ns'] / 1e9)
+        if stats.get('sk_windows'):
+            self.state[f'udpdb_sk_{key}'] = dict(windows=stats['sk_windows'],
+                                                 flagged_windows=stats['sk_flagged_windows'],
+                                                 block_flagged_fraction=stats['sk_block_flagged_fraction'])
+        if stats.get('filterbank_blocks'):
+            self.state[f'udpdb_filterbank_{key}'] = dict(blocks=stats['filterbank_blocks'],
+                                                         dropped_blocks=stats['filterbank_dropped_blocks'])
+        if stats.get('pipeline_stages'):
+            self.state[f'udpdb_pipeline_{key}'] = dict(source_waits=stats['pipeline_source_waits'],
+                                                       source_wait_time=stats['pipeline_source_wait_ns'] / 1e9,
+                                                       stages=stats['pipeline_stages'])
+        if stats.get('timestamp_source', 'none') != 'none':
+            self.state[f'udpdb_timing_{key}'] = dict(timestamp_source=stats['timestamp_source'],
+                                                     receive_latency_histogram=stats['receive_latency_histogram'],
+                                                     ring_latency_histogram=stats['ring_latency_histogram'],
+                                                     packet_gap_histogram=stats['packet_gap_histogram'],
+                                                     pps_offset=stats['pps_offset_ns'] / 1e9)
+        if stats.get('spill_slots'):
+            self.state[f'udpdb_spill_{key}'] = dict(slots=stats['spill_slots'],
+                                                    depth=stats['spill_depth'],
+                                                    max_depth=stats['spill_max_depth'],
+                                                    blocks=stats['spill_blocks'],
+                                                    dropped_blocks=stats['spill_dropped_blocks'],
+                                                    dropped_bytes=stats['spill_dropped_bytes'])
+        self.state[f'udpdb_packets_{key}'] = dict(packet_count=packet_count,
+                                                  dropped_packets=dropped_packets,
+                                                  block_count=stats['block_count'], packets_to_read=packets_to_read,
+                                                  seconds_per_packet=seconds_per_packet,
+                                                  reordered_packets=stats['reordered_packets'],
+                                                  late_packets=stats['late_packets'],
+                                                  duplicate_packets=stats['duplicate_packets'])
+        self.log.info(
+            f"{state} ({key}) {seconds_per_packet * packet_count}s Dropped packets: {dropped_packets} Overruns: {number_of_overruns}")
+
     def start(self):
         super().start()
         self.uuid = str(uuid.uuid4())
@@ -271,6 +541,7 @@ class Roach2(SubComponent):
     def stop(self):
         self.backend.log.info("Stopping ROACH interface")
         self.abort_observation()
+        self.shutdown()
         try:
             shutil.rmtree(self.uwd)
         except IOError:
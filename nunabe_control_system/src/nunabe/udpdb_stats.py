@@ -0,0 +1,155 @@
+"""
+Python binding for the shared memory statistics published by roach2_udpdb.
+
+This wraps libudpdb_stats.so (built alongside roach2_udpdb) with ctypes. The structure here must
+match udpdb_stats_data_t in roach2_software/roach2_udpdb/udpdb_stats.h; the size is checked
+against the library when it is loaded.
+"""
+import ctypes
+import os
+
+LAG_BINS = 32
+TIMING_BINS = 32
+MAX_STAGES = 4
+STATE_NAMES = {0: 'STARTING', 1: 'WAITING', 2: 'RUNNING', 3: 'FINISHED', 4: 'ERROR', 5: 'IDLE'}
+TIMESTAMP_SOURCES = {0: 'none', 1: 'software', 2: 'hardware'}
+
+
+class UdpdbStatsStage(ctypes.Structure):
+    _fields_ = [('name', ctypes.c_char * 16),
+                ('core', ctypes.c_int32),
+                ('padding', ctypes.c_int32),
+                ('blocks', ctypes.c_int64),
+                ('busy_ns', ctypes.c_int64),
+                ('idle_ns', ctypes.c_int64),
+                ('queue_depth', ctypes.c_int64),
+                ('max_queue_depth', ctypes.c_int64)]
+
+    def as_dict(self):
+        d = {name: getattr(self, name) for name, _ in self._fields_ if name != 'padding'}
+        d['name'] = self.name.decode(errors='replace')
+        return d
+
+
+class UdpdbStatsData(ctypes.Structure):
+    _fields_ = [('magic', ctypes.c_uint32),
+                ('version', ctypes.c_uint32),
+                ('size', ctypes.c_uint64),
+                ('pid', ctypes.c_int64),
+                ('dada_key', ctypes.c_uint32),
+                ('stream_index', ctypes.c_int32),
+                ('state', ctypes.c_int32),
+                ('padding', ctypes.c_int32),
+                ('update_time_ns', ctypes.c_int64),
+                ('updates', ctypes.c_uint64),
+                ('packet_count', ctypes.c_int64),
+                ('dropped_packets', ctypes.c_int64),
+                ('block_count', ctypes.c_int64),
+                ('packets_to_read', ctypes.c_int64),
+                ('seconds_per_packet', ctypes.c_double),
+                ('buffer_lag', ctypes.c_int64),
+                ('max_buffer_lag', ctypes.c_int64),
+                ('recent_buffer_lag', ctypes.c_int64),
+                ('number_of_overruns', ctypes.c_int64),
+                ('ring_slots', ctypes.c_int64),
+                ('lag_histogram', ctypes.c_int64 * LAG_BINS),
+                ('packets_received', ctypes.c_int64),
+                ('receive_syscalls', ctypes.c_int64),
+                ('reordered_packets', ctypes.c_int64),
+                ('late_packets', ctypes.c_int64),
+                ('duplicate_packets', ctypes.c_int64),
+                ('capture_cpu', ctypes.c_int32),
+                ('socket_cpu', ctypes.c_int32),
+                ('capture_cpu_time_ns', ctypes.c_int64),
+                ('socket_cpu_time_ns', ctypes.c_int64),
+                ('sk_windows', ctypes.c_int64),
+                ('sk_flagged_windows', ctypes.c_int64),
+                ('sk_block_flagged_fraction', ctypes.c_double),
+                ('filterbank_blocks', ctypes.c_int64),
+                ('filterbank_dropped_blocks', ctypes.c_int64),
+                ('pipeline_nstages', ctypes.c_int32),
+                ('pipeline_padding', ctypes.c_int32),
+                ('pipeline_source_waits', ctypes.c_int64),
+                ('pipeline_source_wait_ns', ctypes.c_int64),
+                ('pipeline_stages', UdpdbStatsStage * MAX_STAGES),
+                ('observations', ctypes.c_int64),
+                ('timestamp_source', ctypes.c_int32),
+                ('timing_padding', ctypes.c_int32),
+                ('receive_latency_histogram', ctypes.c_int64 * TIMING_BINS),
+                ('ring_latency_histogram', ctypes.c_int64 * TIMING_BINS),
+                ('packet_gap_histogram', ctypes.c_int64 * TIMING_BINS),
+                ('pps_arrival_ns', ctypes.c_int64),
+                ('pps_offset_ns', ctypes.c_int64),
+                ('spill_slots', ctypes.c_int64),
+                ('spill_depth', ctypes.c_int64),
+                ('spill_max_depth', ctypes.c_int64),
+                ('spill_blocks', ctypes.c_int64),
+                ('spill_dropped_blocks', ctypes.c_int64),
+                ('spill_dropped_bytes', ctypes.c_int64)]
+
+    def as_dict(self):
+        d = {name: getattr(self, name) for name, _ in self._fields_
+             if name not in ('magic', 'padding', 'pipeline_padding', 'timing_padding')}
+        d['lag_histogram'] = list(self.lag_histogram)
+        for name in ['receive_latency_histogram', 'ring_latency_histogram', 'packet_gap_histogram']:
+            d[name] = list(getattr(self, name))
+        d['timestamp_source'] = TIMESTAMP_SOURCES.get(self.timestamp_source, 'unknown')
+        d['pipeline_stages'] = [stage.as_dict() for stage in self.pipeline_stages[:self.pipeline_nstages]]
+        d['state'] = STATE_NAMES.get(self.state, 'UNKNOWN')
+        return d
+
+
+_library = None
+
+
+def load_library(path):
+    """Load libudpdb_stats.so. Raises OSError if it cannot be used."""
+    global _library
+    if _library is not None:
+        return _library
+    lib = ctypes.CDLL(path)
+    lib.udpdb_stats_attach.restype = ctypes.c_void_p
+    lib.udpdb_stats_attach.argtypes = [ctypes.c_uint32]
+    lib.udpdb_stats_read.restype = ctypes.c_int
+    lib.udpdb_stats_read.argtypes = [ctypes.c_void_p, ctypes.POINTER(UdpdbStatsData)]
+    lib.udpdb_stats_detach.restype = None
+    lib.udpdb_stats_detach.argtypes = [ctypes.c_void_p]
+    lib.udpdb_stats_data_size.restype = ctypes.c_uint64
+    lib.udpdb_stats_data_size.argtypes = []
+    if lib.udpdb_stats_data_size() != ctypes.sizeof(UdpdbStatsData):
+        raise OSError(f"{path} does not match this version of udpdb_stats.py")
+    _library = lib
+    return lib
+
+
+class UdpdbStats:
+    """
+    Reader for the statistics of one roach2_udpdb stream, identified by its DADA key.
+    """
+
+    def __init__(self, key, library_path):
+        self.lib = load_library(library_path)
+        self.key = int(str(key), 16)
+        self.handle = None
+        self.data = UdpdbStatsData()
+
+    def read(self):
+        """Return the latest statistics as a dict, or None if there are none (yet)."""
+        if self.handle is None:
+            self.handle = self.lib.udpdb_stats_attach(self.key)
+            if not self.handle:
+                self.handle = None
+                return None
+        if self.lib.udpdb_stats_read(self.handle, ctypes.byref(self.data)) != 0:
+            return None
+        return self.data.as_dict()
+
+    def close(self):
+        if self.handle is not None:
+            self.lib.udpdb_stats_detach(self.handle)
+            self.handle = None
+
+
+def default_library_path(roach2_udpdb):
+    """libudpdb_stats.so is built in the same directory as roach2_udpdb."""
+    return os.path.join(os.path.dirname(roach2_udpdb), 'libudpdb_stats.so')
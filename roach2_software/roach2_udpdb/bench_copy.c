@@ -0,0 +1,170 @@
+/*
+ * Benchmark of copying packet payloads into a DADA buffer, the last step of the capture.
+ *
+ * The buffer is made by the benchmark itself, with a thread that reads and throws away each block
+ * (see bench_dada.h), so nothing else needs to be running. Each packet is decoded with
+ * decode_roach2_spead_packet_fast and its data copied in two ways:
+ *
+ *   ipcio_write  appended with ipcio_write, as output_write does without a stage block;
+ *   block        copied into its slot in a block opened with ipcio_open_block_write, as direct
+ *                placement and the stage blocks do.
+ *
+ * Reports packets per second, GB/s of data, ns per packet over each batch of packets and the CPU
+ * used, as JSON lines with -j (see bench_report.h) or as a line of text per method otherwise.
+ * The ns per packet is of whole batches, as timing each copy on its own would cost as much as it.
+ *
+ * Usage: bench_copy [-j] [-n packets] [-s block_size] [-N blocks] [-b band_select] [-k key]
+ */
+#include "decode_spead.h"
+#include "bench_report.h"
+#include "bench_dada.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PACKET_BUFFER_SIZE 4500
+// different packets to copy from, so the copies are not all from cache.
+#define PACKET_POOL 1024
+// packets timed together for the distribution.
+#define TIMING_BATCH 1024
+
+typedef enum copy_method_t {
+    COPY_IPCIO_WRITE = 0,
+    COPY_BLOCK
+} copy_method_t;
+
+
+int main (int argc, char **argv)
+{
+    uint64_t npackets = 1 << 22;
+    uint64_t block_size = 8 << 20;
+    uint64_t nblocks = 8;
+    uint64_t band_select = 0;
+    unsigned dada_key = 0xbe10;
+    char json = 0;
+    char arg;
+
+    while ((arg = getopt(argc, argv, "b:jk:n:s:N:")) != -1) {
+        switch (arg) {
+            case 'b':
+                sscanf(optarg,"%"SCNu64,&band_select);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'k':
+                if (sscanf(optarg,"%x",&dada_key) != 1) {
+                    fprintf(stderr,"Could not parse key %s\n",optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                sscanf(optarg,"%"SCNu64,&npackets);
+                break;
+            case 's':
+                sscanf(optarg,"%"SCNu64,&block_size);
+                break;
+            case 'N':
+                sscanf(optarg,"%"SCNu64,&nblocks);
+                break;
+        }
+    }
+
+    const uint64_t frames_per_heap = band_select_to_frames_per_heap(band_select);
+    const uint64_t data_size = band_select_to_data_size(band_select);
+    // whole packets in each block, as roach2_udpdb needs.
+    const uint64_t packets_per_block = block_size/data_size;
+    if (packets_per_block == 0 || npackets == 0 || nblocks == 0) {
+        fprintf(stderr,"Block size %"PRIu64" is less than a packet of %"PRIu64" bytes, or nothing to do\n",block_size,data_size);
+        return EXIT_FAILURE;
+    }
+    block_size = packets_per_block*data_size;
+
+    unsigned char* pool = malloc((size_t)PACKET_POOL*PACKET_BUFFER_SIZE);
+    for (unsigned i = 0; i < PACKET_POOL; ++i) {
+        unsigned char* packet = pool + (size_t)i*PACKET_BUFFER_SIZE;
+        const uint64_t header_length = encode_roach2_spead_header(packet, data_size, i*frames_per_heap, band_select);
+        memset(packet + header_length, i&0xff, data_size);
+    }
+    const uint64_t nsamples = (npackets + TIMING_BATCH - 1)/TIMING_BATCH;
+    double* samples = malloc(nsamples*sizeof(double));
+
+    const char* method_names[2] = {"ipcio_write", "block"};
+    for (int method = COPY_IPCIO_WRITE; method <= COPY_BLOCK; ++method) {
+        bench_dada_t* dada = bench_dada_create(dada_key, nblocks, block_size);
+        if (dada == NULL) {
+            return EXIT_FAILURE;
+        }
+        ipcio_t* data_block = &dada->data_block;
+        if (ipcio_open(data_block, 'W') < 0) {
+            fprintf(stderr,"Could not open the data block %x to write\n",dada_key);
+            bench_dada_destroy(dada);
+            return EXIT_FAILURE;
+        }
+        spead_layout_t layout;
+        spead_layout_init(&layout);
+        uint64_t checksum = 0;
+        char* block = NULL;
+        uint64_t slot = 0;
+
+        const double start = bench_now();
+        const double cpu_start = bench_cpu_time();
+        for (uint64_t sample = 0; sample < nsamples; ++sample) {
+            const uint64_t first = sample*TIMING_BATCH;
+            const uint64_t last = first + TIMING_BATCH < npackets ? first + TIMING_BATCH : npackets;
+            const int64_t batch_start = bench_now_ns();
+            for (uint64_t i = first; i < last; ++i) {
+                uint64_t packet_data_size, frame_counter, packet_band_select;
+                char* data = decode_roach2_spead_packet_fast(&layout, pool + (i % PACKET_POOL)*PACKET_BUFFER_SIZE,
+                        &packet_data_size, &frame_counter, &packet_band_select);
+                checksum += frame_counter;
+                if (method == COPY_IPCIO_WRITE) {
+                    ipcio_write(data_block, data, data_size);
+                    continue;
+                }
+                if (block == NULL) {
+                    uint64_t block_id;
+                    block = ipcio_open_block_write(data_block, &block_id);
+                }
+                memcpy(block + slot*data_size, data, data_size);
+                if (++slot == packets_per_block) {
+                    ipcio_close_block_write(data_block, block_size);
+                    block = NULL;
+                    slot = 0;
+                }
+            }
+            samples[sample] = (double)(bench_now_ns() - batch_start)/(last - first);
+        }
+        if (block != NULL) {
+            ipcio_close_block_write(data_block, slot*data_size);
+        }
+        // ends the data, which lets the reader finish.
+        ipcio_close(data_block);
+        const double elapsed = bench_now() - start;
+        const double cpu_seconds = bench_cpu_time() - cpu_start;
+
+        bench_result_t result = {.bench = "copy", .variant = method_names[method]};
+        snprintf(result.parameters, sizeof(result.parameters), "\"band_select\":%"PRIu64",\"block_size\":%"PRIu64",\"blocks\":%"PRIu64,
+                band_select, block_size, nblocks);
+        snprintf(result.extra, sizeof(result.extra), "\"checksum\":%"PRIu64, checksum);
+        result.packets = npackets;
+        result.bytes = npackets*data_size;
+        result.seconds = elapsed;
+        result.cpu_seconds = cpu_seconds;
+        bench_add_samples(&result, "copy", samples, nsamples);
+        if (json) {
+            bench_print_json(stdout, &result);
+        } else {
+            const bench_distribution_t* d = &result.distributions[0];
+            printf("%-12s %"PRIu64" byte blocks: %.4le packets/s %6.2lf GB/s %.1lf ns per packet (p99 %.1lf), %.2lf cores\n",
+                    method_names[method], block_size, npackets/elapsed, result.bytes/elapsed/1e9, d->p50, d->p99, cpu_seconds/elapsed);
+        }
+        bench_dada_destroy(dada);
+    }
+
+    free(samples);
+    free(pool);
+    return EXIT_SUCCESS;
+}
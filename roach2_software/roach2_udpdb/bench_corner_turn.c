@@ -0,0 +1,120 @@
+/*
+ * Microbenchmark of the corner_turn reordering, with and without AVX2, against a naive
+ * reorder that walks the output one word at a time.
+ *
+ * Every version must agree with the naive one on every block.
+ *
+ * Usage: bench_corner_turn [-o order[,reverse][,swap]] [-c nchan] [-s block_size] [-r repeats]
+ */
+#include "corner_turn.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+static void naive(const corner_turn_config_t* config, uint64_t nchan, const uint32_t* in, uint32_t* out, uint64_t nsamp) {
+    for (uint64_t c = 0; c < nchan; ++c) {
+        const uint64_t source = config->reverse_channels ? nchan - 1 - c : c;
+        for (uint64_t t = 0; t < nsamp; ++t) {
+            uint32_t word = in[t*nchan + source];
+            if (config->swap_pols) {
+                word = (word >> 16) | (word << 16);
+            }
+            if (config->order == ORDER_FTP) {
+                out[c*nsamp + t] = word;
+            } else {
+                out[t*nchan + c] = word;
+            }
+        }
+    }
+}
+
+
+int main (int argc, char **argv)
+{
+    corner_turn_config_t config;
+    corner_turn_parse("FTP", &config);
+    uint64_t nchan = 16;
+    uint64_t block_size = 4 << 20;
+    unsigned repeats = 50;
+    char arg;
+
+    multilog_t* log = multilog_open ("bench_corner_turn", 0);
+    multilog_add (log, stderr);
+
+    while ((arg = getopt(argc, argv, "c:o:r:s:")) != -1) {
+        switch (arg) {
+            case 'c':
+                sscanf(optarg,"%"SCNu64,&nchan);
+                break;
+            case 'o':
+                if (corner_turn_parse(optarg, &config) < 0) {
+                    fprintf(stderr,"Could not parse order %s\n",optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                sscanf(optarg,"%u",&repeats);
+                break;
+            case 's':
+                sscanf(optarg,"%"SCNu64,&block_size);
+                break;
+        }
+    }
+
+    if (block_size % (nchan*4) != 0) {
+        fprintf(stderr,"Block size %"PRIu64" is not a whole number of %"PRIu64" channel samples\n",block_size,nchan);
+        return EXIT_FAILURE;
+    }
+    corner_turn_t* turn = corner_turn_create(&config, nchan, log);
+    const uint64_t nsamp = block_size/(nchan*4);
+    char* in = aligned_alloc(4096, block_size);
+    char* expected = aligned_alloc(4096, block_size);
+    char* out = aligned_alloc(4096, block_size);
+    for (uint64_t i = 0; i < block_size; ++i) {
+        in[i] = (char)(rand() >> 7);
+    }
+    naive(&config, nchan, (const uint32_t*)in, (uint32_t*)expected, nsamp);
+
+    const char can_avx2 = turn->use_avx2;
+    for (int version = 0; version < 3; ++version) {
+        if (version == 2 && !can_avx2) {
+            printf("%-8s not available for %"PRIu64" channels on this CPU\n","avx2",nchan);
+            continue;
+        }
+        turn->use_avx2 = (version == 2);
+        memset(out, 0, block_size);
+        const double start = now();
+        for (unsigned r = 0; r < repeats; ++r) {
+            if (version == 0) {
+                naive(&config, nchan, (const uint32_t*)in, (uint32_t*)out, nsamp);
+            } else {
+                corner_turn_apply(turn, in, out, block_size);
+            }
+        }
+        const double elapsed = now() - start;
+        const char* name = version == 0 ? "naive" : (version == 1 ? "scalar" : "avx2");
+        if (memcmp(out, expected, block_size) != 0) {
+            printf("%-8s gives the wrong answer\n",name);
+            return EXIT_FAILURE;
+        }
+        printf("%-8s %s%s%s %"PRIu64" channels: %8.3lf ms per %"PRIu64" byte block, %6.2lf GB/s\n",name,
+                corner_turn_order_name(config.order),config.reverse_channels ? ",reverse" : "",config.swap_pols ? ",swap" : "",
+                nchan,elapsed/repeats*1e3,block_size,(double)block_size*repeats/elapsed/1e9);
+    }
+
+    free(in);
+    free(expected);
+    free(out);
+    corner_turn_destroy(turn);
+    return EXIT_SUCCESS;
+}
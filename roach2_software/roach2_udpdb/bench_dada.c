@@ -0,0 +1,86 @@
+/*
+ * A DADA buffer of the benchmark's own, with a reader that throws the data away. See bench_dada.h
+ */
+#define _GNU_SOURCE // for pthread_timedjoin_np
+
+#include "bench_dada.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// headers in the header block, as dada_db makes by default.
+#define HEADER_BLOCKS 8
+#define HEADER_BLOCK_SIZE 4096
+// how long to wait for the writer to end the data before removing the buffer from under the reader.
+#define END_OF_DATA_TIMEOUT_S 5
+
+
+static void* drain_data_block(void* context) {
+    bench_dada_t* dada = (bench_dada_t*)context;
+    ipcio_t reader = IPCIO_INIT;
+    if (ipcio_connect(&reader, dada->key) < 0 || ipcio_open(&reader, 'R') < 0) {
+        fprintf(stderr,"Could not connect to the data block %x to read it\n",dada->key);
+        return NULL;
+    }
+    while (!ipcbuf_eod((ipcbuf_t*)&reader)) {
+        uint64_t bytes, block_id;
+        // NULL when the buffer has been removed.
+        if (ipcio_open_block_read(&reader, &bytes, &block_id) == NULL) {
+            break;
+        }
+        ipcio_close_block_read(&reader, bytes);
+        ++(dada->blocks_read);
+        dada->bytes_read += bytes;
+    }
+    ipcio_close(&reader);
+    ipcio_disconnect(&reader);
+    return NULL;
+}
+
+
+bench_dada_t* bench_dada_create(key_t key, uint64_t nbufs, uint64_t bufsz) {
+    bench_dada_t* dada = calloc(1, sizeof(bench_dada_t));
+    dada->key = key;
+    ipcbuf_t header_init = IPCBUF_INIT;
+    ipcio_t data_init = IPCIO_INIT;
+    dada->header_block = header_init;
+    dada->data_block = data_init;
+
+    if (ipcio_create(&dada->data_block, key, nbufs, bufsz, 1) < 0) {
+        fprintf(stderr,"Could not create a DADA data block with key %x, is it in use?\n",key);
+        free(dada);
+        return NULL;
+    }
+    if (ipcbuf_create(&dada->header_block, key + 1, HEADER_BLOCKS, HEADER_BLOCK_SIZE, 1) < 0) {
+        fprintf(stderr,"Could not create a DADA header block with key %x, is it in use?\n",key + 1);
+        ipcio_destroy(&dada->data_block);
+        free(dada);
+        return NULL;
+    }
+    if (pthread_create(&dada->reader, NULL, drain_data_block, dada) == 0) {
+        dada->reader_started = 1;
+    }
+    return dada;
+}
+
+
+void bench_dada_destroy(bench_dada_t* dada) {
+    char joined = !dada->reader_started;
+    if (!joined) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += END_OF_DATA_TIMEOUT_S;
+        joined = pthread_timedjoin_np(dada->reader, NULL, &deadline) == 0;
+        if (!joined) {
+            fprintf(stderr,"No end of data in %x after %d s, removing it anyway\n",dada->key,END_OF_DATA_TIMEOUT_S);
+        }
+    }
+    // if the reader is still waiting, removing the buffer wakes it.
+    ipcio_destroy(&dada->data_block);
+    ipcbuf_destroy(&dada->header_block);
+    if (!joined) {
+        pthread_join(dada->reader, NULL);
+    }
+    free(dada);
+}
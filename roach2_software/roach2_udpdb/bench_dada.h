@@ -0,0 +1,32 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <ipcbuf.h>
+#include <ipcio.h>
+
+/*
+ * A DADA buffer of the benchmark's own, so that the benchmarks do not need dada_db or a reader
+ * running alongside them.
+ *
+ * The data block is made at key and the header block at key + 1, as dada_db does, and a thread
+ * reads and throws away every data block as soon as it is written, like dada_dbnull, until the
+ * end of data. The creator's ipcio_t can be used to write, or another process can connect to the
+ * key with dada_hdu and write to it. Nothing reads the header block, which holds enough headers
+ * for a few observations.
+ */
+typedef struct bench_dada_t {
+    key_t key;
+    ipcbuf_t header_block;
+    ipcio_t data_block;
+    pthread_t reader;
+    char reader_started;
+    // written by the reader thread.
+    uint64_t blocks_read;
+    uint64_t bytes_read;
+} bench_dada_t;
+
+// NULL if the buffer could not be made, for instance because one with that key already exists.
+bench_dada_t* bench_dada_create(key_t key, uint64_t nbufs, uint64_t bufsz);
+
+// wait for the reader to reach the end of data, then remove the buffer.
+void bench_dada_destroy(bench_dada_t* dada);
@@ -0,0 +1,135 @@
+/*
+ * Microbenchmark of decode_roach2_spead_packet against decode_roach2_spead_packet_fast.
+ *
+ * Builds a set of ROACH2-like packets in memory and decodes them repeatedly with each decoder,
+ * reporting ns per packet and packets per second. Both decoders must agree on every packet.
+ * With -j the results are printed as JSON lines instead (see bench_report.h), with the
+ * distribution of ns per packet over the passes through the set.
+ *
+ * Usage: bench_decode [-j] [-n packets] [-r repeats] [-b band_select]
+ */
+#include "decode_spead.h"
+#include "bench_report.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PACKET_BUFFER_SIZE 4500
+
+int main (int argc, char **argv)
+{
+    unsigned npackets = 1024; // enough to spill out of L1 like the real ring does.
+    unsigned repeats = 10000;
+    uint64_t band_select = 0;
+    char json = 0;
+    char arg;
+
+    while ((arg = getopt(argc, argv, "b:jn:r:")) != -1) {
+        switch (arg) {
+            case 'b':
+                sscanf(optarg,"%"SCNu64,&band_select);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'n':
+                sscanf(optarg,"%u",&npackets);
+                break;
+            case 'r':
+                sscanf(optarg,"%u",&repeats);
+                break;
+        }
+    }
+
+    const uint64_t frames_per_heap = 64;
+    const uint64_t data_size = frames_per_heap*(8-band_select/2)*8;
+    unsigned char* packets = malloc((size_t)npackets*PACKET_BUFFER_SIZE);
+    for (unsigned i = 0; i < npackets; ++i) {
+        unsigned char* packet = packets + (size_t)i*PACKET_BUFFER_SIZE;
+        uint64_t header_length = encode_roach2_spead_header(packet, data_size, i*frames_per_heap, band_select);
+        memset(packet + header_length, i&0xff, data_size);
+    }
+
+    uint64_t data_size_out, frame_counter, band_select_out;
+    spead_layout_t layout;
+    spead_layout_init(&layout);
+
+    // check both decoders agree before timing anything.
+    for (unsigned i = 0; i < npackets; ++i) {
+        unsigned char* packet = packets + (size_t)i*PACKET_BUFFER_SIZE;
+        uint64_t fast_data_size, fast_frame_counter, fast_band_select;
+        char* slow_pointer = decode_roach2_spead_packet(packet, &data_size_out, &frame_counter, &band_select_out);
+        char* fast_pointer = decode_roach2_spead_packet_fast(&layout, packet, &fast_data_size, &fast_frame_counter, &fast_band_select);
+        if (slow_pointer != fast_pointer || data_size_out != fast_data_size || frame_counter != fast_frame_counter || band_select_out != fast_band_select) {
+            fprintf(stderr,"decoders disagree on packet %u\n",i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the sum stops the compiler from throwing the decode away. Each pass through the set is timed
+    // on its own, for the distribution.
+    uint64_t checksum = 0;
+    double* generic_samples = malloc(repeats*sizeof(double));
+    double* fast_samples = malloc(repeats*sizeof(double));
+    double start = bench_now();
+    double generic_cpu = bench_cpu_time();
+    for (unsigned r = 0; r < repeats; ++r) {
+        const int64_t pass_start = bench_now_ns();
+        for (unsigned i = 0; i < npackets; ++i) {
+            decode_roach2_spead_packet(packets + (size_t)i*PACKET_BUFFER_SIZE, &data_size_out, &frame_counter, &band_select_out);
+            checksum += frame_counter;
+        }
+        generic_samples[r] = (double)(bench_now_ns() - pass_start)/npackets;
+    }
+    const double generic_time = bench_now() - start;
+    generic_cpu = bench_cpu_time() - generic_cpu;
+
+    start = bench_now();
+    double fast_cpu = bench_cpu_time();
+    for (unsigned r = 0; r < repeats; ++r) {
+        const int64_t pass_start = bench_now_ns();
+        for (unsigned i = 0; i < npackets; ++i) {
+            decode_roach2_spead_packet_fast(&layout, packets + (size_t)i*PACKET_BUFFER_SIZE, &data_size_out, &frame_counter, &band_select_out);
+            checksum -= frame_counter;
+        }
+        fast_samples[r] = (double)(bench_now_ns() - pass_start)/npackets;
+    }
+    const double fast_time = bench_now() - start;
+    fast_cpu = bench_cpu_time() - fast_cpu;
+
+    const double total = (double)npackets*repeats;
+    if (json) {
+        const uint64_t packet_size = layout.header_length + data_size;
+        const char* variants[2] = {"generic", "fast"};
+        const double times[2] = {generic_time, fast_time};
+        const double cpu_times[2] = {generic_cpu, fast_cpu};
+        double* samples[2] = {generic_samples, fast_samples};
+        for (int v = 0; v < 2; ++v) {
+            bench_result_t result = {.bench = "decode", .variant = variants[v]};
+            snprintf(result.parameters, sizeof(result.parameters), "\"band_select\":%"PRIu64",\"packet_set\":%u,\"repeats\":%u",
+                    band_select, npackets, repeats);
+            snprintf(result.extra, sizeof(result.extra), "\"fallbacks\":%"PRIu64, layout.fallbacks);
+            result.packets = (uint64_t)total;
+            result.bytes = result.packets*packet_size;
+            result.seconds = times[v];
+            result.cpu_seconds = cpu_times[v];
+            bench_add_samples(&result, "decode", samples[v], repeats);
+            bench_print_json(stdout, &result);
+        }
+        free(generic_samples);
+        free(fast_samples);
+        free(packets);
+        return EXIT_SUCCESS;
+    }
+    printf("decoder packets ns_per_packet packets_per_second\n");
+    printf("generic %.0lf %.3lf %.4le\n", total, 1e9*generic_time/total, total/generic_time);
+    printf("fast    %.0lf %.3lf %.4le\n", total, 1e9*fast_time/total, total/fast_time);
+    printf("speedup %.2lf fallbacks %"PRIu64" checksum %"PRIu64"\n", generic_time/fast_time, layout.fallbacks, checksum);
+
+    free(generic_samples);
+    free(fast_samples);
+    free(packets);
+    return EXIT_SUCCESS;
+}
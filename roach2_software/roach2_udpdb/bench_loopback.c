@@ -0,0 +1,238 @@
+/*
+ * End to end benchmark of roach2_udpdb over the loopback interface, fed by roach2_spead_gen.
+ *
+ * Makes a DADA buffer of its own with a reader that throws the data away (see bench_dada.h), runs
+ * roach2_udpdb on it for an observation of -T seconds with software receive timestamps, and sends
+ * it synthetic SPEAD packets at -r times the real rate of the band_select (0 for as fast as
+ * possible). Both programs are looked for next to this one. Any arguments after -- are passed on
+ * to roach2_udpdb, so that e.g. direct placement (-- -D) or batched receiving (-- -B 16) can be
+ * compared.
+ *
+ * The numbers come from the shared memory statistics of roach2_udpdb (see udpdb_stats.h), polled
+ * while it runs: packets per second and GB/s of data written while packets were flowing, the CPU
+ * used by the capture and socket threads over that time, and the distributions of the time from
+ * the kernel to the ring and from the ring to the copy, which are only good to a factor of two.
+ * Drops and overruns are reported as well. As JSON lines with -j (see bench_report.h), or as a
+ * line of text otherwise.
+ *
+ * Usage: bench_loopback [-j] [-v] [-T seconds] [-r rate] [-b band_select] [-k key] [-p port]
+ *                       [-s block_size] [-N blocks] [-- roach2_udpdb options]
+ */
+#include "udpdb_stats.h"
+#include "decode_spead.h"
+#include "bench_report.h"
+#include "bench_dada.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_ARGS 64
+#define POLL_INTERVAL_US 10000
+// for roach2_udpdb to start listening, and beyond the observation before giving up on it.
+#define STARTUP_S 1
+#define FINISH_TIMEOUT_S 30
+
+// what is kept of the statistics while packets are flowing.
+typedef struct snapshot_t {
+    double time;
+    int64_t packets;
+    int64_t cpu_ns;
+} snapshot_t;
+
+
+static pid_t run(char** args, char verbose) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+        // stdout is for the results.
+        const int out = verbose ? STDERR_FILENO : open("/dev/null", O_WRONLY);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        execv(args[0], args);
+        _exit(127);
+    }
+    return pid;
+}
+
+
+int main (int argc, char **argv)
+{
+    double seconds = 5;
+    double rate = 1;
+    uint64_t band_select = 0;
+    unsigned dada_key = 0xbe20;
+    int port = 17300;
+    uint64_t block_size = 8 << 20;
+    uint64_t nblocks = 8;
+    char json = 0;
+    char verbose = 0;
+    char arg;
+
+    while ((arg = getopt(argc, argv, "b:jk:p:r:s:vN:T:")) != -1) {
+        switch (arg) {
+            case 'b':
+                sscanf(optarg,"%"SCNu64,&band_select);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'k':
+                if (sscanf(optarg,"%x",&dada_key) != 1) {
+                    fprintf(stderr,"Could not parse key %s\n",optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                sscanf(optarg,"%d",&port);
+                break;
+            case 'r':
+                sscanf(optarg,"%lf",&rate);
+                break;
+            case 's':
+                sscanf(optarg,"%"SCNu64,&block_size);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'N':
+                sscanf(optarg,"%"SCNu64,&nblocks);
+                break;
+            case 'T':
+                sscanf(optarg,"%lf",&seconds);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    const int nextra = argc - optind;
+    if (nextra > MAX_ARGS - 16) {
+        fprintf(stderr,"Too many options for roach2_udpdb\n");
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t data_size = band_select_to_data_size(band_select);
+    block_size = block_size/data_size*data_size;
+    if (block_size == 0) {
+        fprintf(stderr,"Block size is less than a packet of %"PRIu64" bytes\n",data_size);
+        return EXIT_FAILURE;
+    }
+
+    char directory[4096];
+    strncpy(directory, argv[0], sizeof(directory) - 1);
+    directory[sizeof(directory) - 1] = '\0';
+    const char* here = dirname(directory);
+    char udpdb_path[4200], generator_path[4200];
+    snprintf(udpdb_path, sizeof(udpdb_path), "%s/roach2_udpdb", here);
+    snprintf(generator_path, sizeof(generator_path), "%s/roach2_spead_gen", here);
+
+    char port_string[16], key_string[16], seconds_string[32], send_seconds_string[32], rate_string[32], band_string[32], destination[64];
+    snprintf(port_string, sizeof(port_string), "%d", port);
+    snprintf(key_string, sizeof(key_string), "%x", dada_key);
+    snprintf(seconds_string, sizeof(seconds_string), "%lf", seconds);
+    // the generator runs on past the end of the observation, and is stopped when it is over.
+    snprintf(send_seconds_string, sizeof(send_seconds_string), "%lf", seconds + FINISH_TIMEOUT_S);
+    snprintf(rate_string, sizeof(rate_string), "%lf", rate);
+    snprintf(band_string, sizeof(band_string), "%"PRIu64, band_select);
+    snprintf(destination, sizeof(destination), "127.0.0.1:%d", port);
+
+    char* udpdb_args[MAX_ARGS] = {udpdb_path, "-I", "127.0.0.1", "-p", port_string, "-k", key_string, "-T", seconds_string, "-U", "sw"};
+    int nargs = 11;
+    for (int i = 0; i < nextra; ++i) {
+        udpdb_args[nargs++] = argv[optind + i];
+    }
+    udpdb_args[nargs] = NULL;
+    char* generator_args[] = {generator_path, "-d", destination, "-z", "0.5", "-T", send_seconds_string, "-r", rate_string, "-b", band_string, NULL};
+
+    // the variant is the options given to roach2_udpdb.
+    char variant[256] = "";
+    for (int i = 0; i < nextra; ++i) {
+        snprintf(variant + strlen(variant), sizeof(variant) - strlen(variant), "%s%s", i ? " " : "", argv[optind + i]);
+    }
+
+    bench_dada_t* dada = bench_dada_create(dada_key, nblocks, block_size);
+    if (dada == NULL) {
+        return EXIT_FAILURE;
+    }
+    const pid_t udpdb = run(udpdb_args, verbose);
+    usleep(STARTUP_S*1000000);
+    const pid_t generator = run(generator_args, verbose);
+
+    // poll the statistics until roach2_udpdb exits, keeping the first and last time packets moved.
+    udpdb_stats_reader_t* reader = NULL;
+    udpdb_stats_data_t data;
+    char have_data = 0;
+    snapshot_t first = {0}, last = {0};
+    int status = 0;
+    struct rusage usage;
+    const double deadline = bench_now() + STARTUP_S + seconds + FINISH_TIMEOUT_S;
+    char finished = 0;
+    while (!finished) {
+        if (wait4(udpdb, &status, WNOHANG, &usage) == udpdb) {
+            finished = 1;
+        } else if (bench_now() > deadline) {
+            fprintf(stderr,"roach2_udpdb did not finish in time, stopping it\n");
+            kill(udpdb, SIGINT);
+            wait4(udpdb, &status, 0, &usage);
+            finished = 1;
+        }
+        if (reader == NULL) {
+            reader = udpdb_stats_attach(dada_key);
+        }
+        // a segment left by an earlier run on the same key is not ours until roach2_udpdb takes it over.
+        udpdb_stats_data_t latest;
+        if (reader != NULL && udpdb_stats_read(reader, &latest) == 0 && latest.pid == udpdb) {
+            data = latest;
+            have_data = 1;
+            const snapshot_t now = {bench_now(), data.packet_count, data.capture_cpu_time_ns + data.socket_cpu_time_ns};
+            if (first.packets == 0 && now.packets > 0) {
+                first = now;
+            }
+            if (now.packets > last.packets) {
+                last = now;
+            }
+        }
+        if (!finished) {
+            usleep(POLL_INTERVAL_US);
+        }
+    }
+    kill(generator, SIGINT);
+    waitpid(generator, NULL, 0);
+    bench_dada_destroy(dada);
+    if (reader != NULL) {
+        udpdb_stats_detach(reader);
+    }
+
+    const int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    if (!have_data || last.packets <= first.packets || exit_code != 0) {
+        fprintf(stderr,"No packets were captured (roach2_udpdb exit code %d), try -v\n",exit_code);
+        return EXIT_FAILURE;
+    }
+
+    bench_result_t result = {.bench = "loopback", .variant = variant[0] ? variant : "default"};
+    snprintf(result.parameters, sizeof(result.parameters), "\"band_select\":%"PRIu64",\"rate\":%lf,\"seconds\":%lf,\"block_size\":%"PRIu64
+            ",\"blocks\":%"PRIu64, band_select, rate, seconds, block_size, nblocks);
+    snprintf(result.extra, sizeof(result.extra), "\"dropped_packets\":%"PRId64",\"overruns\":%"PRId64",\"late_packets\":%"PRId64
+            ",\"reordered_packets\":%"PRId64",\"receive_syscalls\":%"PRId64",\"process_cpu_seconds\":%.6lf", data.dropped_packets,
+            data.number_of_overruns, data.late_packets, data.reordered_packets, data.receive_syscalls,
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec*1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec*1e-6);
+    result.packets = last.packets - first.packets;
+    result.bytes = result.packets*data_size;
+    result.seconds = last.time - first.time;
+    result.cpu_seconds = (last.cpu_ns - first.cpu_ns)*1e-9;
+    bench_add_histogram(&result, "receive_latency", data.receive_latency_histogram, UDPDB_STATS_TIMING_BINS);
+    bench_add_histogram(&result, "ring_latency", data.ring_latency_histogram, UDPDB_STATS_TIMING_BINS);
+    if (json) {
+        bench_print_json(stdout, &result);
+    } else {
+        printf("loopback %s: %.4le packets/s %6.2lf GB/s receive latency p50 %.0lf p99 %.0lf ns, %.2lf cores, dropped %"PRId64" overruns %"PRId64"\n",
+                result.variant, result.packets/result.seconds, result.bytes/result.seconds/1e9, result.distributions[0].p50,
+                result.distributions[0].p99, result.cpu_seconds/result.seconds, data.dropped_packets, data.number_of_overruns);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+/*
+ * Machine-readable results for the benchmarks. See bench_report.h
+ */
+#include "bench_report.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+int64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+
+double bench_cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+static bench_distribution_t* next_distribution(bench_result_t* result, const char* name) {
+    if (result->ndistributions == BENCH_MAX_DISTRIBUTIONS) {
+        return NULL;
+    }
+    bench_distribution_t* distribution = &result->distributions[result->ndistributions++];
+    memset(distribution, 0, sizeof(bench_distribution_t));
+    distribution->name = name;
+    return distribution;
+}
+
+
+void bench_add_samples(bench_result_t* result, const char* name, double* samples, uint64_t nsamples) {
+    if (nsamples == 0) {
+        return;
+    }
+    bench_distribution_t* distribution = next_distribution(result, name);
+    if (distribution == NULL) {
+        return;
+    }
+    qsort(samples, nsamples, sizeof(double), compare_doubles);
+    double sum = 0;
+    for (uint64_t i = 0; i < nsamples; ++i) {
+        sum += samples[i];
+    }
+    distribution->mean = sum/nsamples;
+    distribution->p50 = samples[(uint64_t)(0.5*(nsamples - 1))];
+    distribution->p90 = samples[(uint64_t)(0.9*(nsamples - 1))];
+    distribution->p99 = samples[(uint64_t)(0.99*(nsamples - 1))];
+    distribution->p999 = samples[(uint64_t)(0.999*(nsamples - 1))];
+    distribution->max = samples[nsamples - 1];
+}
+
+
+static double histogram_percentile(const int64_t* histogram, int nbins, int64_t total, double q) {
+    const double target = q*total;
+    int64_t count = 0;
+    for (int i = 0; i < nbins; ++i) {
+        count += histogram[i];
+        if (histogram[i] > 0 && count >= target) {
+            return (double)(1LL << i);
+        }
+    }
+    return (double)(1LL << (nbins - 1));
+}
+
+
+void bench_add_histogram(bench_result_t* result, const char* name, const int64_t* histogram, int nbins) {
+    int64_t total = 0;
+    double sum = 0;
+    for (int i = 0; i < nbins; ++i) {
+        total += histogram[i];
+        sum += histogram[i]*(i == 0 ? 0.5 : 0.75*(1LL << i));
+    }
+    if (total == 0) {
+        return;
+    }
+    bench_distribution_t* distribution = next_distribution(result, name);
+    if (distribution == NULL) {
+        return;
+    }
+    distribution->mean = sum/total;
+    distribution->p50 = histogram_percentile(histogram, nbins, total, 0.5);
+    distribution->p90 = histogram_percentile(histogram, nbins, total, 0.9);
+    distribution->p99 = histogram_percentile(histogram, nbins, total, 0.99);
+    distribution->p999 = histogram_percentile(histogram, nbins, total, 0.999);
+    distribution->max = histogram_percentile(histogram, nbins, total, 1.0);
+}
+
+
+// the part of value that is safe to put between quotes in JSON.
+static void print_json_string(FILE* out, const char* value) {
+    fputc('"', out);
+    for (const char* c = value; *c; ++c) {
+        if (*c != '"' && *c != '\\' && (unsigned char)*c >= ' ') {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+
+static void cpu_model(char* model, size_t size) {
+    strncpy(model, "unknown", size);
+    FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (cpuinfo == NULL) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), cpuinfo)) {
+        char* colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+            snprintf(model, size, "%s", colon + 2);
+            model[strcspn(model, "\n")] = '\0';
+            break;
+        }
+    }
+    fclose(cpuinfo);
+}
+
+
+void bench_print_json(FILE* out, const bench_result_t* result) {
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    char model[256];
+    cpu_model(model, sizeof(model));
+    struct utsname system;
+    uname(&system);
+    char now[64];
+    const time_t seconds = time(NULL);
+    strftime(now, sizeof(now), "%Y-%m-%dT%H:%M:%SZ", gmtime(&seconds));
+    const char* commit = getenv("BENCH_COMMIT");
+
+    fprintf(out, "{\"bench\":");
+    print_json_string(out, result->bench);
+    fprintf(out, ",\"variant\":");
+    print_json_string(out, result->variant);
+    fprintf(out, ",\"host\":");
+    print_json_string(out, host);
+    fprintf(out, ",\"cpu_model\":");
+    print_json_string(out, model);
+    fprintf(out, ",\"kernel\":");
+    print_json_string(out, system.release);
+    fprintf(out, ",\"time\":\"%s\",\"commit\":", now);
+    print_json_string(out, commit && commit[0] ? commit : "unknown");
+    fprintf(out, ",\"parameters\":{%s}", result->parameters);
+
+    const double seconds_taken = result->seconds > 0 ? result->seconds : 1e-9;
+    fprintf(out, ",\"packets\":%"PRIu64",\"bytes\":%"PRIu64",\"seconds\":%.6lf", result->packets, result->bytes, result->seconds);
+    fprintf(out, ",\"packets_per_second\":%.6le,\"gb_per_second\":%.6lf", result->packets/seconds_taken, result->bytes/seconds_taken/1e9);
+    fprintf(out, ",\"cpu_seconds\":%.6lf,\"cpu_utilisation\":%.4lf", result->cpu_seconds, result->cpu_seconds/seconds_taken);
+
+    fprintf(out, ",\"ns_per_packet\":{");
+    for (int i = 0; i < result->ndistributions; ++i) {
+        const bench_distribution_t* d = &result->distributions[i];
+        fprintf(out, "%s", i ? "," : "");
+        print_json_string(out, d->name);
+        fprintf(out, ":{\"mean\":%.3lf,\"p50\":%.3lf,\"p90\":%.3lf,\"p99\":%.3lf,\"p999\":%.3lf,\"max\":%.3lf}",
+                d->mean, d->p50, d->p90, d->p99, d->p999, d->max);
+    }
+    fprintf(out, "},\"extra\":{%s}}\n", result->extra);
+    fflush(out);
+}
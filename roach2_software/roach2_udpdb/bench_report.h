@@ -0,0 +1,59 @@
+#include <inttypes.h>
+#include <stdio.h>
+
+/*
+ * Machine-readable results for the benchmarks, so that runs can be compared across hosts and
+ * commits.
+ *
+ * Each result is printed as one JSON object on a line of its own (JSON Lines), so the output of
+ * many runs can simply be appended to one file. Every line carries the host, CPU model, kernel,
+ * time and commit (from the BENCH_COMMIT environment variable, which the Makefile sets from git)
+ * alongside the throughput, the CPU used and one or more distributions of ns per packet:
+ *
+ *   {"bench":"ring","variant":"spsc","host":"...","cpu_model":"...","kernel":"...","time":"...",
+ *    "commit":"...","parameters":{...},"packets":...,"bytes":...,"seconds":...,
+ *    "packets_per_second":...,"gb_per_second":...,"cpu_seconds":...,"cpu_utilisation":...,
+ *    "ns_per_packet":{"latency":{"mean":...,"p50":...,"p90":...,"p99":...,"p999":...,"max":...}},
+ *    "extra":{...}}
+ *
+ * cpu_utilisation is CPU time over wall time, so a benchmark with two busy threads can reach 2.
+ * What each distribution measures depends on the benchmark and is given by its name; one with no
+ * samples is left out.
+ */
+
+#define BENCH_MAX_DISTRIBUTIONS 2
+
+typedef struct bench_distribution_t {
+    const char* name;
+    double mean, p50, p90, p99, p999, max;
+} bench_distribution_t;
+
+typedef struct bench_result_t {
+    const char* bench;
+    const char* variant;
+    char parameters[512]; // members of a JSON object, e.g. "\"slots\":8192,\"batch\":16"
+    char extra[512]; // the same, for counts particular to the benchmark
+    uint64_t packets;
+    uint64_t bytes;
+    double seconds;
+    double cpu_seconds;
+    int ndistributions;
+    bench_distribution_t distributions[BENCH_MAX_DISTRIBUTIONS];
+} bench_result_t;
+
+// CLOCK_MONOTONIC in seconds and in ns, and the CPU time of the whole process (all threads) in seconds.
+double bench_now(void);
+int64_t bench_now_ns(void);
+double bench_cpu_time(void);
+
+// add a distribution from individual samples, which are sorted in place.
+void bench_add_samples(bench_result_t* result, const char* name, double* samples, uint64_t nsamples);
+
+/*
+ * Add a distribution from a histogram where bin i counts [2^(i-1), 2^i) ns, like those of
+ * packet_timing.h. Percentiles are the upper edge of the bin they fall in, so are only good to a
+ * factor of two, and the mean takes every value to be in the middle of its bin.
+ */
+void bench_add_histogram(bench_result_t* result, const char* name, const int64_t* histogram, int nbins);
+
+void bench_print_json(FILE* out, const bench_result_t* result);
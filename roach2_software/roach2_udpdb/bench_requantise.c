@@ -0,0 +1,121 @@
+/*
+ * Microbenchmark of requantise, with and without AVX2, on noise like that from the ROACH2.
+ *
+ * The two versions run side by side on the same blocks and must give identical output.
+ *
+ * Usage: bench_requantise [-b nbit] [-o TFP|FTP] [-c nchan] [-s block_size] [-r repeats]
+ */
+#include "corner_turn.h"
+#include "requantise.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+// roughly Gaussian 8-bit values with a different mean and rms for each channel and polarisation.
+static void fill_noise(char* block, uint64_t bytes, uint64_t nchan) {
+    for (uint64_t i = 0; i < bytes; ++i) {
+        const uint64_t position = i % (nchan*4);
+        int sum = 0;
+        for (int j = 0; j < 4; ++j) {
+            sum += (rand() & 0xff) - 128;
+        }
+        const int value = sum * (int)(position/2 % 5 + 1) / 16 + (int)(position % 7) - 3;
+        block[i] = (char)(value < -128 ? -128 : (value > 127 ? 127 : value));
+    }
+}
+
+
+int main (int argc, char **argv)
+{
+    int nbit = 4;
+    sample_order_t order = ORDER_TFP;
+    uint64_t nchan = 16;
+    uint64_t block_size = 4 << 20;
+    unsigned repeats = 20;
+    char arg;
+
+    multilog_t* log = multilog_open ("bench_requantise", 0);
+    multilog_add (log, stderr);
+
+    while ((arg = getopt(argc, argv, "b:c:o:r:s:")) != -1) {
+        switch (arg) {
+            case 'b':
+                sscanf(optarg,"%d",&nbit);
+                break;
+            case 'c':
+                sscanf(optarg,"%"SCNu64,&nchan);
+                break;
+            case 'o':
+                order = strcmp(optarg,"FTP") == 0 ? ORDER_FTP : ORDER_TFP;
+                break;
+            case 'r':
+                sscanf(optarg,"%u",&repeats);
+                break;
+            case 's':
+                sscanf(optarg,"%"SCNu64,&block_size);
+                break;
+        }
+    }
+
+    if (block_size % (nchan*4) != 0) {
+        fprintf(stderr,"Block size %"PRIu64" is not a whole number of %"PRIu64" channel samples\n",block_size,nchan);
+        return EXIT_FAILURE;
+    }
+    requantise_t* scalar = requantise_create(nbit, nchan, order, REQUANTISE_DEFAULT_WINDOW, NULL, log);
+    requantise_t* avx2 = requantise_create(nbit, nchan, order, REQUANTISE_DEFAULT_WINDOW, NULL, log);
+    if (scalar == NULL || avx2 == NULL) {
+        return EXIT_FAILURE;
+    }
+    const char can_avx2 = avx2->use_avx2;
+    scalar->use_avx2 = 0;
+
+    const uint64_t out_size = block_size*nbit/8;
+    char* in = aligned_alloc(4096, block_size);
+    char* expected = aligned_alloc(4096, out_size);
+    char* out = aligned_alloc(4096, out_size);
+    fill_noise(in, block_size, nchan);
+
+    double elapsed[2] = {0, 0};
+    for (unsigned r = 0; r < repeats; ++r) {
+        double start = now();
+        requantise_apply(scalar, in, expected, block_size);
+        elapsed[0] += now() - start;
+        if (can_avx2) {
+            start = now();
+            requantise_apply(avx2, in, out, block_size);
+            elapsed[1] += now() - start;
+            if (memcmp(out, expected, out_size) != 0) {
+                printf("%-8s gives a different answer to scalar on block %u\n","avx2",r);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    for (int version = 0; version < 2; ++version) {
+        const char* name = version == 0 ? "scalar" : "avx2";
+        if (version == 1 && !can_avx2) {
+            printf("%-8s not available for %"PRIu64" channels on this CPU\n",name,nchan);
+            continue;
+        }
+        printf("%-8s %d-bit %s %"PRIu64" channels: %8.3lf ms per %"PRIu64" byte block, %6.2lf GB/s in\n",name,nbit,
+                corner_turn_order_name(order),nchan,elapsed[version]/repeats*1e3,block_size,
+                (double)block_size*repeats/elapsed[version]/1e9);
+    }
+
+    free(in);
+    free(expected);
+    free(out);
+    requantise_destroy(scalar);
+    requantise_destroy(avx2);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+/*
+ * Benchmark of the packet ring between the socket thread and the capture thread.
+ *
+ * A producer thread stands in for the socket thread: it copies ROACH2 packets into the free slots
+ * of the ring in batches of -B, as recvmmsg would, stamps each with the time and publishes the
+ * batch. Unlike the socket thread it waits for room rather than drop packets when the ring is
+ * full, and counts the times it had to. The consumer, on the main thread, takes each packet with
+ * packet_ring_next and decodes it, like get_next_packet_buffer, and checks that the frame
+ * counters arrive in order.
+ *
+ * Reports packets per second, GB/s of packets, the latency of each packet from being published
+ * until the consumer has it, and the CPU used by both threads, as JSON lines with -j (see
+ * bench_report.h) or as a line of text otherwise. -c producer_core,consumer_core pins the threads.
+ *
+ * Usage: bench_ring [-j] [-n packets] [-N slots] [-B batch] [-b band_select] [-c core,core] [-L]
+ */
+#define _GNU_SOURCE
+
+#include "numa_memory.h"
+#include "packet_ring.h"
+#include "decode_spead.h"
+#include "bench_report.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define PACKET_BUFFER_SIZE 4500
+// different packets to copy from, so the copies are not all from cache.
+#define PACKET_POOL 1024
+
+typedef struct producer_t {
+    packet_ring_t* ring;
+    const unsigned char* pool;
+    uint64_t packet_size;
+    uint64_t npackets;
+    unsigned batch;
+    int core;
+    uint64_t full_waits; // times the ring was full
+} producer_t;
+
+
+static void pin_thread(int core) {
+    if (core >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(core, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+}
+
+
+static void* produce(void* context) {
+    producer_t* producer = (producer_t*)context;
+    packet_ring_t* ring = producer->ring;
+    pin_thread(producer->core);
+    uint64_t sent = 0;
+    while (sent < producer->npackets) {
+        const uint64_t free_slots = packet_ring_free(ring);
+        if (free_slots == 0) {
+            ++(producer->full_waits);
+            sched_yield();
+            continue;
+        }
+        const uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t batch = producer->batch < free_slots ? producer->batch : free_slots;
+        batch = batch < producer->npackets - sent ? batch : producer->npackets - sent;
+        for (uint64_t i = 0; i < batch; ++i) {
+            memcpy(packet_ring_slot(ring, head + i), producer->pool + ((sent + i) % PACKET_POOL)*PACKET_BUFFER_SIZE, producer->packet_size);
+        }
+        const int64_t now = bench_now_ns();
+        for (uint64_t i = 0; i < batch; ++i) {
+            ring->publish_ns[(head + i) % ring->nslots] = now;
+        }
+        packet_ring_publish(ring, batch);
+        sent += batch;
+    }
+    return NULL;
+}
+
+
+int main (int argc, char **argv)
+{
+    uint64_t npackets = 1 << 22;
+    uint64_t nslots = 16000; // the default of roach2_udpdb
+    unsigned batch = 16;
+    uint64_t band_select = 0;
+    int producer_core = -1;
+    int consumer_core = -1;
+    memory_policy_t memory = {.node = -1, .hugepages = HUGEPAGES_NONE};
+    char json = 0;
+    char arg;
+
+    multilog_t* log = multilog_open ("bench_ring", 0);
+    multilog_add (log, stderr);
+
+    while ((arg = getopt(argc, argv, "b:c:jn:B:LN:")) != -1) {
+        switch (arg) {
+            case 'b':
+                sscanf(optarg,"%"SCNu64,&band_select);
+                break;
+            case 'c':
+                if (sscanf(optarg,"%d,%d",&producer_core,&consumer_core) != 2) {
+                    fprintf(stderr,"Could not parse cores %s, expected producer_core,consumer_core\n",optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'n':
+                sscanf(optarg,"%"SCNu64,&npackets);
+                break;
+            case 'B':
+                sscanf(optarg,"%u",&batch);
+                break;
+            case 'L':
+                memory.hugepages = HUGEPAGES_2M;
+                break;
+            case 'N':
+                sscanf(optarg,"%"SCNu64,&nslots);
+                break;
+        }
+    }
+    if (npackets == 0 || nslots == 0 || batch == 0) {
+        fprintf(stderr,"Packets, slots and batch must all be more than zero\n");
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t frames_per_heap = band_select_to_frames_per_heap(band_select);
+    const uint64_t data_size = band_select_to_data_size(band_select);
+    unsigned char* pool = malloc((size_t)PACKET_POOL*PACKET_BUFFER_SIZE);
+    uint64_t header_length = 0;
+    for (unsigned i = 0; i < PACKET_POOL; ++i) {
+        unsigned char* packet = pool + (size_t)i*PACKET_BUFFER_SIZE;
+        header_length = encode_roach2_spead_header(packet, data_size, i*frames_per_heap, band_select);
+        memset(packet + header_length, i&0xff, data_size);
+    }
+
+    packet_ring_t* ring = packet_ring_create(nslots, PACKET_BUFFER_SIZE, &memory, log);
+    if (ring == NULL) {
+        return EXIT_FAILURE;
+    }
+    packet_ring_enable_timestamps(ring);
+    double* latency = malloc(npackets*sizeof(double));
+
+    producer_t producer = {.ring = ring, .pool = pool, .packet_size = header_length + data_size,
+            .npackets = npackets, .batch = batch, .core = producer_core};
+    pin_thread(consumer_core);
+    spead_layout_t layout;
+    spead_layout_init(&layout);
+    uint64_t out_of_order = 0;
+
+    const double start = bench_now();
+    const double cpu_start = bench_cpu_time();
+    pthread_t producer_thread;
+    pthread_create(&producer_thread, NULL, produce, &producer);
+    for (uint64_t i = 0; i < npackets; ++i) {
+        unsigned char* packet = packet_ring_next(ring);
+        const int64_t published = ring->publish_ns[(ring->read_position - 1) % ring->nslots];
+        uint64_t packet_data_size, frame_counter, packet_band_select;
+        decode_roach2_spead_packet_fast(&layout, packet, &packet_data_size, &frame_counter, &packet_band_select);
+        latency[i] = (double)(bench_now_ns() - published);
+        if (frame_counter != (i % PACKET_POOL)*frames_per_heap) {
+            ++out_of_order;
+        }
+    }
+    const double elapsed = bench_now() - start;
+    pthread_join(producer_thread, NULL);
+    const double cpu_seconds = bench_cpu_time() - cpu_start;
+
+    if (out_of_order) {
+        fprintf(stderr,"%"PRIu64" packets came out of the ring in the wrong order\n",out_of_order);
+        return EXIT_FAILURE;
+    }
+
+    bench_result_t result = {.bench = "ring", .variant = "spsc"};
+    snprintf(result.parameters, sizeof(result.parameters), "\"band_select\":%"PRIu64",\"slots\":%"PRIu64",\"batch\":%u,"
+            "\"producer_core\":%d,\"consumer_core\":%d,\"hugepages\":%s", band_select, nslots, batch, producer_core, consumer_core,
+            memory.hugepages ? "true" : "false");
+    snprintf(result.extra, sizeof(result.extra), "\"full_waits\":%"PRIu64, producer.full_waits);
+    result.packets = npackets;
+    result.bytes = npackets*producer.packet_size;
+    result.seconds = elapsed;
+    result.cpu_seconds = cpu_seconds;
+    bench_add_samples(&result, "latency", latency, npackets);
+    if (json) {
+        bench_print_json(stdout, &result);
+    } else {
+        const bench_distribution_t* d = &result.distributions[0];
+        printf("ring %"PRIu64" slots batch %u: %.4le packets/s %6.2lf GB/s latency p50 %.0lf p99 %.0lf max %.0lf ns, %.2lf cores, ring full %"PRIu64" times\n",
+                nslots, batch, npackets/elapsed, result.bytes/elapsed/1e9, d->p50, d->p99, d->max, cpu_seconds/elapsed, producer.full_waits);
+    }
+
+    free(latency);
+    free(pool);
+    packet_ring_destroy(ring);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+/*
+ * Per byte position histograms of 8-bit data. See byte_stats.h.
+ *
+ * Each 64-bit word of a frame is loaded once and its 8 bytes are peeled off with shifts, rather
+ * than loading every byte separately. AVX2 has no scatter, so loading 32 bytes at a time and
+ * extracting the words from a vector register was tried too and was no faster than this.
+ */
+
+#include "byte_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define BIAS 0x8080808080808080ULL // flips the sign bit, turning int8 into value+128
+
+// increment the histograms of 8 consecutive positions starting at position p from one word.
+#define COUNT_WORD(counts, p, word) do { \
+    uint16_t* c = (counts) + (p)*256; \
+    const uint64_t w = (word); \
+    ++c[0*256 + ( w        & 0xff)]; \
+    ++c[1*256 + ((w >>  8) & 0xff)]; \
+    ++c[2*256 + ((w >> 16) & 0xff)]; \
+    ++c[3*256 + ((w >> 24) & 0xff)]; \
+    ++c[4*256 + ((w >> 32) & 0xff)]; \
+    ++c[5*256 + ((w >> 40) & 0xff)]; \
+    ++c[6*256 + ((w >> 48) & 0xff)]; \
+    ++c[7*256 + ((w >> 56)       )]; \
+} while (0)
+
+
+static void count_frames(uint16_t* counts, const char* data, uint64_t nframes, uint64_t bytes_per_frame) {
+    for (uint64_t frame = 0; frame < nframes; ++frame) {
+        for (uint64_t p = 0; p < bytes_per_frame; p += 8) {
+            uint64_t word;
+            memcpy(&word, data + p, 8);
+            COUNT_WORD(counts, p, word ^ BIAS);
+        }
+        data += bytes_per_frame;
+    }
+}
+
+
+byte_stats_t* byte_stats_create(uint64_t bytes_per_frame) {
+    if (bytes_per_frame == 0 || bytes_per_frame % 8 || bytes_per_frame > BYTE_STATS_MAX_FRAME_BYTES) {
+        return NULL;
+    }
+    byte_stats_t* stats = malloc(sizeof(byte_stats_t));
+    memset(stats,0,sizeof(byte_stats_t));
+    stats->bytes_per_frame = bytes_per_frame;
+    stats->counts = calloc(bytes_per_frame*256, sizeof(uint16_t));
+    stats->totals = calloc(bytes_per_frame*256, sizeof(uint64_t));
+    return stats;
+}
+
+
+void byte_stats_destroy(byte_stats_t* stats) {
+    free(stats->counts);
+    free(stats->totals);
+    free(stats);
+}
+
+
+static void fold(byte_stats_t* stats) {
+    for (uint64_t i = 0; i < stats->bytes_per_frame*256; ++i) {
+        stats->totals[i] += stats->counts[i];
+    }
+    memset(stats->counts, 0, stats->bytes_per_frame*256*sizeof(uint16_t));
+    stats->frames_since_fold = 0;
+}
+
+
+void byte_stats_add(byte_stats_t* stats, const char* data, uint64_t nframes) {
+    while (nframes > 0) {
+        // each frame adds one to exactly one counter per position, so this is all the room we have.
+        uint64_t n = BYTE_STATS_FOLD_FRAMES - stats->frames_since_fold;
+        if (n > nframes) {
+            n = nframes;
+        }
+        count_frames(stats->counts, data, n, stats->bytes_per_frame);
+        data += n*stats->bytes_per_frame;
+        nframes -= n;
+        stats->frames += n;
+        stats->frames_since_fold += n;
+        if (stats->frames_since_fold == BYTE_STATS_FOLD_FRAMES) {
+            fold(stats);
+        }
+    }
+}
+
+
+void byte_stats_histogram(byte_stats_t* stats, uint64_t histogram[256]) {
+    fold(stats);
+    memset(histogram, 0, 256*sizeof(uint64_t));
+    for (uint64_t p = 0; p < stats->bytes_per_frame; ++p) {
+        for (int v = 0; v < 256; ++v) {
+            histogram[v] += stats->totals[p*256 + v];
+        }
+    }
+}
+
+
+void byte_stats_moments(byte_stats_t* stats, const unsigned* positions, unsigned npositions, byte_moments_t* moments) {
+    fold(stats);
+    uint64_t histogram[256];
+    memset(histogram, 0, sizeof(histogram));
+    for (unsigned i = 0; i < npositions; ++i) {
+        for (int v = 0; v < 256; ++v) {
+            histogram[v] += stats->totals[positions[i]*256 + v];
+        }
+    }
+
+    memset(moments, 0, sizeof(byte_moments_t));
+    double sum = 0, sum_squares = 0;
+    for (int v = 0; v < 256; ++v) {
+        moments->nsamples += histogram[v];
+        sum += (double)histogram[v] * (v - 128);
+        sum_squares += (double)histogram[v] * (v - 128) * (v - 128);
+    }
+    if (moments->nsamples == 0) {
+        return;
+    }
+    const double n = moments->nsamples;
+    moments->mean = sum / n;
+    moments->rms = sqrt(sum_squares / n);
+    moments->clipped = (histogram[0] + histogram[255]) / n;
+
+    // central moments in a second pass, which is cheap with only 256 bins.
+    double m2 = 0, m4 = 0;
+    for (int v = 0; v < 256; ++v) {
+        const double d = (v - 128) - moments->mean;
+        m2 += histogram[v] * d * d;
+        m4 += histogram[v] * d * d * d * d;
+    }
+    m2 /= n;
+    m4 /= n;
+    moments->kurtosis = m2 > 0 ? m4 / (m2 * m2) : 0;
+}
@@ -0,0 +1,46 @@
+#include <inttypes.h>
+
+// bytes in the largest frame (band_select 0: 16 channels x 2 pols x complex 8-bit).
+#define BYTE_STATS_MAX_FRAME_BYTES 64
+// the 16-bit counters are folded into the 64-bit totals at least this often.
+#define BYTE_STATS_FOLD_FRAMES 65535
+
+/*
+ * Histograms of the 8-bit sample values at each byte position of a frame.
+ *
+ * Keeping a separate histogram for each position means neighbouring bytes never increment
+ * the same counter, so a run of equal values does not serialise on one memory location as it
+ * does with a single histogram, and every per channel/polarisation moment can be worked out
+ * exactly afterwards. The global histogram is just the sum over positions.
+ *
+ * Frames are assumed to be in the order of the DADA header: channel, then polarisation, then
+ * real/imaginary, i.e. byte (chan*2 + pol)*2 + dim.
+ */
+typedef struct byte_stats_t {
+    uint64_t bytes_per_frame; // a multiple of 8, no more than BYTE_STATS_MAX_FRAME_BYTES
+    uint16_t* counts; // [bytes_per_frame][256] indexed by value+128, since the last fold
+    uint64_t* totals; // [bytes_per_frame][256]
+    uint64_t frames_since_fold;
+    uint64_t frames;
+} byte_stats_t;
+
+// moments of the samples at a set of byte positions.
+typedef struct byte_moments_t {
+    uint64_t nsamples;
+    double mean;
+    double rms; // about zero, which is what the requantiser sees
+    double kurtosis; // fourth central moment over variance squared; 3 for gaussian noise
+    double clipped; // fraction of samples at -128 or +127
+} byte_moments_t;
+
+byte_stats_t* byte_stats_create(uint64_t bytes_per_frame);
+void byte_stats_destroy(byte_stats_t* stats);
+
+// add nframes consecutive frames of data.
+void byte_stats_add(byte_stats_t* stats, const char* data, uint64_t nframes);
+
+// sum of the histograms at every position, indexed by value+128.
+void byte_stats_histogram(byte_stats_t* stats, uint64_t histogram[256]);
+
+// combined moments of the samples at the given byte positions.
+void byte_stats_moments(byte_stats_t* stats, const unsigned* positions, unsigned npositions, byte_moments_t* moments);
@@ -0,0 +1,165 @@
+/*
+ * Commands from the control FIFO. See control.h.
+ */
+#include "control.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <ascii_header.h>
+
+
+int control_open(control_t* control, const char* fifo, multilog_t* log) {
+    memset(control, 0, sizeof(control_t));
+    control->fd = -1;
+    control->write_fd = -1;
+    control->log = log;
+    pthread_mutex_init(&control->mutex, NULL);
+    if (fifo == NULL) {
+        return 0;
+    }
+    control->fd = open(fifo, O_NONBLOCK|O_RDONLY);
+    if (control->fd < 0) {
+        multilog(log,LOG_ERR,"opening control pipe '%s' errno=%d %s\n",fifo,errno,strerror(errno));
+        return -1;
+    }
+    control->write_fd = open(fifo, O_NONBLOCK|O_WRONLY);
+    return 0;
+}
+
+
+void control_close(control_t* control) {
+    if (control->fd >= 0) {
+        close(control->fd);
+    }
+    if (control->write_fd >= 0) {
+        close(control->write_fd);
+    }
+    control->fd = control->write_fd = -1;
+    pthread_mutex_destroy(&control->mutex);
+}
+
+
+static void handle_command(control_t* control, char* line) {
+    multilog_t* log = control->log;
+    while (isspace((unsigned char)*line)) {
+        ++line;
+    }
+    size_t length = strlen(line);
+    while (length > 0 && isspace((unsigned char)line[length-1])) {
+        line[--length] = '\0';
+    }
+    if (length == 0) {
+        return;
+    }
+    char* arguments = line + strcspn(line, " \t");
+    if (*arguments != '\0') {
+        *arguments++ = '\0';
+    }
+
+    if (strcasecmp(line, "START") == 0) {
+        pthread_mutex_lock(&control->mutex);
+        strncpy(control->parameters, arguments, CONTROL_LINE_LENGTH-1);
+        pthread_mutex_unlock(&control->mutex);
+        atomic_fetch_add(&control->starts, 1);
+        multilog(log,LOG_INFO,"Control: START %s\n",arguments);
+    } else if (strcasecmp(line, "STOP") == 0) {
+        atomic_fetch_add(&control->stops, 1);
+        multilog(log,LOG_INFO,"Control: STOP\n");
+    } else if (strcasecmp(line, "ABORT") == 0) {
+        atomic_fetch_add(&control->aborts, 1);
+        multilog(log,LOG_INFO,"Control: ABORT\n");
+    } else if (strcasecmp(line, "STATUS") == 0) {
+        atomic_fetch_add(&control->statuses, 1);
+    } else if (strcasecmp(line, "QUIT") == 0) {
+        atomic_fetch_add(&control->aborts, 1);
+        atomic_store(&control->quit, 1);
+        multilog(log,LOG_INFO,"Control: QUIT\n");
+    } else {
+        multilog(log,LOG_WARNING,"Control: unknown command '%s'\n",line);
+    }
+}
+
+
+int control_poll(control_t* control, int timeout_ms) {
+    if (control->fd < 0) {
+        poll(NULL, 0, timeout_ms);
+        return 0;
+    }
+    struct pollfd pfd = {control->fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    while (1) {
+        const ssize_t n = read(control->fd, control->line + control->line_length, CONTROL_LINE_LENGTH - 1 - control->line_length);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            multilog(control->log,LOG_ERR,"reading control pipe errno=%d %s\n",errno,strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        control->line_length += n;
+        control->line[control->line_length] = '\0';
+
+        // act on each whole line, and keep any partial one for next time.
+        char* start = control->line;
+        char* end;
+        while ((end = strchr(start, '\n')) != NULL) {
+            *end = '\0';
+            handle_command(control, start);
+            start = end + 1;
+        }
+        control->line_length = strlen(start);
+        if (control->line_length == CONTROL_LINE_LENGTH - 1) {
+            multilog(control->log,LOG_WARNING,"Control: discarding over-long command\n");
+            control->line_length = 0;
+        }
+        memmove(control->line, start, control->line_length + 1);
+    }
+}
+
+
+void control_get_parameters(control_t* control, char* parameters, size_t size) {
+    pthread_mutex_lock(&control->mutex);
+    strncpy(parameters, control->parameters, size-1);
+    parameters[size-1] = '\0';
+    pthread_mutex_unlock(&control->mutex);
+}
+
+
+int control_apply_parameters(const char* parameters, char* header, double* duration, multilog_t* log) {
+    char copy[CONTROL_LINE_LENGTH];
+    strncpy(copy, parameters, CONTROL_LINE_LENGTH-1);
+    copy[CONTROL_LINE_LENGTH-1] = '\0';
+    char* saveptr;
+    for (char* token = strtok_r(copy, " \t", &saveptr); token != NULL; token = strtok_r(NULL, " \t", &saveptr)) {
+        char* value = strchr(token, '=');
+        if (value == NULL || value == token) {
+            multilog(log,LOG_ERR,"Control: expected KEY=VALUE, not '%s'\n",token);
+            return -1;
+        }
+        *value++ = '\0';
+        if (strcasecmp(token, "DURATION") == 0) {
+            char* end;
+            *duration = strtod(value, &end);
+            if (*end != '\0' || *duration < 0) {
+                multilog(log,LOG_ERR,"Control: could not parse DURATION=%s\n",value);
+                return -1;
+            }
+        } else if (ascii_header_set(header, token, "%s", value) < 0) {
+            multilog(log,LOG_ERR,"Control: failed ascii_header_set %s\n",token);
+            return -1;
+        }
+    }
+    return 0;
+}
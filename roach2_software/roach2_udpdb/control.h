@@ -0,0 +1,60 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <multilog.h>
+
+#define CONTROL_LINE_LENGTH 4096
+
+/*
+ * Commands read from the control FIFO (-C), one per line:
+ *
+ *   START [KEY=VALUE ...]  start an observation (daemon mode). Each KEY=VALUE is set in the header,
+ *                          except DURATION=<seconds>, which replaces -T (0 to run until STOP).
+ *                          A START during an observation starts the next one as soon as it ends;
+ *                          if several arrive, the last one is used.
+ *   STOP                   end the observation at the end of the current block.
+ *   ABORT                  end the observation now, and forget any START waiting to follow it.
+ *   STATUS                 publish the state of every stream to the statistics and monitor pipe.
+ *   QUIT                   abort any observation and exit.
+ *
+ * The main thread reads the FIFO and counts each command. The capture threads compare the counts
+ * with those they have already acted on, so a command is never missed by a thread that is busy,
+ * and the data path only ever makes a relaxed atomic load.
+ */
+typedef struct control_t {
+    int fd; // -1 if there is no control FIFO
+    int write_fd; // our own writer, so that the FIFO does not hit end of file when the controller closes it.
+    char line[CONTROL_LINE_LENGTH];
+    size_t line_length;
+
+    atomic_uint starts;
+    atomic_uint stops;
+    atomic_uint aborts;
+    atomic_uint statuses;
+    atomic_int quit;
+
+    pthread_mutex_t mutex; // protects parameters
+    char parameters[CONTROL_LINE_LENGTH]; // KEY=VALUE list of the latest START
+    multilog_t* log;
+} control_t;
+
+// fifo may be NULL, in which case there are never any commands. Returns -1 if the FIFO cannot be opened.
+int control_open(control_t* control, const char* fifo, multilog_t* log);
+void control_close(control_t* control);
+
+// wait up to timeout_ms for commands, and count any that arrive. Returns -1 on a read error.
+int control_poll(control_t* control, int timeout_ms);
+
+// copy of the KEY=VALUE list of the latest START.
+void control_get_parameters(control_t* control, char* parameters, size_t size);
+
+/*
+ * Set each KEY=VALUE in parameters in the header, and take DURATION out into *duration (left
+ * alone if there is none). Returns -1 if a parameter cannot be understood or set.
+ */
+int control_apply_parameters(const char* parameters, char* header, double* duration, multilog_t* log);
+
+static inline unsigned control_count(atomic_uint* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
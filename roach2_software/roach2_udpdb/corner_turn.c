@@ -0,0 +1,191 @@
+/*
+ * Reorder DADA blocks into TFP or FTP order. See corner_turn.h.
+ */
+#include "corner_turn.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+
+static inline uint32_t swap_pols(uint32_t word) {
+    return (word >> 16) | (word << 16);
+}
+
+
+int corner_turn_parse(const char* spec, corner_turn_config_t* config) {
+    memset(config, 0, sizeof(corner_turn_config_t));
+    if (strncmp(spec, "TFP", 3) == 0) {
+        config->order = ORDER_TFP;
+    } else if (strncmp(spec, "FTP", 3) == 0) {
+        config->order = ORDER_FTP;
+    } else {
+        return -1;
+    }
+    spec += 3;
+    while (*spec == ',') {
+        ++spec;
+        if (strncmp(spec, "reverse", 7) == 0) {
+            config->reverse_channels = 1;
+            spec += 7;
+        } else if (strncmp(spec, "swap", 4) == 0) {
+            config->swap_pols = 1;
+            spec += 4;
+        } else {
+            return -1;
+        }
+    }
+    return *spec == '\0' ? 0 : -1;
+}
+
+
+const char* corner_turn_order_name(sample_order_t order) {
+    switch (order) {
+        case ORDER_TFP:
+            return "TFP";
+        case ORDER_FTP:
+            return "FTP";
+    }
+    return "unknown";
+}
+
+
+corner_turn_t* corner_turn_create(const corner_turn_config_t* config, uint64_t nchan, multilog_t* log) {
+    corner_turn_t* turn = malloc(sizeof(corner_turn_t));
+    memset(turn,0,sizeof(corner_turn_t));
+    turn->config = *config;
+    turn->nchan = nchan;
+    turn->log = log;
+    turn->use_avx2 = __builtin_cpu_supports("avx2") && nchan % 8 == 0;
+    multilog(log,LOG_INFO,"Reordering %"PRIu64" channels to %s%s%s%s\n",nchan,corner_turn_order_name(config->order),
+            config->reverse_channels ? ", channels reversed" : "", config->swap_pols ? ", polarisations swapped" : "",
+            turn->use_avx2 ? " with AVX2" : "");
+    return turn;
+}
+
+
+void corner_turn_destroy(corner_turn_t* turn) {
+    free(turn);
+}
+
+
+static void tfp_scalar(const corner_turn_t* turn, const uint32_t* in, uint32_t* out, uint64_t nsamp) {
+    const uint64_t nchan = turn->nchan;
+    for (uint64_t t = 0; t < nsamp; ++t) {
+        const uint32_t* frame = in + t*nchan;
+        for (uint64_t c = 0; c < nchan; ++c) {
+            const uint32_t word = frame[turn->config.reverse_channels ? nchan - 1 - c : c];
+            out[t*nchan + c] = turn->config.swap_pols ? swap_pols(word) : word;
+        }
+    }
+}
+
+
+static void ftp_scalar(const corner_turn_t* turn, const uint32_t* in, uint32_t* out, uint64_t first, uint64_t nsamp) {
+    const uint64_t nchan = turn->nchan;
+    for (uint64_t t0 = first; t0 < nsamp; t0 += CORNER_TURN_TILE_SAMPLES) {
+        const uint64_t t1 = t0 + CORNER_TURN_TILE_SAMPLES < nsamp ? t0 + CORNER_TURN_TILE_SAMPLES : nsamp;
+        for (uint64_t c = 0; c < nchan; ++c) {
+            const uint64_t source = turn->config.reverse_channels ? nchan - 1 - c : c;
+            uint32_t* row = out + c*nsamp;
+            for (uint64_t t = t0; t < t1; ++t) {
+                const uint32_t word = in[t*nchan + source];
+                row[t] = turn->config.swap_pols ? swap_pols(word) : word;
+            }
+        }
+    }
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i swap_pols_avx2(__m256i words) {
+    const __m256i swap = _mm256_setr_epi8(2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13,
+                                          2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13);
+    return _mm256_shuffle_epi8(words, swap);
+}
+
+
+__attribute__((target("avx2")))
+static void tfp_avx2(const corner_turn_t* turn, const uint32_t* in, uint32_t* out, uint64_t nsamp) {
+    const uint64_t nchan = turn->nchan;
+    const __m256i reverse = _mm256_setr_epi32(7,6,5,4,3,2,1,0);
+    for (uint64_t t = 0; t < nsamp; ++t) {
+        for (uint64_t c = 0; c < nchan; c += 8) {
+            __m256i words;
+            if (turn->config.reverse_channels) {
+                words = _mm256_loadu_si256((const __m256i*)(in + t*nchan + nchan - 8 - c));
+                words = _mm256_permutevar8x32_epi32(words, reverse);
+            } else {
+                words = _mm256_loadu_si256((const __m256i*)(in + t*nchan + c));
+            }
+            if (turn->config.swap_pols) {
+                words = swap_pols_avx2(words);
+            }
+            _mm256_storeu_si256((__m256i*)(out + t*nchan + c), words);
+        }
+    }
+}
+
+
+// transposes 8 time samples of 8 channels, leaving r[i] with the 8 samples of channel i.
+#define TRANSPOSE_8X8(r) do { \
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]); \
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]); \
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]); \
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]); \
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2); \
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3); \
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6); \
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7); \
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20); r[4] = _mm256_permute2x128_si256(u0, u4, 0x31); \
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20); r[5] = _mm256_permute2x128_si256(u1, u5, 0x31); \
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20); r[6] = _mm256_permute2x128_si256(u2, u6, 0x31); \
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20); r[7] = _mm256_permute2x128_si256(u3, u7, 0x31); \
+} while (0)
+
+
+__attribute__((target("avx2")))
+static void ftp_avx2(const corner_turn_t* turn, const uint32_t* in, uint32_t* out, uint64_t nsamp) {
+    const uint64_t nchan = turn->nchan;
+    const uint64_t nsamp8 = nsamp & ~(uint64_t)7;
+    for (uint64_t t0 = 0; t0 < nsamp8; t0 += CORNER_TURN_TILE_SAMPLES) {
+        const uint64_t t1 = t0 + CORNER_TURN_TILE_SAMPLES < nsamp8 ? t0 + CORNER_TURN_TILE_SAMPLES : nsamp8;
+        for (uint64_t c = 0; c < nchan; c += 8) {
+            for (uint64_t t = t0; t < t1; t += 8) {
+                __m256i r[8];
+                for (int i = 0; i < 8; ++i) {
+                    r[i] = _mm256_loadu_si256((const __m256i*)(in + (t+i)*nchan + c));
+                }
+                TRANSPOSE_8X8(r);
+                for (int i = 0; i < 8; ++i) {
+                    const uint64_t channel = turn->config.reverse_channels ? nchan - 1 - (c+i) : c+i;
+                    _mm256_storeu_si256((__m256i*)(out + channel*nsamp + t),
+                            turn->config.swap_pols ? swap_pols_avx2(r[i]) : r[i]);
+                }
+            }
+        }
+    }
+    // the last few samples of a partial block.
+    ftp_scalar(turn, in, out, nsamp8, nsamp);
+}
+
+
+void corner_turn_apply(corner_turn_t* turn, const char* in, char* out, uint64_t bytes) {
+    const uint64_t nsamp = bytes / (turn->nchan*4);
+    const uint32_t* in_words = (const uint32_t*)in;
+    uint32_t* out_words = (uint32_t*)out;
+
+    if (turn->config.order == ORDER_FTP) {
+        if (turn->use_avx2) {
+            ftp_avx2(turn, in_words, out_words, nsamp);
+        } else {
+            ftp_scalar(turn, in_words, out_words, 0, nsamp);
+        }
+    } else if (!turn->config.reverse_channels && !turn->config.swap_pols) {
+        memcpy(out, in, bytes);
+    } else if (turn->use_avx2) {
+        tfp_avx2(turn, in_words, out_words, nsamp);
+    } else {
+        tfp_scalar(turn, in_words, out_words, nsamp);
+    }
+}
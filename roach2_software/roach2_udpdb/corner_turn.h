@@ -0,0 +1,52 @@
+#include <inttypes.h>
+#include <multilog.h>
+
+// time samples per tile of the FTP transpose. 64 samples of 16 channels is 4 kB in and 4 kB out.
+#define CORNER_TURN_TILE_SAMPLES 64
+
+/*
+ * Reorder DADA blocks from the order they arrive in from the ROACH2 into the order downstream
+ * software wants.
+ *
+ * Data arrive as TFP: for each time sample, each channel, then each polarisation, with the real
+ * and imaginary parts of each 8-bit sample together, i.e. a 4 byte word for every channel and
+ * time sample. Reordering only ever moves these words around, so everything works on uint32s.
+ *
+ * ORDER_TFP: keep the order, except for any reversal of channels or swap of polarisations.
+ * ORDER_FTP: each block (or the partial block at the end) holds all the time samples of the first
+ *            channel, then all those of the next, and so on, as written by dspsr's FTP DADA files.
+ *
+ * With reverse_channels the channel order is flipped, so the sign of BW in the header changes.
+ * With swap_pols the two polarisations of each channel change places.
+ *
+ * With AVX2 the FTP transpose is done 8x8 words at a time in registers, within tiles of
+ * CORNER_TURN_TILE_SAMPLES samples that stay in L1, and if nchan is not a multiple of 8 a scalar
+ * version of the same loop is used.
+ */
+typedef enum sample_order_t {
+    ORDER_TFP,
+    ORDER_FTP
+} sample_order_t;
+
+typedef struct corner_turn_config_t {
+    sample_order_t order;
+    char reverse_channels;
+    char swap_pols;
+} corner_turn_config_t;
+
+typedef struct corner_turn_t {
+    corner_turn_config_t config;
+    uint64_t nchan;
+    char use_avx2;
+    multilog_t* log;
+} corner_turn_t;
+
+// parse order[,reverse][,swap] where order is TFP or FTP. Returns -1 if not understood.
+int corner_turn_parse(const char* spec, corner_turn_config_t* config);
+const char* corner_turn_order_name(sample_order_t order);
+
+corner_turn_t* corner_turn_create(const corner_turn_config_t* config, uint64_t nchan, multilog_t* log);
+void corner_turn_destroy(corner_turn_t* turn);
+
+// reorder bytes (a multiple of nchan*4) of TFP data from in to out, which must not overlap.
+void corner_turn_apply(corner_turn_t* turn, const char* in, char* out, uint64_t bytes);
@@ -0,0 +1,318 @@
+/*
+ * Write DADA files straight to disk. See dada_disk.h.
+ *
+ * The writer threads use plain pwrite from their own thread rather than io_uring or POSIX AIO:
+ * with O_DIRECT and blocks of tens of MB a blocking write keeps an NVMe device busy, and the
+ * capture thread never waits for it unless every buffer is queued.
+ */
+
+// needed for O_DIRECT
+#define _GNU_SOURCE
+
+#include "dada_disk.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <ascii_header.h>
+
+// O_DIRECT writes must be a multiple of this, from memory aligned to it.
+#define DIRECT_ALIGN 4096
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+static void record_error(dada_disk_t* disk, int error, const char* what, const char* path) {
+    multilog(disk->log,LOG_ERR,"%s %s ERRNO=%d %s\n",what,path,error,strerror(error));
+    if (disk->write_error == 0) {
+        disk->write_error = error;
+    }
+}
+
+
+// start the file that block sequence is the first block of.
+static void open_file(dada_disk_root_t* root, uint64_t sequence) {
+    dada_disk_t* disk = root->disk;
+    const uint64_t file_number = sequence / disk->blocks_per_file;
+    const uint64_t obs_offset = file_number * disk->blocks_per_file * disk->block_size;
+    char filename[2048];
+    snprintf(filename, sizeof(filename), "%s/%s_%s_%016"PRIu64".000000.dada", root->path, disk->utc_start, disk->label, obs_offset);
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    root->fd = open(filename, flags | (disk->use_direct ? O_DIRECT : 0), 0644);
+    if (root->fd < 0 && errno == EINVAL && disk->use_direct) {
+        multilog(disk->log,LOG_WARNING,"O_DIRECT not supported for %s, writing through the page cache\n",filename);
+        root->fd = open(filename, flags, 0644);
+    }
+    if (root->fd < 0) {
+        record_error(disk, errno, "Could not open", filename);
+        return;
+    }
+
+    // header_size is rounded up to DIRECT_ALIGN when the buffer is allocated.
+    char* header;
+    if (posix_memalign((void**)&header, DIRECT_ALIGN, disk->header_size + DIRECT_ALIGN) != 0) {
+        record_error(disk, ENOMEM, "Could not allocate header for", filename);
+        return;
+    }
+    memcpy(header, disk->header, disk->header_size);
+    if (ascii_header_set(header, "OBS_OFFSET", "%"PRIu64, obs_offset) < 0
+            || ascii_header_set(header, "FILE_SIZE", "%"PRIu64, disk->blocks_per_file*disk->block_size) < 0
+            || ascii_header_set(header, "FILE_NUMBER", "%"PRIu64, file_number) < 0) {
+        multilog(disk->log,LOG_WARNING,"Could not set OBS_OFFSET/FILE_SIZE/FILE_NUMBER in %s\n",filename);
+    }
+    if (pwrite(root->fd, header, disk->header_size, 0) != (ssize_t)disk->header_size) {
+        record_error(disk, errno, "Could not write header to", filename);
+    }
+    free(header);
+    multilog(disk->log,LOG_INFO,"Writing %s\n",filename);
+}
+
+
+static void write_block(dada_disk_root_t* root, dada_disk_block_t* block) {
+    dada_disk_t* disk = root->disk;
+    const uint64_t position = block->sequence % disk->blocks_per_file;
+    if (position == 0 || root->fd < 0) {
+        if (root->fd >= 0) {
+            close(root->fd);
+        }
+        open_file(root, block->sequence);
+        if (root->fd < 0) {
+            return;
+        }
+    }
+
+    const off_t offset = disk->header_size + position*disk->block_size;
+    uint64_t length = block->bytes;
+    if (disk->use_direct) {
+        // the buffer is padded, and the file is cut back afterwards.
+        length = (length + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    }
+    const double start = now();
+    uint64_t done = 0;
+    while (done < length) {
+        ssize_t written = pwrite(root->fd, block->data + done, length - done, offset + done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            record_error(disk, errno, "Error writing block to", root->path);
+            return;
+        }
+        done += written;
+    }
+    if (length != block->bytes && ftruncate(root->fd, offset + block->bytes) != 0) {
+        record_error(disk, errno, "Could not truncate file in", root->path);
+    }
+    root->seconds_writing += now() - start;
+    root->bytes_written += block->bytes;
+}
+
+
+static void* writer_thread(void* arg) {
+    dada_disk_root_t* root = arg;
+    dada_disk_t* disk = root->disk;
+
+    pthread_mutex_lock(&disk->mutex);
+    while (1) {
+        while (root->queued == 0 && !disk->closing) {
+            pthread_cond_wait(&disk->cond, &disk->mutex);
+        }
+        if (root->queued == 0) {
+            break;
+        }
+        dada_disk_block_t* block = &disk->blocks[root->queue[0]];
+        pthread_mutex_unlock(&disk->mutex);
+
+        write_block(root, block);
+
+        pthread_mutex_lock(&disk->mutex);
+        --(root->queued);
+        memmove(root->queue, root->queue+1, root->queued*sizeof(int));
+        block->busy = 0;
+        pthread_cond_broadcast(&disk->cond);
+    }
+    pthread_mutex_unlock(&disk->mutex);
+
+    if (root->fd >= 0) {
+        close(root->fd);
+        root->fd = -1;
+    }
+    return NULL;
+}
+
+
+dada_disk_t* dada_disk_open(const char* roots, const char* header, uint64_t header_size, const char* utc_start,
+        const char* label, uint64_t block_size, uint64_t blocks_per_file, multilog_t* log) {
+    dada_disk_t* disk = malloc(sizeof(dada_disk_t));
+    memset(disk,0,sizeof(dada_disk_t));
+    disk->log = log;
+    disk->header_size = header_size;
+    disk->block_size = block_size;
+    disk->blocks_per_file = blocks_per_file;
+    disk->current = -1;
+    disk->use_direct = (header_size % DIRECT_ALIGN == 0) && (block_size % DIRECT_ALIGN == 0);
+    strncpy(disk->utc_start, utc_start, sizeof(disk->utc_start)-1);
+    strncpy(disk->label, label, sizeof(disk->label)-1);
+    disk->header = malloc(header_size);
+    memcpy(disk->header, header, header_size);
+
+    char* list = strdup(roots);
+    char* saveptr = NULL;
+    for (char* path = strtok_r(list, ",", &saveptr); path != NULL; path = strtok_r(NULL, ",", &saveptr)) {
+        if (disk->nroots == DADA_DISK_MAX_ROOTS) {
+            multilog(log,LOG_ERR,"Too many data roots, at most %d allowed\n",DADA_DISK_MAX_ROOTS);
+            free(list);
+            free(disk->header);
+            free(disk);
+            return NULL;
+        }
+        dada_disk_root_t* root = &disk->roots[disk->nroots];
+        strncpy(root->path, path, sizeof(root->path)-1);
+        root->disk = disk;
+        root->index = disk->nroots;
+        root->fd = -1;
+        ++(disk->nroots);
+    }
+    free(list);
+    if (disk->nroots == 0) {
+        multilog(log,LOG_ERR,"No data roots given\n");
+        free(disk->header);
+        free(disk);
+        return NULL;
+    }
+
+    for (int i = 0; i < DADA_DISK_BUFFERS; ++i) {
+        if (posix_memalign((void**)&disk->blocks[i].data, DIRECT_ALIGN, block_size + DIRECT_ALIGN) != 0) {
+            multilog(log,LOG_ERR,"Could not allocate %d blocks of %"PRIu64" bytes\n",DADA_DISK_BUFFERS,block_size);
+            for (int j = 0; j < i; ++j) {
+                free(disk->blocks[j].data);
+            }
+            free(disk->header);
+            free(disk);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&disk->mutex, NULL);
+    pthread_cond_init(&disk->cond, NULL);
+    for (int i = 0; i < disk->nroots; ++i) {
+        pthread_create(&disk->roots[i].thread, NULL, writer_thread, &disk->roots[i]);
+    }
+
+    multilog(log,LOG_INFO,"Writing DADA files to %s, %"PRIu64" byte blocks, %"PRIu64" blocks per file%s\n",
+            roots,block_size,blocks_per_file,disk->use_direct ? ", O_DIRECT" : "");
+    return disk;
+}
+
+
+char* dada_disk_open_block(dada_disk_t* disk) {
+    pthread_mutex_lock(&disk->mutex);
+    int free_block = -1;
+    char waited = 0;
+    while (1) {
+        for (int i = 0; i < DADA_DISK_BUFFERS; ++i) {
+            if (!disk->blocks[i].busy) {
+                free_block = i;
+                break;
+            }
+        }
+        if (free_block >= 0) {
+            break;
+        }
+        if (!waited) {
+            ++(disk->waits);
+            waited = 1;
+        }
+        pthread_cond_wait(&disk->cond, &disk->mutex);
+    }
+    dada_disk_block_t* block = &disk->blocks[free_block];
+    block->busy = 1;
+    block->sequence = disk->next_sequence++;
+    block->bytes = 0;
+    disk->current = free_block;
+    pthread_mutex_unlock(&disk->mutex);
+    return block->data;
+}
+
+
+void dada_disk_close_block(dada_disk_t* disk, uint64_t bytes) {
+    pthread_mutex_lock(&disk->mutex);
+    dada_disk_block_t* block = &disk->blocks[disk->current];
+    block->bytes = bytes;
+    dada_disk_root_t* root = &disk->roots[(block->sequence / disk->blocks_per_file) % disk->nroots];
+    root->queue[root->queued++] = disk->current;
+    disk->current = -1;
+    pthread_cond_broadcast(&disk->cond);
+    pthread_mutex_unlock(&disk->mutex);
+}
+
+
+void dada_disk_write(dada_disk_t* disk, const char* data, uint64_t bytes) {
+    while (bytes > 0) {
+        if (disk->current < 0) {
+            dada_disk_open_block(disk);
+            disk->fill = 0;
+        }
+        uint64_t n = disk->block_size - disk->fill;
+        if (n > bytes) {
+            n = bytes;
+        }
+        memcpy(disk->blocks[disk->current].data + disk->fill, data, n);
+        disk->fill += n;
+        data += n;
+        bytes -= n;
+        if (disk->fill == disk->block_size) {
+            dada_disk_close_block(disk, disk->block_size);
+        }
+    }
+}
+
+
+int dada_disk_close(dada_disk_t* disk) {
+    if (disk->current >= 0) {
+        // only dada_disk_write leaves a block open, and then fill says how much is in it.
+        if (disk->fill > 0) {
+            dada_disk_close_block(disk, disk->fill);
+        } else {
+            disk->blocks[disk->current].busy = 0;
+            disk->current = -1;
+        }
+    }
+
+    pthread_mutex_lock(&disk->mutex);
+    disk->closing = 1;
+    pthread_cond_broadcast(&disk->cond);
+    pthread_mutex_unlock(&disk->mutex);
+
+    uint64_t total = 0;
+    for (int i = 0; i < disk->nroots; ++i) {
+        dada_disk_root_t* root = &disk->roots[i];
+        pthread_join(root->thread, NULL);
+        total += root->bytes_written;
+        multilog(disk->log,LOG_INFO,"Wrote %"PRIu64" bytes to %s at %.1lf MB/s\n",root->bytes_written,root->path,
+                root->seconds_writing > 0 ? root->bytes_written/root->seconds_writing/1e6 : 0.0);
+    }
+    multilog(disk->log,LOG_INFO,"Wrote %"PRIu64" blocks, %"PRIu64" bytes. Waited for the disk %"PRIu64" times\n",
+            disk->next_sequence,total,disk->waits);
+
+    const int ret = disk->write_error ? -1 : 0;
+    pthread_mutex_destroy(&disk->mutex);
+    pthread_cond_destroy(&disk->cond);
+    for (int i = 0; i < DADA_DISK_BUFFERS; ++i) {
+        free(disk->blocks[i].data);
+    }
+    free(disk->header);
+    free(disk);
+    return ret;
+}
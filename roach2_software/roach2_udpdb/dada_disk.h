@@ -0,0 +1,85 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <multilog.h>
+
+// blocks in memory per stream: one being filled, and the rest queued for or being written to disk.
+#define DADA_DISK_BUFFERS 4
+#define DADA_DISK_MAX_ROOTS 8
+#define DADA_DISK_DEFAULT_BLOCK_SIZE (32<<20)
+#define DADA_DISK_DEFAULT_BLOCKS_PER_FILE 32
+
+/*
+ * Write DADA files straight to disk, in place of a psrdada ring and a dada_dbdisk.
+ *
+ * Data are handed over a block at a time, either by filling the buffer from
+ * dada_disk_open_block and passing it back with dada_disk_close_block, or by streaming with
+ * dada_disk_write, which does the same behind the scenes. Each closed block is written by a
+ * writer thread while the next is filled, so the caller only waits if the disk falls
+ * DADA_DISK_BUFFERS-1 blocks behind.
+ *
+ * A new file is started every blocks_per_file blocks, named
+ * <root>/<UTC_START>_<label>_<OBS_OFFSET>.000000.dada, with a copy of the header in which
+ * OBS_OFFSET, FILE_SIZE and FILE_NUMBER are set. Successive files go to successive roots, each
+ * root with its own writer thread, so several disks can be written at once; with one block per
+ * file the blocks themselves are striped across the roots.
+ *
+ * Files are written with O_DIRECT from aligned buffers if the header and block sizes are
+ * multiples of 4096 and the filesystem allows it, so the data do not pass through the page
+ * cache.
+ */
+typedef struct dada_disk_block_t {
+    char* data;
+    uint64_t bytes; // bytes of data to write
+    uint64_t sequence; // block number from the start of the observation
+    char busy; // being filled or waiting to be written
+} dada_disk_block_t;
+
+typedef struct dada_disk_root_t {
+    char path[1024];
+    struct dada_disk_t* disk;
+    int index;
+    pthread_t thread;
+    int queue[DADA_DISK_BUFFERS]; // blocks waiting to be written to this root, oldest first
+    int queued;
+    int fd; // file currently being written, -1 if none
+    uint64_t bytes_written;
+    double seconds_writing;
+} dada_disk_root_t;
+
+typedef struct dada_disk_t {
+    char* header; // template header
+    uint64_t header_size;
+    char utc_start[64];
+    char label[64];
+    uint64_t block_size;
+    uint64_t blocks_per_file;
+    char use_direct;
+
+    dada_disk_block_t blocks[DADA_DISK_BUFFERS];
+    dada_disk_root_t roots[DADA_DISK_MAX_ROOTS];
+    int nroots;
+    uint64_t next_sequence;
+    int current; // block being filled, -1 if none
+    uint64_t fill; // bytes written to the current block by dada_disk_write
+    uint64_t waits; // times the caller had to wait for a free block
+    char closing;
+    int write_error; // errno of the first failed write, 0 if none
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    multilog_t* log;
+} dada_disk_t;
+
+// roots is a comma separated list of directories. The header is copied.
+dada_disk_t* dada_disk_open(const char* roots, const char* header, uint64_t header_size, const char* utc_start,
+        const char* label, uint64_t block_size, uint64_t blocks_per_file, multilog_t* log);
+// write out everything and stop the writer threads. Returns -1 if any write failed.
+int dada_disk_close(dada_disk_t* disk);
+
+// a block_size buffer to fill, waiting for one to be free if necessary.
+char* dada_disk_open_block(dada_disk_t* disk);
+// queue the current block to be written. bytes is normally block_size, but may be less for the last block.
+void dada_disk_close_block(dada_disk_t* disk, uint64_t bytes);
+
+// append data, opening and closing blocks as needed.
+void dada_disk_write(dada_disk_t* disk, const char* data, uint64_t bytes);
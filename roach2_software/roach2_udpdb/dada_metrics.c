@@ -0,0 +1,96 @@
+/*
+ * Read-only metrics of a psrdada data block, built as libdada_metrics.so. See dada_metrics.h
+ */
+
+#include "dada_metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+
+#include <ipcbuf.h>
+
+struct dada_metrics_reader_t {
+    int shmid;
+    const ipcbuf_sync_t* sync;
+    int semid; // full and clear counts of the first reader.
+    dada_metrics_t history[DADA_METRICS_HISTORY];
+    uint64_t nreads;
+};
+
+
+dada_metrics_reader_t* dada_metrics_attach(uint32_t dada_key) {
+    const int shmid = shmget((key_t)dada_key, 0, 0);
+    if (shmid < 0) {
+        return NULL;
+    }
+    const ipcbuf_sync_t* sync = shmat(shmid, NULL, SHM_RDONLY);
+    if (sync == (void*)-1) {
+        return NULL;
+    }
+    const int semid = semget(sync->semkey_data[0], 0, 0);
+    if (semid < 0) {
+        shmdt(sync);
+        return NULL;
+    }
+
+    dada_metrics_reader_t* reader = calloc(1, sizeof(dada_metrics_reader_t));
+    reader->shmid = shmid;
+    reader->sync = sync;
+    reader->semid = semid;
+    return reader;
+}
+
+
+int dada_metrics_read(dada_metrics_reader_t* reader, dada_metrics_t* metrics) {
+    // dada_db -d removes the segment, but it stays mapped here until we detach, so check it is
+    // still live; the semaphores go straight away.
+    struct shmid_ds status;
+    if (shmctl(reader->shmid, IPC_STAT, &status) < 0 || (status.shm_perm.mode & SHM_DEST)) {
+        return -1;
+    }
+    const int full = semctl(reader->semid, IPCBUF_FULL, GETVAL);
+    const int clear = semctl(reader->semid, IPCBUF_CLEAR, GETVAL);
+    if (full < 0 || clear < 0) {
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const volatile ipcbuf_sync_t* sync = reader->sync;
+    metrics->time_us = now.tv_sec*1000000LL + now.tv_nsec/1000;
+    metrics->nbufs = sync->nbufs;
+    metrics->bufsz = sync->bufsz;
+    metrics->full = full;
+    metrics->clear = clear;
+    metrics->write_count = sync->w_buf_next;
+    metrics->read_count = sync->r_bufs[0];
+
+    reader->history[reader->nreads % DADA_METRICS_HISTORY] = *metrics;
+    ++(reader->nreads);
+    return 0;
+}
+
+
+uint64_t dada_metrics_history(dada_metrics_reader_t* reader, dada_metrics_t* samples, uint64_t max) {
+    const uint64_t kept = reader->nreads < DADA_METRICS_HISTORY ? reader->nreads : DADA_METRICS_HISTORY;
+    const uint64_t count = kept < max ? kept : max;
+    for (uint64_t i = 0; i < count; ++i) {
+        samples[i] = reader->history[(reader->nreads - count + i) % DADA_METRICS_HISTORY];
+    }
+    return count;
+}
+
+
+void dada_metrics_detach(dada_metrics_reader_t* reader) {
+    shmdt(reader->sync);
+    free(reader);
+}
+
+
+uint64_t dada_metrics_size(void) {
+    return sizeof(dada_metrics_t);
+}
@@ -0,0 +1,44 @@
+#include <inttypes.h>
+
+/*
+ * Read-only metrics of a psrdada data block, for monitoring without running dada_dbmetric.
+ *
+ * The reader attaches to the ipcbuf sync segment of the key with SHM_RDONLY and reads the full and
+ * clear counts from its semaphores with semctl(GETVAL). It never connects to the buffer as a
+ * reader or writer, never takes a lock, and never attaches to the data blocks themselves, so it
+ * cannot get in the way of the capture. Built as libdada_metrics.so for the control system (see
+ * nunabe/dada_metrics.py).
+ *
+ * Each read is also kept in a short history, so that the rates at which blocks are written and
+ * read can be worked out without the caller keeping its own.
+ */
+
+// number of past reads kept by each reader.
+#define DADA_METRICS_HISTORY 64
+
+typedef struct dada_metrics_t {
+    int64_t time_us; // CLOCK_REALTIME when read, microseconds since the epoch.
+    uint64_t nbufs; // total number of blocks.
+    uint64_t bufsz; // bytes per block.
+    uint64_t full; // blocks written and not yet read.
+    uint64_t clear; // blocks free for the writer.
+    uint64_t write_count; // blocks written since the buffer was created.
+    uint64_t read_count; // blocks read by the first reader since the buffer was created.
+} dada_metrics_t;
+
+typedef struct dada_metrics_reader_t dada_metrics_reader_t;
+
+// NULL if there is no buffer with that key (yet).
+dada_metrics_reader_t* dada_metrics_attach(uint32_t dada_key);
+
+/*
+ * Read the metrics now. Returns 0 on success, and -1 if the buffer has been destroyed, in which
+ * case the reader should be detached and attached again when the buffer is back.
+ */
+int dada_metrics_read(dada_metrics_reader_t* reader, dada_metrics_t* metrics);
+
+// copy up to max past reads into samples, oldest first. Returns the number copied.
+uint64_t dada_metrics_history(dada_metrics_reader_t* reader, dada_metrics_t* samples, uint64_t max);
+
+void dada_metrics_detach(dada_metrics_reader_t* reader);
+uint64_t dada_metrics_size(void);
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 
 
 /*
@@ -27,7 +28,8 @@
  *
  * The packets seem to have only one item stored outside of the header.
  *
- * If needed, some optimisation is possible by just assuming all packets look the same.
+ * Since all packets look the same, decode_roach2_spead_packet_fast learns where the items are
+ * from the first packet and after that just checks they are still there.
  *
  * band select seems to be a flag that specifies the mode of the ROACH firmware.
  *
@@ -107,3 +109,164 @@ char* decode_roach2_spead_packet(unsigned char* heap, uint64_t* data_size, uint6
 }
 
 
+
+// read 8 big endian bytes.
+static inline uint64_t read_item_pointer(unsigned char const* item_pointer) {
+    uint64_t value;
+    memcpy(&value, item_pointer, sizeof(value));
+    return __builtin_bswap64(value);
+}
+
+// the top 24 bits of an item pointer are the mode bit and the identifier, the bottom 40 bits the value.
+#define ITEM_KEY(item) ((item) >> 40)
+#define ITEM_VALUE(item) ((item) & 0xffffffffffULL)
+
+
+void spead_layout_init(spead_layout_t* layout) {
+    memset(layout,0,sizeof(spead_layout_t));
+}
+
+
+/*
+ * Find the item pointers we need in a packet and remember where they were.
+ * Returns 1 if all four items were found.
+ */
+static int learn_layout(spead_layout_t* layout, unsigned char const* heap) {
+    const unsigned item_width = 8;
+    const unsigned number_of_items = (uint64_t)heap[7] | ((uint64_t)heap[6] << 8);
+    char found[4] = {0,0,0,0};
+
+    for (unsigned item_counter = 0; item_counter < number_of_items; ++item_counter) {
+        const unsigned offset = 8 + item_counter*item_width;
+        const uint64_t item = read_item_pointer(heap + offset);
+        switch (ITEM_KEY(item) & 0x7fffff) {
+            case 0x0004:
+                layout->data_size_offset = offset;
+                layout->data_size_key = ITEM_KEY(item);
+                found[0] = 1;
+                break;
+            case 0x1601:
+                layout->frame_counter_offset = offset;
+                layout->frame_counter_key = ITEM_KEY(item);
+                found[1] = 1;
+                break;
+            case 0x1700:
+                layout->band_select_offset = offset;
+                layout->band_select_key = ITEM_KEY(item);
+                found[2] = 1;
+                break;
+            case 0x1800:
+                layout->data_offset_offset = offset;
+                layout->data_offset_key = ITEM_KEY(item);
+                found[3] = 1;
+                break;
+        }
+    }
+
+    layout->number_of_items = number_of_items;
+    layout->header_length = 8 + number_of_items*item_width;
+    layout->learnt = found[0] && found[1] && found[2] && found[3];
+    return layout->learnt;
+}
+
+
+/*
+ * Same result as decode_roach2_spead_packet, but once the layout is known each packet is
+ * only checked for the magic, the item count and the four item identifiers at their usual
+ * places. If anything is different we fall back to the full scan.
+ */
+char* decode_roach2_spead_packet_fast(spead_layout_t* layout, unsigned char* heap, uint64_t* data_size, uint64_t* frame_counter, uint64_t* band_select) {
+    if (!layout->learnt) {
+        char* data_pointer = decode_roach2_spead_packet(heap, data_size, frame_counter, band_select);
+        if (data_pointer) {
+            learn_layout(layout, heap);
+        }
+        return data_pointer;
+    }
+
+    const uint64_t number_of_items = (uint64_t)heap[7] | ((uint64_t)heap[6] << 8);
+    const uint64_t data_size_item     = read_item_pointer(heap + layout->data_size_offset);
+    const uint64_t frame_counter_item = read_item_pointer(heap + layout->frame_counter_offset);
+    const uint64_t band_select_item   = read_item_pointer(heap + layout->band_select_offset);
+    const uint64_t data_offset_item   = read_item_pointer(heap + layout->data_offset_offset);
+
+    if (heap[0] != 0x53 || number_of_items != layout->number_of_items ||
+            ITEM_KEY(data_size_item) != layout->data_size_key ||
+            ITEM_KEY(frame_counter_item) != layout->frame_counter_key ||
+            ITEM_KEY(band_select_item) != layout->band_select_key ||
+            ITEM_KEY(data_offset_item) != layout->data_offset_key ||
+            ITEM_VALUE(data_offset_item) != 0) {
+        ++(layout->fallbacks);
+        return decode_roach2_spead_packet(heap, data_size, frame_counter, band_select);
+    }
+
+    *data_size = ITEM_VALUE(data_size_item);
+    *frame_counter = ITEM_VALUE(frame_counter_item);
+    *band_select = ITEM_VALUE(band_select_item);
+    return (char*)heap + layout->header_length;
+}
+
+
+/*
+ * Write a SPEAD header that looks like the ones from the ROACH2 firmware (SPEAD-64-40, 7 items,
+ * data immediately after the header). Returns the header length in bytes.
+ */
+uint64_t encode_roach2_spead_header(unsigned char* heap, uint64_t data_size, uint64_t frame_counter, uint64_t band_select) {
+    const unsigned number_of_items = 7;
+    // mode bit, identifier and value of each item pointer, in the order the firmware sends them.
+    const uint64_t items[7][3] = {
+        {1, 0x0001, 0}, // heap counter, always zero from the ROACH2
+        {1, 0x0002, 8 + number_of_items*8}, // heap size, which seems to be the header size
+        {1, 0x0003, 0}, // heap offset
+        {1, 0x0004, data_size},
+        {1, 0x1601, frame_counter},
+        {1, 0x1700, band_select},
+        {0, 0x1800, 0}, // the data, at offset zero
+    };
+
+    heap[0] = 0x53; // magic
+    heap[1] = 0x04; // version
+    heap[2] = 0x03; // bytes of mode+identifier in each item pointer
+    heap[3] = 0x05; // bytes of address/value in each item pointer
+    heap[4] = 0;
+    heap[5] = 0;
+    heap[6] = (number_of_items >> 8) & 0xff;
+    heap[7] = number_of_items & 0xff;
+
+    for (unsigned i = 0; i < number_of_items; ++i) {
+        const uint64_t item = (items[i][0] << 63) | (items[i][1] << 40) | ITEM_VALUE(items[i][2]);
+        const uint64_t big_endian = __builtin_bswap64(item);
+        memcpy(heap + 8 + i*8, &big_endian, sizeof(big_endian));
+    }
+
+    return 8 + number_of_items*8;
+}
+
+
+int band_select_to_frames_per_heap(uint64_t band_select) {
+    //https://drive.google.com/file/d/1Dcp3hzQ37FaQsrmJCuuU-ry1TO9biQ90/view?usp=sharing
+    switch (band_select){
+        case 0:
+            return 64;
+        case 2:
+            return 74;
+        case 4:
+            return 86;
+        case 6:
+            return 103;
+        case 8:
+            return 128;
+        case 10:
+            return 171;
+        case 12:
+            return 256;
+        case 14:
+            return 512;
+        default:
+            return -1;
+    }
+}
+int band_select_to_data_size(uint64_t band_select) {
+    int words_per_frame = 8-band_select/2;
+    return band_select_to_frames_per_heap(band_select) * words_per_frame*8; // 
+}
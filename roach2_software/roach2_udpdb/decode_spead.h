@@ -1,3 +1,23 @@
 #include <inttypes.h>
 
 char* decode_roach2_spead_packet(unsigned char* heap, uint64_t* data_size, uint64_t* frame_counter, uint64_t* band_select);
+
+// Item layout learnt from the first valid packet, used by decode_roach2_spead_packet_fast.
+typedef struct spead_layout_t {
+    char learnt; // set once the layout has been learnt.
+    uint64_t number_of_items;
+    uint64_t header_length; // bytes before the data.
+    // byte offset of the item pointer and the expected top 24 bits (mode+identifier) for each item we need.
+    unsigned data_size_offset, frame_counter_offset, band_select_offset, data_offset_offset;
+    uint64_t data_size_key, frame_counter_key, band_select_key, data_offset_key;
+    uint64_t fallbacks; // number of packets that did not match the layout.
+} spead_layout_t;
+
+void spead_layout_init(spead_layout_t* layout);
+char* decode_roach2_spead_packet_fast(spead_layout_t* layout, unsigned char* heap, uint64_t* data_size, uint64_t* frame_counter, uint64_t* band_select);
+
+uint64_t encode_roach2_spead_header(unsigned char* heap, uint64_t data_size, uint64_t frame_counter, uint64_t band_select);
+
+// frames per packet and bytes of data per packet for each band_select setting of the firmware.
+int band_select_to_frames_per_heap(uint64_t band_select);
+int band_select_to_data_size(uint64_t band_select);
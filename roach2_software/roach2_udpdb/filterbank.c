@@ -0,0 +1,377 @@
+/*
+ * Detected filterbank output on a second DADA key. See filterbank.h.
+ */
+#define _GNU_SOURCE
+
+#include "filterbank.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <immintrin.h>
+
+#include <ipcio.h>
+#include <ascii_header.h>
+
+
+int filterbank_parse(const char* spec, filterbank_config_t* config) {
+    memset(config, 0, sizeof(filterbank_config_t));
+    config->nbit = 32;
+    config->core = -1;
+    char state[8] = "I";
+    const int nfields = sscanf(spec, "%x:%"SCNu64":%7[^:]:%d:%d", &config->dada_key, &config->navg, state,
+            &config->nbit, &config->core);
+    if (nfields < 2 || config->navg == 0 || config->navg > FILTERBANK_MAX_NAVG) {
+        return -1;
+    }
+    if (strcmp(state, "I") == 0) {
+        config->state = FILTERBANK_INTENSITY;
+    } else if (strcmp(state, "IQUV") == 0) {
+        config->state = FILTERBANK_STOKES;
+    } else {
+        return -1;
+    }
+    return config->nbit == 32 || config->nbit == 8 ? 0 : -1;
+}
+
+
+filterbank_t* filterbank_open(const filterbank_config_t* config, multilog_t* log) {
+    dada_hdu_t* hdu = dada_hdu_create(log);
+    dada_hdu_set_key(hdu, config->dada_key);
+    if (dada_hdu_connect(hdu) < 0) {
+        multilog(log,LOG_ERR,"Could not connect to filterbank dada hdu for key %x\n",config->dada_key);
+        return NULL;
+    }
+    if (dada_hdu_lock_write(hdu) < 0) {
+        multilog(log,LOG_ERR,"Could not set write mode on filterbank dada hdu for key %x\n",config->dada_key);
+        dada_hdu_disconnect(hdu);
+        return NULL;
+    }
+
+    filterbank_t* fb = malloc(sizeof(filterbank_t));
+    memset(fb,0,sizeof(filterbank_t));
+    fb->config = *config;
+    fb->npol = config->state == FILTERBANK_STOKES ? 4 : 1;
+    fb->hdu = hdu;
+    fb->locked = 1;
+    fb->log = log;
+    pthread_mutex_init(&fb->mutex, NULL);
+    pthread_cond_init(&fb->cond, NULL);
+    multilog(log,LOG_INFO,"Filterbank to key %x: %s averaged over %"PRIu64" samples, %d-bit\n",config->dada_key,
+            config->state == FILTERBANK_STOKES ? "IQUV" : "I",config->navg,config->nbit);
+    return fb;
+}
+
+
+// sums over the navg samples of one output sample, for one channel.
+typedef struct detected_t {
+    int32_t xx, yy, re, im; // |X|^2, |Y|^2, Re(X Y*), Im(X Y*)
+} detected_t;
+
+static void store(const filterbank_t* fb, const detected_t* d, float* out) {
+    const float navg = fb->config.navg;
+    if (fb->npol == 1) {
+        out[0] = (d->xx + d->yy) / navg;
+    } else {
+        out[0] = (d->xx + d->yy) / navg;
+        out[1] = (d->xx - d->yy) / navg;
+        out[2] = 2*d->re / navg;
+        out[3] = 2*d->im / navg;
+    }
+}
+
+
+static void detect_scalar(const filterbank_t* fb, const int8_t* in, uint64_t nout, float* out) {
+    const uint64_t nchan = fb->nchan;
+    const uint64_t navg = fb->config.navg;
+    for (uint64_t o = 0; o < nout; ++o) {
+        for (uint64_t c = 0; c < nchan; ++c) {
+            detected_t d = {0, 0, 0, 0};
+            for (uint64_t t = 0; t < navg; ++t) {
+                const int8_t* s = in + ((o*navg + t)*nchan + c)*4;
+                d.xx += s[0]*s[0] + s[1]*s[1];
+                d.yy += s[2]*s[2] + s[3]*s[3];
+                d.re += s[0]*s[2] + s[1]*s[3];
+                d.im += s[1]*s[2] - s[0]*s[3];
+            }
+            store(fb, &d, out + (o*nchan + c)*fb->npol);
+        }
+    }
+}
+
+
+__attribute__((target("avx2")))
+static void detect_avx2(const filterbank_t* fb, const int8_t* in, uint64_t nout, float* out) {
+    const uint64_t nchan = fb->nchan;
+    const uint64_t navg = fb->config.navg;
+    const uint64_t frame_size = nchan*4;
+    const char stokes = fb->npol == 4;
+    // per channel, X and Y swapped: (Yr, Yi, Xr, Xi), and (Yi, -Yr, ...) for the imaginary part of X Y*.
+    const __m256i swap = _mm256_setr_epi8(4,5,6,7,0,1,2,3, 12,13,14,15,8,9,10,11,
+                                          4,5,6,7,0,1,2,3, 12,13,14,15,8,9,10,11);
+    const __m256i rotate = _mm256_setr_epi8(6,7,4,5,2,3,0,1, 14,15,12,13,10,11,8,9,
+                                            6,7,4,5,2,3,0,1, 14,15,12,13,10,11,8,9);
+    const __m256i sign = _mm256_setr_epi16(-1,1,1,1, -1,1,1,1, -1,1,1,1, -1,1,1,1);
+    for (uint64_t o = 0; o < nout; ++o) {
+        const int8_t* first = in + o*navg*frame_size;
+        // each 16 bytes is 4 channels.
+        for (uint64_t k = 0; k < frame_size/16; ++k) {
+            __m256i power = _mm256_setzero_si256();
+            __m256i cross_re = _mm256_setzero_si256();
+            __m256i cross_im = _mm256_setzero_si256();
+            for (uint64_t t = 0; t < navg; ++t) {
+                const __m256i v = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(first + t*frame_size + k*16)));
+                // |X|^2 and |Y|^2 of each channel in turn.
+                power = _mm256_add_epi32(power, _mm256_madd_epi16(v, v));
+                if (stokes) {
+                    // Re(X Y*) and Im(X Y*) in the even words.
+                    cross_re = _mm256_add_epi32(cross_re, _mm256_madd_epi16(v, _mm256_shuffle_epi8(v, swap)));
+                    cross_im = _mm256_add_epi32(cross_im, _mm256_madd_epi16(v, _mm256_sign_epi16(_mm256_shuffle_epi8(v, rotate), sign)));
+                }
+            }
+            int32_t p[8], re[8], im[8];
+            _mm256_storeu_si256((__m256i*)p, power);
+            _mm256_storeu_si256((__m256i*)re, cross_re);
+            _mm256_storeu_si256((__m256i*)im, cross_im);
+            for (int j = 0; j < 4; ++j) {
+                const detected_t d = {p[j*2], p[j*2+1], re[j*2], im[j*2]};
+                store(fb, &d, out + (o*nchan + k*4 + j)*fb->npol);
+            }
+        }
+    }
+}
+
+
+// scale to 8 bits with the statistics of the previous block, then remember those of this one.
+static void to_8bit(filterbank_t* fb, uint64_t nout) {
+    const uint64_t n = fb->nchan*fb->npol;
+    double* sum = calloc(n, sizeof(double));
+    double* sumsq = calloc(n, sizeof(double));
+    for (uint64_t o = 0; o < nout; ++o) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const double x = fb->spectra[o*n + i];
+            sum[i] += x;
+            sumsq[i] += x*x;
+        }
+    }
+    for (uint64_t i = 0; i < n && nout > 0; ++i) {
+        const double mean = sum[i]/nout;
+        const double variance = sumsq[i]/nout - mean*mean;
+        if (!fb->have_scaling) {
+            fb->mean[i] = mean;
+            fb->sigma[i] = variance > 0 ? sqrt(variance) : 1;
+        }
+        sum[i] = mean;
+        sumsq[i] = variance > 0 ? sqrt(variance) : 1;
+    }
+    for (uint64_t o = 0; o < nout; ++o) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const double x = FILTERBANK_8BIT_MEAN + (fb->spectra[o*n + i] - fb->mean[i]) / fb->sigma[i] * FILTERBANK_8BIT_SIGMA;
+            fb->output[o*n + i] = x < 0 ? 0 : (x > 255 ? 255 : (uint8_t)lrint(x));
+        }
+    }
+    if (nout > 0) {
+        memcpy(fb->mean, sum, n*sizeof(double));
+        memcpy(fb->sigma, sumsq, n*sizeof(double));
+        fb->have_scaling = 1;
+    }
+    free(sum);
+    free(sumsq);
+}
+
+
+static void write_zeros(filterbank_t* fb, uint64_t nout) {
+    const uint64_t per_block = fb->block_size/(fb->nchan*4*fb->config.navg);
+    const uint64_t bytes_per_sample = fb->nchan*fb->npol*fb->config.nbit/8;
+    memset(fb->output, 0, per_block*bytes_per_sample);
+    while (nout > 0) {
+        const uint64_t n = nout < per_block ? nout : per_block;
+        ipcio_write(fb->hdu->data_block, (char*)fb->output, n*bytes_per_sample);
+        nout -= n;
+    }
+}
+
+
+static void process(filterbank_t* fb, const char* block, uint64_t offset, uint64_t bytes) {
+    const uint64_t sample_bytes = fb->nchan*4*fb->config.navg;
+    if (offset > fb->processed_bytes) {
+        // blocks were dropped.
+        write_zeros(fb, (offset - fb->processed_bytes)/sample_bytes);
+    }
+    const uint64_t nout = bytes/sample_bytes;
+    if (fb->use_avx2) {
+        detect_avx2(fb, (const int8_t*)block, nout, fb->spectra);
+    } else {
+        detect_scalar(fb, (const int8_t*)block, nout, fb->spectra);
+    }
+    if (fb->config.nbit == 8) {
+        to_8bit(fb, nout);
+        ipcio_write(fb->hdu->data_block, (char*)fb->output, nout*fb->nchan*fb->npol);
+    } else {
+        ipcio_write(fb->hdu->data_block, (char*)fb->spectra, nout*fb->nchan*fb->npol*sizeof(float));
+    }
+    fb->processed_bytes = offset + bytes;
+}
+
+
+static void* filterbank_thread(void* arg) {
+    filterbank_t* fb = (filterbank_t*)arg;
+    pthread_mutex_lock(&fb->mutex);
+    while (1) {
+        while (fb->done == fb->submitted && !fb->closing) {
+            pthread_cond_wait(&fb->cond, &fb->mutex);
+        }
+        if (fb->done == fb->submitted) {
+            break;
+        }
+        const int slot = fb->done % FILTERBANK_QUEUE_BLOCKS;
+        pthread_mutex_unlock(&fb->mutex);
+        process(fb, fb->blocks[slot], fb->block_offset[slot], fb->block_bytes[slot]);
+        pthread_mutex_lock(&fb->mutex);
+        ++(fb->done);
+    }
+    pthread_mutex_unlock(&fb->mutex);
+    return NULL;
+}
+
+
+int filterbank_start(filterbank_t* fb, const char* header, uint64_t header_size, uint64_t nchan, uint64_t block_size) {
+    multilog_t* log = fb->log;
+    const uint64_t navg = fb->config.navg;
+    if (block_size % (nchan*4*navg) != 0) {
+        multilog(log,LOG_ERR,"Filterbank needs a whole number of %"PRIu64" sample averages in each %"PRIu64" byte block\n",navg,block_size);
+        return -1;
+    }
+    if (!fb->locked) {
+        if (dada_hdu_lock_write(fb->hdu) < 0) {
+            multilog(log,LOG_ERR,"Could not set write mode on filterbank dada hdu for key %x\n",fb->config.dada_key);
+            return -1;
+        }
+        fb->locked = 1;
+    }
+    fb->nchan = nchan;
+    fb->block_size = block_size;
+    fb->use_avx2 = __builtin_cpu_supports("avx2") && nchan % 4 == 0;
+
+    const uint64_t max_out = block_size/(nchan*4*navg)*nchan*fb->npol;
+    fb->spectra = malloc(max_out*sizeof(float));
+    fb->output = malloc(max_out*sizeof(float));
+    fb->mean = calloc(nchan*fb->npol, sizeof(double));
+    fb->sigma = calloc(nchan*fb->npol, sizeof(double));
+    for (int i = 0; i < FILTERBANK_QUEUE_BLOCKS; ++i) {
+        if (posix_memalign((void**)&fb->blocks[i], 4096, block_size) != 0) {
+            multilog(log,LOG_ERR,"Could not allocate filterbank queue of %"PRIu64" byte blocks\n",block_size);
+            return -1;
+        }
+    }
+
+    const uint64_t fb_header_size = ipcbuf_get_bufsz(fb->hdu->header_block);
+    char* fb_header = ipcbuf_get_next_write(fb->hdu->header_block);
+    memset(fb_header, 0, fb_header_size);
+    memcpy(fb_header, header, header_size < fb_header_size ? header_size : fb_header_size - 1);
+    double tsamp = 0;
+    ascii_header_get(header, "TSAMP", "%lf", &tsamp);
+    if (ascii_header_set(fb_header, "NBIT", "%d", fb->config.nbit) < 0
+            || ascii_header_set(fb_header, "NDIM", "%d", 1) < 0
+            || ascii_header_set(fb_header, "NPOL", "%d", fb->npol) < 0
+            || ascii_header_set(fb_header, "STATE", "%s", fb->npol == 4 ? "Stokes" : "Intensity") < 0
+            || ascii_header_set(fb_header, "TSAMP", "%.10lf", tsamp*navg) < 0
+            || ascii_header_set(fb_header, "ORDER", "%s", "TFP") < 0
+            || ascii_header_set(fb_header, "FILTERBANK_NAVG", "%"PRIu64, navg) < 0) {
+        multilog(log,LOG_ERR,"failed ascii_header_set in filterbank header\n");
+        return -1;
+    }
+    if (ipcbuf_mark_filled(fb->hdu->header_block, fb_header_size) < 0) {
+        multilog(log,LOG_ERR,"Could not mark filled filterbank header block\n");
+        return -1;
+    }
+
+    pthread_create(&fb->thread, NULL, filterbank_thread, fb);
+    fb->running = 1;
+    if (fb->config.core >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(fb->config.core, &cpuset);
+        pthread_setaffinity_np(fb->thread, sizeof(cpuset), &cpuset);
+    }
+    multilog(log,LOG_INFO,"Filterbank thread started%s, TSAMP %lf us\n",fb->use_avx2 ? " with AVX2" : "",tsamp*navg);
+    return 0;
+}
+
+
+void filterbank_submit(filterbank_t* fb, const char* block, uint64_t bytes) {
+    pthread_mutex_lock(&fb->mutex);
+    const char full = fb->submitted - fb->done == FILTERBANK_QUEUE_BLOCKS;
+    pthread_mutex_unlock(&fb->mutex);
+
+    const uint64_t offset = fb->submitted_bytes;
+    fb->submitted_bytes += bytes;
+    if (full) {
+        if (fb->dropped_blocks++ == 0) {
+            multilog(fb->log,LOG_WARNING,"Filterbank is not keeping up, dropping blocks\n");
+        }
+        return;
+    }
+    // the slot is ours until submitted moves on.
+    const int slot = fb->submitted % FILTERBANK_QUEUE_BLOCKS;
+    memcpy(fb->blocks[slot], block, bytes);
+    fb->block_bytes[slot] = bytes;
+    fb->block_offset[slot] = offset;
+
+    pthread_mutex_lock(&fb->mutex);
+    ++(fb->submitted);
+    pthread_cond_signal(&fb->cond);
+    pthread_mutex_unlock(&fb->mutex);
+}
+
+
+void filterbank_stop(filterbank_t* fb) {
+    if (fb->running) {
+        pthread_mutex_lock(&fb->mutex);
+        fb->closing = 1;
+        pthread_cond_signal(&fb->cond);
+        pthread_mutex_unlock(&fb->mutex);
+        pthread_join(fb->thread, NULL);
+        fb->running = 0;
+        // blocks dropped at the end have no later block to write their zeros, so write them here.
+        const uint64_t sample_bytes = fb->nchan*4*fb->config.navg;
+        if (fb->submitted_bytes > fb->processed_bytes) {
+            write_zeros(fb, (fb->submitted_bytes - fb->processed_bytes)/sample_bytes);
+        }
+    }
+    if (fb->dropped_blocks > 0) {
+        multilog(fb->log,LOG_WARNING,"Filterbank dropped %"PRIu64" of %"PRIu64" blocks\n",fb->dropped_blocks,fb->submitted+fb->dropped_blocks);
+    }
+    if (fb->locked && dada_hdu_unlock_write(fb->hdu) < 0) {
+        multilog(fb->log,LOG_ERR,"dada_hdu_unlock_write failed for filterbank key %x\n",fb->config.dada_key);
+    }
+    fb->locked = 0;
+
+    for (int i = 0; i < FILTERBANK_QUEUE_BLOCKS; ++i) {
+        free(fb->blocks[i]);
+        fb->blocks[i] = NULL;
+    }
+    free(fb->spectra);
+    free(fb->output);
+    free(fb->mean);
+    free(fb->sigma);
+    fb->spectra = NULL;
+    fb->output = NULL;
+    fb->mean = fb->sigma = NULL;
+
+    // ready for the next observation.
+    fb->submitted = fb->done = fb->submitted_bytes = fb->processed_bytes = fb->dropped_blocks = 0;
+    fb->closing = 0;
+    fb->have_scaling = 0;
+}
+
+
+void filterbank_close(filterbank_t* fb) {
+    filterbank_stop(fb);
+    dada_hdu_disconnect(fb->hdu);
+    pthread_mutex_destroy(&fb->mutex);
+    pthread_cond_destroy(&fb->cond);
+    free(fb);
+}
@@ -0,0 +1,101 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <multilog.h>
+#include <dada_hdu.h>
+
+// input blocks queued for the filterbank thread. If it falls this far behind, blocks are dropped.
+#define FILTERBANK_QUEUE_BLOCKS 4
+// the sums over an output sample are 32-bit, with room for |X|^2 + |Y|^2.
+#define FILTERBANK_MAX_NAVG 16384
+// 8-bit output is offset and scaled so that noise has this mean and standard deviation.
+#define FILTERBANK_8BIT_MEAN 64
+#define FILTERBANK_8BIT_SIGMA 16
+
+/*
+ * Detected, time averaged filterbank written to a second DADA key alongside the baseband data.
+ *
+ * The capture thread hands over each 8-bit TFP block as it is completed (in order, with gaps
+ * filled and after any spectral kurtosis excision, but before reordering or requantisation) with
+ * filterbank_submit, which copies it into a queue of FILTERBANK_QUEUE_BLOCKS blocks. The
+ * filterbank thread, pinned to its own core, square-law detects and averages every navg time
+ * samples. The capture thread never waits for it: if the queue is full the block is dropped and
+ * the filterbank has zeros for that stretch of time, so the baseband data never suffer.
+ *
+ * With FILTERBANK_INTENSITY the output is total intensity I = |X|^2 + |Y|^2. With
+ * FILTERBANK_STOKES it is I, Q = |X|^2 - |Y|^2, U = 2 Re(X Y*) and V = 2 Im(X Y*), which is
+ * the Stokes parameters for linear feeds X and Y; for circular feeds they come out as I, V, Q, U.
+ * Values are the mean over the navg samples. Output is in TFP order, i.e. for each output sample,
+ * each channel, then each of the npol (1 or 4) parameters, as 32-bit floats or as 8-bit unsigned
+ * integers scaled for each channel and parameter by the mean and standard deviation of the
+ * previous block to FILTERBANK_8BIT_MEAN and FILTERBANK_8BIT_SIGMA.
+ *
+ * With AVX2 the detection is done for 4 channels at a time, if nchan is a multiple of 4, giving
+ * exactly the same sums as the scalar version.
+ */
+typedef enum filterbank_state_t {
+    FILTERBANK_INTENSITY,
+    FILTERBANK_STOKES
+} filterbank_state_t;
+
+typedef struct filterbank_config_t {
+    unsigned dada_key;
+    uint64_t navg;
+    filterbank_state_t state;
+    int nbit; // 32 (float) or 8
+    int core; // core for the filterbank thread, -1 not to bind it
+} filterbank_config_t;
+
+typedef struct filterbank_t {
+    filterbank_config_t config;
+    uint64_t nchan;
+    int npol;
+    dada_hdu_t* hdu;
+
+    // queue of input blocks, filled by the capture thread and emptied by the filterbank thread.
+    uint64_t block_size;
+    char* blocks[FILTERBANK_QUEUE_BLOCKS];
+    uint64_t block_bytes[FILTERBANK_QUEUE_BLOCKS];
+    uint64_t block_offset[FILTERBANK_QUEUE_BLOCKS]; // input bytes before the block
+    uint64_t submitted;
+    uint64_t done;
+    uint64_t submitted_bytes;
+    uint64_t dropped_blocks;
+    char closing;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    char running;
+    char locked; // write access to the DADA key is held
+
+    // used only by the filterbank thread
+    uint64_t processed_bytes;
+    float* spectra; // [nout][nchan][npol]
+    uint8_t* output; // 8-bit copy of spectra
+    double* mean; // [nchan*npol] of the previous block, for 8-bit output
+    double* sigma;
+    char have_scaling;
+    char use_avx2;
+    multilog_t* log;
+} filterbank_t;
+
+// parse key:navg[:I|IQUV[:32|8[:core]]]. Returns -1 if not understood.
+int filterbank_parse(const char* spec, filterbank_config_t* config);
+
+// connect to the DADA key and lock it for writing. Returns NULL on failure.
+filterbank_t* filterbank_open(const filterbank_config_t* config, multilog_t* log);
+
+/*
+ * Write the header, based on the baseband header, and start the filterbank thread. block_size is
+ * the size of the blocks that will be submitted, which must be a whole number of navg samples.
+ * After filterbank_stop this starts another observation on the same key. Returns -1 on failure.
+ */
+int filterbank_start(filterbank_t* fb, const char* header, uint64_t header_size, uint64_t nchan, uint64_t block_size);
+
+// queue bytes of TFP data (block_size except at the end). Never waits.
+void filterbank_submit(filterbank_t* fb, const char* block, uint64_t bytes);
+
+// finish the queued blocks, stop the thread and end the observation on the DADA key, which stays connected.
+void filterbank_stop(filterbank_t* fb);
+
+// stop, and disconnect from the DADA key.
+void filterbank_close(filterbank_t* fb);
@@ -0,0 +1,80 @@
+/*
+ * Write a per-block mask of missing packets alongside the DADA data. See missing_mask.h for the format.
+ */
+
+#include "missing_mask.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+missing_mask_t* missing_mask_open(const char* filename, uint64_t packets_per_block, uint64_t bytes_per_packet,
+        uint64_t start_frame_counter, uint64_t frames_per_packet, multilog_t* log) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        multilog(log,LOG_ERR,"Could not open missing packet mask '%s' ERRNO=%d %s\n",filename,errno,strerror(errno));
+        return NULL;
+    }
+
+    missing_mask_t* mask = malloc(sizeof(missing_mask_t));
+    memset(mask,0,sizeof(missing_mask_t));
+    mask->file = file;
+    mask->log = log;
+    mask->packets_per_block = packets_per_block;
+    mask->mask_bytes = (packets_per_block + 7) / 8;
+    mask->bits = calloc(mask->mask_bytes, 1);
+
+    missing_mask_file_header_t header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic, MISSING_MASK_MAGIC, sizeof(header.magic));
+    header.packets_per_block = packets_per_block;
+    header.bytes_per_packet = bytes_per_packet;
+    header.record_size = sizeof(missing_mask_record_t) + mask->mask_bytes;
+    header.start_frame_counter = start_frame_counter;
+    header.frames_per_packet = frames_per_packet;
+    fwrite(&header, sizeof(header), 1, file);
+
+    multilog(log,LOG_INFO,"Writing missing packet mask to %s\n",filename);
+    return mask;
+}
+
+
+static void write_block(missing_mask_t* mask) {
+    missing_mask_record_t record;
+    record.block_index = mask->block_index;
+    record.nmissing = mask->nmissing;
+    fwrite(&record, sizeof(record), 1, mask->file);
+    fwrite(mask->bits, mask->mask_bytes, 1, mask->file);
+
+    memset(mask->bits, 0, mask->mask_bytes);
+    mask->nmissing = 0;
+    ++(mask->block_index);
+}
+
+
+void missing_mask_advance(missing_mask_t* mask, uint64_t next_packet) {
+    while ((mask->block_index + 1) * mask->packets_per_block <= next_packet) {
+        write_block(mask);
+    }
+}
+
+
+void missing_mask_mark(missing_mask_t* mask, uint64_t first_packet, uint64_t count) {
+    for (uint64_t packet = first_packet; packet < first_packet + count; ++packet) {
+        missing_mask_advance(mask, packet);
+        const uint64_t slot = packet - mask->block_index * mask->packets_per_block;
+        mask->bits[slot / 8] |= 1 << (slot % 8);
+        ++(mask->nmissing);
+    }
+}
+
+
+void missing_mask_close(missing_mask_t* mask, uint64_t next_packet) {
+    missing_mask_advance(mask, next_packet);
+    if (mask->block_index * mask->packets_per_block < next_packet) {
+        write_block(mask);
+    }
+    fclose(mask->file);
+    free(mask->bits);
+    free(mask);
+}
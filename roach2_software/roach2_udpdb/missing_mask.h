@@ -0,0 +1,51 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <multilog.h>
+
+#define MISSING_MASK_MAGIC "R2MASK01"
+
+/*
+ * Record of which packets in each DADA block were filled in rather than received.
+ *
+ * The file starts with a missing_mask_file_header_t, followed by one fixed size record per block:
+ * a missing_mask_record_t and then packets_per_block bits (rounded up to whole bytes), with bit
+ * (slot%8) of byte (slot/8) set if packet slot of that block was missing. Block n therefore
+ * starts at sizeof(missing_mask_file_header_t) + n*record_size, so a reader can seek straight
+ * to the block it wants. The last block of an observation may hold fewer packets than the
+ * others, in which case the bits past its end are clear. All values are in host byte order.
+ */
+typedef struct missing_mask_file_header_t {
+    char magic[8]; // MISSING_MASK_MAGIC
+    uint64_t packets_per_block;
+    uint64_t bytes_per_packet; // bytes of data per packet in the DADA block
+    uint64_t record_size; // bytes per block, including the record header
+    uint64_t start_frame_counter; // frame counter of the first packet of block 0
+    uint64_t frames_per_packet;
+} missing_mask_file_header_t;
+
+typedef struct missing_mask_record_t {
+    uint64_t block_index;
+    uint64_t nmissing;
+} missing_mask_record_t;
+
+typedef struct missing_mask_t {
+    FILE* file;
+    uint64_t packets_per_block;
+    uint64_t mask_bytes;
+    uint64_t block_index; // block currently being marked
+    uint64_t nmissing; // in the current block
+    unsigned char* bits; // for the current block
+    multilog_t* log;
+} missing_mask_t;
+
+missing_mask_t* missing_mask_open(const char* filename, uint64_t packets_per_block, uint64_t bytes_per_packet,
+        uint64_t start_frame_counter, uint64_t frames_per_packet, multilog_t* log);
+// write out every block that holds packets before packet index next_packet, including a partly
+// filled last block, then close the file.
+void missing_mask_close(missing_mask_t* mask, uint64_t next_packet);
+
+// mark count packets starting at packet index first_packet (counting from the start of the observation) as missing.
+void missing_mask_mark(missing_mask_t* mask, uint64_t first_packet, uint64_t count);
+
+// write out every block that ends before packet index next_packet.
+void missing_mask_advance(missing_mask_t* mask, uint64_t next_packet);
@@ -0,0 +1,208 @@
+/*
+ * NUMA and hugepage aware allocation. See numa_memory.h.
+ *
+ * The memory policy system calls are made directly, rather than through libnuma, so that there
+ * is nothing extra to install on the capture machines.
+ */
+#define _GNU_SOURCE
+
+#include "numa_memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1<<1)
+#endif
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE (1<<0)
+#endif
+#ifndef MPOL_F_ADDR
+#define MPOL_F_ADDR (1<<1)
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define MAP_HUGE_2MB_FLAG (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB_FLAG (30 << MAP_HUGE_SHIFT)
+
+// nodes up to this number can be bound to.
+#define MAX_NODE 63
+
+
+int hugepage_size_parse(const char* spec, hugepage_size_t* size) {
+    if (strcasecmp(spec, "2M") == 0) {
+        *size = HUGEPAGES_2M;
+    } else if (strcasecmp(spec, "1G") == 0) {
+        *size = HUGEPAGES_1G;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+int numa_node_of_interface(const char* interface) {
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", interface);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    int node = -1;
+    if (fscanf(f, "%d", &node) != 1) {
+        node = -1;
+    }
+    fclose(f);
+    return node;
+}
+
+
+int interface_of_address(const char* ip_address, char* interface) {
+    struct in_addr address;
+    if (inet_pton(AF_INET, ip_address, &address) != 1) {
+        return -1;
+    }
+    struct ifaddrs* addresses;
+    if (getifaddrs(&addresses) != 0) {
+        return -1;
+    }
+    int result = -1;
+    for (struct ifaddrs* a = addresses; a != NULL; a = a->ifa_next) {
+        if (a->ifa_addr && a->ifa_addr->sa_family == AF_INET
+                && ((struct sockaddr_in*)a->ifa_addr)->sin_addr.s_addr == address.s_addr) {
+            strncpy(interface, a->ifa_name, IF_NAMESIZE-1);
+            interface[IF_NAMESIZE-1] = '\0';
+            result = 0;
+            break;
+        }
+    }
+    freeifaddrs(addresses);
+    return result;
+}
+
+
+static size_t page_size_of(hugepage_size_t hugepages) {
+    switch (hugepages) {
+        case HUGEPAGES_1G: return 1024*1024*1024UL;
+        case HUGEPAGES_2M: return 2*1024*1024UL;
+        default: return sysconf(_SC_PAGESIZE);
+    }
+}
+
+
+static const char* hugepage_name(hugepage_size_t hugepages) {
+    switch (hugepages) {
+        case HUGEPAGES_1G: return "1 GB hugepages";
+        case HUGEPAGES_2M: return "2 MB hugepages";
+        default: return "normal pages";
+    }
+}
+
+
+static long set_policy(void* data, size_t size, int node, unsigned flags) {
+    unsigned long nodemask = 1UL << node;
+    return syscall(SYS_mbind, data, size, MPOL_PREFERRED, &nodemask, MAX_NODE + 2, flags);
+}
+
+
+// node that the page at address is on, or -1.
+static int node_of_page(void* address) {
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, address, MPOL_F_NODE|MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return node;
+}
+
+
+// write to every page, so that it is allocated now under the memory policy.
+static void touch_pages(char* data, size_t size, size_t page_size) {
+    for (size_t offset = 0; offset < size; offset += page_size) {
+        volatile char* p = data + offset;
+        *p = *p;
+    }
+}
+
+
+void* memory_alloc(size_t size, const memory_policy_t* policy, const char* name, size_t* map_size, multilog_t* log) {
+    void* data = MAP_FAILED;
+    hugepage_size_t hugepages = policy->hugepages;
+    // try the requested size of hugepages, then smaller ones.
+    while (hugepages != HUGEPAGES_NONE) {
+        const size_t page_size = page_size_of(hugepages);
+        *map_size = (size + page_size - 1) / page_size * page_size;
+        const int size_flag = hugepages == HUGEPAGES_1G ? MAP_HUGE_1GB_FLAG : MAP_HUGE_2MB_FLAG;
+        data = mmap(NULL, *map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|size_flag, -1, 0);
+        if (data != MAP_FAILED) {
+            break;
+        }
+        multilog(log,LOG_WARNING,"Could not allocate %zu bytes of %s for %s ERRNO=%d %s\n",*map_size,hugepage_name(hugepages),name,errno,strerror(errno));
+        hugepages = hugepages == HUGEPAGES_1G ? HUGEPAGES_2M : HUGEPAGES_NONE;
+    }
+    if (data == MAP_FAILED) {
+        *map_size = size;
+        data = mmap(NULL, *map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            multilog(log,LOG_ERR,"Could not allocate %zu bytes for %s ERRNO=%d %s\n",*map_size,name,errno,strerror(errno));
+            return NULL;
+        }
+        if (policy->hugepages != HUGEPAGES_NONE) {
+            // transparent hugepages are better than nothing.
+            madvise(data, *map_size, MADV_HUGEPAGE);
+        }
+    }
+
+    // the policy has to be set before anything touches the memory.
+    if (policy->node >= 0) {
+        if (policy->node > MAX_NODE || set_policy(data, *map_size, policy->node, 0) != 0) {
+            multilog(log,LOG_WARNING,"Could not bind %s to NUMA node %d ERRNO=%d %s\n",name,policy->node,errno,strerror(errno));
+        }
+    }
+
+    // locking faults in every page, otherwise do it by hand.
+    const char locked = mlock(data, *map_size) == 0;
+    if (!locked) {
+        multilog(log,LOG_WARNING,"Could not lock %s in memory ERRNO=%d %s. Raise the memlock limit to avoid paging.\n",name,errno,strerror(errno));
+        touch_pages(data, *map_size, page_size_of(hugepages));
+    }
+
+    multilog(log,LOG_INFO,"Allocated %zu bytes of %s for %s on NUMA node %d%s\n",
+            *map_size,hugepage_name(hugepages),name,node_of_page(data),locked ? ", locked" : "");
+    if (policy->node >= 0 && node_of_page(data) != policy->node) {
+        multilog(log,LOG_WARNING,"%s is not on NUMA node %d\n",name,policy->node);
+    }
+    return data;
+}
+
+
+void memory_free(void* data, size_t map_size) {
+    munmap(data, map_size);
+}
+
+
+int memory_bind(void* data, size_t size, int node, const char* name, multilog_t* log) {
+    // mbind works on whole pages.
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    char* start = (char*)((uintptr_t)data / page_size * page_size);
+    size = (size + ((char*)data - start) + page_size - 1) / page_size * page_size;
+    if (node < 0 || node > MAX_NODE || set_policy(start, size, node, MPOL_MF_MOVE) != 0) {
+        multilog(log,LOG_WARNING,"Could not bind %s to NUMA node %d ERRNO=%d %s\n",name,node,errno,strerror(errno));
+        return -1;
+    }
+    touch_pages(start, size, page_size);
+    if (node_of_page(start) != node) {
+        multilog(log,LOG_WARNING,"%s is not on NUMA node %d; pages still mapped by another process were not moved\n",name,node);
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <multilog.h>
+
+/*
+ * Placement of the large buffers on the NUMA node that owns the NIC, backed by hugepages and
+ * locked and faulted in before the observation starts.
+ *
+ * memory_alloc tries hugepages of the requested size first, then 2 MB hugepages, then normal
+ * pages with transparent hugepages advised. The mapping is bound to the node with a preferred
+ * policy (so a node without enough free memory degrades to remote memory rather than failing),
+ * then locked, which also faults every page in. If it cannot be locked (RLIMIT_MEMLOCK), every
+ * page is touched instead, so no page fault is left for the capture threads either way.
+ *
+ * memory_bind does the same for memory that is already mapped, such as the DADA shared memory
+ * buffers created by dada_db, moving any pages that are on the wrong node.
+ */
+typedef enum hugepage_size_t {
+    HUGEPAGES_NONE = 0,
+    HUGEPAGES_2M,
+    HUGEPAGES_1G
+} hugepage_size_t;
+
+typedef struct memory_policy_t {
+    int node; // NUMA node to allocate on, -1 for no preference
+    hugepage_size_t hugepages;
+} memory_policy_t;
+
+// parse "2M" or "1G". Returns -1 if not understood.
+int hugepage_size_parse(const char* spec, hugepage_size_t* size);
+
+// NUMA node of the device behind a network interface, or -1 if unknown.
+int numa_node_of_interface(const char* interface);
+
+// name of the interface with an IPv4 address, into interface[IF_NAMESIZE]. Returns -1 if there is none.
+int interface_of_address(const char* ip_address, char* interface);
+
+// returns NULL on failure. map_size is set to the size to give to memory_free.
+void* memory_alloc(size_t size, const memory_policy_t* policy, const char* name, size_t* map_size, multilog_t* log);
+void memory_free(void* data, size_t map_size);
+
+// bind existing memory to a node, move its pages there and fault it in. Returns -1 on failure.
+int memory_bind(void* data, size_t size, int node, const char* name, multilog_t* log);
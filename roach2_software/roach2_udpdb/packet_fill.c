@@ -0,0 +1,215 @@
+/*
+ * Fill data for packets that were lost.
+ *
+ * The fill data is prepared in a chunk of PACKET_FILL_CHUNK_PACKETS packets, so that a gap of
+ * many packets is written with a few large writes rather than one per packet, and
+ * nothing is decoded or copied from the internal ring whilst we are already behind.
+ */
+
+#include "packet_fill.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// the noise is always the same for the same statistics.
+#define NOISE_SEED 0x726f616368320001ULL
+#define GAUSSIAN_TABLE_SIZE 65536 // indexed by the top 16 bits of a random number
+
+int packet_fill_parse_policy(const char* name, fill_policy_t* policy) {
+    if (strcmp(name,"zeros") == 0) {
+        *policy = FILL_ZEROS;
+    } else if (strcmp(name,"noise") == 0) {
+        *policy = FILL_NOISE;
+    } else if (strcmp(name,"last") == 0) {
+        *policy = FILL_LAST;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+const char* packet_fill_policy_name(fill_policy_t policy) {
+    switch (policy) {
+        case FILL_ZEROS:
+            return "zeros";
+        case FILL_NOISE:
+            return "noise";
+        case FILL_LAST:
+            return "last";
+    }
+    return "unknown";
+}
+
+
+packet_fill_t* packet_fill_create(fill_policy_t policy, uint64_t data_size, uint64_t bytes_per_frame, multilog_t* log) {
+    packet_fill_t* fill = malloc(sizeof(packet_fill_t));
+    memset(fill,0,sizeof(packet_fill_t));
+    fill->log = log;
+    fill->policy = policy;
+    fill->data_size = data_size;
+    fill->bytes_per_frame = bytes_per_frame;
+    fill->random_state = NOISE_SEED;
+
+    // zeros until we know better.
+    fill->chunk = calloc(PACKET_FILL_CHUNK_PACKETS, data_size);
+    fill->last_packet = calloc(1, data_size);
+    if (policy == FILL_ZEROS) {
+        fill->chunk_ready = PACKET_FILL_CHUNK_PACKETS;
+    }
+    if (policy == FILL_NOISE) {
+        fill->sum = calloc(bytes_per_frame, sizeof(double));
+        fill->sum_squares = calloc(bytes_per_frame, sizeof(double));
+    }
+
+    multilog(log,LOG_INFO,"Missing packets filled with %s\n",packet_fill_policy_name(policy));
+    return fill;
+}
+
+
+void packet_fill_destroy(packet_fill_t* fill) {
+    free(fill->chunk);
+    free(fill->last_packet);
+    free(fill->sum);
+    free(fill->sum_squares);
+    free(fill);
+}
+
+
+// xorshift64*
+static uint64_t next_random(packet_fill_t* fill) {
+    fill->random_state ^= fill->random_state >> 12;
+    fill->random_state ^= fill->random_state << 25;
+    fill->random_state ^= fill->random_state >> 27;
+    return fill->random_state * 0x2545F4914F6CDD1DULL;
+}
+
+
+static double next_gaussian(packet_fill_t* fill) {
+    // Box-Muller, throwing away the second value.
+    const double u1 = ((next_random(fill) >> 11) + 1.0) / 9007199254740993.0;
+    const double u2 = (next_random(fill) >> 11) / 9007199254740992.0;
+    return sqrt(-2.0*log(u1)) * cos(2.0*M_PI*u2);
+}
+
+
+static void make_noise_chunk(packet_fill_t* fill) {
+    const uint64_t nsamples = fill->learnt_packets * (fill->data_size / fill->bytes_per_frame);
+    double* mean = malloc(fill->bytes_per_frame*sizeof(double));
+    double* rms = malloc(fill->bytes_per_frame*sizeof(double));
+    for (uint64_t i = 0; i < fill->bytes_per_frame; ++i) {
+        mean[i] = fill->sum[i] / nsamples;
+        const double variance = fill->sum_squares[i] / nsamples - mean[i]*mean[i];
+        rms[i] = variance > 0 ? sqrt(variance) : 0.0;
+    }
+
+    // This happens whilst packets are arriving, so draw from a table of gaussian deviates rather
+    // than calling log() and cos() for every one of the ~1M samples.
+    double* gaussian = malloc(GAUSSIAN_TABLE_SIZE*sizeof(double));
+    for (uint64_t i = 0; i < GAUSSIAN_TABLE_SIZE; ++i) {
+        gaussian[i] = next_gaussian(fill);
+    }
+
+    int8_t* chunk = (int8_t*)fill->chunk;
+    const uint64_t chunk_bytes = PACKET_FILL_CHUNK_PACKETS*fill->data_size;
+    for (uint64_t i = 0; i < chunk_bytes; ++i) {
+        const uint64_t j = i % fill->bytes_per_frame;
+        double value = round(mean[j] + rms[j]*gaussian[next_random(fill) >> 48]);
+        if (value > 127.0) value = 127.0;
+        if (value < -128.0) value = -128.0;
+        chunk[i] = (int8_t)value;
+    }
+    free(gaussian);
+    free(mean);
+    free(rms);
+    fill->chunk_ready = PACKET_FILL_CHUNK_PACKETS;
+    multilog(fill->log,LOG_INFO,"Noise fill statistics measured from %"PRIu64" packets\n",fill->learnt_packets);
+}
+
+
+void packet_fill_good_packet(packet_fill_t* fill, const char* data) {
+    if (fill->policy == FILL_LAST) {
+        // this is a copy of every packet, so it costs some memory bandwidth.
+        memcpy(fill->last_packet, data, fill->data_size);
+        fill->chunk_ready = 0;
+    } else if (fill->policy == FILL_NOISE && fill->learnt_packets < PACKET_FILL_LEARN_PACKETS) {
+        const int8_t* samples = (const int8_t*)data;
+        for (uint64_t i = 0; i < fill->data_size; ++i) {
+            const uint64_t j = i % fill->bytes_per_frame;
+            fill->sum[j] += samples[i];
+            fill->sum_squares[j] += samples[i]*samples[i];
+        }
+        ++(fill->learnt_packets);
+        if (fill->learnt_packets == PACKET_FILL_LEARN_PACKETS) {
+            make_noise_chunk(fill);
+        }
+    }
+}
+
+
+// make sure at least npackets at the start of the chunk are ready to use.
+static void prepare_chunk(packet_fill_t* fill, uint64_t npackets) {
+    if (npackets > PACKET_FILL_CHUNK_PACKETS) {
+        npackets = PACKET_FILL_CHUNK_PACKETS;
+    }
+    if (fill->policy == FILL_LAST) {
+        while (fill->chunk_ready < npackets) {
+            memcpy(fill->chunk + fill->chunk_ready*fill->data_size, fill->last_packet, fill->data_size);
+            ++(fill->chunk_ready);
+        }
+    }
+}
+
+
+void packet_fill_write(packet_fill_t* fill, packet_fill_writer_t writer, void* arg, uint64_t npackets) {
+    prepare_chunk(fill, npackets);
+
+    uint64_t offset = 0;
+    if (fill->policy == FILL_NOISE && fill->chunk_ready) {
+        // start each gap somewhere different so that short gaps are not all identical.
+        offset = fill->noise_offset;
+        fill->noise_offset = next_random(fill) % PACKET_FILL_CHUNK_PACKETS;
+    }
+
+    while (npackets > 0) {
+        uint64_t n = PACKET_FILL_CHUNK_PACKETS - offset;
+        if (n > npackets) {
+            n = npackets;
+        }
+        writer(arg, fill->chunk + offset*fill->data_size, n*fill->data_size);
+        npackets -= n;
+        offset = 0;
+    }
+}
+
+
+void packet_fill_slots(packet_fill_t* fill, char* block, const char* slot_filled, uint64_t packets_per_block) {
+    const uint64_t data_size = fill->data_size;
+    const char* previous = fill->last_packet;
+    uint64_t noise_packet = fill->noise_offset;
+
+    for (uint64_t slot = 0; slot < packets_per_block; ++slot) {
+        char* destination = block + slot*data_size;
+        if (slot_filled[slot]) {
+            previous = destination;
+            continue;
+        }
+        if (fill->policy == FILL_LAST) {
+            memcpy(destination, previous, data_size);
+        } else if (fill->policy == FILL_ZEROS) {
+            memset(destination, 0, data_size);
+        } else {
+            memcpy(destination, fill->chunk + noise_packet*data_size, data_size);
+            noise_packet = (noise_packet + 1) % PACKET_FILL_CHUNK_PACKETS;
+        }
+    }
+
+    if (fill->policy == FILL_NOISE) {
+        fill->noise_offset = next_random(fill) % PACKET_FILL_CHUNK_PACKETS;
+    }
+    if (fill->policy == FILL_LAST && previous != fill->last_packet) {
+        // carry the last packet of this block over to the start of the next.
+        memcpy(fill->last_packet, previous, data_size);
+    }
+}
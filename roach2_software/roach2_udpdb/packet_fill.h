@@ -0,0 +1,58 @@
+#include <inttypes.h>
+#include <multilog.h>
+
+// number of packets of fill data prepared in advance, i.e. the most written by one writer call.
+#define PACKET_FILL_CHUNK_PACKETS 256
+// number of good packets used to measure the statistics of the noise fill.
+#define PACKET_FILL_LEARN_PACKETS 256
+
+/*
+ * What to put in the place of packets that never arrived.
+ *
+ * FILL_ZEROS: zeros, which is easy to spot and flag downstream.
+ * FILL_NOISE: Gaussian noise with the mean and rms of each byte of a frame (i.e. each channel,
+ *             polarisation and real/imaginary part) measured from the first good packets.
+ *             The noise comes from a fixed seed, so a given gap is always filled the same way.
+ * FILL_LAST:  repeats of the last good packet.
+ */
+typedef enum fill_policy_t {
+    FILL_ZEROS,
+    FILL_NOISE,
+    FILL_LAST
+} fill_policy_t;
+
+typedef struct packet_fill_t {
+    fill_policy_t policy;
+    uint64_t data_size; // bytes of data per packet
+    uint64_t bytes_per_frame; // statistics are measured separately for each byte in a frame
+    char* chunk; // PACKET_FILL_CHUNK_PACKETS packets of fill data
+    uint64_t chunk_ready; // number of packets at the start of chunk that hold the right data
+    char* last_packet; // copy of the last good packet for FILL_LAST
+    uint64_t noise_offset; // packet of the noise chunk to start the next gap at
+
+    // statistics for FILL_NOISE
+    uint64_t learnt_packets;
+    double* sum;
+    double* sum_squares;
+    uint64_t random_state;
+
+    multilog_t* log;
+} packet_fill_t;
+
+int packet_fill_parse_policy(const char* name, fill_policy_t* policy);
+const char* packet_fill_policy_name(fill_policy_t policy);
+
+packet_fill_t* packet_fill_create(fill_policy_t policy, uint64_t data_size, uint64_t bytes_per_frame, multilog_t* log);
+void packet_fill_destroy(packet_fill_t* fill);
+
+// tell the fill about a good packet. Only does any work while it is needed.
+void packet_fill_good_packet(packet_fill_t* fill, const char* data);
+
+// appends nbytes of data to wherever the output is going.
+typedef void (*packet_fill_writer_t)(void* arg, const char* data, uint64_t nbytes);
+
+// write npackets of fill data to the end of the output, with at most one writer call per chunk.
+void packet_fill_write(packet_fill_t* fill, packet_fill_writer_t writer, void* arg, uint64_t npackets);
+
+// fill the slots of a block that are not marked in slot_filled.
+void packet_fill_slots(packet_fill_t* fill, char* block, const char* slot_filled, uint64_t packets_per_block);
@@ -0,0 +1,232 @@
+/*
+ * Capture UDP packets from an AF_PACKET TPACKET_V3 memory-mapped ring.
+ *
+ * The kernel fills large blocks of frames in a ring that is shared with us, and only wakes us
+ * up when a whole block is ready (or the block retire timeout expires). We then walk the frames
+ * in place, pick out the UDP packets addressed to our IP/port and hand back a pointer to the
+ * UDP payload (i.e. the SPEAD packet). Nothing is copied; a block is given back to the kernel
+ * once we have moved on to the next one.
+ *
+ * This sees every frame on the interface, so it does not need (or stop) a normal socket being
+ * bound to the same port. It needs CAP_NET_RAW.
+ *
+ * Works on real interfaces, veth pairs and loopback (where outgoing copies are ignored).
+ */
+
+// needed for some of the AF_PACKET definitions
+#define _GNU_SOURCE
+
+#include "packet_mmap.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+// how long the kernel will wait before handing over a partly filled block.
+#define BLOCK_RETIRE_TIMEOUT_MS 8
+
+packet_mmap_t* packet_mmap_open(const char* interface, const char* ip_address, int port, unsigned block_size, unsigned block_count, multilog_t* log) {
+    packet_mmap_t* ring = malloc(sizeof(packet_mmap_t));
+    memset(ring,0,sizeof(packet_mmap_t));
+    ring->log = log;
+    ring->block_size = block_size;
+    ring->block_count = block_count;
+    ring->dst_ip = inet_addr(ip_address);
+    ring->dst_port = htons(port);
+
+    multilog(log,LOG_INFO,"Packet mmap capture on %s for %s:%d, %u blocks of %u bytes\n",interface,ip_address,port,block_count,block_size);
+
+    ring->sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if (ring->sock < 0) {
+        multilog(log,LOG_ERR,"could not open AF_PACKET socket ERRNO=%d %s\n",errno,strerror(errno));
+        free(ring);
+        return NULL;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(ring->sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        multilog(log,LOG_ERR,"could not set TPACKET_V3 ERRNO=%d %s\n",errno,strerror(errno));
+        packet_mmap_close(ring);
+        return NULL;
+    }
+
+#ifdef PACKET_IGNORE_OUTGOING
+    // on loopback we would otherwise see every packet twice. Not fatal if the kernel is too old.
+    int ignore_outgoing = 1;
+    setsockopt(ring->sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore_outgoing, sizeof(ignore_outgoing));
+#endif
+
+    struct tpacket_req3 req;
+    memset(&req,0,sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = block_count;
+    req.tp_frame_size = TPACKET_ALIGNMENT << 7; // not used for V3 reads, but must divide the block size.
+    req.tp_frame_nr = (block_size / req.tp_frame_size) * block_count;
+    req.tp_retire_blk_tov = BLOCK_RETIRE_TIMEOUT_MS;
+    req.tp_feature_req_word = 0;
+    if (setsockopt(ring->sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        multilog(log,LOG_ERR,"could not create PACKET_RX_RING ERRNO=%d %s\n",errno,strerror(errno));
+        packet_mmap_close(ring);
+        return NULL;
+    }
+
+    ring->map_size = (size_t)block_size * block_count;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, ring->sock, 0);
+    if (ring->map == MAP_FAILED) {
+        // MAP_LOCKED can fail if the memlock limit is low, so try again without it.
+        ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->sock, 0);
+    }
+    if (ring->map == MAP_FAILED) {
+        multilog(log,LOG_ERR,"could not mmap packet ring ERRNO=%d %s\n",errno,strerror(errno));
+        ring->map = NULL;
+        packet_mmap_close(ring);
+        return NULL;
+    }
+
+    struct sockaddr_ll address;
+    memset(&address,0,sizeof(address));
+    address.sll_family = AF_PACKET;
+    address.sll_protocol = htons(ETH_P_IP);
+    address.sll_ifindex = if_nametoindex(interface);
+    if (address.sll_ifindex == 0) {
+        multilog(log,LOG_ERR,"unknown interface '%s'\n",interface);
+        packet_mmap_close(ring);
+        return NULL;
+    }
+    if (bind(ring->sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        multilog(log,LOG_ERR,"could not bind to interface %s ERRNO=%d %s\n",interface,errno,strerror(errno));
+        packet_mmap_close(ring);
+        return NULL;
+    }
+
+    multilog(log,LOG_INFO,"Packet mmap ring ok\n");
+    return ring;
+}
+
+
+/*
+ * Check that a frame is an unfragmented UDP/IPv4 packet for our address and return the UDP payload.
+ */
+static unsigned char* filter_frame(packet_mmap_t* ring, struct tpacket3_hdr* frame, uint64_t* length) {
+    struct sockaddr_ll* link = (struct sockaddr_ll*)((unsigned char*)frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+    if (link->sll_pkttype == PACKET_OUTGOING) {
+        return NULL;
+    }
+
+    unsigned char* network = (unsigned char*)frame + frame->tp_net;
+    unsigned char* end = (unsigned char*)frame + frame->tp_mac + frame->tp_snaplen;
+    struct iphdr* ip = (struct iphdr*)network;
+    if (network + sizeof(struct iphdr) > end || ip->version != 4 || ip->protocol != IPPROTO_UDP) {
+        return NULL;
+    }
+    if (ip->daddr != ring->dst_ip || (ntohs(ip->frag_off) & 0x3fff)) {
+        return NULL;
+    }
+
+    struct udphdr* udp = (struct udphdr*)(network + ip->ihl*4);
+    if ((unsigned char*)(udp + 1) > end || udp->dest != ring->dst_port) {
+        return NULL;
+    }
+
+    // the UDP stack has not checked these frames, so the length may be nonsense.
+    if (ntohs(udp->len) < sizeof(struct udphdr)) {
+        return NULL;
+    }
+    unsigned char* payload = (unsigned char*)(udp + 1);
+    const uint64_t payload_length = ntohs(udp->len) - sizeof(struct udphdr);
+    if (payload_length > (uint64_t)(end - payload)) {
+        // truncated by the kernel, the block size is too small for this packet.
+        return NULL;
+    }
+    *length = payload_length;
+    return payload;
+}
+
+
+static void release_block(packet_mmap_t* ring) {
+    struct tpacket_block_desc* block = (struct tpacket_block_desc*)(ring->map + (size_t)ring->current_block*ring->block_size);
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring->current_block = (ring->current_block + 1) % ring->block_count;
+    ring->frames_left = 0;
+
+    // the kernel counts frames it could not fit in the ring. Reading the statistics resets them.
+    struct tpacket_stats_v3 stats;
+    socklen_t stats_length = sizeof(stats);
+    if (getsockopt(ring->sock, SOL_PACKET, PACKET_STATISTICS, &stats, &stats_length) == 0) {
+        ring->kernel_drops += stats.tp_drops;
+    }
+}
+
+
+/*
+ * Return a pointer to the next SPEAD packet (UDP payload) and its length.
+ *
+ * The pointer is into the shared ring and stays valid until the next call.
+ * Returns NULL if no packet arrived within timeout_ms.
+ */
+unsigned char* packet_mmap_next(packet_mmap_t* ring, uint64_t* length, int timeout_ms) {
+    while (1) {
+        while (ring->frames_left > 0) {
+            struct tpacket3_hdr* frame = (struct tpacket3_hdr*)ring->next_frame;
+            ring->next_frame += frame->tp_next_offset;
+            --(ring->frames_left);
+            unsigned char* payload = filter_frame(ring, frame, length);
+            if (payload) {
+                ++(ring->packets);
+                ring->arrival_ns = frame->tp_sec*1000000000ULL + frame->tp_nsec;
+                return payload;
+            }
+            ++(ring->rejected);
+        }
+
+        struct tpacket_block_desc* block = (struct tpacket_block_desc*)(ring->map + (size_t)ring->current_block*ring->block_size);
+        if (ring->next_frame) {
+            // we have finished with the block we were reading, so hand it back.
+            release_block(ring);
+            ring->next_frame = NULL;
+            continue;
+        }
+
+        if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+            // wait for the kernel to retire the block.
+            struct pollfd pfd;
+            pfd.fd = ring->sock;
+            pfd.events = POLLIN | POLLERR;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, timeout_ms) == 0) {
+                return NULL;
+            }
+            continue;
+        }
+
+        ring->frames_left = block->hdr.bh1.num_pkts;
+        ring->next_frame = (unsigned char*)block + block->hdr.bh1.offset_to_first_pkt;
+        if (ring->frames_left == 0) {
+            release_block(ring);
+            ring->next_frame = NULL;
+        }
+    }
+}
+
+
+void packet_mmap_close(packet_mmap_t* ring) {
+    if (ring->map) {
+        munmap(ring->map, ring->map_size);
+    }
+    if (ring->sock >= 0) {
+        close(ring->sock);
+    }
+    free(ring);
+}
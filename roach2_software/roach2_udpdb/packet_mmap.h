@@ -0,0 +1,29 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <multilog.h>
+
+// default geometry of the memory-mapped ring: 64 blocks of 4 MiB.
+#define PACKET_MMAP_DEFAULT_BLOCK_SIZE (1<<22)
+#define PACKET_MMAP_DEFAULT_BLOCK_COUNT 64
+
+typedef struct packet_mmap_t {
+    int sock; // AF_PACKET socket
+    unsigned char* map; // the mmap'd ring
+    size_t map_size;
+    unsigned block_size;
+    unsigned block_count;
+    unsigned current_block; // block we are currently reading frames from
+    unsigned frames_left; // frames still to read in current block, 0 if we do not own the block.
+    unsigned char* next_frame; // next frame to read in current block
+    uint32_t dst_ip; // destination IP to accept, network byte order
+    uint16_t dst_port; // destination port to accept, network byte order
+    uint64_t packets; // number of packets returned
+    uint64_t arrival_ns; // kernel receive time of the packet last returned, ns since the epoch
+    uint64_t rejected; // number of frames that did not match the filter
+    uint64_t kernel_drops; // frames the kernel dropped because the ring was full
+    multilog_t* log;
+} packet_mmap_t;
+
+packet_mmap_t* packet_mmap_open(const char* interface, const char* ip_address, int port, unsigned block_size, unsigned block_count, multilog_t* log);
+unsigned char* packet_mmap_next(packet_mmap_t* ring, uint64_t* length, int timeout_ms);
+void packet_mmap_close(packet_mmap_t* ring);
@@ -0,0 +1,292 @@
+/*
+ * Record raw packets to disk, and read the recordings back. See packet_record.h for the format.
+ *
+ * The recorder never blocks the caller on the disk. Records are copied into one of
+ * PACKET_RECORD_BUFFERS aligned buffers and each full buffer is handed to a writer thread,
+ * which writes it with one large sequential write, using O_DIRECT where the filesystem allows
+ * so that the recording does not fill the page cache the rest of the machine needs. If every
+ * buffer is waiting for the disk, packets are dropped from the recording and counted.
+ */
+
+// needed for O_DIRECT
+#define _GNU_SOURCE
+
+#include "packet_record.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// O_DIRECT writes must be a multiple of this, from memory aligned to it.
+#define DIRECT_ALIGN 4096
+
+
+uint64_t packet_record_stride(uint64_t length) {
+    const uint64_t size = sizeof(packet_record_t) + length;
+    return (size + PACKET_RECORD_ALIGN - 1) / PACKET_RECORD_ALIGN * PACKET_RECORD_ALIGN;
+}
+
+
+static void* writer_thread(void* arg) {
+    packet_recorder_t* recorder = arg;
+    pthread_mutex_lock(&recorder->mutex);
+    while (1) {
+        while (recorder->buffers_written == recorder->buffers_filled && !recorder->closing) {
+            pthread_cond_wait(&recorder->cond, &recorder->mutex);
+        }
+        if (recorder->buffers_written == recorder->buffers_filled) {
+            break;
+        }
+        const uint64_t index = recorder->buffers_written % PACKET_RECORD_BUFFERS;
+        pthread_mutex_unlock(&recorder->mutex);
+
+        const char* buffer = recorder->buffers[index];
+        uint64_t left = recorder->buffer_bytes[index];
+        while (left > 0 && recorder->write_error == 0) {
+            ssize_t written = write(recorder->fd, buffer, left);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                recorder->write_error = errno;
+                multilog(recorder->log,LOG_ERR,"Error writing %s ERRNO=%d %s\n",recorder->filename,errno,strerror(errno));
+                break;
+            }
+            buffer += written;
+            left -= written;
+        }
+
+        pthread_mutex_lock(&recorder->mutex);
+        __atomic_store_n(&recorder->buffers_written, recorder->buffers_written + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&recorder->mutex);
+    return NULL;
+}
+
+
+packet_recorder_t* packet_recorder_open(const char* filename, uint64_t record_stride, const char* source, multilog_t* log) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) {
+        // e.g. tmpfs, which does not do O_DIRECT.
+        multilog(log,LOG_WARNING,"O_DIRECT not supported for %s, writing through the page cache\n",filename);
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        multilog(log,LOG_ERR,"Could not open recording '%s' ERRNO=%d %s\n",filename,errno,strerror(errno));
+        return NULL;
+    }
+
+    packet_recorder_t* recorder = malloc(sizeof(packet_recorder_t));
+    memset(recorder,0,sizeof(packet_recorder_t));
+    recorder->fd = fd;
+    recorder->filename = strdup(filename);
+    recorder->log = log;
+    for (int i = 0; i < PACKET_RECORD_BUFFERS; ++i) {
+        if (posix_memalign((void**)&recorder->buffers[i], DIRECT_ALIGN, PACKET_RECORD_BUFFER_SIZE) != 0) {
+            multilog(log,LOG_ERR,"Could not allocate recording buffers\n");
+            packet_recorder_close(recorder);
+            return NULL;
+        }
+    }
+
+    memcpy(recorder->header.magic, PACKET_RECORD_MAGIC, sizeof(recorder->header.magic));
+    recorder->header.header_size = PACKET_RECORD_HEADER_SIZE;
+    recorder->header.record_stride = record_stride;
+    strncpy(recorder->header.source, source, sizeof(recorder->header.source)-1);
+
+    // the header goes at the start of the first buffer, and is written again on close.
+    memset(recorder->buffers[0], 0, PACKET_RECORD_HEADER_SIZE);
+    memcpy(recorder->buffers[0], &recorder->header, sizeof(recorder->header));
+    recorder->fill = PACKET_RECORD_HEADER_SIZE;
+
+    pthread_mutex_init(&recorder->mutex, NULL);
+    pthread_cond_init(&recorder->cond, NULL);
+    pthread_create(&recorder->writer, NULL, writer_thread, recorder);
+
+    multilog(log,LOG_INFO,"Recording packets to %s, %"PRIu64" bytes per record\n",filename,record_stride);
+    return recorder;
+}
+
+
+static void hand_over_buffer(packet_recorder_t* recorder) {
+    pthread_mutex_lock(&recorder->mutex);
+    recorder->buffer_bytes[recorder->buffers_filled % PACKET_RECORD_BUFFERS] = recorder->fill;
+    ++(recorder->buffers_filled);
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->mutex);
+    recorder->fill = 0;
+}
+
+
+// copy n bytes to the end of the recording, or zeros if data is NULL.
+static void append(packet_recorder_t* recorder, const void* data, uint64_t n) {
+    while (n > 0) {
+        char* buffer = recorder->buffers[recorder->buffers_filled % PACKET_RECORD_BUFFERS];
+        uint64_t chunk = PACKET_RECORD_BUFFER_SIZE - recorder->fill;
+        if (chunk > n) {
+            chunk = n;
+        }
+        if (data) {
+            memcpy(buffer + recorder->fill, data, chunk);
+            data = (const char*)data + chunk;
+        } else {
+            memset(buffer + recorder->fill, 0, chunk);
+        }
+        recorder->fill += chunk;
+        n -= chunk;
+        if (recorder->fill == PACKET_RECORD_BUFFER_SIZE) {
+            hand_over_buffer(recorder);
+        }
+    }
+}
+
+
+int packet_recorder_add(packet_recorder_t* recorder, const unsigned char* packet, uint64_t length,
+        uint64_t arrival_ns, uint64_t frame_counter) {
+    // the buffer being filled is not free, even if it is empty.
+    const uint64_t written = __atomic_load_n(&recorder->buffers_written, __ATOMIC_ACQUIRE);
+    const uint64_t free_buffers = PACKET_RECORD_BUFFERS - 1 - (recorder->buffers_filled - written);
+    const uint64_t room = PACKET_RECORD_BUFFER_SIZE - recorder->fill + free_buffers*PACKET_RECORD_BUFFER_SIZE;
+    if (room < recorder->header.record_stride || recorder->write_error) {
+        ++(recorder->header.dropped);
+        return -1;
+    }
+
+    packet_record_t record;
+    memset(&record,0,sizeof(record));
+    record.arrival_ns = arrival_ns;
+    record.frame_counter = frame_counter;
+    record.length = length;
+    record.captured = length;
+    if (sizeof(record) + length > recorder->header.record_stride) {
+        record.captured = recorder->header.record_stride - sizeof(record);
+    }
+    if (recorder->header.npackets == 0) {
+        recorder->header.start_ns = arrival_ns;
+    }
+
+    append(recorder, &record, sizeof(record));
+    append(recorder, packet, record.captured);
+    append(recorder, NULL, recorder->header.record_stride - sizeof(record) - record.captured);
+    ++(recorder->header.npackets);
+    return 0;
+}
+
+
+int packet_recorder_close(packet_recorder_t* recorder) {
+    int ret = 0;
+    if (recorder->buffers[PACKET_RECORD_BUFFERS-1]) {
+        // everything was allocated, so the writer thread is running. Pad the last buffer for O_DIRECT.
+        const uint64_t padding = (DIRECT_ALIGN - recorder->fill % DIRECT_ALIGN) % DIRECT_ALIGN;
+        memset(recorder->buffers[recorder->buffers_filled % PACKET_RECORD_BUFFERS] + recorder->fill, 0, padding);
+        recorder->fill += padding;
+        if (recorder->fill > 0) {
+            hand_over_buffer(recorder);
+        }
+        pthread_mutex_lock(&recorder->mutex);
+        recorder->closing = 1;
+        pthread_cond_signal(&recorder->cond);
+        pthread_mutex_unlock(&recorder->mutex);
+        pthread_join(recorder->writer, NULL);
+        pthread_mutex_destroy(&recorder->mutex);
+        pthread_cond_destroy(&recorder->cond);
+
+        // cut off the padding and fill in the header, through a buffer that suits O_DIRECT.
+        if (ftruncate(recorder->fd, PACKET_RECORD_HEADER_SIZE + recorder->header.npackets*recorder->header.record_stride) != 0) {
+            recorder->write_error = errno;
+        }
+        memset(recorder->buffers[0], 0, PACKET_RECORD_HEADER_SIZE);
+        memcpy(recorder->buffers[0], &recorder->header, sizeof(recorder->header));
+        if (pwrite(recorder->fd, recorder->buffers[0], PACKET_RECORD_HEADER_SIZE, 0) != PACKET_RECORD_HEADER_SIZE) {
+            recorder->write_error = errno;
+        }
+        if (recorder->write_error) {
+            multilog(recorder->log,LOG_ERR,"Recording %s is incomplete ERRNO=%d %s\n",recorder->filename,recorder->write_error,strerror(recorder->write_error));
+            ret = -1;
+        }
+        multilog(recorder->log,LOG_INFO,"Recorded %"PRIu64" packets to %s, dropped %"PRIu64"\n",
+                recorder->header.npackets,recorder->filename,recorder->header.dropped);
+    }
+
+    close(recorder->fd);
+    for (int i = 0; i < PACKET_RECORD_BUFFERS; ++i) {
+        free(recorder->buffers[i]);
+    }
+    free(recorder->filename);
+    free(recorder);
+    return ret;
+}
+
+
+packet_recording_t* packet_recording_open(const char* filename, multilog_t* log) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        multilog(log,LOG_ERR,"Could not open recording '%s' ERRNO=%d %s\n",filename,errno,strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size < PACKET_RECORD_HEADER_SIZE) {
+        multilog(log,LOG_ERR,"'%s' is too short to be a recording\n",filename);
+        close(fd);
+        return NULL;
+    }
+
+    const char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        multilog(log,LOG_ERR,"Could not mmap recording '%s' ERRNO=%d %s\n",filename,errno,strerror(errno));
+        return NULL;
+    }
+    const packet_record_file_header_t* header = (const packet_record_file_header_t*)map;
+    if (memcmp(header->magic, PACKET_RECORD_MAGIC, sizeof(header->magic)) != 0 || header->record_stride < sizeof(packet_record_t)) {
+        multilog(log,LOG_ERR,"'%s' is not a packet recording\n",filename);
+        munmap((void*)map, st.st_size);
+        return NULL;
+    }
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+    packet_recording_t* recording = malloc(sizeof(packet_recording_t));
+    recording->header = header;
+    recording->map = map;
+    recording->map_size = st.st_size;
+    recording->record_stride = header->record_stride;
+    recording->npackets = (st.st_size - header->header_size) / header->record_stride;
+    if (header->npackets == 0) {
+        multilog(log,LOG_WARNING,"Recording '%s' was not closed, using the %"PRIu64" whole records in the file\n",filename,recording->npackets);
+    } else if (header->npackets < recording->npackets) {
+        recording->npackets = header->npackets;
+    }
+    return recording;
+}
+
+
+void packet_recording_close(packet_recording_t* recording) {
+    munmap((void*)recording->map, recording->map_size);
+    free(recording);
+}
+
+
+const packet_record_t* packet_recording_get(const packet_recording_t* recording, uint64_t n) {
+    return (const packet_record_t*)(recording->map + recording->header->header_size + n*recording->record_stride);
+}
+
+
+uint64_t packet_recording_find_time(const packet_recording_t* recording, uint64_t arrival_ns) {
+    uint64_t low = 0, high = recording->npackets;
+    while (low < high) {
+        const uint64_t middle = low + (high - low)/2;
+        if (packet_recording_get(recording, middle)->arrival_ns < arrival_ns) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
@@ -0,0 +1,94 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <multilog.h>
+
+#define PACKET_RECORD_MAGIC "R2REC001"
+// the file header is padded to this, so the records start on an O_DIRECT friendly boundary.
+#define PACKET_RECORD_HEADER_SIZE 4096
+// records are padded to a multiple of this.
+#define PACKET_RECORD_ALIGN 64
+// the recorder hands the disk this much at a time, from this many buffers.
+#define PACKET_RECORD_BUFFER_SIZE (8<<20)
+#define PACKET_RECORD_BUFFERS 16
+
+/*
+ * A recording of raw packets, as they arrived.
+ *
+ * The file starts with a packet_record_file_header_t padded to PACKET_RECORD_HEADER_SIZE,
+ * followed by one record per packet, every record_stride bytes: a packet_record_t, then the
+ * packet, then zeros up to the next record. Record n is therefore at
+ * PACKET_RECORD_HEADER_SIZE + n*record_stride and the whole file can be mmap'd and indexed
+ * directly. Records are in arrival order, so arrival_ns never decreases and a time can be
+ * found by binary search without reading the whole file. All values are in host byte order.
+ *
+ * npackets is written when the recording is closed. If it is zero the recording did not
+ * finish, and the number of whole records in the file should be used instead.
+ */
+typedef struct packet_record_file_header_t {
+    char magic[8]; // PACKET_RECORD_MAGIC
+    uint64_t header_size; // PACKET_RECORD_HEADER_SIZE
+    uint64_t record_stride;
+    uint64_t npackets;
+    uint64_t dropped; // packets not recorded because the disk was not keeping up
+    uint64_t start_ns; // arrival time of the first packet, ns since the epoch
+    char source[64]; // where the packets were captured, e.g. "eth2 10.0.3.1:12000"
+} packet_record_file_header_t;
+
+typedef struct packet_record_t {
+    uint64_t arrival_ns; // kernel receive time, ns since the epoch
+    uint64_t frame_counter; // from the SPEAD header, or UINT64_MAX if it could not be decoded
+    uint32_t length; // of the packet as received
+    uint32_t captured; // bytes of the packet stored, less than length if it did not fit
+    uint64_t reserved;
+} packet_record_t;
+
+
+// Writer. Records are copied into large aligned buffers which a separate thread writes out.
+typedef struct packet_recorder_t {
+    int fd;
+    char* filename;
+    packet_record_file_header_t header;
+
+    char* buffers[PACKET_RECORD_BUFFERS];
+    uint64_t buffer_bytes[PACKET_RECORD_BUFFERS]; // bytes to write from each buffer handed over
+    uint64_t fill; // bytes used in the buffer being filled
+    uint64_t buffers_filled; // buffers handed to the writer thread
+    uint64_t buffers_written; // buffers written out by the writer thread
+    char closing;
+    int write_error; // errno of a failed write, 0 if none
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t writer;
+
+    multilog_t* log;
+} packet_recorder_t;
+
+// records are record_stride bytes apart, which should have room for a packet_record_t and the largest packet.
+packet_recorder_t* packet_recorder_open(const char* filename, uint64_t record_stride, const char* source, multilog_t* log);
+// returns -1 if the packet was dropped because the writer is behind.
+int packet_recorder_add(packet_recorder_t* recorder, const unsigned char* packet, uint64_t length,
+        uint64_t arrival_ns, uint64_t frame_counter);
+// write out everything and fill in the header. Returns -1 if any write failed.
+int packet_recorder_close(packet_recorder_t* recorder);
+
+// the record_stride needed for packets of up to length bytes.
+uint64_t packet_record_stride(uint64_t length);
+
+
+// Reader, with the whole file mmap'd.
+typedef struct packet_recording_t {
+    const packet_record_file_header_t* header;
+    const char* map;
+    uint64_t map_size;
+    uint64_t npackets;
+    uint64_t record_stride;
+} packet_recording_t;
+
+packet_recording_t* packet_recording_open(const char* filename, multilog_t* log);
+void packet_recording_close(packet_recording_t* recording);
+
+// record n, with the packet at (const unsigned char*)(record+1).
+const packet_record_t* packet_recording_get(const packet_recording_t* recording, uint64_t n);
+
+// index of the first record that arrived at or after arrival_ns.
+uint64_t packet_recording_find_time(const packet_recording_t* recording, uint64_t arrival_ns);
@@ -0,0 +1,143 @@
+/*
+ * Lock-free single-producer / single-consumer packet ring shared by the socket thread and the
+ * thread writing to psrdada.
+ *
+ * The producer writes into slots and then publishes them with a release store of head.
+ * The consumer acquires head, reads the slot, and gives it back with a release store of tail
+ * when it asks for the next one. The producer never writes into a slot that has not been
+ * given back, so a full ring is detected (and counted as an overrun) before any data is lost
+ * from inside the ring.
+ *
+ * When there is nothing to read the consumer spins for a short time and then sleeps on a futex,
+ * which the producer only pokes (one atomic load per publish) if the consumer is actually asleep.
+ *
+ * The ring can be backed by hugepages to reduce TLB misses on the ~70 MB buffer, and placed on
+ * the NUMA node of the NIC (see numa_memory.h).
+ */
+
+#define _GNU_SOURCE
+
+#include "numa_memory.h"
+#include "packet_ring.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// number of times the consumer polls head before going to sleep.
+#define CONSUMER_SPIN_COUNT 2000
+// the consumer re-checks at least this often in case a wakeup was missed (nanoseconds).
+#define CONSUMER_SLEEP_NS 100000000
+
+packet_ring_t* packet_ring_create(uint64_t nslots, uint64_t packet_size, const memory_policy_t* memory, multilog_t* log) {
+    packet_ring_t* ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(packet_ring_t));
+    memset(ring,0,sizeof(packet_ring_t));
+    ring->log = log;
+    ring->nslots = nslots;
+    // round slots up to whole cache lines so that packets never share a line.
+    ring->slot_size = (packet_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+    // one extra slot at the end is the producer's overflow slot.
+    const size_t size = (nslots+1)*ring->slot_size;
+    ring->buffer = memory_alloc(size, memory, "packet ring", &ring->map_size, log);
+    if (ring->buffer == NULL) {
+        free(ring);
+        return NULL;
+    }
+
+    multilog(log,LOG_INFO,"Packet ring: %"PRIu64" slots of %"PRIu64" bytes (%zu bytes)\n",ring->nslots,ring->slot_size,ring->map_size);
+    return ring;
+}
+
+
+void packet_ring_destroy(packet_ring_t* ring) {
+    memory_free(ring->buffer, ring->map_size);
+    free(ring->arrival_ns);
+    free(ring->publish_ns);
+    free(ring);
+}
+
+
+void packet_ring_enable_timestamps(packet_ring_t* ring) {
+    ring->arrival_ns = calloc(ring->nslots, sizeof(int64_t));
+    ring->publish_ns = calloc(ring->nslots, sizeof(int64_t));
+}
+
+
+/*
+ * Make count more slots visible to the consumer, and wake it if it is asleep.
+ */
+void packet_ring_publish(packet_ring_t* ring, uint64_t count) {
+    atomic_fetch_add_explicit(&ring->head, count, memory_order_release);
+    // The fence orders the head store before the load of consumer_sleeping. The consumer does
+    // the opposite, so at least one of us sees the other.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->consumer_sleeping, memory_order_relaxed)) {
+        atomic_store_explicit(&ring->consumer_sleeping, 0, memory_order_relaxed);
+        atomic_fetch_add_explicit(&ring->wakeup_sequence, 1, memory_order_release);
+        syscall(SYS_futex, &ring->wakeup_sequence, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+
+static void wait_for_producer(packet_ring_t* ring) {
+    for (unsigned spin = 0; spin < CONSUMER_SPIN_COUNT; ++spin) {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (ring->cached_head > ring->read_position) {
+            return;
+        }
+    }
+
+    while (1) {
+        const unsigned sequence = atomic_load_explicit(&ring->wakeup_sequence, memory_order_acquire);
+        atomic_store_explicit(&ring->consumer_sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (ring->cached_head > ring->read_position) {
+            atomic_store_explicit(&ring->consumer_sleeping, 0, memory_order_relaxed);
+            return;
+        }
+        struct timespec timeout = {0, CONSUMER_SLEEP_NS};
+        syscall(SYS_futex, &ring->wakeup_sequence, FUTEX_WAIT_PRIVATE, sequence, &timeout, NULL, 0);
+    }
+}
+
+
+/*
+ * Give back the slot returned by the previous call, then wait for the next packet and return it.
+ * The returned slot is owned by the consumer until the next call.
+ */
+unsigned char* packet_ring_next(packet_ring_t* ring) {
+    // everything before read_position has been handed out and is now finished with.
+    atomic_store_explicit(&ring->tail, ring->read_position, memory_order_release);
+
+    if (ring->cached_head <= ring->read_position) {
+        wait_for_producer(ring);
+    }
+
+    unsigned char* slot = packet_ring_slot(ring, ring->read_position);
+    ++(ring->read_position);
+    return slot;
+}
+
+
+unsigned char* packet_ring_try_next(packet_ring_t* ring) {
+    atomic_store_explicit(&ring->tail, ring->read_position, memory_order_release);
+
+    if (ring->cached_head <= ring->read_position) {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (ring->cached_head <= ring->read_position) {
+            return NULL;
+        }
+    }
+
+    unsigned char* slot = packet_ring_slot(ring, ring->read_position);
+    ++(ring->read_position);
+    return slot;
+}
+
@@ -0,0 +1,78 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <multilog.h>
+
+// memory_policy_t comes from numa_memory.h, which must be included first.
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Single-producer / single-consumer ring of fixed size packet slots.
+ *
+ * The producer (socket thread) owns head and the consumer owns tail, each on its own cache line.
+ * Slots between tail and head belong to the consumer, everything else belongs to the producer,
+ * so a slot is never overwritten while the consumer may still be reading it.
+ */
+typedef struct packet_ring_t {
+    // producer side
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t head; // number of slots published
+    uint64_t cached_tail; // producer's copy of tail, refreshed only when the ring looks full
+    atomic_uint_fast64_t overruns; // packets the producer had to throw away because the ring was full
+
+    // consumer side
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t tail; // number of slots released back to the producer
+    uint64_t read_position; // number of slots handed out to the consumer
+    uint64_t cached_head; // consumer's copy of head
+
+    // wakeup of a sleeping consumer
+    _Alignas(CACHE_LINE_SIZE) atomic_int consumer_sleeping;
+    atomic_uint wakeup_sequence; // futex word
+
+    // read-only after creation
+    _Alignas(CACHE_LINE_SIZE) unsigned char* buffer;
+    uint64_t nslots;
+    uint64_t slot_size;
+    size_t map_size;
+    int64_t* arrival_ns; // with timestamps, kernel arrival time of the packet in each slot, 0 if unknown
+    int64_t* publish_ns; // and when it was put in the ring
+    multilog_t* log;
+} packet_ring_t;
+
+// the buffer is allocated with memory_alloc, so it is on the requested node, locked and faulted in.
+packet_ring_t* packet_ring_create(uint64_t nslots, uint64_t packet_size, const memory_policy_t* memory, multilog_t* log);
+void packet_ring_destroy(packet_ring_t* ring);
+
+// keep receive timestamps with each slot, see packet_timing.h.
+void packet_ring_enable_timestamps(packet_ring_t* ring);
+
+// consumer
+unsigned char* packet_ring_next(packet_ring_t* ring);
+// the same, but returns NULL rather than wait if there is nothing to read.
+unsigned char* packet_ring_try_next(packet_ring_t* ring);
+
+// producer
+void packet_ring_publish(packet_ring_t* ring, uint64_t count);
+
+static inline unsigned char* packet_ring_slot(packet_ring_t* ring, uint64_t position) {
+    return ring->buffer + (position % ring->nslots)*ring->slot_size;
+}
+
+// the spare slot after the end of the ring, for the producer to receive into when the ring is full.
+static inline unsigned char* packet_ring_overflow_slot(packet_ring_t* ring) {
+    return ring->buffer + ring->nslots*ring->slot_size;
+}
+
+// number of slots the producer can fill without waiting for the consumer.
+static inline uint64_t packet_ring_free(packet_ring_t* ring) {
+    const uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail < ring->nslots) {
+        return ring->nslots - (head - ring->cached_tail);
+    }
+    ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return ring->nslots - (head - ring->cached_tail);
+}
+
+// number of slots published but not yet handed to the consumer.
+static inline uint64_t packet_ring_lag(packet_ring_t* ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - ring->read_position;
+}
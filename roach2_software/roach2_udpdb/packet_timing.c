@@ -0,0 +1,118 @@
+/*
+ * Kernel receive timestamps. See packet_timing.h.
+ */
+#include "packet_timing.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+
+#include <linux/errqueue.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+
+
+int timestamp_source_parse(const char* spec, timestamp_source_t* source) {
+    if (strcmp(spec, "sw") == 0) {
+        *source = TIMESTAMPS_SOFTWARE;
+    } else if (strcmp(spec, "hw") == 0) {
+        *source = TIMESTAMPS_HARDWARE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+const char* timestamp_source_name(timestamp_source_t source) {
+    switch (source) {
+        case TIMESTAMPS_SOFTWARE:
+            return "software";
+        case TIMESTAMPS_HARDWARE:
+            return "hardware";
+        default:
+            return "none";
+    }
+}
+
+
+/*
+ * Turn on receive timestamps in the NIC. This is for the whole interface, so it can upset
+ * anything else that has set it differently (e.g. ptp4l), and needs CAP_NET_ADMIN.
+ */
+static int enable_nic_timestamps(int sock, const char* interface, multilog_t* log) {
+    if (interface == NULL || interface[0] == '\0') {
+        multilog(log,LOG_WARNING,"Hardware timestamps need the interface the packets arrive on\n");
+        return -1;
+    }
+    struct hwtstamp_config config;
+    memset(&config,0,sizeof(config));
+    config.tx_type = HWTSTAMP_TX_OFF;
+    config.rx_filter = HWTSTAMP_FILTER_ALL;
+    struct ifreq request;
+    memset(&request,0,sizeof(request));
+    strncpy(request.ifr_name, interface, IF_NAMESIZE-1);
+    request.ifr_data = (char*)&config;
+    if (ioctl(sock, SIOCSHWTSTAMP, &request) < 0) {
+        multilog(log,LOG_WARNING,"Could not turn on hardware timestamps on %s errno=%d %s\n",interface,errno,strerror(errno));
+        return -1;
+    }
+    if (config.rx_filter == HWTSTAMP_FILTER_NONE) {
+        multilog(log,LOG_WARNING,"%s cannot timestamp received packets\n",interface);
+        return -1;
+    }
+    return 0;
+}
+
+
+timestamp_source_t packet_timing_enable(int sock, timestamp_source_t source, const char* interface, multilog_t* log) {
+    if (source == TIMESTAMPS_HARDWARE && enable_nic_timestamps(sock, interface, log) < 0) {
+        source = TIMESTAMPS_SOFTWARE;
+    }
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (source == TIMESTAMPS_HARDWARE) {
+        flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        multilog(log,LOG_WARNING,"Could not turn on receive timestamps errno=%d %s\n",errno,strerror(errno));
+        return TIMESTAMPS_NONE;
+    }
+    multilog(log,LOG_INFO,"Using %s receive timestamps\n",timestamp_source_name(source));
+    return source;
+}
+
+
+timestamp_source_t packet_timing_enable_packet_socket(int sock, timestamp_source_t source, const char* interface, multilog_t* log) {
+    if (source == TIMESTAMPS_HARDWARE) {
+        int flags = SOF_TIMESTAMPING_RAW_HARDWARE;
+        if (enable_nic_timestamps(sock, interface, log) < 0
+                || setsockopt(sock, SOL_PACKET, PACKET_TIMESTAMP, &flags, sizeof(flags)) < 0) {
+            source = TIMESTAMPS_SOFTWARE;
+        }
+    }
+    multilog(log,LOG_INFO,"Using %s receive timestamps\n",timestamp_source_name(source));
+    return source;
+}
+
+
+int64_t packet_timing_arrival(struct msghdr* message) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(message); cmsg != NULL; cmsg = CMSG_NXTHDR(message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            const struct scm_timestamping* stamps = (const struct scm_timestamping*)CMSG_DATA(cmsg);
+            // ts[2] is the raw hardware timestamp, ts[0] the software one.
+            const struct timespec* ts = (stamps->ts[2].tv_sec || stamps->ts[2].tv_nsec) ? &stamps->ts[2] : &stamps->ts[0];
+            return ts->tv_sec*1000000000LL + ts->tv_nsec;
+        }
+    }
+    return 0;
+}
+
+
+int64_t packet_timing_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec*1000000000LL + now.tv_nsec;
+}
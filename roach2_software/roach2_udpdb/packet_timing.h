@@ -0,0 +1,71 @@
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <multilog.h>
+
+/*
+ * Kernel receive timestamps for each packet (SO_TIMESTAMPING), and histograms of where the time
+ * goes between the NIC and the DADA block.
+ *
+ * Software timestamps are taken by the kernel as the driver hands it the packet, on CLOCK_REALTIME.
+ * Hardware timestamps are taken by the NIC as the packet arrives, but on the NIC's own clock, so
+ * they only mean anything next to the system clock if that is kept in step with it (e.g. by
+ * phc2sys). If the NIC or driver cannot make them we fall back to software timestamps.
+ *
+ * Each histogram bin i counts intervals of [2^(i-1), 2^i) ns; bin 0 counts anything under 1 ns,
+ * including negative intervals, which mean the clocks disagree.
+ */
+
+// the same as UDPDB_STATS_TIMING_BINS.
+#define PACKET_TIMING_BINS 32
+
+// room for the control message that carries the timestamps of one packet.
+#define PACKET_TIMING_CONTROL_SIZE 128
+
+typedef enum timestamp_source_t {
+    TIMESTAMPS_NONE = 0,
+    TIMESTAMPS_SOFTWARE,
+    TIMESTAMPS_HARDWARE
+} timestamp_source_t;
+
+typedef struct packet_timing_t {
+    timestamp_source_t source;
+    // written by whichever thread receives the packets: the socket thread, or the capture thread
+    // if there is none.
+    int64_t receive_latency[PACKET_TIMING_BINS]; // arrival until the packet is in the ring
+    int64_t packet_gap[PACKET_TIMING_BINS]; // arrival since the packet before
+    int64_t previous_arrival_ns;
+    // written by the capture thread.
+    _Alignas(64) int64_t ring_latency[PACKET_TIMING_BINS]; // in the ring until it is copied towards the DADA block
+} packet_timing_t;
+
+// parse "sw" or "hw". Returns -1 if not understood.
+int timestamp_source_parse(const char* spec, timestamp_source_t* source);
+const char* timestamp_source_name(timestamp_source_t source);
+
+/*
+ * Ask for receive timestamps on a UDP socket, or on an AF_PACKET socket, whose frames always carry
+ * one. interface is needed to turn on hardware timestamps in the NIC, and may be NULL otherwise.
+ * Returns the source actually in use, TIMESTAMPS_NONE if there are none.
+ */
+timestamp_source_t packet_timing_enable(int sock, timestamp_source_t source, const char* interface, multilog_t* log);
+timestamp_source_t packet_timing_enable_packet_socket(int sock, timestamp_source_t source, const char* interface, multilog_t* log);
+
+// arrival time of a message received with msg_control set, ns since the epoch, or 0 if it has none.
+int64_t packet_timing_arrival(struct msghdr* message);
+
+// CLOCK_REALTIME in ns since the epoch.
+int64_t packet_timing_now(void);
+
+static inline void packet_timing_count(int64_t* histogram, int64_t ns) {
+    const int bin = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+    ++(histogram[bin < PACKET_TIMING_BINS ? bin : PACKET_TIMING_BINS-1]);
+}
+
+// count the latency of a packet that arrived at arrival_ns and was received at now_ns, and the gap since the last one.
+static inline void packet_timing_received(packet_timing_t* timing, int64_t arrival_ns, int64_t now_ns) {
+    packet_timing_count(timing->receive_latency, now_ns - arrival_ns);
+    if (timing->previous_arrival_ns) {
+        packet_timing_count(timing->packet_gap, arrival_ns - timing->previous_arrival_ns);
+    }
+    timing->previous_arrival_ns = arrival_ns;
+}
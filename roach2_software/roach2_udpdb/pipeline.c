@@ -0,0 +1,225 @@
+/*
+ * Processing stages connected by lock-free queues. See pipeline.h.
+ */
+#define _GNU_SOURCE
+
+#include "numa_memory.h"
+#include "pipeline.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <immintrin.h>
+
+// spin this many times waiting for a block before sleeping.
+#define PIPELINE_SPINS 1000
+#define PIPELINE_SLEEP_NS 20000
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+static void queue_init(pipeline_queue_t* queue, uint64_t capacity) {
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    queue->slots = calloc(capacity, sizeof(pipeline_block_t*));
+    queue->capacity = capacity;
+}
+
+
+// the queues hold every block at most once, so there is always room.
+static void queue_push(pipeline_queue_t* queue, pipeline_block_t* block) {
+    const uint64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    queue->slots[head % queue->capacity] = block;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+
+static pipeline_block_t* queue_pop(pipeline_queue_t* queue) {
+    const uint64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&queue->head, memory_order_acquire) == tail) {
+        return NULL;
+    }
+    pipeline_block_t* block = queue->slots[tail % queue->capacity];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return block;
+}
+
+
+static void wait_a_little(unsigned* spins) {
+    if (++(*spins) < PIPELINE_SPINS) {
+        _mm_pause();
+    } else {
+        const struct timespec pause = {0, PIPELINE_SLEEP_NS};
+        nanosleep(&pause, NULL);
+    }
+}
+
+
+pipeline_t* pipeline_create(uint64_t nblocks, uint64_t block_size, const memory_policy_t* memory, multilog_t* log) {
+    pipeline_t* pipeline = malloc(sizeof(pipeline_t));
+    memset(pipeline,0,sizeof(pipeline_t));
+    pipeline->nblocks = nblocks;
+    pipeline->block_size = block_size;
+    pipeline->log = log;
+    pipeline->memory = memory_alloc(nblocks*block_size, memory, "pipeline blocks", &pipeline->map_size, log);
+    if (pipeline->memory == NULL) {
+        free(pipeline);
+        return NULL;
+    }
+    pipeline->blocks = calloc(nblocks, sizeof(pipeline_block_t));
+    for (int i = 0; i <= PIPELINE_MAX_STAGES; ++i) {
+        queue_init(&pipeline->queues[i], nblocks);
+    }
+    for (uint64_t i = 0; i < nblocks; ++i) {
+        pipeline->blocks[i].data = pipeline->memory + i*block_size;
+    }
+    atomic_init(&pipeline->stopping, 0);
+    return pipeline;
+}
+
+
+int pipeline_add_stage(pipeline_t* pipeline, const char* name, int core, pipeline_function_t function, void* arg) {
+    if (pipeline->nstages >= PIPELINE_MAX_STAGES) {
+        return -1;
+    }
+    pipeline_stage_t* stage = &pipeline->stages[pipeline->nstages];
+    strncpy(stage->name, name, sizeof(stage->name)-1);
+    stage->core = core;
+    stage->function = function;
+    stage->arg = arg;
+    stage->pipeline = pipeline;
+    stage->index = pipeline->nstages;
+    ++(pipeline->nstages);
+    return 0;
+}
+
+
+static void* stage_thread(void* arg) {
+    pipeline_stage_t* stage = (pipeline_stage_t*)arg;
+    pipeline_t* pipeline = stage->pipeline;
+    pipeline_queue_t* input = &pipeline->queues[stage->index];
+    pipeline_queue_t* output = &pipeline->queues[stage->index + 1];
+    // the previous stage, or the source for the first one.
+    atomic_int* upstream_finished = stage->index > 0 ? &pipeline->stages[stage->index - 1].finished : &pipeline->stopping;
+
+    while (1) {
+        const uint64_t wait_start = now_ns();
+        pipeline_block_t* block;
+        unsigned spins = 0;
+        char done = 0;
+        while ((block = queue_pop(input)) == NULL) {
+            if (atomic_load_explicit(upstream_finished, memory_order_acquire)) {
+                // anything pushed before the flag was set is visible now.
+                if ((block = queue_pop(input)) == NULL) {
+                    done = 1;
+                }
+                break;
+            }
+            wait_a_little(&spins);
+        }
+        if (done) {
+            break;
+        }
+        const uint64_t depth = pipeline_queue_depth(pipeline, stage->index) + 1;
+        if (depth > atomic_load_explicit(&stage->max_queue_depth, memory_order_relaxed)) {
+            atomic_store_explicit(&stage->max_queue_depth, depth, memory_order_relaxed);
+        }
+        const uint64_t busy_start = now_ns();
+        stage->function(stage->arg, block);
+        const uint64_t busy_end = now_ns();
+        atomic_fetch_add_explicit(&stage->idle_ns, busy_start - wait_start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stage->busy_ns, busy_end - busy_start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stage->blocks, 1, memory_order_relaxed);
+        queue_push(output, block);
+    }
+    atomic_store_explicit(&stage->finished, 1, memory_order_release);
+    return NULL;
+}
+
+
+void pipeline_start(pipeline_t* pipeline) {
+    // every block starts out free, including after a pipeline_stop.
+    for (int i = 0; i <= pipeline->nstages; ++i) {
+        atomic_store(&pipeline->queues[i].head, 0);
+        atomic_store(&pipeline->queues[i].tail, 0);
+    }
+    for (int i = 0; i < pipeline->nstages; ++i) {
+        atomic_store(&pipeline->stages[i].finished, 0);
+    }
+    atomic_store(&pipeline->stopping, 0);
+    pipeline->next_sequence = 0;
+    pipeline_queue_t* pool = &pipeline->queues[pipeline->nstages];
+    for (uint64_t i = 0; i < pipeline->nblocks; ++i) {
+        queue_push(pool, &pipeline->blocks[i]);
+    }
+    for (int i = 0; i < pipeline->nstages; ++i) {
+        pipeline_stage_t* stage = &pipeline->stages[i];
+        pthread_create(&stage->thread, NULL, stage_thread, stage);
+        if (stage->core >= 0) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(stage->core, &cpuset);
+            pthread_setaffinity_np(stage->thread, sizeof(cpuset), &cpuset);
+        }
+        multilog(pipeline->log,LOG_INFO,"Pipeline stage %d '%s' on core %d\n",i,stage->name,stage->core);
+    }
+    pipeline->running = 1;
+}
+
+
+void pipeline_stop(pipeline_t* pipeline) {
+    if (!pipeline->running) {
+        return;
+    }
+    atomic_store_explicit(&pipeline->stopping, 1, memory_order_release);
+    for (int i = 0; i < pipeline->nstages; ++i) {
+        pthread_join(pipeline->stages[i].thread, NULL);
+    }
+    pipeline->running = 0;
+}
+
+
+void pipeline_destroy(pipeline_t* pipeline) {
+    pipeline_stop(pipeline);
+    for (int i = 0; i <= PIPELINE_MAX_STAGES; ++i) {
+        free(pipeline->queues[i].slots);
+    }
+    free(pipeline->blocks);
+    memory_free(pipeline->memory, pipeline->map_size);
+    free(pipeline);
+}
+
+
+pipeline_block_t* pipeline_acquire(pipeline_t* pipeline) {
+    pipeline_queue_t* pool = &pipeline->queues[pipeline->nstages];
+    pipeline_block_t* block = queue_pop(pool);
+    if (block == NULL) {
+        const uint64_t start = now_ns();
+        unsigned spins = 0;
+        while ((block = queue_pop(pool)) == NULL) {
+            wait_a_little(&spins);
+        }
+        atomic_fetch_add_explicit(&pipeline->source_waits, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pipeline->source_wait_ns, now_ns() - start, memory_order_relaxed);
+    }
+    block->bytes = 0;
+    return block;
+}
+
+
+void pipeline_submit(pipeline_t* pipeline, pipeline_block_t* block) {
+    block->sequence = pipeline->next_sequence++;
+    queue_push(&pipeline->queues[0], block);
+}
+
+
+uint64_t pipeline_queue_depth(pipeline_t* pipeline, int stage) {
+    pipeline_queue_t* queue = &pipeline->queues[stage];
+    return atomic_load_explicit(&queue->head, memory_order_acquire) - atomic_load_explicit(&queue->tail, memory_order_acquire);
+}
@@ -0,0 +1,98 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <multilog.h>
+
+// memory_policy_t comes from numa_memory.h, which must be included first.
+
+#define PIPELINE_MAX_STAGES 4
+#define PIPELINE_DEFAULT_BLOCKS 8
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+/*
+ * A chain of processing stages, each a thread pinned to its own core, that blocks of data pass
+ * through in order.
+ *
+ * The pipeline owns a pool of nblocks blocks of block_size bytes. The source (the capture thread)
+ * takes a free block with pipeline_acquire, fills it and passes it on with pipeline_submit. Each
+ * stage calls its function on every block in turn and hands it to the next stage, and the last
+ * stage puts it back in the pool. Only references to blocks move between threads, through bounded
+ * single-producer/single-consumer queues, so nothing is copied and no locks are taken.
+ *
+ * If a stage falls behind, the blocks pile up in its queue until the pool is empty, and then the
+ * source waits in pipeline_acquire. A waiting thread spins briefly and then sleeps in short steps,
+ * so an idle stage costs little even when it does not have a core to itself.
+ *
+ * Each stage counts the blocks it has done, the time spent in its function (busy) and waiting for
+ * a block (idle), and the depth of its input queue. They can be read from any thread at any time.
+ */
+typedef struct pipeline_block_t {
+    char* data;
+    uint64_t bytes; // bytes of data in the block
+    uint64_t sequence; // order in which the source submitted it
+} pipeline_block_t;
+
+typedef void (*pipeline_function_t)(void* arg, pipeline_block_t* block);
+
+typedef struct pipeline_queue_t {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t head; // blocks pushed
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t tail; // blocks popped
+    _Alignas(CACHE_LINE_SIZE) pipeline_block_t** slots;
+    uint64_t capacity;
+} pipeline_queue_t;
+
+typedef struct pipeline_stage_t {
+    char name[16];
+    int core; // -1 if not bound to a core
+    pipeline_function_t function;
+    void* arg;
+    struct pipeline_t* pipeline;
+    int index;
+    pthread_t thread;
+    atomic_int finished;
+
+    // statistics, written only by the stage's thread
+    atomic_uint_fast64_t blocks;
+    atomic_uint_fast64_t busy_ns;
+    atomic_uint_fast64_t idle_ns;
+    atomic_uint_fast64_t max_queue_depth;
+} pipeline_stage_t;
+
+typedef struct pipeline_t {
+    uint64_t nblocks;
+    uint64_t block_size;
+    pipeline_block_t* blocks;
+    char* memory;
+    size_t map_size;
+
+    // queues[i] feeds stage i, and queues[nstages] returns blocks to the pool.
+    pipeline_queue_t queues[PIPELINE_MAX_STAGES + 1];
+    pipeline_stage_t stages[PIPELINE_MAX_STAGES];
+    int nstages;
+    uint64_t next_sequence;
+    atomic_int stopping;
+    char running;
+
+    // source statistics
+    atomic_uint_fast64_t source_waits;
+    atomic_uint_fast64_t source_wait_ns;
+    multilog_t* log;
+} pipeline_t;
+
+// blocks are allocated with memory_alloc. Returns NULL if they cannot be.
+pipeline_t* pipeline_create(uint64_t nblocks, uint64_t block_size, const memory_policy_t* memory, multilog_t* log);
+// add a stage to the end of the chain; only before pipeline_start. Returns -1 if there are too many.
+int pipeline_add_stage(pipeline_t* pipeline, const char* name, int core, pipeline_function_t function, void* arg);
+void pipeline_start(pipeline_t* pipeline);
+// let every submitted block through all the stages, then stop the threads. The pipeline can be started again.
+void pipeline_stop(pipeline_t* pipeline);
+void pipeline_destroy(pipeline_t* pipeline);
+
+// source side
+pipeline_block_t* pipeline_acquire(pipeline_t* pipeline);
+void pipeline_submit(pipeline_t* pipeline, pipeline_block_t* block);
+
+// blocks waiting in the queue of stage i.
+uint64_t pipeline_queue_depth(pipeline_t* pipeline, int stage);
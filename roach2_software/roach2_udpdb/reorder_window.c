@@ -0,0 +1,59 @@
+/*
+ * Reorder window for packets that arrive out of sequence. See reorder_window.h
+ */
+
+#include "reorder_window.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+reorder_window_t* reorder_window_create(uint64_t depth, uint64_t data_size) {
+    reorder_window_t* window = malloc(sizeof(reorder_window_t));
+    memset(window,0,sizeof(reorder_window_t));
+    window->depth = depth;
+    window->data_size = data_size;
+    window->data = malloc(depth*data_size);
+    window->packet_number = calloc(depth, sizeof(uint64_t));
+    window->present = calloc(depth, 1);
+    return window;
+}
+
+
+void reorder_window_destroy(reorder_window_t* window) {
+    free(window->data);
+    free(window->packet_number);
+    free(window->present);
+    free(window);
+}
+
+
+int reorder_window_put(reorder_window_t* window, uint64_t packet_number, const char* data) {
+    const uint64_t position = packet_number % window->depth;
+    if (window->present[position]) {
+        // the caller never lets the window hold more than depth consecutive packets, so this is a duplicate.
+        return -1;
+    }
+    memcpy(window->data + position*window->data_size, data, window->data_size);
+    window->packet_number[position] = packet_number;
+    window->present[position] = 1;
+    ++(window->held);
+    return 0;
+}
+
+
+int reorder_window_holds(reorder_window_t* window, uint64_t packet_number) {
+    const uint64_t position = packet_number % window->depth;
+    return window->present[position] && window->packet_number[position] == packet_number;
+}
+
+
+char* reorder_window_take(reorder_window_t* window, uint64_t packet_number) {
+    const uint64_t position = packet_number % window->depth;
+    if (!reorder_window_holds(window, packet_number)) {
+        return NULL;
+    }
+    window->present[position] = 0;
+    --(window->held);
+    return window->data + position*window->data_size;
+}
+
@@ -0,0 +1,32 @@
+#include <inttypes.h>
+
+// default number of packets that can be held waiting for an earlier packet to turn up.
+#define REORDER_WINDOW_DEFAULT_DEPTH 64
+
+/*
+ * A small window of packets that arrived ahead of the one we are waiting for.
+ *
+ * Packets are keyed on their packet number (frame counter / frames per packet) modulo the depth,
+ * and are copied in, since the internal ring slot they arrived in is given back straight away.
+ * Only packets that arrive out of order are ever copied.
+ */
+typedef struct reorder_window_t {
+    uint64_t depth;
+    uint64_t data_size;
+    char* data; // depth packets
+    uint64_t* packet_number; // packet number held in each position, if present
+    char* present;
+    uint64_t held; // number of packets in the window
+} reorder_window_t;
+
+reorder_window_t* reorder_window_create(uint64_t depth, uint64_t data_size);
+void reorder_window_destroy(reorder_window_t* window);
+
+// store a packet. Returns -1 if this packet is already in the window.
+int reorder_window_put(reorder_window_t* window, uint64_t packet_number, const char* data);
+
+// is this packet in the window?
+int reorder_window_holds(reorder_window_t* window, uint64_t packet_number);
+
+// remove a packet from the window. The data stays valid until the next put. Returns NULL if it is not there.
+char* reorder_window_take(reorder_window_t* window, uint64_t packet_number);
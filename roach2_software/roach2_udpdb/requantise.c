@@ -0,0 +1,377 @@
+/*
+ * Requantise 8-bit voltages to 4 or 2 bits. See requantise.h.
+ *
+ * A block is handled as one or more runs of bytes in which the channel, polarisation and
+ * real/imaginary part repeat with a fixed period: the whole block with a period of one frame for
+ * TFP, or one run per channel with a period of 32 bytes (8 samples) for FTP.
+ */
+#include "corner_turn.h"
+#include "requantise.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <immintrin.h>
+
+// sums of 16-bit values stay in 16 bits for this many periods.
+#define SUM16_PERIODS 255
+
+
+int requantise_parse(const char* spec, int* nbit, uint64_t* window_blocks) {
+    *window_blocks = REQUANTISE_DEFAULT_WINDOW;
+    int n = sscanf(spec, "%d:%"SCNu64, nbit, window_blocks);
+    if (n < 1 || (*nbit != 4 && *nbit != 2) || *window_blocks == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+requantise_t* requantise_create(int nbit, uint64_t nchan, sample_order_t order, uint64_t window_blocks,
+        const char* scales_filename, multilog_t* log) {
+    if (nchan*4 > REQUANTISE_MAX_PERIOD) {
+        multilog(log,LOG_ERR,"Cannot requantise %"PRIu64" channels, at most %d allowed\n",nchan,REQUANTISE_MAX_PERIOD/4);
+        return NULL;
+    }
+    requantise_t* rq = malloc(sizeof(requantise_t));
+    memset(rq,0,sizeof(requantise_t));
+    rq->nbit = nbit;
+    rq->nchan = nchan;
+    rq->order = order;
+    rq->log = log;
+    rq->step_sigma = nbit == 4 ? 0.3352 : 0.9816;
+    rq->qmin = -(1 << (nbit-1));
+    rq->qmax = (1 << (nbit-1)) - 1;
+    rq->window_blocks = window_blocks;
+    rq->window_sum = calloc(window_blocks*nchan*4, sizeof(int64_t));
+    rq->window_sumsq = calloc(window_blocks*nchan*2, sizeof(int64_t));
+    rq->window_nsamples = calloc(window_blocks, sizeof(uint64_t));
+    rq->offset = calloc(nchan*4, sizeof(int16_t));
+    rq->scale = calloc(nchan*4, sizeof(int16_t));
+    rq->record = calloc(nchan*6, sizeof(float));
+    rq->use_avx2 = __builtin_cpu_supports("avx2") && (order == ORDER_FTP || nchan*4 == 32 || nchan*4 == 64);
+
+    if (scales_filename) {
+        rq->scales_file = fopen(scales_filename, "wb");
+        if (rq->scales_file == NULL) {
+            multilog(log,LOG_ERR,"Could not open requantisation scales file '%s' ERRNO=%d %s\n",scales_filename,errno,strerror(errno));
+            requantise_destroy(rq);
+            return NULL;
+        }
+        requantise_file_header_t header;
+        memset(&header,0,sizeof(header));
+        memcpy(header.magic, REQUANTISE_SCALES_MAGIC, sizeof(header.magic));
+        header.nbit = nbit;
+        header.nchan = nchan;
+        header.order = order;
+        header.window_blocks = window_blocks;
+        header.step_sigma = rq->step_sigma;
+        header.record_size = sizeof(requantise_record_t) + nchan*6*sizeof(float);
+        fwrite(&header, sizeof(header), 1, rq->scales_file);
+        multilog(log,LOG_INFO,"Writing requantisation scales to %s\n",scales_filename);
+    }
+
+    multilog(log,LOG_INFO,"Requantising to %d bits, scaled over %"PRIu64" blocks%s\n",nbit,window_blocks,rq->use_avx2 ? ", with AVX2" : "");
+    return rq;
+}
+
+
+void requantise_destroy(requantise_t* rq) {
+    if (rq->scales_file) {
+        fclose(rq->scales_file);
+    }
+    free(rq->window_sum);
+    free(rq->window_sumsq);
+    free(rq->window_nsamples);
+    free(rq->offset);
+    free(rq->scale);
+    free(rq->record);
+    free(rq);
+}
+
+
+/*
+ * The runs that make up a block of nsamp samples. Run r starts at byte *start, is *length bytes
+ * long and repeats every *period bytes; index[j] is the (chan*2 + pol)*2 + dim of byte j of a period.
+ */
+static uint64_t count_runs(const requantise_t* rq) {
+    return rq->order == ORDER_FTP ? rq->nchan : 1;
+}
+
+static void get_run(const requantise_t* rq, uint64_t nsamp, uint64_t r, uint64_t* start, uint64_t* length,
+        uint64_t* period, int* index) {
+    if (rq->order == ORDER_FTP) {
+        *start = r*nsamp*4;
+        *length = nsamp*4;
+        *period = 32;
+        for (int j = 0; j < 32; ++j) {
+            index[j] = r*4 + j%4;
+        }
+    } else {
+        *start = 0;
+        *length = nsamp*rq->nchan*4;
+        *period = rq->nchan*4;
+        for (uint64_t j = 0; j < *period; ++j) {
+            index[j] = j;
+        }
+    }
+}
+
+
+static void accumulate_scalar(const int8_t* in, uint64_t length, uint64_t period, int64_t* sum, int64_t* sumsq) {
+    for (uint64_t k = 0; k < length; k += period) {
+        const uint64_t n = length - k < period ? length - k : period;
+        for (uint64_t j = 0; j < n; ++j) {
+            const int32_t x = in[k+j];
+            sum[j] += x;
+            sumsq[j/2] += x*x;
+        }
+    }
+}
+
+
+__attribute__((target("avx2")))
+static void flush_sums(__m256i* sum16, __m256i* sumsq32, int nslots, int64_t* sum, int64_t* sumsq) {
+    int16_t s[16];
+    int32_t q[8];
+    for (int slot = 0; slot < nslots; ++slot) {
+        for (int half = 0; half < 2; ++half) {
+            _mm256_storeu_si256((__m256i*)s, sum16[slot*2+half]);
+            _mm256_storeu_si256((__m256i*)q, sumsq32[slot*2+half]);
+            for (int i = 0; i < 16; ++i) {
+                sum[slot*32 + half*16 + i] += s[i];
+            }
+            for (int i = 0; i < 8; ++i) {
+                sumsq[slot*16 + half*8 + i] += q[i];
+            }
+            sum16[slot*2+half] = _mm256_setzero_si256();
+            sumsq32[slot*2+half] = _mm256_setzero_si256();
+        }
+    }
+}
+
+
+// period is 32 or 64. Sums are 16-bit for up to SUM16_PERIODS periods before being added to the totals.
+__attribute__((target("avx2")))
+static void accumulate_avx2(const int8_t* in, uint64_t length, uint64_t period, int64_t* sum, int64_t* sumsq) {
+    const int nslots = period / 32;
+    __m256i sum16[4], sumsq32[4];
+    for (int i = 0; i < 4; ++i) {
+        sum16[i] = _mm256_setzero_si256();
+        sumsq32[i] = _mm256_setzero_si256();
+    }
+    const uint64_t whole = length / period * period;
+    uint64_t periods = 0;
+    for (uint64_t k = 0; k < whole; k += period) {
+        for (int slot = 0; slot < nslots; ++slot) {
+            const __m256i bytes = _mm256_loadu_si256((const __m256i*)(in + k + slot*32));
+            const __m256i lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(bytes));
+            const __m256i hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(bytes, 1));
+            sum16[slot*2] = _mm256_add_epi16(sum16[slot*2], lo);
+            sum16[slot*2+1] = _mm256_add_epi16(sum16[slot*2+1], hi);
+            // madd adds the squares of each real/imaginary pair.
+            sumsq32[slot*2] = _mm256_add_epi32(sumsq32[slot*2], _mm256_madd_epi16(lo, lo));
+            sumsq32[slot*2+1] = _mm256_add_epi32(sumsq32[slot*2+1], _mm256_madd_epi16(hi, hi));
+        }
+        if (++periods == SUM16_PERIODS) {
+            flush_sums(sum16, sumsq32, nslots, sum, sumsq);
+            periods = 0;
+        }
+    }
+    flush_sums(sum16, sumsq32, nslots, sum, sumsq);
+    accumulate_scalar(in + whole, length - whole, period, sum, sumsq);
+}
+
+
+static inline int16_t quantise_value(int8_t x, int16_t offset, int16_t scale, int shift, int16_t qmin, int16_t qmax) {
+    int32_t y = x*256 - offset;
+    y = y < -32768 ? -32768 : (y > 32767 ? 32767 : y);
+    int32_t q = ((y * scale) >> 16) >> shift;
+    return q < qmin ? qmin : (q > qmax ? qmax : q);
+}
+
+
+// length is a multiple of 8/nbit.
+static void quantise_scalar(const requantise_t* rq, const int8_t* in, uint8_t* out, uint64_t length, uint64_t period,
+        const int16_t* offset, const int16_t* scale) {
+    const int per_byte = 8 / rq->nbit;
+    const int mask = (1 << rq->nbit) - 1;
+    uint64_t j = 0;
+    for (uint64_t k = 0; k < length; k += per_byte) {
+        uint8_t packed = 0;
+        for (int i = 0; i < per_byte; ++i) {
+            const int16_t q = quantise_value(in[k+i], offset[j], scale[j], rq->shift, rq->qmin, rq->qmax);
+            packed |= (q & mask) << (i*rq->nbit);
+            if (++j == period) {
+                j = 0;
+            }
+        }
+        out[k / per_byte] = packed;
+    }
+}
+
+
+// period is 32 or 64, and length a multiple of it.
+__attribute__((target("avx2")))
+static void quantise_avx2(const requantise_t* rq, const int8_t* in, uint8_t* out, uint64_t length, uint64_t period,
+        const int16_t* offset, const int16_t* scale) {
+    const int nslots = period / 32;
+    __m256i offsets[4], scales[4];
+    for (int i = 0; i < nslots*2; ++i) {
+        offsets[i] = _mm256_loadu_si256((const __m256i*)(offset + i*16));
+        scales[i] = _mm256_loadu_si256((const __m256i*)(scale + i*16));
+    }
+    const __m128i shift = _mm_cvtsi32_si128(rq->shift);
+    const __m256i qmin = _mm256_set1_epi16(rq->qmin);
+    const __m256i qmax = _mm256_set1_epi16(rq->qmax);
+    const __m256i low2 = _mm256_set1_epi16(0x0003), next2 = _mm256_set1_epi16(0x000c);
+    const __m256i low4 = _mm256_set1_epi16(0x000f), next4 = _mm256_set1_epi16(0x00f0);
+    const __m256i first_bytes = _mm256_setr_epi8(0,4,8,12, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1,
+                                                 0,4,8,12, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1);
+    const __m256i first_dwords = _mm256_setr_epi32(0,4,0,0,0,0,0,0);
+    const uint64_t out_per_chunk = 32 * rq->nbit / 8;
+
+    for (uint64_t k = 0; k < length; k += 32) {
+        const int slot = (k % period) / 32;
+        const __m256i bytes = _mm256_loadu_si256((const __m256i*)(in + k));
+        __m256i lo = _mm256_slli_epi16(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(bytes)), 8);
+        __m256i hi = _mm256_slli_epi16(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(bytes, 1)), 8);
+        lo = _mm256_sra_epi16(_mm256_mulhi_epi16(_mm256_subs_epi16(lo, offsets[slot*2]), scales[slot*2]), shift);
+        hi = _mm256_sra_epi16(_mm256_mulhi_epi16(_mm256_subs_epi16(hi, offsets[slot*2+1]), scales[slot*2+1]), shift);
+        lo = _mm256_max_epi16(_mm256_min_epi16(lo, qmax), qmin);
+        hi = _mm256_max_epi16(_mm256_min_epi16(hi, qmax), qmin);
+        // back to one byte per value, in order.
+        __m256i q = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xd8);
+
+        uint8_t* destination = out + k / 32 * out_per_chunk;
+        if (rq->nbit == 4) {
+            // each 16-bit lane holds two values: keep the low nibble of each.
+            __m256i pairs = _mm256_or_si256(_mm256_and_si256(q, low4), _mm256_and_si256(_mm256_srli_epi16(q, 4), next4));
+            pairs = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0x08);
+            _mm_storeu_si128((__m128i*)destination, _mm256_castsi256_si128(pairs));
+        } else {
+            // two values to a nibble in each 16-bit lane, then two nibbles to a byte in each 32-bit lane.
+            __m256i nibbles = _mm256_or_si256(_mm256_and_si256(q, low2), _mm256_and_si256(_mm256_srli_epi16(q, 6), next2));
+            __m256i quads = _mm256_or_si256(_mm256_and_si256(nibbles, _mm256_set1_epi32(0x0f)),
+                    _mm256_and_si256(_mm256_srli_epi32(nibbles, 12), _mm256_set1_epi32(0xf0)));
+            quads = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(quads, first_bytes), first_dwords);
+            _mm_storel_epi64((__m128i*)destination, _mm256_castsi256_si128(quads));
+        }
+    }
+}
+
+
+// work out the fixed point offset and scale from the sums over the window.
+static void update_parameters(requantise_t* rq) {
+    const uint64_t npos = rq->nchan*4;
+    double sum[REQUANTISE_MAX_PERIOD] = {0};
+    double sumsq[REQUANTISE_MAX_PERIOD/2] = {0};
+    double nsamples = 0;
+    for (uint64_t b = 0; b < rq->window_blocks; ++b) {
+        nsamples += rq->window_nsamples[b];
+        for (uint64_t i = 0; i < npos; ++i) {
+            sum[i] += rq->window_sum[b*npos + i];
+        }
+        for (uint64_t i = 0; i < npos/2; ++i) {
+            sumsq[i] += rq->window_sumsq[b*npos/2 + i];
+        }
+    }
+
+    double step[REQUANTISE_MAX_PERIOD/2];
+    double smallest_step = 0;
+    for (uint64_t cp = 0; cp < npos/2; ++cp) {
+        const double mean_re = sum[cp*2] / nsamples;
+        const double mean_im = sum[cp*2+1] / nsamples;
+        const double variance = (sumsq[cp] - nsamples*(mean_re*mean_re + mean_im*mean_im)) / (2*nsamples);
+        // an all zero channel (e.g. zero fill) still needs a sensible step.
+        const double rms = variance > 0.25 ? sqrt(variance) : 0.5;
+        step[cp] = rq->step_sigma * rms;
+        if (cp == 0 || step[cp] < smallest_step) {
+            smallest_step = step[cp];
+        }
+        for (int dim = 0; dim < 2; ++dim) {
+            double offset = round(sum[cp*2+dim] / nsamples * 256);
+            rq->offset[cp*2+dim] = offset < -32768 ? -32768 : (offset > 32767 ? 32767 : offset);
+        }
+    }
+
+    // as much precision in scale as the smallest step allows.
+    rq->shift = 0;
+    while (rq->shift < 15 && ldexp(1.0, 8 + rq->shift + 1) / smallest_step <= 32767) {
+        ++(rq->shift);
+    }
+    for (uint64_t cp = 0; cp < npos/2; ++cp) {
+        double scale = round(ldexp(1.0, 8 + rq->shift) / step[cp]);
+        scale = scale < 1 ? 1 : (scale > 32767 ? 32767 : scale);
+        rq->scale[cp*2] = rq->scale[cp*2+1] = scale;
+        // the values actually used, for the scales file.
+        rq->record[npos + cp] = ldexp(1.0, 8 + rq->shift) / scale;
+        rq->record[cp*2] = rq->offset[cp*2] / 256.0;
+        rq->record[cp*2+1] = rq->offset[cp*2+1] / 256.0;
+    }
+}
+
+
+uint64_t requantise_apply(requantise_t* rq, const char* in, char* out, uint64_t bytes) {
+    const uint64_t npos = rq->nchan*4;
+    const uint64_t nsamp = bytes / npos;
+    const uint64_t nruns = count_runs(rq);
+    const int8_t* data = (const int8_t*)in;
+    int index[REQUANTISE_MAX_PERIOD];
+    uint64_t start, length, period;
+
+    // replace the oldest block of the window with this one.
+    const uint64_t slot = rq->block_index % rq->window_blocks;
+    int64_t* block_sum = rq->window_sum + slot*npos;
+    int64_t* block_sumsq = rq->window_sumsq + slot*npos/2;
+    memset(block_sum, 0, npos*sizeof(int64_t));
+    memset(block_sumsq, 0, npos/2*sizeof(int64_t));
+    rq->window_nsamples[slot] = nsamp;
+    for (uint64_t r = 0; r < nruns; ++r) {
+        int64_t sum[REQUANTISE_MAX_PERIOD] = {0};
+        int64_t sumsq[REQUANTISE_MAX_PERIOD/2] = {0};
+        get_run(rq, nsamp, r, &start, &length, &period, index);
+        if (rq->use_avx2) {
+            accumulate_avx2(data + start, length, period, sum, sumsq);
+        } else {
+            accumulate_scalar(data + start, length, period, sum, sumsq);
+        }
+        for (uint64_t j = 0; j < period; ++j) {
+            block_sum[index[j]] += sum[j];
+        }
+        for (uint64_t j = 0; j < period; j += 2) {
+            block_sumsq[index[j]/2] += sumsq[j/2];
+        }
+    }
+
+    update_parameters(rq);
+
+    if (rq->scales_file) {
+        requantise_record_t record;
+        record.block_index = rq->block_index;
+        record.nsamples = nsamp;
+        fwrite(&record, sizeof(record), 1, rq->scales_file);
+        fwrite(rq->record, sizeof(float), npos*6/4, rq->scales_file);
+    }
+
+    for (uint64_t r = 0; r < nruns; ++r) {
+        int16_t offset[REQUANTISE_MAX_PERIOD], scale[REQUANTISE_MAX_PERIOD];
+        get_run(rq, nsamp, r, &start, &length, &period, index);
+        for (uint64_t j = 0; j < period; ++j) {
+            offset[j] = rq->offset[index[j]];
+            scale[j] = rq->scale[index[j]];
+        }
+        uint8_t* destination = (uint8_t*)out + start*rq->nbit/8;
+        uint64_t done = 0;
+        if (rq->use_avx2) {
+            done = length / period * period;
+            quantise_avx2(rq, data + start, destination, done, period, offset, scale);
+        }
+        // the rest starts on a whole period, so the pattern of offsets lines up.
+        quantise_scalar(rq, data + start + done, destination + done*rq->nbit/8, length - done, period, offset, scale);
+    }
+
+    ++(rq->block_index);
+    return bytes * rq->nbit / 8;
+}
@@ -0,0 +1,86 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <multilog.h>
+
+// sample_order_t comes from corner_turn.h, which must be included first.
+
+#define REQUANTISE_SCALES_MAGIC "R2SCAL01"
+#define REQUANTISE_DEFAULT_WINDOW 8
+// statistics are gathered with this many bytes repeating, so a frame of band_select 0 must fit.
+#define REQUANTISE_MAX_PERIOD 64
+
+/*
+ * Requantise 8-bit complex voltages to 4 or 2 bits per value on their way into the DADA block.
+ *
+ * For each channel and polarisation the mean of the real and imaginary parts and the rms of the
+ * two together are measured over a sliding window of the last window_blocks blocks, including
+ * the block being requantised. Each value x becomes
+ *
+ *     q = floor((x - offset) / step)     clipped to -8..7 (4-bit) or -2..1 (2-bit)
+ *
+ * with step = step_sigma * rms, where step_sigma is 0.3352 for 4 bits and 0.9816 for 2 bits,
+ * the optimum for Gaussian noise. q is stored in two's complement, packed from the least
+ * significant bits of each byte up, in the same order as the 8-bit values were. The value is
+ * best restored as offset + (q + 0.5) * step.
+ *
+ * The scale changes from block to block, so offset and step for every block can be written to a
+ * file that starts with a requantise_file_header_t, followed by one record per block: a
+ * requantise_record_t, then float offset[nchan*4] indexed by (chan*2 + pol)*2 + dim, and float
+ * step[nchan*2] indexed by chan*2 + pol. These are the exact values used, after rounding to the
+ * fixed point arithmetic below.
+ *
+ * Blocks can be in TFP or FTP order (see corner_turn.h); the channel numbers are those of the
+ * block, after any reordering. The arithmetic is 16-bit fixed point, so the AVX2 version (used
+ * when a frame is 32 or 64 bytes, or always for FTP) gives exactly the same answer as the scalar
+ * one.
+ */
+typedef struct requantise_file_header_t {
+    char magic[8]; // REQUANTISE_SCALES_MAGIC
+    uint64_t nbit;
+    uint64_t nchan;
+    uint64_t order; // sample_order_t of the blocks
+    uint64_t window_blocks;
+    double step_sigma;
+    uint64_t record_size; // bytes per block, including the record header
+} requantise_file_header_t;
+
+typedef struct requantise_record_t {
+    uint64_t block_index;
+    uint64_t nsamples; // time samples in the block
+} requantise_record_t;
+
+typedef struct requantise_t {
+    int nbit;
+    uint64_t nchan;
+    sample_order_t order;
+    double step_sigma;
+    int16_t qmin, qmax;
+
+    // sums for each block in the window, oldest overwritten first.
+    uint64_t window_blocks;
+    int64_t* window_sum; // [window_blocks][nchan*4]
+    int64_t* window_sumsq; // [window_blocks][nchan*2], real and imaginary together
+    uint64_t* window_nsamples; // [window_blocks]
+    uint64_t block_index;
+
+    // fixed point parameters for the current block: q = ((x*256 - offset) * scale >> 16) >> shift
+    int16_t* offset; // [nchan*4]
+    int16_t* scale; // [nchan*4], the same for real and imaginary
+    int shift;
+
+    FILE* scales_file;
+    float* record; // offset and step for the scales file
+    char use_avx2;
+    multilog_t* log;
+} requantise_t;
+
+// parse nbit[:window_blocks]. Returns -1 if not understood.
+int requantise_parse(const char* spec, int* nbit, uint64_t* window_blocks);
+
+// scales_filename may be NULL.
+requantise_t* requantise_create(int nbit, uint64_t nchan, sample_order_t order, uint64_t window_blocks,
+        const char* scales_filename, multilog_t* log);
+void requantise_destroy(requantise_t* requantise);
+
+// requantise bytes (a multiple of nchan*4) of 8-bit data from in to out. Returns the bytes written to out.
+uint64_t requantise_apply(requantise_t* requantise, const char* in, char* out, uint64_t bytes);
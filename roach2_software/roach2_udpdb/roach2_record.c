@@ -0,0 +1,147 @@
+/*
+ * Record the raw packet stream for one IP/port to disk, with the kernel arrival time and frame
+ * counter of every packet, so that a capture can be looked at (or replayed with roach2_replay)
+ * afterwards.
+ *
+ * Packets are taken from an AF_PACKET ring (see packet_mmap.c), which sees a copy of every
+ * frame on the interface, so this runs alongside roach2_udpdb on the same port without taking
+ * any packets from it. It needs CAP_NET_RAW. The file is written with large aligned writes from
+ * a separate thread (see packet_record.c).
+ *
+ * Usage: roach2_record -i interface -o file [-I ip] [-p port] [-T seconds] [-v]
+ *
+ * Records until -T seconds after the first packet, or until interrupted if -T is 0.
+ */
+#include "decode_spead.h"
+#include "packet_mmap.h"
+#include "packet_record.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <multilog.h>
+
+#define STRLEN 1024
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int signum) {
+    stop = 1;
+}
+
+
+int main (int argc, char **argv)
+{
+    char ip_address[128];
+    char interface[128] = "";
+    char filename[STRLEN] = "";
+    int portnum = 12000;
+    char verbose = 0;
+    char arg;
+    double seconds = 0;
+
+    strncpy(ip_address,"10.0.3.1",127);
+
+    multilog_t* log = multilog_open ("roach2_record", 0);
+    multilog_add (log, stderr);
+
+    while ((arg = getopt(argc, argv, "i:o:p:vI:T:")) != -1) {
+        switch (arg) {
+            case 'i':
+                strncpy(interface,optarg,127);
+                break;
+            case 'o':
+                strncpy(filename,optarg,STRLEN-1);
+                break;
+            case 'p':
+                sscanf(optarg,"%d",&portnum);
+                break;
+            case 'v':
+                verbose=1;
+                break;
+            case 'I':
+                strncpy(ip_address,optarg,127);
+                break;
+            case 'T':
+                sscanf(optarg,"%lf",&seconds);
+                break;
+        }
+    }
+    if (interface[0] == '\0' || filename[0] == '\0') {
+        fprintf(stderr,"Usage: roach2_record -i interface -o file [-I ip] [-p port] [-T seconds] [-v]\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    packet_mmap_t* ring = packet_mmap_open(interface, ip_address, portnum,
+            PACKET_MMAP_DEFAULT_BLOCK_SIZE, PACKET_MMAP_DEFAULT_BLOCK_COUNT, log);
+    if (ring == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // the interface, the address and a port, with room for the space, colon and an int.
+    char source[sizeof(interface) + sizeof(ip_address) + 16];
+    snprintf(source, sizeof(source), "%s %s:%d", interface, ip_address, portnum);
+
+    packet_recorder_t* recorder = NULL;
+    spead_layout_t spead_layout;
+    spead_layout_init(&spead_layout);
+    uint64_t first_arrival_ns = 0;
+    uint64_t truncated = 0;
+    uint64_t next_report = 0;
+
+    while (!stop) {
+        uint64_t length;
+        unsigned char* packet = packet_mmap_next(ring, &length, 1000);
+        if (packet == NULL) {
+            continue;
+        }
+
+        uint64_t data_size, frame_counter, band_select;
+        if (decode_roach2_spead_packet_fast(&spead_layout, packet, &data_size, &frame_counter, &band_select) == NULL) {
+            frame_counter = UINT64_MAX;
+        }
+
+        if (recorder == NULL) {
+            // all packets from the ROACH2 are the same size, so the first one sets the record size.
+            recorder = packet_recorder_open(filename, packet_record_stride(length), source, log);
+            if (recorder == NULL) {
+                packet_mmap_close(ring);
+                return EXIT_FAILURE;
+            }
+            first_arrival_ns = ring->arrival_ns;
+            next_report = first_arrival_ns + 1000000000ULL;
+        }
+        if (sizeof(packet_record_t) + length > recorder->header.record_stride) {
+            ++truncated;
+        }
+        packet_recorder_add(recorder, packet, length, ring->arrival_ns, frame_counter);
+
+        if (verbose && ring->arrival_ns > next_report) {
+            multilog(log,LOG_INFO,"Recorded %"PRIu64" packets, dropped %"PRIu64", kernel drops %"PRIu64"\n",
+                    recorder->header.npackets,recorder->header.dropped,ring->kernel_drops);
+            next_report += 1000000000ULL;
+        }
+        if (seconds > 0 && ring->arrival_ns - first_arrival_ns >= seconds*1e9) {
+            break;
+        }
+    }
+
+    int ret = EXIT_SUCCESS;
+    if (recorder) {
+        multilog(log,LOG_INFO,"Kernel drops: %"PRIu64" truncated packets: %"PRIu64"\n",ring->kernel_drops,truncated);
+        if (packet_recorder_close(recorder) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    } else {
+        multilog(log,LOG_WARNING,"No packets recieved\n");
+    }
+    packet_mmap_close(ring);
+    return ret;
+}
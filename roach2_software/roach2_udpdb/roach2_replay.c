@@ -0,0 +1,198 @@
+/*
+ * Send a recording made by roach2_record back out to a UDP destination, with the original
+ * spacing between packets, scaled by -x (2 is twice as fast, 0 is as fast as possible).
+ *
+ * The recording is mmap'd and the packets are sent straight from the map with sendmmsg,
+ * in batches of up to -B packets that are due within SEND_AHEAD of each other.
+ *
+ * Usage: roach2_replay -d ip:port [-x speed] [-s start_seconds] [-n packets] [-l loops] [-B batch] file
+ */
+#define _GNU_SOURCE // for sendmmsg
+#include "packet_record.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <multilog.h>
+
+#define MAX_SEND_BATCH 1024
+// packets can go this many seconds early, so that packets a few us apart can share a sendmmsg call.
+#define SEND_AHEAD 50e-6
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+static void sleep_until(double when) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)when;
+    ts.tv_nsec = (long)((when - ts.tv_sec)*1e9);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+
+static int send_batch(int sock, struct mmsghdr* msgs, int n, multilog_t* log) {
+    int offset = 0;
+    while (offset < n) {
+        int retval = sendmmsg(sock, msgs + offset, n - offset, 0);
+        if (retval == -1) {
+            // a refusal is reported for an earlier packet when nothing is listening yet, so carry on.
+            if (errno == ENOBUFS || errno == EAGAIN || errno == ECONNREFUSED) {
+                continue;
+            }
+            multilog(log,LOG_ERR,"error sending packets ERRNO=%d %s\n",errno,strerror(errno));
+            return -1;
+        }
+        offset += retval;
+    }
+    return 0;
+}
+
+
+int main (int argc, char **argv)
+{
+    char ip_address[128] = "";
+    int portnum = 0;
+    double speed = 1.0;
+    double start_seconds = 0;
+    uint64_t packets_to_send = 0;
+    int loops = 1;
+    int batch_size = 64;
+    char arg;
+
+    multilog_t* log = multilog_open ("roach2_replay", 0);
+    multilog_add (log, stderr);
+
+    while ((arg = getopt(argc, argv, "d:l:n:s:x:B:")) != -1) {
+        switch (arg) {
+            case 'd':
+                if (sscanf(optarg,"%127[^:]:%d",ip_address,&portnum) != 2) {
+                    ip_address[0] = '\0';
+                }
+                break;
+            case 'l':
+                sscanf(optarg,"%d",&loops);
+                break;
+            case 'n':
+                sscanf(optarg,"%"SCNu64,&packets_to_send);
+                break;
+            case 's':
+                sscanf(optarg,"%lf",&start_seconds);
+                break;
+            case 'x':
+                sscanf(optarg,"%lf",&speed);
+                break;
+            case 'B':
+                sscanf(optarg,"%d",&batch_size);
+                break;
+        }
+    }
+    if (optind != argc-1 || ip_address[0] == '\0' || batch_size < 1 || batch_size > MAX_SEND_BATCH) {
+        fprintf(stderr,"Usage: roach2_replay -d ip:port [-x speed] [-s start_seconds] [-n packets] [-l loops] [-B batch] file\n");
+        return EXIT_FAILURE;
+    }
+
+    packet_recording_t* recording = packet_recording_open(argv[optind], log);
+    if (recording == NULL) {
+        return EXIT_FAILURE;
+    }
+    if (recording->npackets == 0) {
+        multilog(log,LOG_ERR,"No packets in %s\n",argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t first_arrival_ns = packet_recording_get(recording, 0)->arrival_ns;
+    const uint64_t first = packet_recording_find_time(recording, first_arrival_ns + (uint64_t)(start_seconds*1e9));
+    uint64_t last = recording->npackets;
+    if (packets_to_send > 0 && first + packets_to_send < last) {
+        last = first + packets_to_send;
+    }
+    if (first >= last) {
+        multilog(log,LOG_ERR,"Nothing to send after %lf seconds\n",start_seconds);
+        return EXIT_FAILURE;
+    }
+    multilog(log,LOG_INFO,"Replaying packets %"PRIu64" to %"PRIu64" of %s (%s) to %s:%d at %.3lf x, %d time(s)\n",
+            first,last,argv[optind],recording->header->source,ip_address,portnum,speed,loops);
+
+    struct sockaddr_in destination;
+    memset(&destination,0,sizeof(destination));
+    destination.sin_family = AF_INET;
+    destination.sin_addr.s_addr = inet_addr(ip_address);
+    destination.sin_port = htons(portnum);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int sndbuf = 32 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, (socklen_t)sizeof(int));
+    if (connect(sock, (struct sockaddr*)&destination, sizeof(destination)) != 0) {
+        multilog(log,LOG_ERR,"Could not connect to %s:%d ERRNO=%d %s\n",ip_address,portnum,errno,strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct mmsghdr* msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    struct iovec* iovecs = calloc(batch_size, sizeof(struct iovec));
+    for (int i = 0; i < batch_size; ++i) {
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const uint64_t start_ns = packet_recording_get(recording, first)->arrival_ns;
+    const uint64_t end_ns = packet_recording_get(recording, last-1)->arrival_ns;
+    // each loop starts one average packet spacing after the last one ended.
+    const uint64_t loop_ns = end_ns - start_ns + (last - first > 1 ? (end_ns - start_ns)/(last - first - 1) : 0);
+    uint64_t sent = 0, truncated = 0;
+    int nbatch = 0;
+    const double start = now();
+
+    for (int loop = 0; loop < loops; ++loop) {
+        for (uint64_t i = first; i < last; ++i) {
+            const packet_record_t* record = packet_recording_get(recording, i);
+            if (speed > 0) {
+                const double due = start + (loop*loop_ns + record->arrival_ns - start_ns)*1e-9/speed;
+                if (due > now() + SEND_AHEAD) {
+                    // send what is already due before waiting for this one.
+                    if (nbatch > 0 && send_batch(sock, msgs, nbatch, log) != 0) {
+                        return EXIT_FAILURE;
+                    }
+                    nbatch = 0;
+                    sleep_until(due - SEND_AHEAD);
+                }
+            }
+            if (record->captured < record->length) {
+                ++truncated;
+            }
+            iovecs[nbatch].iov_base = (void*)(record + 1);
+            iovecs[nbatch].iov_len = record->captured;
+            ++nbatch;
+            ++sent;
+            if (nbatch == batch_size) {
+                if (send_batch(sock, msgs, nbatch, log) != 0) {
+                    return EXIT_FAILURE;
+                }
+                nbatch = 0;
+            }
+        }
+    }
+    if (nbatch > 0 && send_batch(sock, msgs, nbatch, log) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    const double elapsed = now() - start;
+    multilog(log,LOG_INFO,"Sent %"PRIu64" packets in %.3lf s (%.0lf packets/s), %"PRIu64" were truncated in the recording\n",
+            sent,elapsed,sent/elapsed,truncated);
+
+    free(msgs);
+    free(iovecs);
+    packet_recording_close(recording);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,510 @@
+/*
+ * Software stand-in for the ROACH2: sends ROACH2-format SPEAD packets to one or more UDP
+ * destinations, so that roach2_udpdb can be load tested without the FPGA.
+ *
+ * Packets have the same header as the firmware (see encode_roach2_spead_header) and the
+ * frames_per_heap and data size of the chosen band_select. The frame counter free-runs for
+ * -z seconds and is then reset to zero, as if the 1PPS had arrived after arming. For each
+ * packet time one packet is sent to every destination, with the same frame counter, like the
+ * two halves of the band from the real board.
+ *
+ * The rate is given relative to the real packet rate of the band_select, so -r 1 is line rate,
+ * -r 2 is twice it and -r 0 sends as fast as possible. Packets are sent with sendmmsg in
+ * batches of -B and paced against CLOCK_MONOTONIC between batches.
+ *
+ * Loss, reordering and duplicates can be injected at random: -L drops a fraction of packets,
+ * -R holds back a fraction and sends each one up to -D packet times late, and -U sends a
+ * fraction twice.
+ *
+ * The data are 8-bit complex gaussian noise of rms -a, laid out as channel, polarisation,
+ * real/imaginary. With -S pulsar a dispersed pulse of period -P and width -W seconds is
+ * added by raising the rms by a factor -G during the pulse, delayed in each channel for a
+ * dispersion measure -M, with channels of -C MHz starting from the centre frequency -F of the
+ * first destination. Further destinations continue the band.
+ *
+ * Usage: roach2_spead_gen -d ip:port [-d ip:port ...] [options]
+ */
+#define _GNU_SOURCE // for sendmmsg
+#include "decode_spead.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define SECONDS_PER_FRAME 0.0625e-6
+#define MAX_STREAMS 8
+#define MAX_SEND_BATCH 1024
+#define MAX_REORDER_DEPTH 1024 // packet times
+#define PACKET_BUFFER_SIZE 4500
+#define SPEAD_HEADER_SIZE 64
+// packets of noise made in advance. Each packet sent starts from a random one.
+#define NOISE_POOL_PACKETS 1024
+#define DISPERSION_CONSTANT 4.148808e3 // s MHz^2 cm^3 / pc
+
+typedef enum signal_t {
+    SIGNAL_NOISE,
+    SIGNAL_PULSAR
+} signal_t;
+
+typedef struct generator_t {
+    uint64_t band_select;
+    uint64_t frames_per_heap;
+    uint64_t data_size;
+    uint64_t bytes_per_frame;
+    uint64_t nchan;
+
+    int nstreams;
+    struct sockaddr_in destinations[MAX_STREAMS];
+
+    double loss_fraction;
+    double reorder_fraction;
+    int reorder_depth;
+    double duplicate_fraction;
+
+    signal_t signal;
+    double rms;
+    double period; // seconds
+    double width; // seconds
+    double dm;
+    double pulse_gain;
+    double centre_frequency; // MHz, of the first stream
+    double channel_bandwidth; // MHz, negative for a lower sideband
+    double* channel_delay; // [nstreams][nchan] seconds after the highest frequency
+
+    int8_t* noise_pool; // NOISE_POOL_PACKETS packets of noise
+    uint64_t random_state;
+} generator_t;
+
+// packets waiting for the next sendmmsg call.
+typedef struct send_batch_t {
+    unsigned char* buffers;
+    struct mmsghdr* msgs;
+    struct iovec* iovecs;
+    int n;
+    uint64_t packet_size;
+} send_batch_t;
+
+// a packet held back to be sent late.
+typedef struct held_packet_t {
+    int stream;
+    int countdown; // packet times still to go before this one is sent
+    unsigned char buffer[PACKET_BUFFER_SIZE];
+} held_packet_t;
+
+
+// xorshift64*
+static uint64_t next_random(generator_t* gen) {
+    gen->random_state ^= gen->random_state >> 12;
+    gen->random_state ^= gen->random_state << 25;
+    gen->random_state ^= gen->random_state >> 27;
+    return gen->random_state * 0x2545F4914F6CDD1DULL;
+}
+
+
+static double next_uniform(generator_t* gen) {
+    return (next_random(gen) >> 11) / 9007199254740992.0;
+}
+
+
+static int8_t clip(double value) {
+    value = round(value);
+    if (value > 127.0) value = 127.0;
+    if (value < -128.0) value = -128.0;
+    return (int8_t)value;
+}
+
+
+static void make_noise_pool(generator_t* gen) {
+    const uint64_t nsamples = NOISE_POOL_PACKETS*gen->data_size;
+    gen->noise_pool = malloc(nsamples);
+    for (uint64_t i = 0; i < nsamples; ++i) {
+        // Box-Muller, throwing away the second value.
+        const double u1 = ((next_random(gen) >> 11) + 1.0) / 9007199254740993.0;
+        const double u2 = next_uniform(gen);
+        gen->noise_pool[i] = clip(gen->rms * sqrt(-2.0*log(u1)) * cos(2.0*M_PI*u2));
+    }
+}
+
+
+static void make_channel_delays(generator_t* gen) {
+    const uint64_t total_channels = gen->nstreams*gen->nchan;
+    gen->channel_delay = malloc(total_channels*sizeof(double));
+    double highest = -1;
+    double* frequency = malloc(total_channels*sizeof(double));
+    for (uint64_t c = 0; c < total_channels; ++c) {
+        // channel c of a stream centred on centre_frequency, then the following streams.
+        const double first = gen->centre_frequency - gen->channel_bandwidth*(gen->nchan/2.0 - 0.5);
+        frequency[c] = first + c*gen->channel_bandwidth;
+        if (frequency[c] > highest) highest = frequency[c];
+    }
+    for (uint64_t c = 0; c < total_channels; ++c) {
+        gen->channel_delay[c] = DISPERSION_CONSTANT * gen->dm * (1.0/(frequency[c]*frequency[c]) - 1.0/(highest*highest));
+    }
+    free(frequency);
+}
+
+
+/*
+ * Fill the data of one packet starting at absolute frame number frame (counting from the
+ * start, not the frame counter, so the pulse continues smoothly across the 1PPS reset).
+ */
+static void make_packet_data(generator_t* gen, int stream, uint64_t frame, int8_t* data) {
+    const int8_t* noise = gen->noise_pool + (next_random(gen) % NOISE_POOL_PACKETS)*gen->data_size;
+    memcpy(data, noise, gen->data_size);
+    if (gen->signal != SIGNAL_PULSAR) {
+        return;
+    }
+
+    const double t0 = frame * SECONDS_PER_FRAME;
+    for (uint64_t chan = 0; chan < gen->nchan; ++chan) {
+        // start of the pulse before the start of this packet, in frames relative to the packet.
+        double phase = fmod(t0 - gen->channel_delay[stream*gen->nchan + chan], gen->period);
+        if (phase < 0) phase += gen->period;
+        double start = -phase / SECONDS_PER_FRAME;
+        while (start < gen->frames_per_heap) {
+            const double end = start + gen->width / SECONDS_PER_FRAME;
+            const double first = start < 0 ? 0 : ceil(start);
+            const double last = end > gen->frames_per_heap ? gen->frames_per_heap : ceil(end);
+            for (uint64_t f = first; f < last; ++f) {
+                int8_t* sample = data + f*gen->bytes_per_frame + chan*4; // 2 pols x complex
+                for (int i = 0; i < 4; ++i) {
+                    sample[i] = clip(sample[i] * gen->pulse_gain);
+                }
+            }
+            start += gen->period / SECONDS_PER_FRAME;
+        }
+    }
+}
+
+
+// the buffer the next packet of the batch should be built in.
+static unsigned char* batch_slot(send_batch_t* batch) {
+    return batch->buffers + (size_t)batch->n*PACKET_BUFFER_SIZE;
+}
+
+
+// add the packet built in batch_slot to the batch.
+static void batch_commit(send_batch_t* batch, struct sockaddr_in* destination) {
+    struct mmsghdr* msg = batch->msgs + batch->n;
+    batch->iovecs[batch->n].iov_base = batch_slot(batch);
+    batch->iovecs[batch->n].iov_len = batch->packet_size;
+    msg->msg_hdr.msg_iov = batch->iovecs + batch->n;
+    msg->msg_hdr.msg_iovlen = 1;
+    msg->msg_hdr.msg_name = destination;
+    msg->msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    ++(batch->n);
+}
+
+
+static void batch_copy(send_batch_t* batch, const unsigned char* packet, struct sockaddr_in* destination) {
+    memcpy(batch_slot(batch), packet, batch->packet_size);
+    batch_commit(batch, destination);
+}
+
+
+static int parse_destination(const char* text, struct sockaddr_in* address) {
+    char ip[128];
+    int port;
+    if (sscanf(text, "%127[^:]:%d", ip, &port) != 2) {
+        return -1;
+    }
+    memset(address,0,sizeof(struct sockaddr_in));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &address->sin_addr) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+static void sleep_until(double when) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)when;
+    ts.tv_nsec = (long)((when - ts.tv_sec)*1e9);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+
+static void usage(void) {
+    fprintf(stderr,
+            "roach2_spead_gen -d ip:port [-d ip:port ...] [options]\n"
+            " -d ip:port  destination, up to %d (one packet to each per packet time)\n"
+            " -b n        band_select (default 0)\n"
+            " -r x        rate relative to line rate, 0 for as fast as possible (default 1)\n"
+            " -T s        seconds of data to send after the 1PPS reset, 0 for ever (default 10)\n"
+            " -z s        seconds of data before the 1PPS reset (default 1)\n"
+            " -B n        packets per sendmmsg call (default 64)\n"
+            " -L f        fraction of packets to lose\n"
+            " -R f        fraction of packets to send late\n"
+            " -D n        most packets a late packet is delayed by (default 8)\n"
+            " -U f        fraction of packets to duplicate\n"
+            " -S s        signal: noise or pulsar (default noise)\n"
+            " -a x        rms of the noise (default 20)\n"
+            " -P s        pulse period (default 0.1)\n"
+            " -W s        pulse width (default 0.005)\n"
+            " -G x        rms gain during the pulse (default 2)\n"
+            " -M dm       dispersion measure (default 50)\n"
+            " -F MHz      centre frequency of the first destination (default 1532)\n"
+            " -C MHz      channel bandwidth, negative for lower sideband (default -16)\n"
+            " -s n        random seed\n"
+            " -v          report progress every second\n",
+            MAX_STREAMS);
+}
+
+
+int main (int argc, char **argv)
+{
+    generator_t gen;
+    memset(&gen,0,sizeof(gen));
+    gen.reorder_depth = 8;
+    gen.signal = SIGNAL_NOISE;
+    gen.rms = 20;
+    gen.period = 0.1;
+    gen.width = 0.005;
+    gen.pulse_gain = 2;
+    gen.dm = 50;
+    gen.centre_frequency = 1532;
+    gen.channel_bandwidth = -16;
+    gen.random_state = 0x726f616368320002ULL;
+
+    double rate = 1.0;
+    double seconds = 10;
+    double seconds_before_reset = 1;
+    int batch_size = 64;
+    char verbose = 0;
+    char arg;
+
+    while ((arg = getopt(argc, argv, "a:b:d:r:s:vz:B:C:D:F:G:L:M:P:R:S:T:U:W:")) != -1) {
+        switch (arg) {
+            case 'a':
+                sscanf(optarg,"%lf",&gen.rms);
+                break;
+            case 'b':
+                sscanf(optarg,"%"SCNu64,&gen.band_select);
+                break;
+            case 'd':
+                if (gen.nstreams == MAX_STREAMS || parse_destination(optarg, &gen.destinations[gen.nstreams]) != 0) {
+                    fprintf(stderr,"Bad or too many destinations '%s'\n",optarg);
+                    return EXIT_FAILURE;
+                }
+                ++gen.nstreams;
+                break;
+            case 'r':
+                sscanf(optarg,"%lf",&rate);
+                break;
+            case 's':
+                sscanf(optarg,"%"SCNu64,&gen.random_state);
+                break;
+            case 'v':
+                verbose=1;
+                break;
+            case 'z':
+                sscanf(optarg,"%lf",&seconds_before_reset);
+                break;
+            case 'B':
+                sscanf(optarg,"%d",&batch_size);
+                break;
+            case 'C':
+                sscanf(optarg,"%lf",&gen.channel_bandwidth);
+                break;
+            case 'D':
+                sscanf(optarg,"%d",&gen.reorder_depth);
+                break;
+            case 'F':
+                sscanf(optarg,"%lf",&gen.centre_frequency);
+                break;
+            case 'G':
+                sscanf(optarg,"%lf",&gen.pulse_gain);
+                break;
+            case 'L':
+                sscanf(optarg,"%lf",&gen.loss_fraction);
+                break;
+            case 'M':
+                sscanf(optarg,"%lf",&gen.dm);
+                break;
+            case 'P':
+                sscanf(optarg,"%lf",&gen.period);
+                break;
+            case 'R':
+                sscanf(optarg,"%lf",&gen.reorder_fraction);
+                break;
+            case 'S':
+                if (strcmp(optarg,"noise") == 0) {
+                    gen.signal = SIGNAL_NOISE;
+                } else if (strcmp(optarg,"pulsar") == 0) {
+                    gen.signal = SIGNAL_PULSAR;
+                } else {
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                sscanf(optarg,"%lf",&seconds);
+                break;
+            case 'U':
+                sscanf(optarg,"%lf",&gen.duplicate_fraction);
+                break;
+            case 'W':
+                sscanf(optarg,"%lf",&gen.width);
+                break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (gen.nstreams == 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (band_select_to_frames_per_heap(gen.band_select) < 0) {
+        fprintf(stderr,"Unknown band_select %"PRIu64"\n",gen.band_select);
+        return EXIT_FAILURE;
+    }
+    if (batch_size > MAX_SEND_BATCH || gen.reorder_depth < 1 || gen.reorder_depth > MAX_REORDER_DEPTH) {
+        fprintf(stderr,"Batch size must be at most %d and reorder depth 1-%d\n",MAX_SEND_BATCH,MAX_REORDER_DEPTH);
+        return EXIT_FAILURE;
+    }
+
+    gen.frames_per_heap = band_select_to_frames_per_heap(gen.band_select);
+    gen.data_size = band_select_to_data_size(gen.band_select);
+    gen.bytes_per_frame = gen.data_size / gen.frames_per_heap;
+    gen.nchan = gen.bytes_per_frame / 4;
+    make_noise_pool(&gen);
+    make_channel_delays(&gen);
+
+    const double seconds_per_packet = gen.frames_per_heap * SECONDS_PER_FRAME;
+    const uint64_t packets_before_reset = seconds_before_reset / seconds_per_packet;
+    const uint64_t packets_to_send = seconds > 0 ? packets_before_reset + (uint64_t)(seconds / seconds_per_packet) : UINT64_MAX;
+    // the firmware counter is free-running before the reset, so do not start it at zero.
+    const uint64_t initial_frame_counter = (1ULL << 30) * gen.frames_per_heap;
+
+    fprintf(stderr,"Sending %d stream(s) of band_select=%"PRIu64" (%"PRIu64" frames, %"PRIu64" bytes per packet) at %.3lf x line rate (%.0lf packets/s per stream)\n",
+            gen.nstreams,gen.band_select,gen.frames_per_heap,gen.data_size,rate,rate/seconds_per_packet);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int sndbuf = 32 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, (socklen_t)sizeof(int));
+
+    send_batch_t batch;
+    batch.n = 0;
+    batch.packet_size = SPEAD_HEADER_SIZE + gen.data_size;
+    batch.buffers = malloc((size_t)batch_size*PACKET_BUFFER_SIZE);
+    batch.msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    batch.iovecs = calloc(batch_size, sizeof(struct iovec));
+
+    // a batch must have room for everything held back plus an original and a duplicate per stream.
+    const int max_held = batch_size - 2*gen.nstreams;
+    if (max_held < 1) {
+        fprintf(stderr,"Batch size must be more than %d for %d streams\n",2*gen.nstreams,gen.nstreams);
+        return EXIT_FAILURE;
+    }
+    held_packet_t* held = calloc(max_held, sizeof(held_packet_t));
+    int nheld = 0;
+
+    uint64_t packet_time = 0; // packet times sent so far
+    uint64_t sent = 0, lost = 0, late = 0, duplicated = 0;
+    const double start = now();
+    double next_report = start + 1;
+
+    while (packet_time < packets_to_send || nheld > 0) {
+        while (batch.n + 2*gen.nstreams + nheld <= batch_size && (packet_time < packets_to_send || nheld > 0)) {
+            // anything held back long enough goes first.
+            for (int h = 0; h < nheld; ) {
+                if (held[h].countdown-- <= 0 || packet_time >= packets_to_send) {
+                    batch_copy(&batch, held[h].buffer, &gen.destinations[held[h].stream]);
+                    held[h] = held[--nheld];
+                } else {
+                    ++h;
+                }
+            }
+            if (packet_time >= packets_to_send) {
+                break;
+            }
+
+            const uint64_t frame = packet_time * gen.frames_per_heap;
+            const uint64_t frame_counter = packet_time < packets_before_reset ?
+                initial_frame_counter + frame : (packet_time - packets_before_reset) * gen.frames_per_heap;
+            for (int stream = 0; stream < gen.nstreams; ++stream) {
+                if (gen.loss_fraction > 0 && next_uniform(&gen) < gen.loss_fraction) {
+                    ++lost;
+                    continue;
+                }
+                unsigned char* packet = batch_slot(&batch);
+                encode_roach2_spead_header(packet, gen.data_size, frame_counter, gen.band_select);
+                make_packet_data(&gen, stream, frame, (int8_t*)packet + SPEAD_HEADER_SIZE);
+                if (gen.reorder_fraction > 0 && nheld < max_held && next_uniform(&gen) < gen.reorder_fraction) {
+                    held[nheld].stream = stream;
+                    held[nheld].countdown = 1 + next_random(&gen) % gen.reorder_depth;
+                    memcpy(held[nheld].buffer, packet, batch.packet_size);
+                    ++nheld;
+                    ++late;
+                    continue;
+                }
+                batch_commit(&batch, &gen.destinations[stream]);
+                if (gen.duplicate_fraction > 0 && next_uniform(&gen) < gen.duplicate_fraction) {
+                    batch_copy(&batch, packet, &gen.destinations[stream]);
+                    ++duplicated;
+                }
+            }
+            ++packet_time;
+        }
+
+        if (batch.n == 0) {
+            continue;
+        }
+        if (rate > 0) {
+            // pace against when the last packet time of this batch is due.
+            sleep_until(start + packet_time * seconds_per_packet / rate);
+        }
+        int offset = 0;
+        while (offset < batch.n) {
+            int retval = sendmmsg(sock, batch.msgs + offset, batch.n - offset, 0);
+            if (retval == -1) {
+                if (errno == ENOBUFS || errno == EAGAIN) {
+                    continue;
+                }
+                fprintf(stderr,"error sending packets ERRNO=%d %s\n",errno,strerror(errno));
+                return EXIT_FAILURE;
+            }
+            offset += retval;
+        }
+        sent += batch.n;
+        batch.n = 0;
+
+        if (verbose && now() > next_report) {
+            const double elapsed = now() - start;
+            fprintf(stderr,"%.1lf s: sent %"PRIu64" packets, %.3lf x line rate\n",
+                    elapsed,sent,packet_time*seconds_per_packet/elapsed);
+            next_report += 1;
+        }
+    }
+
+    const double elapsed = now() - start;
+    fprintf(stderr,"Sent %"PRIu64" packets in %.3lf s (%.0lf packets/s, %.3lf Gb/s, %.3lf x line rate). lost: %"PRIu64" late: %"PRIu64" duplicated: %"PRIu64"\n",
+            sent,elapsed,sent/elapsed,sent*batch.packet_size*8e-9/elapsed,packet_time*seconds_per_packet/elapsed,lost,late,duplicated);
+
+    free(batch.buffers);
+    free(batch.msgs);
+    free(batch.iovecs);
+    free(held);
+    free(gen.noise_pool);
+    free(gen.channel_delay);
+    return EXIT_SUCCESS;
+}
@@ -9,6 +9,13 @@
  *
  * The code uses a separate thread to read from the socket and fill an internal ring-buffer
  * and the main thread copies from the internal ring buffer into a psrdada buffer.
+ * The ring holds 16000 packets by default; use -N <n> to change this and -L to back it with hugepages.
+ * If the ring is full the socket thread drops the new packet and counts an overrun.
+ *
+ * The ring and the other large buffers are locked and faulted in at startup. -L backs them with
+ * 2 MB hugepages, or -E 2M|1G with hugepages of that size. -A <node> puts them, and the pages of
+ * the DADA buffer, on that NUMA node; -A auto uses the node of the NIC that the stream arrives on
+ * (from the capture interface, or the interface with the listening address).
  *
  * The code uses the frame_counter in the SPEAD packet to keep track of where each data packet
  * should be stored.
@@ -21,6 +28,98 @@
  * To avoid packet drops, make sure to set
  * sysctl -w net.core.rmem_max=26214400
  *
+ * At high packet rates the socket thread can use recvmmsg to read several packets per system call.
+ * Use -B <n> to set the batch size and -W <us> to set how long to wait to fill a batch.
+ *
+ * With -q core,core[,...] there is one socket thread, each with its own socket and ring, on each
+ * of the given cores (instead of the -c core). The sockets share the port with SO_REUSEPORT, and
+ * the kernel hands each of them runs of 8192 frames in turn, chosen from the frame counter, since
+ * a single UDP flow cannot be spread over several NIC queues by RSS. The main thread merges the
+ * rings back into frame counter order. With -S, give -q once for each stream, in the same order.
+ * Not with -D or -i.
+ *
+ * Alternatively, -i <interface> captures from an AF_PACKET TPACKET_V3 memory-mapped ring on that
+ * interface. In this mode there is no socket thread or internal ring-buffer; the main thread
+ * decodes packets in place in the kernel's ring and copies them straight into the psrdada buffer.
+ *
+ * With -D the internal ring-buffer is skipped altogether. A single thread, pinned to the -c core,
+ * opens each psrdada block with ipcio_open_block_write and uses recvmsg with two iovecs, so the
+ * SPEAD header goes to a scratch buffer and the data lands directly in its slot in the block.
+ *
+ * Packets that never arrive are replaced with fill data chosen by -P zeros|noise|last (default noise,
+ * with the statistics of each channel measured from the data before the 1PPS). With -m <dir> a mask
+ * of which packets in each block were filled is written to <dir>/<UTC_START>_<key>.mask, and its
+ * name is put in the header as MISSING_MASK_FILE. See missing_mask.h for the format.
+ *
+ * Packets that arrive out of sequence are held in a reorder window of -R <n> packets (default 64)
+ * until the ones before them turn up, and a gap is only filled once a packet arrives that does not
+ * fit in the window. -R 1 writes packets strictly in order as they arrive.
+ *
+ * If the reader of the DADA buffer falls behind, ipcio would make the capture wait for a clear
+ * block, and the packet rings would overrun. With -o size_mb[:dir] each block is instead put aside
+ * in a spill of that size, in memory or in a file in dir (on a fast local disk), whenever the DADA
+ * buffer has no clear block, and written into it in order as space frees up. If the spill fills
+ * too, whole blocks are dropped and written as zeros, so everything after them keeps its time;
+ * each run of dropped blocks is logged and counted in the statistics. See spill.h.
+ *
+ * Progress is published to a shared memory segment per stream, /dev/shm/roach2_udpdb_<key>, which
+ * can be read at any rate with libudpdb_stats.so (see udpdb_stats.h). The old text lines are still
+ * written to the -M monitor pipe if one is given.
+ *
+ * With -U sw|hw the kernel timestamps each packet as it arrives, in software or in the NIC (see
+ * packet_timing.h). The start time is then taken from when the frame counter reset packet arrived,
+ * rather than when the capture thread got to it, and histograms of the time from the NIC to the
+ * ring, from the ring to the DADA block and between packets are published with the statistics.
+ *
+ * Several streams (e.g. the two halves of the band) can be captured by one process by giving
+ * -S ip:port:key:freq[:core[:interface]] once per stream. Each stream has its own receive path,
+ * capture thread and DADA buffer, and they all start on the same frame with the same UTC_START.
+ * Without -S there is a single stream set by -I, -p, -k, -f and -c.
+ *
+ * With -O dir[,dir...] there is no DADA buffer: each stream writes DADA files directly to those
+ * directories, -Y blocks of -Z bytes per file, spread across the directories in turn so that
+ * several disks can be written at once. See dada_disk.h. The -k key then only labels the files.
+ *
+ * Data normally go out in the order they arrive, TFP. With -X TFP|FTP[,reverse][,swap] each block
+ * is reordered on its way out, so that downstream software does not each have to do it; the ORDER,
+ * BW and RESOLUTION header keys describe the result. See corner_turn.h.
+ *
+ * With -Q 4|2[:window_blocks] the 8-bit samples are requantised to 4 or 2 bits, scaled for each
+ * channel and polarisation by the mean and rms over the last few blocks (default 8), and NBIT is
+ * set to match. Each DADA block then holds 8/nbit times as many packets. If -m is given the
+ * scaling of every block is written to <dir>/<UTC_START>_<key>.scales, named in the header as
+ * REQUANT_SCALES_FILE. See requantise.h.
+ *
+ * With -K m[:nsigma][:zero|replace] RFI is excised by spectral kurtosis over windows of m samples
+ * (see spectral_kurtosis.h) before any requantisation or reordering; the SK_ header keys record
+ * the settings. The fraction of windows flagged is published with the statistics, and if -m is
+ * given the flags of every window are written to <dir>/<UTC_START>_<key>.sk, named in the header
+ * as SK_FLAGS_FILE.
+ *
+ * With -G key:navg[:I|IQUV[:32|8[:core]]] a detected filterbank, total intensity or full Stokes
+ * averaged over navg samples, is also written to a second DADA key by a thread of its own on the
+ * given core. It is fed from the blocks on their way out, after any spectral kurtosis excision
+ * but before reordering or requantisation, and drops blocks rather than hold up the baseband data
+ * if it cannot keep up. With -S, give -G once for each stream, in the same order. See filterbank.h.
+ *
+ * With -J capture_core:transform_core:write_core[:blocks] the work on each block is spread over
+ * a pipeline of threads (see pipeline.h): the capture thread, on the first core, only puts packets
+ * in order into a pool of blocks (default 8); a transform stage does the spectral kurtosis and
+ * feeds the filterbank; and a write stage reorders, requantises and copies into the DADA buffer.
+ * The time each stage is busy and idle, and the depth of its queue, are published with the
+ * statistics. With -S, give -J once for each stream, in the same order.
+ *
+ * When excising, filtering, reordering or requantising, packets are gathered in a separate block (with -D,
+ * received straight into it), and the copy into the DADA block takes the place of the copy that
+ * -D avoids.
+ *
+ * Commands can be written to the -C control pipe one per line: START, STOP, ABORT, STATUS and
+ * QUIT (see control.h). With -d the process runs as a daemon: it stays connected to the DADA
+ * buffers and keeps decoding packets and noting frame counter resets between observations, and
+ * each observation is begun by a START, whose KEY=VALUE parameters are added to the header and
+ * whose DURATION replaces -T. Once the time of the reset is known, an observation starts with
+ * the next packet rather than waiting for the next 1PPS, and its PICOSECONDS are set.
+ *
  */
 
 
@@ -28,7 +127,23 @@
 #define _GNU_SOURCE
 
 #include "decode_spead.h"
+#include "packet_mmap.h"
+#include "numa_memory.h"
+#include "packet_ring.h"
+#include "packet_timing.h"
+#include "packet_fill.h"
+#include "missing_mask.h"
+#include "reorder_window.h"
+#include "udpdb_stats.h"
 #include "default_header.h"
+#include "dada_disk.h"
+#include "corner_turn.h"
+#include "requantise.h"
+#include "spectral_kurtosis.h"
+#include "filterbank.h"
+#include "pipeline.h"
+#include "control.h"
+#include "spill.h"
 
 // standard libraries
 #include <stdlib.h>
@@ -48,9 +163,12 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/filter.h>
 
 // time
 #include <sys/time.h>
+#include <time.h>
 
 // psrdada buffers
 #include <dada_hdu.h>
@@ -62,6 +180,7 @@
 
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
+#define MIN(a,b) (((a)<(b))?(a):(b))
 
 
 #define STRLEN 1024
@@ -69,35 +188,251 @@
 
 // max size of packets that can be read.
 #define PACKET_BUFFER_SIZE 4500
-// number of packets in the internal buffer.
+// default number of packets in the internal buffer.
 #define NUM_PACKET_BUFFERS 16000
+// largest number of packets that can be requested in one recvmmsg call.
+#define MAX_RECV_BATCH 1024
+
+// largest number of UDP streams that can be captured by one process.
+#define MAX_STREAMS 8
+// largest number of receive sockets and threads for one stream.
+#define MAX_RECEIVERS 8
+// with several receive sockets, each is sent runs of 2^RECEIVE_RUN_SHIFT frames (512 us).
+#define RECEIVE_RUN_SHIFT 13
+// byte of the UDP payload where the low 32 bits of the frame counter are, in the firmware's SPEAD layout.
+#define FRAME_COUNTER_LOW_WORD_OFFSET 44
+// spin this many times waiting for any of several rings before sleeping, or for the ring that
+// should have the next packet before taking one from another.
+#define MERGE_SPINS 2000
+#define MERGE_SLEEP_NS 20000
+
+// the frame counter ticks every 0.0625 microseconds.
+#define FRAMES_PER_SECOND 16000000
+#define PICOSECONDS_PER_FRAME 62500
+// seconds to wait for the capture threads to finish after a QUIT.
+#define QUIT_TIMEOUT 5
+
+// Parameters of the observation shared by all streams, and what they need to agree on a start.
+typedef struct observation_t {
+    char* header_file; // header template file, or NULL to use the default header.
+    char source_name[STRLEN];
+    char telescope_id[STRLEN];
+    char receiver_name[STRLEN];
+    char receiver_basis[STRLEN];
+    double bandwidth;
+    double requested_integration_time; // seconds.
+    char force_start_without_1pps;
+    char daemon; // stay up between observations, which are started and stopped by control commands.
+    control_t control;
+    atomic_int running_streams; // capture threads that have not finished.
+
+    int nstreams;
+    pthread_mutex_t start_mutex;
+    pthread_barrier_t start_barrier; // every stream waits here once it has found its start packet.
+    // what the streams bring to the barrier, under start_mutex.
+    uint64_t latest_frame_counter;
+    int streams_abandoning;
+    int streams_without_reset;
+    int64_t earliest_arrival_ns; // kernel arrival time of the first start packet, 0 if unknown
+    // what they agree on.
+    uint64_t start_frame_counter; // first frame written by every stream.
+    char start_abandoned;
+    struct timeval start_time; // time at which the streams started.
+    time_t utc_start;
+    uint64_t start_picoseconds;
+    double start_fractional_second; // of start_time from utc_start, when starting on a reset.
+    char start_from_known_reset;
+    // when the frame counter was last reset, if we know. Under start_mutex.
+    char reset_seen;
+    time_t reset_time;
+} observation_t;
+
+struct local_context_t;
+
+// A socket thread with its own socket and ring. There is one per stream, unless -q gives more.
+typedef struct receiver_t {
+    struct local_context_t* context;
+    int index;
+    int core; // CPU core the thread is bound to.
+    int sock;
+    packet_ring_t* ring;
+    packet_timing_t* timing; // latency and gaps of the packets this thread receives, NULL without timestamps.
+    clockid_t thread_clock; // CPU time clock of the thread.
+    char have_thread_clock;
+    uint64_t overruns_seen; // ring overruns already added to number_of_overruns.
+    // when merging several rings, the next packet from this one, owned by the capture thread.
+    unsigned char* pending;
+    uint64_t pending_slot;
+    uint64_t pending_frame_counter;
+} receiver_t;
 
 typedef struct local_context_t {
     multilog_t* log; // psrdada thread-safe logger
+    char label[STRLEN]; // identifies this stream in log messages.
+    int stream_index; // position of this stream on the command line, reported in the monitor line.
     char ip_address[128]; // local IP address to listen on
     int portnum; // port to listen on
     int socket_listen_cpu_core; // CPU core on which to listen for packets.
-    atomic_int_fast64_t buffer_write_position; // number of packets recieved.
-    int_fast64_t buffer_read_position; // number of packets read.
-    int number_of_overruns; // times that we have overrun the internal buffer
-    unsigned char* buffer; // the internal buffer will be length PACKET_BUFFER_SIZE*NUM_PACKET_BUFFERS
+    int nreceivers; // socket threads, each with its own socket and ring.
+    receiver_t receivers[MAX_RECEIVERS];
+    uint64_t last_merged_frame_counter; // frame counter of the packet last taken from the merged rings.
+    uint64_t merge_frame_increment; // frames per packet, as seen whilst merging.
+    spead_layout_t merge_layout; // for reading frame counters whilst merging, so as not to upset spead_layout's counts.
+    char steered; // the receivers are sent runs of frames in turn, see steer_receive_sockets.
+    int recv_batch_size; // packets per recvmmsg call. 1 means use plain recv().
+    int recv_batch_timeout; // microseconds recvmmsg may wait to fill a batch. 0 means return whatever is ready.
+    atomic_int_fast64_t packets_received; // number of packets recieved.
+    int number_of_overruns; // packets lost because the internal buffer was full
+    uint64_t ring_slots; // number of packets in the internal ring buffer of each socket thread.
+    memory_policy_t memory; // NUMA node and hugepages for the packet ring and other buffers.
+    char numa_auto; // put them on the node of the NIC the stream arrives on.
+    unsigned char* buffer; // single packet buffer used before the 1PPS in direct placement mode.
+    char capture_interface[IF_NAMESIZE]; // if set, capture from a packet mmap ring on this interface.
+    packet_mmap_t* mmap_ring; // packet mmap ring used instead of the socket thread and internal buffer.
+    uint64_t mmap_ring_drops_seen; // kernel drops already added to number_of_overruns.
+    unsigned char* last_packet_buffer; // most recent packet returned by get_next_packet_buffer.
+    char direct_placement; // if set, receive packet data directly into the psrdada blocks.
+    int sock; // socket used by the capture thread in direct placement mode.
+    spead_layout_t spead_layout; // SPEAD item layout learnt from the first packet.
+    fill_policy_t fill_policy; // what to write in place of missing packets.
+    packet_fill_t* fill;
+    char mask_directory[STRLEN]; // if set, write a mask of missing packets to this directory.
+    missing_mask_t* mask;
+    uint64_t reorder_depth; // packets that can be held waiting for a late packet.
+    reorder_window_t* reorder_window;
+    timestamp_source_t timestamp_source; // if set, ask for kernel receive timestamps of this kind.
+    packet_timing_t* timing; // latency histograms, NULL without timestamps.
+    int64_t last_arrival_ns; // arrival time of the packet last returned by get_next_packet_buffer, 0 if unknown.
+    int64_t pps_arrival_ns; // arrival time of the last frame counter reset packet.
+    int64_t pps_offset_ns; // and its offset from the nearest second.
+
+    // output
+    key_t dada_key; // dada ringbuffer key
+    double centre_frequency; // MHz
+    dada_hdu_t* hdu;
+    char hdu_locked;
+    char disk_roots[STRLEN]; // if set, write DADA files to these directories instead of to the DADA buffer.
+    uint64_t disk_block_size;
+    uint64_t disk_blocks_per_file;
+    dada_disk_t* disk;
+    uint64_t spill_bytes; // if set, size of the spill for when the DADA buffer is full.
+    char spill_dir[STRLEN]; // directory for the spill file, or empty to keep it in memory.
+    spill_t* spill;
+    char reorder; // if set, reorder each block as set by reorder_config before it is written.
+    corner_turn_config_t reorder_config;
+    corner_turn_t* corner_turn;
+    int requantise_nbit; // if set, requantise to this many bits before the data are written.
+    uint64_t requantise_window;
+    requantise_t* requantise;
+    char spectral_kurtosis_set; // if set, excise RFI as set by spectral_kurtosis_config before anything else.
+    spectral_kurtosis_config_t spectral_kurtosis_config;
+    spectral_kurtosis_t* spectral_kurtosis;
+    char filterbank_set; // if set, also write a detected filterbank as set by filterbank_config.
+    filterbank_config_t filterbank_config;
+    filterbank_t* filterbank;
+    uint64_t filterbank_blocks; // blocks handed to the filterbank, and those it had to drop.
+    uint64_t filterbank_dropped_blocks;
+    char pipeline_set; // if set, blocks are excised and written by pipeline stages on cores of their own.
+    int pipeline_cores[3]; // capture thread, transform stage and write stage
+    uint64_t pipeline_blocks;
+    pipeline_t* pipeline;
+    pipeline_block_t* pipeline_block; // block the capture thread is filling
+    // copies of the pipeline statistics, which outlive the pipeline.
+    int pipeline_nstages;
+    int64_t pipeline_source_waits;
+    int64_t pipeline_source_wait_ns;
+    udpdb_stats_stage_t pipeline_stages[UDPDB_STATS_MAX_STAGES];
+    char* stage; // block that packets are gathered in when excising, reordering or requantising.
+    uint64_t stage_size; // non-zero if data go through stage blocks
+    uint64_t stage_fill; // bytes in stage
+    char* stage_scratch; // reordered block when requantising as well.
+    size_t stage_map_size;
+    size_t stage_scratch_map_size;
+    char* header_buf; // header block being filled in for this observation.
+    uint64_t header_size;
+    uint64_t dada_block_size;
+    int monitor_fd;
+    observation_t* observation;
+    int result; // exit status of the capture thread.
+    atomic_int finished; // set by the capture thread as it exits.
+    // control commands already acted on, see control.h.
+    unsigned starts_seen;
+    unsigned stops_seen;
+    unsigned aborts_seen;
+    unsigned statuses_seen;
+    int64_t observations; // completed by this stream.
 
     // monitor variables
     int64_t packet_count; int64_t dropped_packets;
     int64_t block_count; int64_t packets_to_read; double seconds_per_packet;
     int64_t buffer_lag; int64_t max_buffer_lag; int64_t recent_buffer_lag;
+    atomic_int_fast64_t receive_syscalls; // number of recv/recvmmsg calls that returned packets into the ring.
+    int64_t reordered_packets; // packets that arrived out of sequence but were put in the right place.
+    int64_t late_packets; // packets that arrived too late to be used.
+    int64_t duplicate_packets;
+    int64_t lag_histogram[UDPDB_STATS_LAG_BINS]; // number of packets read at each lag, see udpdb_stats.h
+    udpdb_stats_segment_t* stats; // shared memory statistics, NULL if they could not be set up.
+    uint64_t stats_updates;
 } local_context_t;
 
-void *socket_receive_thread(void* thread_context);
+int parse_stream(const char* spec, local_context_t* context);
+int parse_cores(const char* spec, receiver_t* receivers);
+void find_numa_node(local_context_t* context);
+int open_dada_output(local_context_t* context);
+int fill_dada_header(local_context_t* context);
+int start_receiving(local_context_t* context);
+void *capture_thread(void* thread_context);
+int wait_for_start_command(local_context_t* local_context);
+int begin_dada_header(local_context_t* context, double* integration_time);
+int observe(local_context_t* local_context);
+void free_stage_blocks(local_context_t* local_context);
+int synchronise_start(local_context_t* context, uint64_t frame_counter, char reset_known, char abandon);
+void set_start_time(observation_t* observation, char reset_known);
+void note_frame_counter_reset(local_context_t* context);
+void note_pps_arrival(local_context_t* context);
+struct timeval arrival_or_now(int64_t arrival_ns);
+int open_receive_socket(local_context_t* context, packet_timing_t* timing);
+int steer_receive_sockets(int sock, int nsockets, multilog_t* log);
+void check_steering(local_context_t* local_context);
+void *socket_receive_thread(void* thread_receiver);
+void receive_batched(int sock, receiver_t* receiver);
+void time_received_packet(receiver_t* receiver, struct msghdr* message, int64_t now_ns, uint64_t position, char in_ring);
 unsigned char* get_next_packet_buffer(local_context_t* local_context);
-unsigned char* get_random_packet_buffer(local_context_t* local_context);
+unsigned char* get_next_packet_merged(local_context_t* local_context);
+void note_buffer_lag(local_context_t* local_context, uint64_t lag);
+void note_ring_overruns(local_context_t* local_context, receiver_t* receiver);
+unsigned char* get_next_packet_mmap(local_context_t* local_context);
+unsigned char* get_next_packet_direct(local_context_t* local_context);
+void time_direct_packet(local_context_t* local_context, struct msghdr* message);
 
 
-char* monitor_string; // Global seems the best way :(
 void monitor(int monitor_fd, char* state,local_context_t* context);
+void publish_stats(char* state, local_context_t* context);
+void update_pipeline_stats(local_context_t* context);
+
+void write_packet(local_context_t* local_context, char* data, uint64_t data_size);
+void output_write(void* context, const char* data, uint64_t bytes);
+char* output_open_block(local_context_t* local_context);
+void output_close_block(local_context_t* local_context, uint64_t bytes);
+void output_flush(local_context_t* local_context);
+char* destination_open_block(local_context_t* local_context);
+void destination_close_block(local_context_t* local_context, uint64_t bytes);
+void transform_block(local_context_t* local_context, char* block, uint64_t bytes);
+void write_block(local_context_t* local_context, const char* block, uint64_t bytes);
+void transform_stage(void* context, pipeline_block_t* block);
+void write_stage(void* context, pipeline_block_t* block);
+void drain_reorder_window(local_context_t* local_context, uint64_t* expected_frame_counter,
+        uint64_t frame_increment, uint64_t data_size);
+void advance_reorder_window(local_context_t* local_context, uint64_t* expected_frame_counter,
+        uint64_t frame_counter, uint64_t frame_increment, uint64_t data_size);
+
+int direct_capture(local_context_t* local_context, int monitor_fd,
+        char* first_data_pointer, uint64_t first_frame_counter, uint64_t start_frame_counter,
+        uint64_t header_length, uint64_t data_size,
+        uint64_t frame_increment, uint64_t packets_per_block, uint64_t blocks_to_read);
+void finish_direct_block(local_context_t* local_context, int monitor_fd, char* block, char* slot_filled,
+        uint64_t nslots, uint64_t packets_per_block, uint64_t data_size);
 
-int band_select_to_frames_per_heap(uint64_t band_select);
-int band_select_to_data_size(uint64_t band_select);
 
 //******
 //
@@ -110,74 +445,166 @@ int band_select_to_data_size(uint64_t band_select);
 int main (int argc, char **argv)
 {
 
-    // dada ringbuffer key
-    key_t dada_key = DADA_DEFAULT_BLOCK_KEY;
-
-    // header parameter stuff
-    char* header_file = 0;
-    char* source_name = malloc(STRLEN);
-    char* telescope_id = malloc(STRLEN);
-    char* receiver_name = malloc(STRLEN);
-    char* receiver_basis = malloc(STRLEN);
-    char* utc_start = malloc(STRLEN);
-    double centre_frequency = 1532.0; // this is wrong, but will be updated later
-    double bandwidth = -256.0;
-    strncpy(receiver_basis,"Circular",STRLEN);
-    strncpy(receiver_name,"Unknown",STRLEN);
-    strncpy(telescope_id,"",STRLEN);
+    observation_t* observation = malloc(sizeof(observation_t));
+    memset(observation,0,sizeof(observation_t));
+    observation->bandwidth = -256.0;
+    observation->requested_integration_time=300.0; // seconds.
+    strncpy(observation->receiver_basis,"Circular",STRLEN);
+    strncpy(observation->receiver_name,"Unknown",STRLEN);
+    strncpy(observation->telescope_id,"",STRLEN);
+
     // control parameters
-    char force_start_without_1pps = 0;
-    double requested_integration_time=300.0; // seconds.
     char* control_fifo = NULL;
     char* monitor_fifo = NULL;
-    monitor_string = malloc(STRLEN); // allocate memory for the monitor string
+    char* stream_specs[MAX_STREAMS];
+    int nstream_specs = 0;
+    char* filterbank_specs[MAX_STREAMS];
+    int nfilterbank_specs = 0;
+    char* pipeline_specs[MAX_STREAMS];
+    int npipeline_specs = 0;
+    char* receiver_specs[MAX_STREAMS];
+    int nreceiver_specs = 0;
 
     // for parsing arguments
     char arg;
 
-    // structs for storing start and end time.
-    struct timeval start_time;
-    struct timeval end_time;
-
 
     // Set up logging...
     multilog_t* log = multilog_open ("udp2db", 0); // dada logger
     multilog_add (log, stderr);
     multilog(log,LOG_DEBUG,"Debug verbosity\n");
 
-    // set up the context for the socket thread. this actually stores a bunch of useful state information.
-    local_context_t* local_context = malloc(sizeof(local_context_t));
-    memset(local_context,0,sizeof(local_context_t)); // initialise to zero.
-    // allocate the internal ring buffer.
-    local_context->buffer = malloc(PACKET_BUFFER_SIZE*NUM_PACKET_BUFFERS);
-    local_context->log = log;
+    // Options are parsed into this context, which is then copied for each stream.
+    // this actually stores a bunch of useful state information.
+    local_context_t* defaults = malloc(sizeof(local_context_t));
+    memset(defaults,0,sizeof(local_context_t)); // initialise to zero.
+    defaults->log = log;
 
     // set a default value
-    strncpy(local_context->ip_address,"10.0.3.1",128);
-
-
-    while ((arg = getopt(argc, argv, "b:c:f:i:k:lp:r:s:t:C:FH:I:M:T:")) != -1) {
+    strncpy(defaults->ip_address,"10.0.3.1",128);
+    defaults->recv_batch_size = 1;
+    defaults->recv_batch_timeout = 0;
+    defaults->ring_slots = NUM_PACKET_BUFFERS;
+    defaults->dada_key = DADA_DEFAULT_BLOCK_KEY;
+    defaults->memory.node = -1;
+    defaults->centre_frequency = 1532.0; // this is wrong, but will be updated later
+    defaults->fill_policy = FILL_NOISE;
+    defaults->reorder_depth = REORDER_WINDOW_DEFAULT_DEPTH;
+    defaults->disk_block_size = DADA_DISK_DEFAULT_BLOCK_SIZE;
+    defaults->disk_blocks_per_file = DADA_DISK_DEFAULT_BLOCKS_PER_FILE;
+
+
+    while ((arg = getopt(argc, argv, "b:c:df:i:k:lm:o:p:q:r:s:t:A:B:C:DE:FG:H:I:J:K:LM:N:O:P:Q:R:S:T:U:W:X:Y:Z:")) != -1) {
         switch (arg) {
             case 'f': // centre frequency
-                sscanf(optarg,"%lf",&centre_frequency);
+                sscanf(optarg,"%lf",&defaults->centre_frequency);
                 break;
             case 'b': // bandwidth
-                sscanf(optarg,"%lf",&bandwidth);
+                sscanf(optarg,"%lf",&observation->bandwidth);
                 break;
             case 'c':
-                sscanf(optarg,"%d",&local_context->socket_listen_cpu_core);
+                sscanf(optarg,"%d",&defaults->socket_listen_cpu_core);
+                break;
+            case 'B':
+                sscanf(optarg,"%d",&defaults->recv_batch_size);
+                if (defaults->recv_batch_size < 1 || defaults->recv_batch_size > MAX_RECV_BATCH) {
+                    multilog(log,LOG_ERR, "receive batch size must be between 1 and %d\n", MAX_RECV_BATCH);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'W':
+                sscanf(optarg,"%d",&defaults->recv_batch_timeout);
+                break;
+            case 'o':
+                if (spill_parse(optarg, &defaults->spill_bytes, defaults->spill_dir, sizeof(defaults->spill_dir)) < 0) {
+                    multilog(log,LOG_ERR, "could not parse spill '%s', expected size_mb[:dir]\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'N':
+                if (sscanf(optarg,"%"SCNu64,&defaults->ring_slots) != 1 || defaults->ring_slots == 0) {
+                    multilog(log,LOG_ERR, "could not parse internal buffer size from %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                defaults->memory.hugepages = HUGEPAGES_2M;
+                break;
+            case 'E':
+                if (hugepage_size_parse(optarg, &defaults->memory.hugepages) < 0) {
+                    multilog(log,LOG_ERR, "unknown hugepage size '%s', expected 2M or 1G\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'A':
+                if (strcmp(optarg, "auto") == 0) {
+                    defaults->numa_auto = 1;
+                } else if (sscanf(optarg, "%d", &defaults->memory.node) != 1 || defaults->memory.node < 0) {
+                    multilog(log,LOG_ERR, "could not parse NUMA node '%s', expected a node number or auto\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'P':
+                if (packet_fill_parse_policy(optarg, &defaults->fill_policy) < 0) {
+                    multilog(log,LOG_ERR, "unknown fill policy '%s', expected zeros, noise or last\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'R':
+                if (sscanf(optarg,"%"SCNu64,&defaults->reorder_depth) != 1 || defaults->reorder_depth == 0) {
+                    multilog(log,LOG_ERR, "could not parse reorder window depth from %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                strncpy(defaults->mask_directory,optarg,STRLEN-1);
+                break;
+            case 'X':
+                if (corner_turn_parse(optarg, &defaults->reorder_config) < 0) {
+                    multilog(log,LOG_ERR, "could not parse order '%s', expected TFP|FTP[,reverse][,swap]\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                defaults->reorder=1;
+                break;
+            case 'K':
+                if (spectral_kurtosis_parse(optarg, &defaults->spectral_kurtosis_config) < 0) {
+                    multilog(log,LOG_ERR, "could not parse spectral kurtosis '%s', expected m[:nsigma][:zero|replace]\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                defaults->spectral_kurtosis_set=1;
+                break;
+            case 'Q':
+                if (requantise_parse(optarg, &defaults->requantise_nbit, &defaults->requantise_window) < 0) {
+                    multilog(log,LOG_ERR, "could not parse requantisation '%s', expected 4|2[:window_blocks]\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'O':
+                strncpy(defaults->disk_roots,optarg,STRLEN-1);
+                break;
+            case 'Z':
+                if (sscanf(optarg,"%"SCNu64,&defaults->disk_block_size) != 1 || defaults->disk_block_size == 0) {
+                    multilog(log,LOG_ERR, "could not parse disk block size from %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'Y':
+                if (sscanf(optarg,"%"SCNu64,&defaults->disk_blocks_per_file) != 1 || defaults->disk_blocks_per_file == 0) {
+                    multilog(log,LOG_ERR, "could not parse blocks per file from %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
                 break;
             case 't':
-                strncpy(telescope_id,optarg,STRLEN);
+                strncpy(observation->telescope_id,optarg,STRLEN-1);
                 break;
             case 's':
-                strncpy(source_name,optarg,STRLEN);
+                strncpy(observation->source_name,optarg,STRLEN-1);
                 break;
             case 'r':
-                strncpy(receiver_name,optarg,STRLEN);
+                strncpy(observation->receiver_name,optarg,STRLEN-1);
                 break;
             case 'l':
-                strncpy(receiver_basis,"Linear",STRLEN);
+                strncpy(observation->receiver_basis,"Linear",STRLEN);
                 break;
             case 'C':
                 control_fifo = malloc(strlen(optarg)+1);
@@ -188,23 +615,70 @@ int main (int argc, char **argv)
                 strncpy(monitor_fifo, optarg,strlen(optarg)+1);
                 break;
             case 'T':
-                sscanf(optarg,"%lf",&requested_integration_time);
+                sscanf(optarg,"%lf",&observation->requested_integration_time);
                 break;
             case 'H':
-                header_file=malloc(strlen(optarg)+1);
-                memcpy(header_file,optarg,strlen(optarg)+1);
+                observation->header_file=malloc(strlen(optarg)+1);
+                memcpy(observation->header_file,optarg,strlen(optarg)+1);
                 break;
             case 'I':
-                strncpy(local_context->ip_address,optarg,128);
+                strncpy(defaults->ip_address,optarg,128);
+                break;
+            case 'i':
+                if (strlen(optarg) >= IF_NAMESIZE) {
+                    multilog(log,LOG_ERR, "interface name '%s' is too long, at most %d characters\n", optarg, IF_NAMESIZE-1);
+                    return EXIT_FAILURE;
+                }
+                snprintf(defaults->capture_interface,IF_NAMESIZE,"%s",optarg);
                 break;
             case 'p':
-                sscanf(optarg,"%d",&local_context->portnum);
+                sscanf(optarg,"%d",&defaults->portnum);
                 break;
             case 'F':
-                force_start_without_1pps=1;
+                observation->force_start_without_1pps=1;
+                break;
+            case 'd':
+                observation->daemon=1;
+                break;
+            case 'D':
+                defaults->direct_placement=1;
+                break;
+            case 'q':
+                if (nreceiver_specs >= MAX_STREAMS) {
+                    multilog(log,LOG_ERR, "too many receive core lists, at most %d allowed\n", MAX_STREAMS);
+                    return EXIT_FAILURE;
+                }
+                receiver_specs[nreceiver_specs++] = optarg;
+                break;
+            case 'U':
+                if (timestamp_source_parse(optarg, &defaults->timestamp_source) < 0) {
+                    multilog(log,LOG_ERR, "unknown timestamp source '%s', expected sw or hw\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'S':
+                if (nstream_specs >= MAX_STREAMS) {
+                    multilog(log,LOG_ERR, "too many streams, at most %d allowed\n", MAX_STREAMS);
+                    return EXIT_FAILURE;
+                }
+                stream_specs[nstream_specs++] = optarg;
+                break;
+            case 'G':
+                if (nfilterbank_specs >= MAX_STREAMS) {
+                    multilog(log,LOG_ERR, "too many filterbanks, at most %d allowed\n", MAX_STREAMS);
+                    return EXIT_FAILURE;
+                }
+                filterbank_specs[nfilterbank_specs++] = optarg;
+                break;
+            case 'J':
+                if (npipeline_specs >= MAX_STREAMS) {
+                    multilog(log,LOG_ERR, "too many pipelines, at most %d allowed\n", MAX_STREAMS);
+                    return EXIT_FAILURE;
+                }
+                pipeline_specs[npipeline_specs++] = optarg;
                 break;
             case 'k':
-                if (sscanf (optarg, "%x", &dada_key) != 1)
+                if (sscanf (optarg, "%x", &defaults->dada_key) != 1)
                 {
                     multilog(log,LOG_ERR, "dada_dbdisk: could not parse key from %s\n", optarg);
                     return EXIT_FAILURE;
@@ -215,6 +689,77 @@ int main (int argc, char **argv)
 
 
     // Part 1. Initialise everything ...
+    // Each -S gives one stream, otherwise there is just the one described by -I -p -k -f -c.
+    observation->nstreams = nstream_specs > 0 ? nstream_specs : 1;
+    local_context_t* contexts[MAX_STREAMS];
+    for (int istream = 0; istream < observation->nstreams; ++istream) {
+        local_context_t* local_context = malloc(sizeof(local_context_t));
+        memcpy(local_context, defaults, sizeof(local_context_t));
+        local_context->stream_index = istream;
+        local_context->observation = observation;
+        spead_layout_init(&local_context->spead_layout);
+        spead_layout_init(&local_context->merge_layout);
+        if (nstream_specs > 0 && parse_stream(stream_specs[istream], local_context) < 0) {
+            multilog(log,LOG_ERR, "could not parse stream '%s', expected ip:port:key:freq[:core[:interface]]\n", stream_specs[istream]);
+            return EXIT_FAILURE;
+        }
+        if (istream < nfilterbank_specs) {
+            if (filterbank_parse(filterbank_specs[istream], &local_context->filterbank_config) < 0) {
+                multilog(log,LOG_ERR, "could not parse filterbank '%s', expected key:navg[:I|IQUV[:32|8[:core]]]\n", filterbank_specs[istream]);
+                return EXIT_FAILURE;
+            }
+            local_context->filterbank_set = 1;
+        }
+        if (istream < npipeline_specs) {
+            local_context->pipeline_blocks = PIPELINE_DEFAULT_BLOCKS;
+            int* cores = local_context->pipeline_cores;
+            if (sscanf(pipeline_specs[istream], "%d:%d:%d:%"SCNu64, &cores[0], &cores[1], &cores[2], &local_context->pipeline_blocks) < 3
+                    || local_context->pipeline_blocks < 2) {
+                multilog(log,LOG_ERR, "could not parse pipeline '%s', expected capture_core:transform_core:write_core[:blocks]\n", pipeline_specs[istream]);
+                return EXIT_FAILURE;
+            }
+            local_context->pipeline_set = 1;
+        }
+        local_context->nreceivers = 1;
+        local_context->receivers[0].core = local_context->socket_listen_cpu_core;
+        if (istream < nreceiver_specs) {
+            local_context->nreceivers = parse_cores(receiver_specs[istream], local_context->receivers);
+            if (local_context->nreceivers < 1) {
+                multilog(log,LOG_ERR, "could not parse receive cores '%s', expected up to %d cores separated by commas\n", receiver_specs[istream], MAX_RECEIVERS);
+                return EXIT_FAILURE;
+            }
+            if (local_context->direct_placement || local_context->capture_interface[0] != '\0') {
+                multilog(log,LOG_ERR, "several receive sockets (-q) cannot be used with -D or -i\n");
+                return EXIT_FAILURE;
+            }
+        }
+        snprintf(local_context->label, STRLEN, "%x", local_context->dada_key);
+        if (local_context->numa_auto) {
+            find_numa_node(local_context);
+        }
+        contexts[istream] = local_context;
+    }
+    if (nreceiver_specs > observation->nstreams) {
+        multilog(log,LOG_ERR, "%d receive core lists given for %d streams\n", nreceiver_specs, observation->nstreams);
+        return EXIT_FAILURE;
+    }
+    if (npipeline_specs > observation->nstreams) {
+        multilog(log,LOG_ERR, "%d pipelines given for %d streams\n", npipeline_specs, observation->nstreams);
+        return EXIT_FAILURE;
+    }
+    if (nfilterbank_specs > observation->nstreams) {
+        multilog(log,LOG_ERR, "%d filterbanks given for %d streams\n", nfilterbank_specs, observation->nstreams);
+        return EXIT_FAILURE;
+    }
+    free(defaults);
+
+    pthread_mutex_init(&observation->start_mutex, NULL);
+    pthread_barrier_init(&observation->start_barrier, NULL, observation->nstreams);
+    if (observation->daemon && control_fifo == NULL) {
+        multilog(log,LOG_ERR, "daemon mode (-d) needs a control pipe (-C)\n");
+        return EXIT_FAILURE;
+    }
+
     // open monitor and control pipes
 
     int monitor_fd=-1;
@@ -224,30 +769,185 @@ int main (int argc, char **argv)
         multilog(log,LOG_ERR,"opening monitor pipe '%s' errno=%d %s\n",monitor_fifo,errno,strerror(errno));
         }
     }
-    int control_fd=-1;
-    if (control_fifo!=NULL){
-        control_fd = open(control_fifo,O_NONBLOCK|O_RDONLY);
-        if (control_fd < 0){
-            multilog(log,LOG_ERR,"opening control pipe '%s' errno=%d %s\n",control_fifo,errno,strerror(errno));
+    if (control_open(&observation->control, control_fifo, log) < 0 && observation->daemon) {
+        return EXIT_FAILURE;
+    }
+
+
+    // set up the dada buffers and start receiving on each stream.
+    for (int istream = 0; istream < observation->nstreams; ++istream) {
+        contexts[istream]->monitor_fd = monitor_fd;
+        contexts[istream]->stats = udpdb_stats_create(contexts[istream]->dada_key);
+        if (contexts[istream]->stats == NULL) {
+            multilog(log,LOG_WARNING,"Could not create shared memory statistics for key %x ERRNO=%d %s\n",contexts[istream]->dada_key,errno,strerror(errno));
+        }
+        monitor(monitor_fd, "STARTING", contexts[istream]);
+        if (open_dada_output(contexts[istream]) < 0) {
+            return EXIT_FAILURE;
+        }
+        if (contexts[istream]->filterbank_set) {
+            contexts[istream]->filterbank = filterbank_open(&contexts[istream]->filterbank_config, log);
+            if (contexts[istream]->filterbank == NULL) {
+                return EXIT_FAILURE;
+            }
+        }
+        if (start_receiving(contexts[istream]) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+
+    // Part 2. Each stream gets a capture thread that waits for the 1PPS and copies data into its DADA buffer.
+    pthread_t capture_threads[MAX_STREAMS];
+    atomic_store(&observation->running_streams, observation->nstreams);
+    for (int istream = 0; istream < observation->nstreams; ++istream) {
+        pthread_create(&capture_threads[istream], NULL, capture_thread, contexts[istream]);
+    }
+
+    // read the control pipe until the capture threads have finished.
+    control_t* control = &observation->control;
+    char start_ignored = 0;
+    time_t quit_time = 0;
+    while (control->fd >= 0 && atomic_load(&observation->running_streams) > 0) {
+        if (control_poll(control, 200) < 0) {
+            break;
+        }
+        if (!observation->daemon && !start_ignored && atomic_load(&control->starts) > 0) {
+            multilog(log,LOG_WARNING,"START is only understood in daemon mode (-d)\n");
+            start_ignored = 1;
+        }
+        if (atomic_load(&control->quit)) {
+            // a capture thread can be stuck waiting for packets that are not coming.
+            if (quit_time == 0) {
+                quit_time = time(NULL);
+            } else if (time(NULL) - quit_time > QUIT_TIMEOUT) {
+                for (int istream = 0; istream < observation->nstreams; ++istream) {
+                    if (!atomic_load(&contexts[istream]->finished)) {
+                        multilog(log,LOG_ERR,"[%s] Capture thread did not finish after QUIT\n",contexts[istream]->label);
+                    }
+                }
+                multilog(log,LOG_ERR,"Exiting with capture threads still running, their data may be incomplete\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    int result = EXIT_SUCCESS;
+    for (int istream = 0; istream < observation->nstreams; ++istream) {
+        pthread_join(capture_threads[istream], NULL);
+        if (contexts[istream]->result != EXIT_SUCCESS) {
+            result = contexts[istream]->result;
+        }
+    }
+
+    // free local memory
+    if (observation->header_file != 0) {
+        free(observation->header_file);
+    }
+    pthread_barrier_destroy(&observation->start_barrier);
+    control_close(&observation->control);
+    free(observation);
+
+    return result;
+}
+
+
+/*
+ * Parse a stream description of the form ip:port:key:freq[:core[:interface]]
+ * Returns -1 if it could not be understood.
+ */
+int parse_stream(const char* spec, local_context_t* context) {
+    char ip_address[128];
+    char interface[IF_NAMESIZE+1] = ""; // one more than fits, to catch names that are too long
+    int core = context->socket_listen_cpu_core;
+    int nfields = sscanf(spec, "%127[^:]:%d:%x:%lf:%d:%16s", ip_address, &context->portnum, &context->dada_key,
+            &context->centre_frequency, &core, interface);
+    if (nfields < 4 || strlen(interface) >= IF_NAMESIZE) {
+        return -1;
+    }
+    strncpy(context->ip_address, ip_address, 128);
+    context->socket_listen_cpu_core = core;
+    if (nfields == 6) {
+        snprintf(context->capture_interface, IF_NAMESIZE, "%s", interface);
+    }
+    return 0;
+}
+
+
+/*
+ * Parse a list of receive cores of the form core[,core...] into the receivers.
+ * Returns the number of receivers, or -1 if it could not be understood.
+ */
+int parse_cores(const char* spec, receiver_t* receivers) {
+    int nreceivers = 0;
+    const char* field = spec;
+    while (1) {
+        char* end;
+        const long core = strtol(field, &end, 10);
+        if (end == field || core < 0 || nreceivers >= MAX_RECEIVERS) {
+            return -1;
+        }
+        receivers[nreceivers++].core = core;
+        if (*end == '\0') {
+            return nreceivers;
+        }
+        if (*end != ',') {
+            return -1;
         }
+        field = end + 1;
+    }
+}
 
+
+/*
+ * Set the NUMA node for the stream's buffers to that of the NIC it arrives on: the capture
+ * interface if there is one, otherwise the interface with the listening address.
+ */
+void find_numa_node(local_context_t* context) {
+    multilog_t* log = context->log;
+    char interface[IF_NAMESIZE] = "";
+    if (context->capture_interface[0] != '\0') {
+        snprintf(interface, IF_NAMESIZE, "%s", context->capture_interface);
+    } else if (interface_of_address(context->ip_address, interface) < 0) {
+        multilog(log,LOG_WARNING,"[%s] No interface has address %s, so the NUMA node of the NIC is not known\n",context->label,context->ip_address);
+        return;
+    }
+    context->memory.node = numa_node_of_interface(interface);
+    if (context->memory.node < 0) {
+        multilog(log,LOG_WARNING,"[%s] NUMA node of %s is not known, memory will not be bound\n",context->label,interface);
+    } else {
+        multilog(log,LOG_INFO,"[%s] %s is on NUMA node %d\n",context->label,interface,context->memory.node);
     }
+}
 
 
+/*
+ * Connect to the DADA buffer for this stream and lock it for writing. When writing straight to
+ * disk there is no DADA buffer, so the header is kept in memory until the files are opened.
+ */
+int open_dada_output(local_context_t* context) {
+    multilog_t* log = context->log;
+    const key_t dada_key = context->dada_key;
 
-    // set up the dada stuff...
+    if (context->disk_roots[0] != '\0') {
+        context->dada_block_size = context->disk_block_size;
+        context->header_size = DADA_DEFAULT_HEADER_SIZE;
+        multilog(log,LOG_INFO,"Writing to disk in %s, block size = %"PRIu64" bytes\n",context->disk_roots,context->dada_block_size);
+        return 0;
+    }
 
     dada_hdu_t* hdu = dada_hdu_create (log);
     multilog(log,LOG_DEBUG,"dada_hdu=%p\n",hdu);
     multilog(log,LOG_INFO, "dada key    : %x\n",dada_key);
     dada_hdu_set_key(hdu,dada_key);
+    context->hdu = hdu;
 
     multilog(log,LOG_DEBUG,"Key set OK\n");
 
     if (dada_hdu_connect (hdu) < 0)
     {
         multilog(log,LOG_ERR,"Could not connect to dada hdu for key %x\n",dada_key);
-        return EXIT_FAILURE;
+        return -1;
     }  else {
         multilog(log,LOG_INFO, "Connected to dada hdu (%x)\n",dada_key);
     }
@@ -255,471 +955,2126 @@ int main (int argc, char **argv)
     if (dada_hdu_lock_write(hdu) < 0)
     {
         multilog(log,LOG_ERR,"Could not set write mode on dada hdu for key %x\n",dada_key);
-        return EXIT_FAILURE;
+        return -1;
     } else {
         multilog(log,LOG_INFO, "dada hdu set write mode ok (%x)\n",dada_key);
     }
+    context->hdu_locked = 1;
+
+    context->dada_block_size = ipcbuf_get_bufsz((ipcbuf_t*) hdu->data_block);
 
-    const uint64_t dada_block_size = ipcbuf_get_bufsz((ipcbuf_t*) hdu->data_block);
+    if (context->memory.node >= 0) {
+        // dada_db put the buffers wherever it was running; move them next to the NIC.
+        ipcbuf_t* data_block = (ipcbuf_t*) hdu->data_block;
+        const uint64_t nbufs = ipcbuf_get_nbufs(data_block);
+        uint64_t ibuf = 0;
+        while (ibuf < nbufs && memory_bind(data_block->buffer[ibuf], context->dada_block_size, context->memory.node, "DADA data block", log) == 0) {
+            ++ibuf;
+        }
+        if (ibuf == nbufs) {
+            multilog(log,LOG_INFO,"%"PRIu64" DADA data blocks bound to NUMA node %d\n",nbufs,context->memory.node);
+        }
+    }
 
-    multilog(log,LOG_INFO,"dada block size = %"PRIu64" bytes\n",dada_block_size);
+    multilog(log,LOG_INFO,"dada block size = %"PRIu64" bytes\n",context->dada_block_size);
 
-    // Start to configure the header.
-    uint64_t header_size = ipcbuf_get_bufsz (hdu->header_block);
+    const uint64_t header_size = ipcbuf_get_bufsz (hdu->header_block);
+    context->header_size = header_size;
     multilog(log, LOG_INFO, "header block size = %"PRIu64"\n", header_size);
-    // Get the next header block to write to.
-    char* header_buf = ipcbuf_get_next_write (hdu->header_block);
 
-    if (header_file != 0) {
+    if (context->spill_bytes) {
+        context->spill = spill_create(hdu->data_block, context->dada_block_size, context->spill_bytes, context->spill_dir,
+                context->label, &context->memory, log);
+        if (context->spill == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Fill in the parts of the header that are known before the observation starts.
+ */
+int fill_dada_header(local_context_t* context) {
+    multilog_t* log = context->log;
+    observation_t* observation = context->observation;
+    char* header_buf = context->header_buf;
+    const uint64_t header_size = context->header_size;
+
+    if (observation->header_file != 0) {
         // read the header parameters from the file.
-        if (fileread (header_file, header_buf, header_size) < 0)  {
-            multilog (log, LOG_ERR, "Could not read header from %s\n", header_file);
-            return EXIT_FAILURE;
+        if (fileread (observation->header_file, header_buf, header_size) < 0)  {
+            multilog (log, LOG_ERR, "Could not read header from %s\n", observation->header_file);
+            return -1;
         }
     } else {
         // use hardcoded default file
         if (default_header_ascii_len > header_size){
             multilog (log, LOG_ERR, "Header block size too small for default header parameters! %d bytes < %d bytes\n", header_size,default_header_ascii_len);
-            return EXIT_FAILURE;
+            return -1;
         }
         memset(header_buf,0,header_size);
         memcpy(header_buf,default_header_ascii,default_header_ascii_len);
     }
 
-    if (ascii_header_set (header_buf, "FREQ", "%.8lf", centre_frequency) < 0) {
+    if (ascii_header_set (header_buf, "FREQ", "%.8lf", context->centre_frequency) < 0) {
         multilog (log, LOG_ERR, "failed ascii_header_set FREQ\n");
-        return EXIT_FAILURE;
+        return -1;
     }
 
-    if (ascii_header_set (header_buf, "BW", "%.8lf", bandwidth) < 0) {
+    if (ascii_header_set (header_buf, "BW", "%.8lf", observation->bandwidth) < 0) {
         multilog (log, LOG_ERR, "failed ascii_header_set BW\n");
-        return EXIT_FAILURE;
+        return -1;
     }
-    if (ascii_header_set (header_buf, "SOURCE", "%s", source_name) < 0) {
+    if (ascii_header_set (header_buf, "SOURCE", "%s", observation->source_name) < 0) {
         multilog (log, LOG_ERR, "failed ascii_header_set SOURCE\n");
-        return EXIT_FAILURE;
+        return -1;
     }
-    if (ascii_header_set (header_buf, "RECEIVER", "%s", receiver_name) < 0) {
+    if (ascii_header_set (header_buf, "RECEIVER", "%s", observation->receiver_name) < 0) {
         multilog (log, LOG_ERR, "failed ascii_header_set RECEIVER\n");
-        return EXIT_FAILURE;
+        return -1;
     }
 
-    if (ascii_header_set (header_buf, "BASIS", "%s", receiver_basis) < 0) {
+    if (ascii_header_set (header_buf, "BASIS", "%s", observation->receiver_basis) < 0) {
         multilog (log, LOG_ERR, "failed ascii_header_set BASIS\n");
-        return EXIT_FAILURE;
+        return -1;
     }
+    return 0;
+}
 
 
-    // Part 1.1 start the socket rx thread...
-    pthread_t socket_thread;
-    pthread_create(&socket_thread,NULL, socket_receive_thread, local_context);
-
-    // bind the socket rx thread to an appropriate core
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(local_context->socket_listen_cpu_core, &cpuset);
-    pthread_setaffinity_np(socket_thread, sizeof(cpuset), &cpuset);
-
-
-    // Part 2. Wait for a frame counter reset to indicate synchronisation with 1PPS.
+/*
+ * Start the socket rx thread, or open the packet mmap ring or direct placement socket.
+ */
+int start_receiving(local_context_t* local_context) {
+    multilog_t* log = local_context->log;
 
-    // variables to store the packet contents.
-    uint64_t frame_counter=0;
-    uint64_t band_select=0;
-    uint64_t data_size=0;
-    char* data_pointer=0;
-    // this helps track lost packets...
-    uint64_t expected_frame_counter=0;
+    if (local_context->timestamp_source != TIMESTAMPS_NONE) {
+        local_context->timing = aligned_alloc(64, sizeof(packet_timing_t));
+        memset(local_context->timing,0,sizeof(packet_timing_t));
+    }
 
-    multilog(log,LOG_INFO,"Waiting for frame counter reset...\n");
-    while (1) {
-        // read from buffer
-        unsigned char* packet_buffer = get_next_packet_buffer(local_context);
-        data_pointer = decode_roach2_spead_packet(packet_buffer, &data_size, &frame_counter, &band_select);
-        if(data_pointer==0){
-            multilog(log,LOG_WARNING,"Invalid packet recieved\n");
-            continue;
+    if (local_context->capture_interface[0] != '\0') {
+        local_context->mmap_ring = packet_mmap_open(local_context->capture_interface,
+                local_context->ip_address, local_context->portnum,
+                PACKET_MMAP_DEFAULT_BLOCK_SIZE, PACKET_MMAP_DEFAULT_BLOCK_COUNT, log);
+        if (local_context->mmap_ring == NULL) {
+            multilog(log,LOG_ERR,"Could not open packet mmap ring on %s\n",local_context->capture_interface);
+            return -1;
         }
-
-        uint64_t frame_increment = band_select_to_frames_per_heap(band_select);
-
-        if (frame_counter==0) {
-            // this is what we were waiting for! break out of this look and start working.
-            break;
+        if (local_context->timing) {
+            // the frames in the ring always carry a timestamp.
+            local_context->timing->source = packet_timing_enable_packet_socket(local_context->mmap_ring->sock,
+                    local_context->timestamp_source, local_context->capture_interface, log);
         }
-
-        if (expected_frame_counter == 0 ) expected_frame_counter = frame_counter;
-
-        if (frame_counter > expected_frame_counter) {
-            local_context->dropped_packets += (frame_counter - expected_frame_counter ) / frame_increment;
+    } else if (local_context->direct_placement) {
+        // only need space for one packet, used whilst waiting for the 1PPS.
+        local_context->buffer = malloc(PACKET_BUFFER_SIZE);
+        local_context->sock = open_receive_socket(local_context, local_context->timing);
+        if (local_context->sock < 0) {
+            return -1;
         }
-
-        if ((local_context->packet_count %100000) == 0 ){
-            monitor(monitor_fd, "WAITING", local_context);
-            multilog(log,LOG_INFO,"Waiting for 1PPS. lag: % 3d max_lag: % 3d block_lag: % 3d overruns: %d packet_loss: %"PRId64"/%"PRId64" (%lg%%)\n",
-                    local_context->buffer_lag,
-                    local_context->max_buffer_lag, 
-                    local_context->recent_buffer_lag,
-                    local_context->number_of_overruns, 
-                    local_context->dropped_packets,
-                    local_context->packet_count,
-                    100.0*(double)(local_context->dropped_packets)/(double)(local_context->packet_count));
-            local_context->recent_buffer_lag = 0;
-
-            if(force_start_without_1pps && (local_context->packet_count > 100000)) {
-                // this allows us to force start without trigering for testing only.
-                multilog(log,LOG_WARNING,"STARTING WITHOUT WAITING FOR 1PPS!!!!\n");
-                break;
+    } else {
+        if (local_context->nreceivers > 1) {
+            multilog(log,LOG_INFO,"[%s] Receiving with %d sockets, merged by frame counter\n",local_context->label,local_context->nreceivers);
+        }
+        for (int i = 0; i < local_context->nreceivers; ++i) {
+            receiver_t* receiver = &local_context->receivers[i];
+            receiver->context = local_context;
+            receiver->index = i;
+            // allocate the internal ring buffer.
+            receiver->ring = packet_ring_create(local_context->ring_slots, PACKET_BUFFER_SIZE, &local_context->memory, log);
+            if (receiver->ring == NULL) {
+                return -1;
+            }
+            if (local_context->timing) {
+                packet_ring_enable_timestamps(receiver->ring);
+                receiver->timing = aligned_alloc(64, sizeof(packet_timing_t));
+                memset(receiver->timing,0,sizeof(packet_timing_t));
+            }
+            // bound here, in order, so that each socket's place in the reuseport group is its index.
+            receiver->sock = open_receive_socket(local_context, receiver->timing);
+            if (receiver->sock < 0) {
+                return -1;
             }
         }
+        if (local_context->nreceivers > 1
+                && steer_receive_sockets(local_context->receivers[local_context->nreceivers-1].sock, local_context->nreceivers, log) < 0) {
+            return -1;
+        }
+        local_context->steered = (local_context->nreceivers > 1);
+
+        for (int i = 0; i < local_context->nreceivers; ++i) {
+            receiver_t* receiver = &local_context->receivers[i];
+            pthread_t socket_thread;
+            pthread_create(&socket_thread,NULL, socket_receive_thread, receiver);
+            if (pthread_getcpuclockid(socket_thread, &receiver->thread_clock) == 0) {
+                receiver->have_thread_clock = 1;
+            }
 
-        ++(local_context->packet_count); // increment packet counter
-        expected_frame_counter += frame_increment; // expect the next frame
-
+            // bind the socket rx thread to an appropriate core
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(receiver->core, &cpuset);
+            pthread_setaffinity_np(socket_thread, sizeof(cpuset), &cpuset);
+        }
     }
+    return 0;
+}
 
-    // reset appropriate counters...
-    local_context->max_buffer_lag    = 0;
-    local_context->recent_buffer_lag = 0;
-    local_context->number_of_overruns= 0;
-    local_context->dropped_packets   = 0;
-    local_context->packet_count    = 0;
-
-    // part 2.2 - set the start time and write the header to the dada buffer
-    // We should have just started at the current UTC second.
-    gettimeofday(&start_time, NULL);
 
-    time_t rounded_start_time = start_time.tv_sec;
-    double fractional_second = start_time.tv_usec/1e6;
-    if (fractional_second > 0.5) {
-        ++rounded_start_time; // round time up if we are above half a second.
-        fractional_second -= 1.0;
+/*
+ * Called by each stream once it has the packet it wants to start on, or with abandon set if it
+ * cannot start. Waits for all the other streams, then sets the frame counter that every stream
+ * should start at (the latest of them, normally zero) and the observation start time. Returns -1
+ * if any stream abandoned the start, in which case none of them start.
+ */
+int synchronise_start(local_context_t* context, uint64_t frame_counter, char reset_known, char abandon) {
+    observation_t* observation = context->observation;
+
+    pthread_mutex_lock(&observation->start_mutex);
+    observation->latest_frame_counter = MAX(observation->latest_frame_counter, frame_counter);
+    observation->streams_abandoning += abandon;
+    observation->streams_without_reset += !reset_known;
+    if (context->last_arrival_ns && (observation->earliest_arrival_ns == 0 || context->last_arrival_ns < observation->earliest_arrival_ns)) {
+        observation->earliest_arrival_ns = context->last_arrival_ns;
+    }
+    pthread_mutex_unlock(&observation->start_mutex);
+
+    if (pthread_barrier_wait(&observation->start_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        // everyone has had their say, so take it in and clear it for the next observation.
+        observation->start_frame_counter = observation->latest_frame_counter;
+        observation->start_abandoned = observation->streams_abandoning > 0;
+        set_start_time(observation, observation->streams_without_reset == 0);
+        observation->latest_frame_counter = 0;
+        observation->streams_abandoning = 0;
+        observation->streams_without_reset = 0;
+        observation->earliest_arrival_ns = 0;
     }
+    // wait again so that everyone sees the start time.
+    pthread_barrier_wait(&observation->start_barrier);
 
-    multilog(log,LOG_INFO,"1PPS reset triggered at fractioal second %lfs\n",fractional_second);
-    strftime(utc_start, STRLEN, DADA_TIMESTR, gmtime(&rounded_start_time));
+    return observation->start_abandoned ? -1 : 0;
+}
 
-    multilog(log,LOG_INFO,"UTC_START = %s\n",utc_start);
 
-    /* write UTC_START to the header */
-    if (ascii_header_set (header_buf, "UTC_START", "%s", utc_start) < 0) {
-        multilog (log, LOG_ERR, "failed ascii_header_set UTC_START\n");
-        return EXIT_FAILURE;
+/*
+ * Work out UTC_START. If every stream knows when the frame counter was reset, the start frame is
+ * counted on from that, to a fraction of a second. Otherwise we should have just seen the reset,
+ * and started at the current UTC second. With receive timestamps the start time is when the first
+ * start packet arrived, rather than when we got round to looking at it.
+ */
+void set_start_time(observation_t* observation, char reset_known) {
+    observation->start_time = arrival_or_now(observation->earliest_arrival_ns);
+    observation->start_from_known_reset = reset_known && observation->reset_seen;
+    if (observation->start_from_known_reset) {
+        const uint64_t frame = observation->start_frame_counter;
+        observation->utc_start = observation->reset_time + frame/FRAMES_PER_SECOND;
+        observation->start_picoseconds = frame%FRAMES_PER_SECOND*PICOSECONDS_PER_FRAME;
+        return;
     }
 
-    multilog (log, LOG_INFO, "UTC_START %s written to header\n", utc_start);
-
+    observation->utc_start = observation->start_time.tv_sec;
+    observation->start_fractional_second = observation->start_time.tv_usec/1e6;
+    if (observation->start_fractional_second > 0.5) {
+        ++(observation->utc_start); // round time up if we are above half a second.
+        observation->start_fractional_second -= 1.0;
+    }
+    observation->start_picoseconds = 0;
+    if (observation->start_frame_counter == 0) {
+        // later observations can start without waiting for another reset.
+        observation->reset_time = observation->utc_start;
+        observation->reset_seen = 1;
+    }
+}
 
 
-    const uint_fast32_t frame_increment = band_select_to_frames_per_heap(band_select);
-    const uint64_t expected_data_size     = band_select_to_data_size(band_select);
-    const uint64_t packets_per_block = dada_block_size/expected_data_size;
-    double seconds_per_frame = 0.0625e-6; // 0.0625 microseconds.
-    local_context->seconds_per_packet = seconds_per_frame*frame_increment;
+/*
+ * Remember that the frame counter was zero when the last packet arrived (or at about now, without
+ * receive timestamps), which is taken to be the nearest UTC second.
+ */
+void note_frame_counter_reset(local_context_t* context) {
+    observation_t* observation = context->observation;
+    note_pps_arrival(context);
+    const struct timeval now = arrival_or_now(context->last_arrival_ns);
+    pthread_mutex_lock(&observation->start_mutex);
+    observation->reset_time = now.tv_sec + (now.tv_usec > 500000 ? 1 : 0);
+    observation->reset_seen = 1;
+    pthread_mutex_unlock(&observation->start_mutex);
+}
 
-    multilog(log, LOG_INFO, "BandSel %"PRIu64", Packet data size = %"PRIu64", dada block size = %"PRIu64"\n",band_select,data_size, dada_block_size);
 
-    if (data_size != expected_data_size) {
+/*
+ * With receive timestamps, log when the frame counter reset packet arrived relative to the UTC
+ * second. That is the 1PPS plus the time the packet took to reach us, so it should be small and steady.
+ */
+void note_pps_arrival(local_context_t* context) {
+    const int64_t arrival = context->last_arrival_ns;
+    if (arrival == 0) {
+        return;
+    }
+    int64_t offset = arrival % 1000000000LL;
+    if (offset > 500000000LL) {
+        offset -= 1000000000LL;
+    }
+    context->pps_arrival_ns = arrival;
+    context->pps_offset_ns = offset;
+    multilog(context->log,LOG_INFO,"[%s] Frame counter reset arrived %+.6lf ms from the second (%s timestamp)\n",
+            context->label,offset/1e6,timestamp_source_name(context->timing->source));
+}
+
+
+/*
+ * The time a packet arrived, or the current time if we do not know. A hardware timestamp from a
+ * NIC clock that is not kept in step with the system clock is useless for this, so anything more
+ * than a second from the system clock is ignored.
+ */
+struct timeval arrival_or_now(int64_t arrival_ns) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    const int64_t now_ns = now.tv_sec*1000000000LL + now.tv_usec*1000LL;
+    if (arrival_ns != 0 && llabs(now_ns - arrival_ns) < 1000000000LL) {
+        now.tv_sec = arrival_ns/1000000000LL;
+        now.tv_usec = arrival_ns%1000000000LL/1000;
+    }
+    return now;
+}
+
+
+/*
+ * Record one observation for a stream, or one per START command in daemon mode, until QUIT.
+ */
+void *capture_thread(void* thread_context) {
+    local_context_t* local_context = (local_context_t*)thread_context;
+    observation_t* observation = local_context->observation;
+    control_t* control = &observation->control;
+    multilog_t* log = local_context->log;
+    const int monitor_fd = local_context->monitor_fd;
+
+    if (local_context->direct_placement) {
+        // this thread does the receiving, so bind it to the socket core
+        multilog(log, LOG_INFO, "bind to core %d\n", local_context->socket_listen_cpu_core);
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(local_context->socket_listen_cpu_core, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    } else if (local_context->pipeline_set && local_context->pipeline_cores[0] >= 0) {
+        multilog(log, LOG_INFO, "bind capture thread to core %d\n", local_context->pipeline_cores[0]);
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(local_context->pipeline_cores[0], &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+
+    int status = 0;
+    while (1) {
+        if (observation->daemon && wait_for_start_command(local_context) < 0) {
+            break;
+        }
+        status = observe(local_context);
+        if (status < 0) {
+            break;
+        }
+        if (status == 0) {
+            ++(local_context->observations);
+        }
+        if (!observation->daemon) {
+            break;
+        }
+    }
+
+    // Part 4. Some cleanup when we are finished.
+    free_stage_blocks(local_context);
+    if (local_context->filterbank) {
+        filterbank_close(local_context->filterbank);
+        local_context->filterbank = NULL;
+    }
+    // disconnect from HDU
+    if (local_context->hdu && dada_hdu_disconnect (local_context->hdu) < 0) {
+        multilog (log, LOG_ERR, "could not disconnect from hdu\n");
+    }
+
+    if (status < 0) {
+        monitor(monitor_fd, "ERROR", local_context);
+        if (observation->daemon) {
+            // the other streams cannot start again without this one, so stop them as well.
+            multilog(log,LOG_ERR,"[%s] Stopping the daemon after an error\n",local_context->label);
+            atomic_store(&control->quit, 1);
+            atomic_fetch_add(&control->aborts, 1);
+        }
+    } else {
+        monitor(monitor_fd, "FINISHED", local_context);
+    }
+    // after the last statistics, which include its counts.
+    if (local_context->spill) {
+        spill_destroy(local_context->spill);
+        local_context->spill = NULL;
+    }
+    local_context->result = status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    atomic_store(&local_context->finished, 1);
+    atomic_fetch_sub(&observation->running_streams, 1);
+    return NULL;
+}
+
+
+/*
+ * Daemon mode: keep reading packets between observations, so that the socket, ring and fill
+ * statistics stay warm and any frame counter reset is noticed, until a START command arrives.
+ * STOP and ABORT mean nothing here. Returns -1 on QUIT.
+ */
+int wait_for_start_command(local_context_t* local_context) {
+    observation_t* observation = local_context->observation;
+    control_t* control = &observation->control;
+    multilog_t* log = local_context->log;
+    uint64_t frame_counter=0, band_select=0, data_size=0;
+    uint64_t previous_frame_counter=0;
+    uint64_t npackets=0;
+
+    monitor(local_context->monitor_fd, "IDLE", local_context);
+    multilog(log,LOG_INFO,"[%s] Idle, waiting for START\n",local_context->label);
+    while (1) {
+        // a STOP or ABORT counted before the START belongs to the last observation, or to none.
+        const unsigned stops = atomic_load(&control->stops);
+        const unsigned aborts = atomic_load(&control->aborts);
+        const unsigned starts = atomic_load(&control->starts);
+        if (atomic_load(&control->quit)) {
+            return -1;
+        }
+        if (starts != local_context->starts_seen) {
+            local_context->starts_seen = starts;
+            return 0;
+        }
+        local_context->stops_seen = stops;
+        local_context->aborts_seen = aborts;
+        if (control_count(&control->statuses) != local_context->statuses_seen) {
+            local_context->statuses_seen = control_count(&control->statuses);
+            monitor(local_context->monitor_fd, "IDLE", local_context);
+        }
+
+        unsigned char* packet_buffer = get_next_packet_buffer(local_context);
+        char* data_pointer = decode_roach2_spead_packet_fast(&local_context->spead_layout, packet_buffer, &data_size, &frame_counter, &band_select);
+        if(data_pointer==0){
+            multilog(log,LOG_WARNING,"Invalid packet recieved\n");
+            continue;
+        }
+        const uint64_t frame_increment = band_select_to_frames_per_heap(band_select);
+        if (local_context->fill == NULL) {
+            local_context->fill = packet_fill_create(local_context->fill_policy, data_size, data_size/frame_increment, log);
+        }
+        packet_fill_good_packet(local_context->fill, data_pointer);
+
+        if (frame_counter == 0) {
+            multilog(log,LOG_INFO,"[%s] Frame counter reset\n",local_context->label);
+            note_frame_counter_reset(local_context);
+        } else if (frame_counter + FRAMES_PER_SECOND < previous_frame_counter) {
+            // reset, but we missed the packet that would have said when. Anything less far back
+            // is just a late packet.
+            multilog(log,LOG_WARNING,"[%s] Frame counter went back from %"PRIu64" to %"PRIu64", waiting for the next reset\n",local_context->label,previous_frame_counter,frame_counter);
+            pthread_mutex_lock(&observation->start_mutex);
+            observation->reset_seen = 0;
+            pthread_mutex_unlock(&observation->start_mutex);
+            previous_frame_counter = frame_counter;
+        }
+        previous_frame_counter = MAX(frame_counter, previous_frame_counter);
+
+        if (++npackets % 100000 == 0) {
+            monitor(local_context->monitor_fd, "IDLE", local_context);
+        }
+    }
+}
+
+
+/*
+ * Get a header block for the next observation and fill in what is known before it starts,
+ * including the KEY=VALUE parameters of the START command in daemon mode. The DADA buffer was
+ * unlocked at the end of any previous observation, so it is locked again here. Returns -1 on
+ * failure, or 1 if the START parameters could not be used.
+ */
+int begin_dada_header(local_context_t* context, double* integration_time) {
+    multilog_t* log = context->log;
+    observation_t* observation = context->observation;
+
+    if (context->disk_roots[0] != '\0') {
+        context->header_buf = calloc(1, context->header_size);
+    } else {
+        if (!context->hdu_locked) {
+            if (dada_hdu_lock_write(context->hdu) < 0) {
+                multilog(log,LOG_ERR,"Could not set write mode on dada hdu for key %x\n",context->dada_key);
+                return -1;
+            }
+            context->hdu_locked = 1;
+        }
+        // Get the next header block to write to.
+        context->header_buf = ipcbuf_get_next_write (context->hdu->header_block);
+    }
+    if (fill_dada_header(context) < 0) {
+        return -1;
+    }
+
+    *integration_time = observation->requested_integration_time;
+    if (observation->daemon) {
+        char parameters[CONTROL_LINE_LENGTH];
+        control_get_parameters(&observation->control, parameters, CONTROL_LINE_LENGTH);
+        if (control_apply_parameters(parameters, context->header_buf, integration_time, log) < 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Wait for the frame counter reset, or if we already know when it was take the next packet, and
+ * then copy packets into the DADA buffer for one observation of one stream.
+ *
+ * Returns 0 at the end of the observation, 1 if it was aborted before it started, or -1 on failure.
+ */
+int observe(local_context_t* local_context) {
+    observation_t* observation = local_context->observation;
+    control_t* control = &observation->control;
+    multilog_t* log = local_context->log;
+    dada_hdu_t* hdu = local_context->hdu;
+    const uint64_t dada_block_size = local_context->dada_block_size;
+    const int monitor_fd = local_context->monitor_fd;
+    char utc_start[STRLEN];
+
+    // structs for storing start and end time.
+    struct timeval start_time;
+    struct timeval end_time;
+
+    double integration_time;
+    const int header_result = begin_dada_header(local_context, &integration_time);
+    char* header_buf = local_context->header_buf;
+    if (header_result < 0) {
+        synchronise_start(local_context, 0, 0, 1);
+        return -1;
+    }
+
+    // Part 2. Wait for a frame counter reset to indicate synchronisation with 1PPS.
+
+    // variables to store the packet contents.
+    uint64_t frame_counter=0;
+    uint64_t band_select=0;
+    uint64_t data_size=0;
+    char* data_pointer=0;
+    // this helps track lost packets...
+    uint64_t expected_frame_counter=0;
+
+    pthread_mutex_lock(&observation->start_mutex);
+    const char reset_known = observation->reset_seen;
+    pthread_mutex_unlock(&observation->start_mutex);
+    char abandon = header_result > 0;
+
+    if (abandon) {
+        multilog(log,LOG_ERR,"[%s] Not starting, could not use the START parameters\n",local_context->label);
+    } else if (reset_known) {
+        // start straight away on the next packet.
+        do {
+            unsigned char* packet_buffer = get_next_packet_buffer(local_context);
+            data_pointer = decode_roach2_spead_packet_fast(&local_context->spead_layout, packet_buffer, &data_size, &frame_counter, &band_select);
+        } while (data_pointer == 0);
+    } else {
+        multilog(log,LOG_INFO,"[%s] Waiting for frame counter reset...\n",local_context->label);
+        local_context->packet_count = 0;
+        local_context->dropped_packets = 0;
+        while (1) {
+            if (control_count(&control->aborts) != local_context->aborts_seen) {
+                abandon = 1;
+                break;
+            }
+            // read from buffer
+            unsigned char* packet_buffer = get_next_packet_buffer(local_context);
+            data_pointer = decode_roach2_spead_packet_fast(&local_context->spead_layout, packet_buffer, &data_size, &frame_counter, &band_select);
+            if(data_pointer==0){
+                multilog(log,LOG_WARNING,"Invalid packet recieved\n");
+                continue;
+            }
+
+            uint64_t frame_increment = band_select_to_frames_per_heap(band_select);
+
+            if (local_context->fill == NULL) {
+                local_context->fill = packet_fill_create(local_context->fill_policy, data_size, data_size/frame_increment, log);
+            }
+            packet_fill_good_packet(local_context->fill, data_pointer);
+
+            if (frame_counter==0) {
+                // this is what we were waiting for! break out of this look and start working.
+                note_pps_arrival(local_context);
+                break;
+            }
+
+            if (expected_frame_counter == 0 ) expected_frame_counter = frame_counter;
+
+            if (frame_counter > expected_frame_counter) {
+                local_context->dropped_packets += (frame_counter - expected_frame_counter ) / frame_increment;
+            }
+
+            if ((local_context->packet_count %100000) == 0 ){
+                monitor(monitor_fd, "WAITING", local_context);
+                multilog(log,LOG_INFO,"[%s] Waiting for 1PPS. lag: % 3d max_lag: % 3d block_lag: % 3d overruns: %d packet_loss: %"PRId64"/%"PRId64" (%lg%%)\n",
+                        local_context->label,
+                        local_context->buffer_lag,
+                        local_context->max_buffer_lag,
+                        local_context->recent_buffer_lag,
+                        local_context->number_of_overruns,
+                        local_context->dropped_packets,
+                        local_context->packet_count,
+                        100.0*(double)(local_context->dropped_packets)/(double)(local_context->packet_count));
+                local_context->recent_buffer_lag = 0;
+
+                if(observation->force_start_without_1pps && (local_context->packet_count > 100000)) {
+                    // this allows us to force start without trigering for testing only.
+                    multilog(log,LOG_WARNING,"STARTING WITHOUT WAITING FOR 1PPS!!!!\n");
+                    break;
+                }
+            }
+
+            ++(local_context->packet_count); // increment packet counter
+            expected_frame_counter += frame_increment; // expect the next frame
+
+        }
+    }
+
+    // All streams start on the same frame. Normally they have all just seen the reset, but if we
+    // forced a start some may need to skip ahead.
+    if (synchronise_start(local_context, frame_counter, reset_known, abandon) < 0) {
+        multilog(log,LOG_WARNING,"[%s] Observation abandoned before it started\n",local_context->label);
+        if (local_context->disk_roots[0] != '\0') {
+            free(header_buf);
+        }
+        local_context->header_buf = NULL;
+        // forget any START that came after the ABORT.
+        local_context->aborts_seen = control_count(&control->aborts);
+        local_context->starts_seen = control_count(&control->starts);
+        return 1;
+    }
+    const uint64_t start_frame_counter = observation->start_frame_counter;
+    while (frame_counter < start_frame_counter) {
+        unsigned char* packet_buffer = get_next_packet_buffer(local_context);
+        data_pointer = decode_roach2_spead_packet_fast(&local_context->spead_layout, packet_buffer, &data_size, &frame_counter, &band_select);
+        if(data_pointer==0){
+            frame_counter = 0;
+        }
+    }
+
+    // reset appropriate counters...
+    local_context->max_buffer_lag    = 0;
+    local_context->recent_buffer_lag = 0;
+    local_context->number_of_overruns= 0;
+    local_context->dropped_packets   = 0;
+    local_context->packet_count    = 0;
+    local_context->block_count     = 0;
+    local_context->reordered_packets = 0;
+    local_context->late_packets      = 0;
+    local_context->duplicate_packets = 0;
+
+    // part 2.2 - set the start time and write the header to the dada buffer
+    start_time = observation->start_time;
+    time_t rounded_start_time = observation->utc_start;
+
+    if (observation->start_from_known_reset) {
+        multilog(log,LOG_INFO,"Starting at frame %"PRIu64", %"PRIu64" ps into the second\n",start_frame_counter,observation->start_picoseconds);
+    } else {
+        multilog(log,LOG_INFO,"1PPS reset triggered at fractioal second %lfs\n",observation->start_fractional_second);
+    }
+    strftime(utc_start, STRLEN, DADA_TIMESTR, gmtime(&rounded_start_time));
+
+    multilog(log,LOG_INFO,"UTC_START = %s\n",utc_start);
+
+    /* write UTC_START to the header */
+    if (ascii_header_set (header_buf, "UTC_START", "%s", utc_start) < 0) {
+        multilog (log, LOG_ERR, "failed ascii_header_set UTC_START\n");
+        return -1;
+    }
+    if (observation->start_from_known_reset
+            && ascii_header_set (header_buf, "PICOSECONDS", "%"PRIu64, observation->start_picoseconds) < 0) {
+        multilog (log, LOG_ERR, "failed ascii_header_set PICOSECONDS\n");
+        return -1;
+    }
+
+    multilog (log, LOG_INFO, "UTC_START %s written to header\n", utc_start);
+
+
+
+    const uint_fast32_t frame_increment = band_select_to_frames_per_heap(band_select);
+    const uint64_t expected_data_size     = band_select_to_data_size(band_select);
+    // when requantising, each DADA block holds 8/nbit blocks worth of 8-bit packets.
+    const uint64_t input_block_size = local_context->requantise_nbit ? dada_block_size*8/local_context->requantise_nbit : dada_block_size;
+    const uint64_t packets_per_block = input_block_size/expected_data_size;
+    double seconds_per_frame = 1.0/FRAMES_PER_SECOND; // 0.0625 microseconds.
+    local_context->seconds_per_packet = seconds_per_frame*frame_increment;
+
+    multilog(log, LOG_INFO, "BandSel %"PRIu64", Packet data size = %"PRIu64", dada block size = %"PRIu64"\n",band_select,data_size, dada_block_size);
+
+    if (data_size != expected_data_size) {
         multilog (log, LOG_ERR, "packet data size does not match expected data size %"PRIu64"%!="PRIu64"\n",data_size,expected_data_size);
-        return EXIT_FAILURE;
+        return -1;
+    }
+
+    if (input_block_size % expected_data_size ) {
+        multilog(log,LOG_ERR,"Require integer number of packets per block, but %"PRIu64"%"PRIu64"!=0.\n",input_block_size,expected_data_size);
+        return -1;
+    }
+
+    if (local_context->mask_directory[0] != '\0') {
+        char mask_file[STRLEN];
+        if (snprintf(mask_file, STRLEN, "%s/%s_%s.mask", local_context->mask_directory, utc_start, local_context->label) >= STRLEN) {
+            multilog (log, LOG_ERR, "Missing packet mask path in %s is too long\n", local_context->mask_directory);
+            return -1;
+        }
+        const uint64_t bytes_per_packet = local_context->requantise_nbit ? data_size*local_context->requantise_nbit/8 : data_size;
+        local_context->mask = missing_mask_open(mask_file, packets_per_block, bytes_per_packet, start_frame_counter, frame_increment, log);
+        if (local_context->mask == NULL) {
+            return -1;
+        }
+        if (ascii_header_set (header_buf, "MISSING_MASK_FILE", "%s", mask_file) < 0) {
+            multilog (log, LOG_ERR, "failed ascii_header_set MISSING_MASK_FILE\n");
+            return -1;
+        }
+    }
+    if (ascii_header_set (header_buf, "FILL_POLICY", "%s", packet_fill_policy_name(local_context->fill_policy)) < 0) {
+        multilog (log, LOG_ERR, "failed ascii_header_set FILL_POLICY\n");
+        return -1;
+    }
+
+    const uint64_t nchan = data_size/frame_increment/4; // 4 bytes per channel: 2 pols, complex, 8-bit
+    if (local_context->spectral_kurtosis_set) {
+        const spectral_kurtosis_config_t* config = &local_context->spectral_kurtosis_config;
+        char flags_file[STRLEN] = "";
+        if (local_context->mask_directory[0] != '\0'
+                && snprintf(flags_file, STRLEN, "%s/%s_%s.sk", local_context->mask_directory, utc_start, local_context->label) >= STRLEN) {
+            multilog (log, LOG_ERR, "Spectral kurtosis flags path in %s is too long\n", local_context->mask_directory);
+            return -1;
+        }
+        local_context->spectral_kurtosis = spectral_kurtosis_create(config, nchan, flags_file[0] ? flags_file : NULL, log);
+        if (local_context->spectral_kurtosis == NULL) {
+            return -1;
+        }
+        if (ascii_header_set (header_buf, "SK_M", "%"PRIu64, config->m) < 0
+                || ascii_header_set (header_buf, "SK_NSIGMA", "%.2lf", config->nsigma) < 0
+                || ascii_header_set (header_buf, "SK_MODE", "%s", config->mode == SK_REPLACE ? "REPLACE" : "ZERO") < 0) {
+            multilog (log, LOG_ERR, "failed ascii_header_set SK_M/SK_NSIGMA/SK_MODE\n");
+            return -1;
+        }
+        if (flags_file[0] && ascii_header_set (header_buf, "SK_FLAGS_FILE", "%s", flags_file) < 0) {
+            multilog (log, LOG_ERR, "failed ascii_header_set SK_FLAGS_FILE\n");
+            return -1;
+        }
+    }
+
+    // the filterbank sees the data as they arrive, so its header is taken before any reordering or requantisation.
+    if (local_context->filterbank
+            && filterbank_start(local_context->filterbank, header_buf, local_context->header_size, nchan, input_block_size) < 0) {
+        return -1;
+    }
+
+    if (local_context->reorder) {
+        const corner_turn_config_t* config = &local_context->reorder_config;
+        local_context->corner_turn = corner_turn_create(config, nchan, log);
+        if (config->order == ORDER_FTP && ascii_header_set (header_buf, "RESOLUTION", "%"PRIu64, dada_block_size) < 0) {
+            multilog (log, LOG_ERR, "failed ascii_header_set RESOLUTION\n");
+            return -1;
+        }
+        if (config->reverse_channels && ascii_header_set (header_buf, "BW", "%.8lf", -observation->bandwidth) < 0) {
+            multilog (log, LOG_ERR, "failed ascii_header_set BW\n");
+            return -1;
+        }
+        if (config->swap_pols && ascii_header_set (header_buf, "SWAP_POLS", "%d", 1) < 0) {
+            multilog (log, LOG_ERR, "failed ascii_header_set SWAP_POLS\n");
+            return -1;
+        }
+    }
+    const sample_order_t order = local_context->corner_turn ? local_context->reorder_config.order : ORDER_TFP;
+    if (ascii_header_set (header_buf, "ORDER", "%s", corner_turn_order_name(order)) < 0) {
+        multilog (log, LOG_ERR, "failed ascii_header_set ORDER\n");
+        return -1;
+    }
+
+    if (local_context->requantise_nbit) {
+        char scales_file[STRLEN] = "";
+        if (local_context->mask_directory[0] != '\0'
+                && snprintf(scales_file, STRLEN, "%s/%s_%s.scales", local_context->mask_directory, utc_start, local_context->label) >= STRLEN) {
+            multilog (log, LOG_ERR, "Requantisation scales path in %s is too long\n", local_context->mask_directory);
+            return -1;
+        }
+        local_context->requantise = requantise_create(local_context->requantise_nbit, nchan, order, local_context->requantise_window,
+                scales_file[0] ? scales_file : NULL, log);
+        if (local_context->requantise == NULL) {
+            return -1;
+        }
+        if (ascii_header_set (header_buf, "NBIT", "%d", local_context->requantise_nbit) < 0
+                || ascii_header_set (header_buf, "REQUANT_STEP_SIGMA", "%.4lf", local_context->requantise->step_sigma) < 0
+                || ascii_header_set (header_buf, "REQUANT_WINDOW_BLOCKS", "%"PRIu64, local_context->requantise_window) < 0) {
+            multilog (log, LOG_ERR, "failed ascii_header_set NBIT/REQUANT_STEP_SIGMA/REQUANT_WINDOW_BLOCKS\n");
+            return -1;
+        }
+        if (scales_file[0] && ascii_header_set (header_buf, "REQUANT_SCALES_FILE", "%s", scales_file) < 0) {
+            multilog (log, LOG_ERR, "failed ascii_header_set REQUANT_SCALES_FILE\n");
+            return -1;
+        }
+    }
+
+    // the spill works a whole block at a time, so it needs the stage blocks too.
+    if (local_context->spectral_kurtosis || local_context->filterbank || local_context->corner_turn || local_context->requantise
+            || local_context->pipeline_set || local_context->spill) {
+        // the blocks are kept from one observation to the next, unless the packets have changed size.
+        if (local_context->stage_size != input_block_size) {
+            free_stage_blocks(local_context);
+        }
+        local_context->stage_size = input_block_size;
+        if (local_context->pipeline_set) {
+            // the capture thread fills blocks, which are excised and filtered, then written, each on another core.
+            if (local_context->pipeline == NULL) {
+                local_context->pipeline = pipeline_create(local_context->pipeline_blocks, input_block_size, &local_context->memory, log);
+                if (local_context->pipeline == NULL) {
+                    return -1;
+                }
+                pipeline_add_stage(local_context->pipeline, "transform", local_context->pipeline_cores[1], transform_stage, local_context);
+                pipeline_add_stage(local_context->pipeline, "write", local_context->pipeline_cores[2], write_stage, local_context);
+            }
+            pipeline_start(local_context->pipeline);
+        } else if (local_context->stage == NULL && (local_context->stage = memory_alloc(input_block_size, &local_context->memory, "stage block",
+                        &local_context->stage_map_size, log)) == NULL) {
+            return -1;
+        }
+        if (local_context->corner_turn && local_context->requantise && local_context->stage_scratch == NULL
+                && (local_context->stage_scratch = memory_alloc(input_block_size, &local_context->memory, "reordering block",
+                        &local_context->stage_scratch_map_size, log)) == NULL) {
+            return -1;
+        }
+    } else {
+        local_context->stage_size = 0;
+    }
+
+    // @TODO: set frequency parameters in header
+
+
+    // ....
+    // ....
+    // ....
+    // ....
+
+
+    // End of header writing. Mark header closed, or start writing files with it.
+    if (local_context->disk_roots[0] != '\0') {
+        local_context->disk = dada_disk_open(local_context->disk_roots, header_buf, local_context->header_size, utc_start,
+                local_context->label, dada_block_size, local_context->disk_blocks_per_file, log);
+        if (local_context->disk == NULL) {
+            return -1;
+        }
+    } else if (ipcbuf_mark_filled (hdu->header_block, local_context->header_size) < 0)  {
+        multilog (log, LOG_ERR, "Could not mark filled header block\n");
+        return -1;
+    }
+
+
+    multilog(log, LOG_INFO, "packets_per_block %"PRIu64"\n",packets_per_block);
+
+
+    // Part 3. Capture some data!
+
+    // Not sure if there is any need to read integer number of blocks, but I guess it doesn't make much difference.
+    uint64_t blocks_to_read = (integration_time / seconds_per_frame)/frame_increment/packets_per_block+1;
+    if (integration_time <= 0) {
+        // run until STOP.
+        blocks_to_read = INT64_MAX/packets_per_block;
+    }
+    local_context->packets_to_read = blocks_to_read*packets_per_block;
+    uint64_t nextblock = packets_per_block;
+
+    multilog(log,LOG_INFO,"Packets to read %"PRIu64"\n",local_context->packets_to_read);
+
+    if (local_context->direct_placement) {
+        const uint64_t header_length = data_pointer - (char*)local_context->last_packet_buffer;
+        if (direct_capture(local_context, monitor_fd, data_pointer, frame_counter, start_frame_counter, header_length, data_size,
+                frame_increment, packets_per_block, blocks_to_read) < 0) {
+            return -1;
+        }
+    } else {
+        // the packet we have already decoded is handled first, as if it had just arrived.
+        char have_packet = 1;
+        expected_frame_counter = start_frame_counter;
+        uint64_t highest_frame_counter = start_frame_counter; // a packet below this one has been overtaken.
+        local_context->packet_count = 0;
+        local_context->reorder_window = reorder_window_create(local_context->reorder_depth, data_size);
+        multilog(log,LOG_INFO,"Reorder window of %"PRIu64" packets\n",local_context->reorder_depth);
+
+        while (local_context->packet_count < local_context->packets_to_read) {
+
+            if (local_context->packet_count > nextblock) {
+                monitor(monitor_fd, "RUNNING", local_context);
+                multilog(log,LOG_INFO,"[%s] New block. lag: % 3d max_lag: % 3d block_lag: % 3d overruns: %d reordered: %"PRId64" late: %"PRId64" packet_loss: %"PRId64"/%"PRId64" (%lg%%)\n",
+                        local_context->label,
+                        local_context->buffer_lag,
+                        local_context->max_buffer_lag,
+                        local_context->recent_buffer_lag,
+                        local_context->number_of_overruns,
+                        local_context->reordered_packets,
+                        local_context->late_packets,
+                        local_context->dropped_packets,
+                        local_context->packet_count,
+                        100.0*(double)(local_context->dropped_packets)/(double)(local_context->packet_count));
+                local_context->recent_buffer_lag = 0;
+                nextblock += packets_per_block;
+            }
+            if (local_context->mask) {
+                missing_mask_advance(local_context->mask, local_context->packet_count);
+            }
+
+            // commands from the control pipe.
+            if (control_count(&control->aborts) != local_context->aborts_seen) {
+                break;
+            }
+            if (control_count(&control->stops) != local_context->stops_seen) {
+                local_context->stops_seen = control_count(&control->stops);
+                // finish the block we are in.
+                local_context->packets_to_read = MIN(local_context->packets_to_read,
+                        (local_context->packet_count + packets_per_block - 1)/packets_per_block*packets_per_block);
+                multilog(log,LOG_INFO,"[%s] Stopping after %"PRId64" packets\n",local_context->label,local_context->packets_to_read);
+                continue;
+            }
+            if (control_count(&control->statuses) != local_context->statuses_seen) {
+                local_context->statuses_seen = control_count(&control->statuses);
+                monitor(monitor_fd, "RUNNING", local_context);
+            }
+
+            if (!have_packet) {
+                // get next packet
+                unsigned char* packet_buffer = get_next_packet_buffer(local_context);
+                data_pointer = decode_roach2_spead_packet_fast(&local_context->spead_layout, packet_buffer, &data_size, &frame_counter, &band_select);
+                if(data_pointer==0){
+                    multilog(log,LOG_WARNING,"Invalid packet recieved\n");
+                    continue;
+                }
+            }
+            have_packet = 0;
+
+            assert(band_select==0);
+            assert(data_size==expected_data_size);
+
+            // multilog(log,LOG_DEBUG," >> %"PRIu64" > %"PRIu64" >> %"PRIu64"\n",packets_to_read,local_context->packet_count,frame_counter);
+
+            // Logic to decide if the packet is what we wanted or if we need to do something else.
+            if (frame_counter < expected_frame_counter) {
+                if (frame_counter == 0){
+                    // we must have re-set the frame counter.
+                    multilog(log,LOG_ERR,"Unexpected frame counter reset. Timing integrity lost. Aborting observation\n");
+                    note_frame_counter_reset(local_context);
+                    break;
+                } else {
+                    ++(local_context->late_packets);
+                    multilog(log,LOG_WARNING,"Discarding late packet. frame counter %"PRIu64" expected %"PRIu64"\n",frame_counter,expected_frame_counter);
+                    continue;
+                }
+            }
+
+            if ((frame_counter - expected_frame_counter)/frame_increment >= local_context->reorder_depth) {
+                // This packet does not fit in the reorder window, so we have waited long enough for the ones before it.
+                advance_reorder_window(local_context, &expected_frame_counter, frame_counter, frame_increment, data_size);
+                if (local_context->packet_count >= local_context->packets_to_read) {
+                    break;
+                }
+            }
+
+            if (frame_counter == expected_frame_counter) {
+                // copy the contents of this packet, and any that were waiting for it.
+                write_packet(local_context, data_pointer, data_size);
+                expected_frame_counter += frame_increment; // expect the next frame
+                drain_reorder_window(local_context, &expected_frame_counter, frame_increment, data_size);
+            } else if (reorder_window_put(local_context->reorder_window, frame_counter/frame_increment, data_pointer) < 0) {
+                ++(local_context->duplicate_packets);
+                multilog(log,LOG_WARNING,"Discarding duplicate packet. frame counter %"PRIu64"\n",frame_counter);
+                continue;
+            }
+            if (frame_counter < highest_frame_counter) {
+                // arrived out of sequence, but not too late to go in the right place.
+                ++(local_context->reordered_packets);
+            }
+            highest_frame_counter = MAX(highest_frame_counter, frame_counter);
+
+        }
+    }
+
+    gettimeofday(&end_time, NULL);
+
+    if (control_count(&control->aborts) != local_context->aborts_seen) {
+        // an ABORT also cancels any START sent since this observation began.
+        multilog(log,LOG_WARNING,"[%s] Observation aborted\n",local_context->label);
+        local_context->aborts_seen = control_count(&control->aborts);
+        local_context->starts_seen = control_count(&control->starts);
+    }
+    // a STOP that came as the observation ended was for this one, not the next.
+    local_context->stops_seen = control_count(&control->stops);
+
+    if (local_context->reorder_window) {
+        reorder_window_destroy(local_context->reorder_window);
+        local_context->reorder_window = NULL;
+    }
+
+    if (local_context->mask) {
+        missing_mask_close(local_context->mask, local_context->packet_count);
+        local_context->mask = NULL;
+    }
+
+    output_flush(local_context);
+    if (local_context->filterbank) {
+        local_context->filterbank_blocks = local_context->filterbank->submitted;
+        local_context->filterbank_dropped_blocks = local_context->filterbank->dropped_blocks;
+        filterbank_stop(local_context->filterbank);
+    }
+    if (local_context->corner_turn) {
+        corner_turn_destroy(local_context->corner_turn);
+        local_context->corner_turn = NULL;
+    }
+    if (local_context->requantise) {
+        requantise_destroy(local_context->requantise);
+        local_context->requantise = NULL;
+    }
+    if (local_context->spectral_kurtosis) {
+        spectral_kurtosis_destroy(local_context->spectral_kurtosis);
+        local_context->spectral_kurtosis = NULL;
+    }
+    if (local_context->pipeline) {
+        update_pipeline_stats(local_context);
+    }
+
+    double runtime = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec)/1e6;
+    multilog(log,LOG_INFO,"[%s] Finished. Sent %"PRIu64" packets in %lf s. Total packets dropped: %"PRIu64", %lf%%\n",local_context->label,local_context->packet_count,runtime,local_context->dropped_packets,100.0*(double)local_context->dropped_packets/(double)local_context->packet_count);
+
+    local_context->header_buf = NULL;
+    if (local_context->disk) {
+        // wait for everything to reach the disk.
+        const int disk_result = dada_disk_close(local_context->disk);
+        local_context->disk = NULL;
+        free(header_buf);
+        if (disk_result < 0) {
+            multilog (log, LOG_ERR, "[%s] Errors writing to disk, data are incomplete\n", local_context->label);
+            return -1;
+        }
+        return 0;
+    }
+
+    // unlock write access from the HDU, performs implicit EOD
+    local_context->hdu_locked = 0;
+    if (dada_hdu_unlock_write (hdu) < 0) {
+        multilog (log, LOG_ERR, "dada_hdu_unlock_write failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Free the blocks that packets are gathered in, or the pipeline that owns them.
+ */
+void free_stage_blocks(local_context_t* local_context) {
+    if (local_context->pipeline) {
+        update_pipeline_stats(local_context);
+        pipeline_destroy(local_context->pipeline);
+        local_context->pipeline = NULL;
+    } else if (local_context->stage) {
+        memory_free(local_context->stage, local_context->stage_map_size);
+    }
+    if (local_context->stage_scratch) {
+        memory_free(local_context->stage_scratch, local_context->stage_scratch_map_size);
+    }
+    local_context->stage = local_context->stage_scratch = NULL;
+}
+
+
+
+/*
+ * Create the UDP socket and bind it to the listening address. Returns -1 on failure.
+ */
+int open_receive_socket(local_context_t* context, packet_timing_t* timing){
+    multilog_t* log = context->log;
+    struct timeval tv;
+
+    // Set up the listening socket address
+    multilog(log,LOG_INFO, "Listen IP   : %s\n",context->ip_address);
+    multilog(log,LOG_INFO, "Listen Port : %d\n",context->portnum);
+
+    struct sockaddr_in socket_address;
+    memset(&socket_address,0,sizeof(socket_address)); // default set to zero.
+    socket_address.sin_family=AF_INET; // set IP
+    socket_address.sin_addr.s_addr=inet_addr(context->ip_address); // set ip address to listen on
+    socket_address.sin_port = htons(context->portnum); // set port to listen on
+
+    // create and bind the socket
+    int sock = socket(AF_INET, SOCK_DGRAM, 0); // UDP/IP
+    if (context->nreceivers > 1) {
+        // every receiver binds the same address, and the kernel shares the packets out between them.
+        const int enable = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    }
+    int ret = bind(sock, (struct sockaddr *) &socket_address, sizeof(socket_address));
+    if (ret != 0) {
+        multilog(log,LOG_ERR,"error binding socket ERRNO=%d %s\n",errno,strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    multilog(log,LOG_INFO,"Socket bind ok\n");
+
+    // set a socket timeout to detect no packets comming
+    tv.tv_sec = 5; // 5 second
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    int size = 32 * 1024 * 1024; // 2MB
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, (socklen_t)sizeof(int));
+
+    if (timing) {
+        // hardware timestamps are turned on in the NIC that has the listening address.
+        char interface[IF_NAMESIZE] = "";
+        interface_of_address(context->ip_address, interface);
+        timing->source = packet_timing_enable(sock, context->timestamp_source, interface, log);
+        context->timing->source = timing->source;
+    }
+
+    //    int disable = 1;
+    //    setsockopt(sock, SOL_SOCKET, SO_NO_CHECK, (void*)&disable, sizeof(disable));
+
+    return sock;
+}
+
+
+/*
+ * Share the packets out between the nsockets receive sockets bound to the same address, giving
+ * each runs of 2^RECEIVE_RUN_SHIFT frames in turn. A ROACH2 stream is one UDP flow, so the NIC's
+ * RSS hash would send every packet to the same queue and the kernel's own reuseport hash to the
+ * same socket; instead a classic BPF program picks the socket from the frame counter. The program
+ * returns a socket's place in the reuseport group, which is the order they were bound in, so the
+ * sockets must all be bound in receiver order before it is attached.
+ */
+int steer_receive_sockets(int sock, int nsockets, multilog_t* log) {
+    struct sock_filter code[] = {
+        // A = low 32 bits of the frame counter (loads are big-endian from the UDP payload).
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, FRAME_COUNTER_LOW_WORD_OFFSET),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, RECEIVE_RUN_SHIFT),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nsockets),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog program = {sizeof(code)/sizeof(code[0]), code};
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+        multilog(log,LOG_ERR,"could not steer packets between the receive sockets ERRNO=%d %s\n",errno,strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * The steering program reads the frame counter from where the firmware puts it, the fifth item
+ * pointer. Once the first packet has shown where it really is, stop steering if that is somewhere
+ * else, so that the kernel shares the packets out by its own hash, and merge the rings without
+ * expecting runs from any one of them.
+ */
+void check_steering(local_context_t* local_context) {
+    const spead_layout_t* layout = &local_context->merge_layout;
+    if (!local_context->steered || !layout->learnt || layout->frame_counter_offset + 4 == FRAME_COUNTER_LOW_WORD_OFFSET) {
+        return;
+    }
+    multilog_t* log = local_context->log;
+    multilog(log,LOG_ERR,"[%s] Frame counter is at byte %u of the SPEAD header, not %d, so packets cannot be steered between the receive sockets\n",
+            local_context->label,layout->frame_counter_offset + 4,FRAME_COUNTER_LOW_WORD_OFFSET);
+    const int unused = 0;
+    if (setsockopt(local_context->receivers[0].sock, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &unused, sizeof(unused)) < 0) {
+        multilog(log,LOG_ERR,"[%s] could not stop steering packets ERRNO=%d %s\n",local_context->label,errno,strerror(errno));
+    }
+    local_context->steered = 0;
+}
+
+
+void *socket_receive_thread(void* thread_receiver){
+    receiver_t* receiver = (receiver_t*)thread_receiver;
+    local_context_t* context = receiver->context;
+    multilog_t* log = context->log;
+
+    multilog(log, LOG_INFO, "bind to core %d\n", receiver->core);
+
+    const int sock = receiver->sock;
+    packet_ring_t* ring = receiver->ring;
+
+    // read and ignore a bunch of packets at the start, shared between the socket threads.
+    for (unsigned i = 0; i < 100000/context->nreceivers ; ++i ){
+        ssize_t size = recv(sock, (void*)packet_ring_overflow_slot(ring),PACKET_BUFFER_SIZE,0);
+    }
+
+
+
+    if (context->recv_batch_size > 1) {
+        receive_batched(sock, receiver);
+    }
+
+    // the timestamps come in a control message alongside the packet.
+    char timestamp_control[PACKET_TIMING_CONTROL_SIZE];
+    struct iovec iov;
+    struct msghdr message;
+    memset(&message,0,sizeof(message));
+    iov.iov_len = PACKET_BUFFER_SIZE;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    while(1) {
+        // find the next location in the ring buffer, or throw the packet away if the ring is full.
+        const char ring_full = (packet_ring_free(ring) == 0);
+        const uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        iov.iov_base = ring_full ? packet_ring_overflow_slot(ring) : packet_ring_slot(ring, head);
+        if (receiver->timing) {
+            message.msg_control = timestamp_control;
+            message.msg_controllen = sizeof(timestamp_control);
+        }
+        ssize_t retval = recvmsg(sock, &message, 0);
+        if (retval == -1 ){
+            if (errno==EAGAIN) {
+                multilog(log,LOG_WARNING,"No packets recieved within 5 seconds... [ERRNO=%d '%s']\n",errno,strerror(errno));
+                continue;
+            } else {
+                multilog(log,LOG_ERR,"error getting packet ERRNO=%d %s\n",errno,strerror(errno));
+                continue;
+            }
+        }
+        ++(context->receive_syscalls);
+        ++(context->packets_received);
+        if (receiver->timing) {
+            time_received_packet(receiver, &message, packet_timing_now(), head, !ring_full);
+        }
+        if (ring_full) {
+            ++(ring->overruns);
+        } else {
+            packet_ring_publish(ring, 1);
+        }
+    }
+
+
+    return NULL;
+
+}
+
+
+/*
+ * Fill the ring buffer using recvmmsg, so that one system call can deliver up to
+ * recv_batch_size packets into consecutive ring slots. Batches are limited to the free
+ * space in the ring; if there is none we read one packet into the overflow slot and drop it.
+ *
+ * If recv_batch_timeout is zero we use MSG_WAITFORONE, i.e. block for the first packet then
+ * take whatever else is already queued on the socket. Otherwise recvmmsg waits to fill the batch,
+ * but note that the kernel only checks the timeout after each datagram arrives, so the
+ * SO_RCVTIMEO on the socket still governs how long we wait when there is no traffic at all.
+ */
+void receive_batched(int sock, receiver_t* receiver) {
+    local_context_t* context = receiver->context;
+    multilog_t* log = context->log;
+    packet_ring_t* ring = receiver->ring;
+    const unsigned batch_size = context->recv_batch_size;
+    struct mmsghdr msgs[MAX_RECV_BATCH];
+    struct iovec iovecs[MAX_RECV_BATCH];
+    char timestamp_controls[MAX_RECV_BATCH][PACKET_TIMING_CONTROL_SIZE];
+    struct timespec timeout;
+    struct timespec* timeout_pointer = NULL;
+    int flags = MSG_WAITFORONE;
+
+    if (context->recv_batch_timeout > 0) {
+        timeout.tv_sec  = context->recv_batch_timeout / 1000000;
+        timeout.tv_nsec = (context->recv_batch_timeout % 1000000) * 1000;
+        timeout_pointer = &timeout;
+        flags = 0;
+    }
+
+    multilog(log,LOG_INFO,"Using recvmmsg with batches of %u packets, timeout %d us\n",batch_size,context->recv_batch_timeout);
+
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned i=0; i < batch_size; ++i){
+        iovecs[i].iov_len          = PACKET_BUFFER_SIZE;
+        msgs[i].msg_hdr.msg_iov    = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(1) {
+        // point each message at the next free ring slots. A batch can wrap around the end of the ring.
+        const uint64_t free_slots = packet_ring_free(ring);
+        const uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned batch = batch_size < free_slots ? batch_size : free_slots;
+        if (batch == 0) {
+            iovecs[0].iov_base = packet_ring_overflow_slot(ring);
+            batch = 1;
+        } else {
+            for (unsigned i=0; i < batch; ++i){
+                iovecs[i].iov_base = packet_ring_slot(ring, head+i);
+            }
+        }
+        for (unsigned i=0; receiver->timing && i < batch; ++i){
+            msgs[i].msg_hdr.msg_control    = timestamp_controls[i];
+            msgs[i].msg_hdr.msg_controllen = PACKET_TIMING_CONTROL_SIZE;
+        }
+        int retval = recvmmsg(sock, msgs, batch, flags, timeout_pointer);
+        if (retval == -1 ){
+            if (errno==EAGAIN) {
+                multilog(log,LOG_WARNING,"No packets recieved within 5 seconds... [ERRNO=%d '%s']\n",errno,strerror(errno));
+                continue;
+            } else {
+                multilog(log,LOG_ERR,"error getting packet ERRNO=%d %s\n",errno,strerror(errno));
+                continue;
+            }
+        }
+        ++(context->receive_syscalls);
+        context->packets_received += retval;
+        if (receiver->timing) {
+            const int64_t now = packet_timing_now();
+            for (int i=0; i < retval; ++i){
+                time_received_packet(receiver, &msgs[i].msg_hdr, now, head+i, free_slots != 0);
+            }
+        }
+        if (free_slots == 0) {
+            ring->overruns += retval;
+        } else {
+            packet_ring_publish(ring, retval);
+        }
     }
+}
 
-    if (dada_block_size % expected_data_size ) {
-        multilog(log,LOG_ERR,"Require integer number of packets per block, but %"PRIu64"%"PRIu64"!=0.\n",dada_block_size,expected_data_size);
-        return EXIT_FAILURE;
+
+/*
+ * Count how long a packet took from the NIC to the ring, and the gap since the one before, and
+ * keep its arrival time with it in the ring for the capture thread. Called by the socket thread
+ * before the packet is published; in_ring is zero if it was thrown away because the ring was full.
+ */
+void time_received_packet(receiver_t* receiver, struct msghdr* message, int64_t now_ns, uint64_t position, char in_ring) {
+    const int64_t arrival = packet_timing_arrival(message);
+    if (arrival == 0) {
+        return;
+    }
+    packet_timing_received(receiver->timing, arrival, now_ns);
+    if (in_ring) {
+        packet_ring_t* ring = receiver->ring;
+        ring->arrival_ns[position % ring->nslots] = arrival;
+        ring->publish_ns[position % ring->nslots] = now_ns;
     }
+}
 
-    // @TODO: set frequency parameters in header
 
+unsigned char* get_next_packet_buffer(local_context_t* local_context){
+    if (local_context->mmap_ring) {
+        return get_next_packet_mmap(local_context);
+    }
+    if (local_context->direct_placement) {
+        return get_next_packet_direct(local_context);
+    }
 
-    // ....
-    // ....
-    // ....
-    // ....
+    if (local_context->nreceivers > 1) {
+        return get_next_packet_merged(local_context);
+    }
 
+    receiver_t* receiver = &local_context->receivers[0];
+    packet_ring_t* ring = receiver->ring;
+    unsigned char* packet_buffer = packet_ring_next(ring);
+    if (ring->arrival_ns) {
+        const uint64_t slot = (ring->read_position - 1) % ring->nslots;
+        local_context->last_arrival_ns = ring->arrival_ns[slot];
+        if (local_context->last_arrival_ns) {
+            packet_timing_count(local_context->timing->ring_latency, packet_timing_now() - ring->publish_ns[slot]);
+        }
+    }
 
-    // End of header writing. Mark header closed.
-    if (ipcbuf_mark_filled (hdu->header_block, header_size) < 0)  {
-        multilog (log, LOG_ERR, "Could not mark filled header block\n");
-        return EXIT_FAILURE;
+    note_buffer_lag(local_context, packet_ring_lag(ring));
+    note_ring_overruns(local_context, receiver);
+
+    local_context->last_packet_buffer = packet_buffer;
+    return packet_buffer;
+}
+
+
+/*
+ * With several receive sockets, take the packets from their rings in frame counter order. Each
+ * socket is sent runs of frames in turn (see steer_receive_sockets), so we know which ring the
+ * next packet should come from. If that one is empty we wait a little for it before taking the
+ * earliest packet from another, as the socket threads do not keep in step. Any disorder left
+ * over is dealt with by the reorder window as usual. Without steering (see check_steering) the
+ * earliest packet to hand is taken straight away.
+ *
+ * A packet more than a second behind the last one taken is after a frame counter reset, so it
+ * goes after anything from before the reset still waiting in another ring.
+ */
+unsigned char* get_next_packet_merged(local_context_t* local_context){
+    const uint64_t next_frame_counter = local_context->last_merged_frame_counter + local_context->merge_frame_increment;
+    receiver_t* expected = &local_context->receivers[((uint32_t)next_frame_counter >> RECEIVE_RUN_SHIFT) % local_context->nreceivers];
+    receiver_t* chosen = NULL;
+    unsigned spins = 0;
+    char slept = 0;
+    while (1) {
+        chosen = NULL;
+        char chosen_after_reset = 0;
+        for (int i = 0; i < local_context->nreceivers; ++i) {
+            receiver_t* receiver = &local_context->receivers[i];
+            if (receiver->pending == NULL) {
+                receiver->pending = packet_ring_try_next(receiver->ring);
+                if (receiver->pending == NULL) {
+                    continue;
+                }
+                receiver->pending_slot = (receiver->ring->read_position - 1) % receiver->ring->nslots;
+                uint64_t data_size, frame_counter, band_select;
+                const char learnt = local_context->merge_layout.learnt;
+                if (decode_roach2_spead_packet_fast(&local_context->merge_layout, receiver->pending, &data_size, &frame_counter, &band_select) == NULL) {
+                    // let the capture thread see it straight away and throw it out.
+                    frame_counter = local_context->last_merged_frame_counter;
+                } else {
+                    local_context->merge_frame_increment = band_select_to_frames_per_heap(band_select);
+                }
+                if (!learnt) {
+                    check_steering(local_context);
+                }
+                receiver->pending_frame_counter = frame_counter;
+            }
+            const char after_reset = receiver->pending_frame_counter + FRAMES_PER_SECOND < local_context->last_merged_frame_counter;
+            if (chosen == NULL || after_reset < chosen_after_reset
+                    || (after_reset == chosen_after_reset && receiver->pending_frame_counter < chosen->pending_frame_counter)) {
+                chosen = receiver;
+                chosen_after_reset = after_reset;
+            }
+        }
+        if (chosen != NULL && (chosen == expected || expected->pending != NULL || slept || !local_context->steered)) {
+            break;
+        }
+        if (++spins < MERGE_SPINS) {
+            __builtin_ia32_pause();
+        } else {
+            // sleep rather than spin, in case the socket threads need this core.
+            struct timespec pause = {0, MERGE_SLEEP_NS};
+            nanosleep(&pause, NULL);
+            slept = 1;
+        }
     }
 
+    unsigned char* packet_buffer = chosen->pending;
+    packet_ring_t* ring = chosen->ring;
+    chosen->pending = NULL;
+    local_context->last_merged_frame_counter = chosen->pending_frame_counter;
+    if (ring->arrival_ns) {
+        local_context->last_arrival_ns = ring->arrival_ns[chosen->pending_slot];
+        if (local_context->last_arrival_ns) {
+            packet_timing_count(local_context->timing->ring_latency, packet_timing_now() - ring->publish_ns[chosen->pending_slot]);
+        }
+    }
 
-    multilog(log, LOG_INFO, "packets_per_block %"PRIu64"\n",packets_per_block);
+    uint64_t lag = 0;
+    for (int i = 0; i < local_context->nreceivers; ++i) {
+        receiver_t* receiver = &local_context->receivers[i];
+        lag += packet_ring_lag(receiver->ring) + (receiver->pending != NULL);
+        note_ring_overruns(local_context, receiver);
+    }
+    note_buffer_lag(local_context, lag);
 
+    local_context->last_packet_buffer = packet_buffer;
+    return packet_buffer;
+}
 
-    // Part 3. Capture some data!
 
-    // Not sure if there is any need to read integer number of blocks, but I guess it doesn't make much difference.
-    uint64_t blocks_to_read = (requested_integration_time / seconds_per_frame)/frame_increment/packets_per_block+1;
-    local_context->packets_to_read = blocks_to_read*packets_per_block;
-    uint64_t nextblock = packets_per_block;
+void note_buffer_lag(local_context_t* local_context, uint64_t lag) {
+    // monitoring stuff to check max buffer lag
+    local_context->buffer_lag = lag + 1;
+    ++(local_context->lag_histogram[lag ? MIN(64 - __builtin_clzll(lag), UDPDB_STATS_LAG_BINS-1) : 0]);
+    local_context->max_buffer_lag = MAX(local_context->buffer_lag,local_context->max_buffer_lag); // MAX macro
+    local_context->recent_buffer_lag = MAX(local_context->buffer_lag,local_context->recent_buffer_lag);
+}
 
 
-    // write the first data packet to the dada buffer.
-    ipcio_write (hdu->data_block, data_pointer, data_size);
+void note_ring_overruns(local_context_t* local_context, receiver_t* receiver) {
+    // the socket thread counts packets it could not store because the ring was full.
+    const uint64_t overruns = atomic_load_explicit(&receiver->ring->overruns, memory_order_relaxed);
+    if (overruns != receiver->overruns_seen) {
+        multilog(local_context->log,LOG_WARNING,"OVERRUN!!! internal buffer full, %"PRIu64" packets dropped\n",overruns - receiver->overruns_seen);
+        local_context->number_of_overruns += overruns - receiver->overruns_seen;
+        receiver->overruns_seen = overruns;
+    }
+}
 
-    // set up for the next frame.
-    expected_frame_counter = frame_counter + frame_increment;
-    local_context->packet_count = 1;
 
-    multilog(log,LOG_INFO,"Packets to read %"PRIu64"\n",local_context->packets_to_read);
+/*
+ * Get the next packet directly from the packet mmap ring. There is no internal buffer so
+ * the lag is always zero, and the kernel's ring drops are reported as overruns.
+ */
+unsigned char* get_next_packet_mmap(local_context_t* local_context){
+    packet_mmap_t* mmap_ring = local_context->mmap_ring;
+    uint64_t length = 0;
+    unsigned char* packet_buffer = NULL;
+    while (packet_buffer == NULL) {
+        packet_buffer = packet_mmap_next(mmap_ring, &length, 5000);
+        if (packet_buffer == NULL) {
+            multilog(local_context->log,LOG_WARNING,"No packets recieved within 5 seconds...\n");
+        }
+    }
+
+    if (mmap_ring->kernel_drops != local_context->mmap_ring_drops_seen) {
+        multilog(local_context->log,LOG_WARNING,"OVERRUN!!! kernel dropped %"PRIu64" frames\n",mmap_ring->kernel_drops - local_context->mmap_ring_drops_seen);
+        local_context->number_of_overruns += mmap_ring->kernel_drops - local_context->mmap_ring_drops_seen;
+        local_context->mmap_ring_drops_seen = mmap_ring->kernel_drops;
+    }
+
+    local_context->packets_received = mmap_ring->packets;
+    local_context->last_packet_buffer = packet_buffer;
+    if (local_context->timing) {
+        // the kernel's ring is the only ring, so the time spent in it counts as receive latency.
+        local_context->last_arrival_ns = mmap_ring->arrival_ns;
+        packet_timing_received(local_context->timing, mmap_ring->arrival_ns, packet_timing_now());
+    }
+    return packet_buffer;
+}
 
-    while (local_context->packet_count < local_context->packets_to_read) {
 
-        if (local_context->packet_count > nextblock) {
-            monitor(monitor_fd, "RUNNING", local_context);
-            multilog(log,LOG_INFO,"New block. lag: % 3d max_lag: % 3d block_lag: % 3d overruns: %d packet_loss: %"PRId64"/%"PRId64" (%lg%%)\n",
-                    local_context->buffer_lag,
-                    local_context->max_buffer_lag, 
-                    local_context->recent_buffer_lag,
-                    local_context->number_of_overruns, 
-                    local_context->dropped_packets,
-                    local_context->packet_count,
-                    100.0*(double)(local_context->dropped_packets)/(double)(local_context->packet_count));
-            local_context->recent_buffer_lag = 0;
-            nextblock += packets_per_block;
+/*
+ * In direct placement mode we only use the internal buffer before the 1PPS, one packet at a time.
+ */
+unsigned char* get_next_packet_direct(local_context_t* local_context){
+    char timestamp_control[PACKET_TIMING_CONTROL_SIZE];
+    struct iovec iov = {local_context->buffer, PACKET_BUFFER_SIZE};
+    struct msghdr message;
+    memset(&message,0,sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (local_context->timing) {
+        message.msg_control = timestamp_control;
+        message.msg_controllen = sizeof(timestamp_control);
+    }
+    while (recvmsg(local_context->sock, &message, 0) == -1) {
+        if (errno==EAGAIN) {
+            multilog(local_context->log,LOG_WARNING,"No packets recieved within 5 seconds... [ERRNO=%d '%s']\n",errno,strerror(errno));
+        } else {
+            multilog(local_context->log,LOG_ERR,"error getting packet ERRNO=%d %s\n",errno,strerror(errno));
         }
+    }
+    ++(local_context->receive_syscalls);
+    ++(local_context->packets_received);
+    local_context->last_packet_buffer = local_context->buffer;
+    if (local_context->timing) {
+        time_direct_packet(local_context, &message);
+    }
+    return local_context->buffer;
+}
 
-        // get next packet
-        unsigned char* packet_buffer = get_next_packet_buffer(local_context);
-        data_pointer = decode_roach2_spead_packet(packet_buffer, &data_size, &frame_counter, &band_select);
-        if(data_pointer==0){
-            multilog(log,LOG_WARNING,"Invalid packet recieved\n");
-            continue;
+
+/*
+ * Without a ring in direct placement mode, the time until the capture thread has the packet
+ * counts as receive latency.
+ */
+void time_direct_packet(local_context_t* local_context, struct msghdr* message) {
+    local_context->last_arrival_ns = packet_timing_arrival(message);
+    if (local_context->last_arrival_ns) {
+        packet_timing_received(local_context->timing, local_context->last_arrival_ns, packet_timing_now());
+    }
+}
+
+
+/*
+ * Fill any of the first nslots slots of a direct placement block that never got a packet according
+ * to the fill policy, record them in the missing packet mask, then hand those slots to the output.
+ * nslots is packets_per_block except for a block cut short at the end of an observation.
+ */
+void finish_direct_block(local_context_t* local_context, int monitor_fd, char* block, char* slot_filled,
+        uint64_t nslots, uint64_t packets_per_block, uint64_t data_size) {
+    multilog_t* log = local_context->log;
+    uint64_t nmissing = 0;
+    for (uint64_t slot = 0; slot < nslots; ++slot) {
+        if (!slot_filled[slot]) {
+            ++nmissing;
+        }
+    }
+
+    if (nmissing) {
+        packet_fill_slots(local_context->fill, block, slot_filled, nslots);
+        local_context->dropped_packets += nmissing;
+        multilog(log,LOG_WARNING,"Filled %"PRIu64" missing packets with %s in block %"PRId64"\n",nmissing,packet_fill_policy_name(local_context->fill_policy),local_context->block_count);
+    }
+    if (local_context->mask) {
+        const uint64_t first_packet = local_context->block_count*packets_per_block;
+        for (uint64_t slot = 0; nmissing && slot < nslots; ++slot) {
+            if (!slot_filled[slot]) {
+                missing_mask_mark(local_context->mask, first_packet + slot, 1);
+            }
         }
+        missing_mask_advance(local_context->mask, first_packet + nslots);
+    }
+
+    output_close_block(local_context, nslots*data_size);
+    local_context->packet_count = local_context->block_count*packets_per_block + nslots;
+    ++(local_context->block_count);
+
+    monitor(monitor_fd, "RUNNING", local_context);
+    multilog(log,LOG_INFO,"New block. overruns: %d reordered: %"PRId64" late: %"PRId64" packet_loss: %"PRId64"/%"PRId64" (%lg%%)\n",
+            local_context->number_of_overruns,
+            local_context->reordered_packets,
+            local_context->late_packets,
+            local_context->dropped_packets,
+            local_context->packet_count,
+            100.0*(double)(local_context->dropped_packets)/(double)(local_context->packet_count));
+}
+
 
-        assert(band_select==0);
-        assert(data_size==expected_data_size);
+/*
+ * Capture loop for direct placement mode.
+ *
+ * Each packet is received with the SPEAD header going into a scratch buffer and the data going
+ * into the next expected slot of the open output block. Usually that is where it belongs. If the
+ * frame counter says otherwise the data is moved to the right slot, so late packets that are still
+ * within the current block are not lost.
+ *
+ * STOP ends the observation at the end of the current block, and ABORT ends it straight away, as
+ * does a frame counter reset. The part of the block received so far is then filled and handed over.
+ *
+ * Returns 0 on success, or -1 if the SPEAD header is too large for direct placement.
+ */
+int direct_capture(local_context_t* local_context, int monitor_fd,
+        char* first_data_pointer, uint64_t first_frame_counter, uint64_t start_frame_counter,
+        uint64_t header_length, uint64_t data_size,
+        uint64_t frame_increment, uint64_t packets_per_block, uint64_t blocks_to_read) {
+    multilog_t* log = local_context->log;
+    control_t* control = &local_context->observation->control;
+    const uint64_t frames_per_block = packets_per_block*frame_increment;
+    uint64_t frame_counter=0, band_select=0, packet_data_size=0;
+    unsigned char header_buffer[PACKET_BUFFER_SIZE];
+    unsigned char overflow_buffer[PACKET_BUFFER_SIZE];
+    char timestamp_control[PACKET_TIMING_CONTROL_SIZE];
+
+    if (header_length > PACKET_BUFFER_SIZE) {
+        multilog(log,LOG_ERR,"SPEAD header too large for direct placement (%"PRIu64" bytes)\n",header_length);
+        return -1;
+    }
+    multilog(log,LOG_INFO,"Direct placement into dada blocks, SPEAD header %"PRIu64" bytes\n",header_length);
+
+    char* carry_buffer = malloc(data_size); // holds a packet that belongs in a later block.
+    char* slot_filled = malloc(packets_per_block);
+
+    // the header goes to scratch, the data into the block, and anything extra to the overflow so we can reject it.
+    struct iovec iov[3];
+    iov[0].iov_base = header_buffer;
+    iov[0].iov_len  = header_length;
+    iov[1].iov_len  = data_size;
+    iov[2].iov_base = overflow_buffer;
+    iov[2].iov_len  = PACKET_BUFFER_SIZE;
+    struct msghdr message;
+    memset(&message,0,sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = 3;
+
+    local_context->block_count = 0;
+    uint64_t block_start_frame = start_frame_counter;
+    char* block = output_open_block(local_context);
+    memset(slot_filled,0,packets_per_block);
+    // the first packet is normally the start frame, but may be later if packets were lost.
+    uint64_t expected_slot = (first_frame_counter - start_frame_counter)/frame_increment;
+    if (expected_slot < packets_per_block) {
+        memcpy(block + expected_slot*data_size, first_data_pointer, data_size);
+        slot_filled[expected_slot] = 1;
+        ++expected_slot;
+    } else {
+        expected_slot = 0;
+    }
+
+    while (local_context->block_count < blocks_to_read) {
 
-        // multilog(log,LOG_DEBUG," >> %"PRIu64" > %"PRIu64" >> %"PRIu64"\n",packets_to_read,local_context->packet_count,frame_counter);
+        if (control_count(&control->aborts) != local_context->aborts_seen) {
+            finish_direct_block(local_context, monitor_fd, block, slot_filled, expected_slot, packets_per_block, data_size);
+            break;
+        }
+        if (control_count(&control->stops) != local_context->stops_seen) {
+            local_context->stops_seen = control_count(&control->stops);
+            blocks_to_read = MIN(blocks_to_read, local_context->block_count + 1);
+            multilog(log,LOG_INFO,"[%s] Stopping after %"PRIu64" blocks\n",local_context->label,blocks_to_read);
+        }
+
+        if (expected_slot >= packets_per_block) {
+            finish_direct_block(local_context, monitor_fd, block, slot_filled, packets_per_block, packets_per_block, data_size);
+            if (local_context->block_count >= blocks_to_read) {
+                break;
+            }
+            block = output_open_block(local_context);
+            memset(slot_filled,0,packets_per_block);
+            block_start_frame += frames_per_block;
+            expected_slot = 0;
+        }
 
-        // Logic to decide if the packet is what we wanted or if we need to do something else.
-        if (frame_counter > expected_frame_counter) {
-            uint64_t ndropped = (frame_counter - expected_frame_counter ) /frame_increment;
-            local_context->dropped_packets += ndropped;
-            for (uint64_t i = 0 ; i < ndropped; ++i) {
-                // write some fake data packets where they were dropped.
-                // we grab a random packet from the buffer to use as data.
-                // be careful not to overwrite any important variables for the actual packet we are working on!
-                unsigned char* junk_packet_buffer = get_random_packet_buffer(local_context);
-                uint64_t junk_data_size,junk_frame_counter,junk_band_select;
-                char* junk_data_pointer = decode_roach2_spead_packet(junk_packet_buffer, &junk_data_size, &junk_frame_counter, &junk_band_select);
-                assert(data_size==expected_data_size);
-                ipcio_write (hdu->data_block, junk_data_pointer, junk_data_size);
+        char* received_data = block + expected_slot*data_size;
+        iov[1].iov_base = received_data;
+        if (local_context->timing) {
+            message.msg_control = timestamp_control;
+            message.msg_controllen = sizeof(timestamp_control);
+        }
+        ssize_t retval = recvmsg(local_context->sock, &message, 0);
+        if (retval == -1 ){
+            if (errno==EAGAIN) {
+                multilog(log,LOG_WARNING,"No packets recieved within 5 seconds... [ERRNO=%d '%s']\n",errno,strerror(errno));
+            } else {
+                multilog(log,LOG_ERR,"error getting packet ERRNO=%d %s\n",errno,strerror(errno));
             }
-            multilog(log,LOG_WARNING,"Injected %d randomly sampled packets... %"PRIu64"/%"PRIu64"\n",ndropped,frame_counter,expected_frame_counter);
-            local_context->packet_count += ndropped;
-            expected_frame_counter = frame_counter; // we caught up the frames, set the expected frame counter to the current one...
+            continue;
+        }
+        ++(local_context->receive_syscalls);
+        ++(local_context->packets_received);
+        if (local_context->timing) {
+            time_direct_packet(local_context, &message);
+        }
+
+        char* data_pointer = decode_roach2_spead_packet_fast(&local_context->spead_layout, header_buffer, &packet_data_size, &frame_counter, &band_select);
+        if (data_pointer != (char*)header_buffer + header_length || packet_data_size != data_size || retval != header_length + data_size) {
+            multilog(log,LOG_WARNING,"Invalid packet recieved\n");
+            continue;
         }
-        if (frame_counter < expected_frame_counter) {
-            // @TODO: How do we actually handle out of sequence packets?
+
+        if (frame_counter < block_start_frame) {
             if (frame_counter == 0){
                 // we must have re-set the frame counter.
                 multilog(log,LOG_ERR,"Unexpected frame counter reset. Timing integrity lost. Aborting observation\n");
+                note_frame_counter_reset(local_context);
+                finish_direct_block(local_context, monitor_fd, block, slot_filled, expected_slot, packets_per_block, data_size);
                 break;
-            } else {
-                multilog(log,LOG_WARNING,"Discarding out of sequence packet. frame counter %"PRIu64" expected %"PRIu64"\n",frame_counter,expected_frame_counter);
-                continue;
             }
+            ++(local_context->late_packets);
+            multilog(log,LOG_WARNING,"Discarding out of sequence packet. frame counter %"PRIu64" is before current block %"PRIu64"\n",frame_counter,block_start_frame);
+            continue;
         }
 
-        // copy the contents of this packet.
-        ipcio_write (hdu->data_block, data_pointer, data_size);
-        ++(local_context->packet_count); // increment packet counter
-        expected_frame_counter += frame_increment; // expect the next frame
+        uint64_t slot = (frame_counter - block_start_frame)/frame_increment;
+
+        if (slot >= packets_per_block) {
+            // This packet belongs in a later block. Keep hold of it whilst we finish this block.
+            memcpy(carry_buffer, received_data, data_size);
+            finish_direct_block(local_context, monitor_fd, block, slot_filled, packets_per_block, packets_per_block, data_size);
+            slot -= packets_per_block;
+            block_start_frame += frames_per_block;
+
+            // Any blocks that are skipped entirely are written out empty.
+            while (slot >= packets_per_block && local_context->block_count < blocks_to_read) {
+                multilog(log,LOG_WARNING,"Entire block of packets missing\n");
+                block = output_open_block(local_context);
+                memset(slot_filled,0,packets_per_block);
+                finish_direct_block(local_context, monitor_fd, block, slot_filled, packets_per_block, packets_per_block, data_size);
+                slot -= packets_per_block;
+                block_start_frame += frames_per_block;
+            }
+            if (local_context->block_count >= blocks_to_read) {
+                break;
+            }
 
+            block = output_open_block(local_context);
+            memset(slot_filled,0,packets_per_block);
+            memcpy(block + slot*data_size, carry_buffer, data_size);
+            slot_filled[slot] = 1;
+            expected_slot = slot+1;
+        } else if (slot >= expected_slot) {
+            // in order, or early. Anything we skipped over may still turn up later.
+            if (slot != expected_slot) {
+                memcpy(block + slot*data_size, received_data, data_size);
+            }
+            slot_filled[slot] = 1;
+            expected_slot = slot+1;
+        } else if (!slot_filled[slot]) {
+            // a late packet that still belongs in this block.
+            memcpy(block + slot*data_size, received_data, data_size);
+            slot_filled[slot] = 1;
+            ++(local_context->reordered_packets);
+        } else {
+            ++(local_context->duplicate_packets);
+            multilog(log,LOG_WARNING,"Discarding duplicate packet. frame counter %"PRIu64"\n",frame_counter);
+            continue;
+        }
+        local_context->packet_count = local_context->block_count*packets_per_block + expected_slot;
     }
 
-    gettimeofday(&end_time, NULL);
+    free(carry_buffer);
+    free(slot_filled);
+    return 0;
+}
 
-    double runtime = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec)/1e6;
-    multilog(log,LOG_INFO,"Finished. Sent %"PRIu64" packets in %lf s. Total packets dropped: %"PRIu64", %lf%%\n",local_context->packet_count,runtime,local_context->dropped_packets,100.0*(double)local_context->dropped_packets/(double)local_context->packet_count);
 
-    // Part 4. Some cleanup when we are finished.
-    //
-    // unlock write access from the HDU, performs implicit EOD
-    if (dada_hdu_unlock_write (hdu) < 0) {
-        multilog (log, LOG_ERR, "dada_hdu_unlock_write failed\n");
-        return EXIT_FAILURE;
-    }
+/*
+ * Copy a packet of good data to the end of the DADA buffer.
+ */
+void write_packet(local_context_t* local_context, char* data, uint64_t data_size) {
+    output_write(local_context, data, data_size);
+    packet_fill_good_packet(local_context->fill, data);
+    ++(local_context->packet_count); // increment packet counter
+}
 
-    // disconnect from HDU
-    if (dada_hdu_disconnect (hdu) < 0) {
-        multilog (log, LOG_ERR, "could not unlock write on hdu\n");
-    }
 
-    // free local memory
-    free(source_name);
-    free(telescope_id);
-    free(receiver_name);
-    free(receiver_basis);
-    free(utc_start);
-    if (header_file != 0) {
-        free(header_file);
+/*
+ * Append data to the output, which is either the DADA buffer or the files written by dada_disk.
+ * When excising, reordering or requantising, data are gathered into the stage block first.
+ * The signature matches packet_fill_writer_t.
+ */
+void output_write(void* context, const char* data, uint64_t bytes) {
+    local_context_t* local_context = (local_context_t*)context;
+    if (local_context->stage_size) {
+        while (bytes > 0) {
+            if (local_context->stage == NULL) {
+                output_open_block(local_context);
+            }
+            const uint64_t n = MIN(bytes, local_context->stage_size - local_context->stage_fill);
+            memcpy(local_context->stage + local_context->stage_fill, data, n);
+            local_context->stage_fill += n;
+            data += n;
+            bytes -= n;
+            if (local_context->stage_fill == local_context->stage_size) {
+                output_close_block(local_context, local_context->stage_size);
+            }
+        }
+    } else if (local_context->disk) {
+        dada_disk_write(local_context->disk, data, bytes);
+    } else {
+        ipcio_write(local_context->hdu->data_block, (char*)data, bytes);
     }
-    free(monitor_string);
+}
+
 
-    return EXIT_SUCCESS;
+/*
+ * Get the next whole block of the output to fill in place.
+ */
+char* output_open_block(local_context_t* local_context) {
+    if (local_context->stage_size) {
+        if (local_context->pipeline) {
+            local_context->pipeline_block = pipeline_acquire(local_context->pipeline);
+            local_context->stage = local_context->pipeline_block->data;
+        }
+        local_context->stage_fill = 0;
+        return local_context->stage;
+    }
+    return destination_open_block(local_context);
 }
 
 
+/*
+ * Hand back the block from output_open_block with bytes of data in it. When going through stage
+ * blocks, this is where they are excised and copied into the DADA buffer or disk block, or passed
+ * to the pipeline to do that on other cores.
+ */
+void output_close_block(local_context_t* local_context, uint64_t bytes) {
+    if (!local_context->stage_size) {
+        destination_close_block(local_context, bytes);
+        return;
+    }
+    if (local_context->pipeline) {
+        local_context->pipeline_block->bytes = bytes;
+        pipeline_submit(local_context->pipeline, local_context->pipeline_block);
+        local_context->pipeline_block = NULL;
+        local_context->stage = NULL;
+    } else {
+        transform_block(local_context, local_context->stage, bytes);
+        write_block(local_context, local_context->stage, bytes);
+    }
+    local_context->stage_fill = 0;
+}
 
-#define VLEN 16
-void *socket_receive_thread(void* thread_context){
-    local_context_t* context = (local_context_t*)thread_context;
-    multilog_t* log = context->log;
-    struct timeval tv;
 
-    multilog(log, LOG_INFO, "bind to core %d\n", context->socket_listen_cpu_core);
+/*
+ * Write out a partly filled stage block left by output_write, and wait for the pipeline to finish.
+ */
+void output_flush(local_context_t* local_context) {
+    if (local_context->stage && local_context->stage_fill > 0) {
+        output_close_block(local_context, local_context->stage_fill);
+    }
+    if (local_context->pipeline) {
+        pipeline_stop(local_context->pipeline);
+        // a block we still hold goes back in the pool when the pipeline is started again.
+        local_context->pipeline_block = NULL;
+        local_context->stage = NULL;
+    }
+    if (local_context->spill) {
+        spill_flush(local_context->spill);
+    }
+}
 
 
-    // Set up the listening socket address
-    multilog(log,LOG_INFO, "Listen IP   : %s\n",context->ip_address);
-    multilog(log,LOG_INFO, "Listen Port : %d\n",context->portnum);
+/*
+ * Work done on a stage block in place before it is written: spectral kurtosis excision and
+ * feeding the filterbank.
+ */
+void transform_block(local_context_t* local_context, char* block, uint64_t bytes) {
+    if (local_context->spectral_kurtosis) {
+        spectral_kurtosis_apply(local_context->spectral_kurtosis, block, bytes);
+    }
+    if (local_context->filterbank) {
+        filterbank_submit(local_context->filterbank, block, bytes);
+    }
+}
 
-    struct sockaddr_in socket_address;
-    memset(&socket_address,0,sizeof(socket_address)); // default set to zero.
-    socket_address.sin_family=AF_INET; // set IP
-    socket_address.sin_addr.s_addr=inet_addr(context->ip_address); // set ip address to listen on
-    socket_address.sin_port = htons(context->portnum); // set port to listen on
 
-    // create and bind the socket
-    int sock = socket(AF_INET, SOCK_DGRAM, 0); // UDP/IP
-    int ret = bind(sock, (struct sockaddr *) &socket_address, sizeof(socket_address));
-    if (ret != 0) {
-        multilog(log,LOG_ERR,"error binding socket ERRNO=%d %s\n",errno,strerror(errno));
-        return NULL;
+/*
+ * Copy a stage block into the DADA buffer or disk block, reordering and requantising on the way.
+ */
+void write_block(local_context_t* local_context, const char* block, uint64_t bytes) {
+    char* destination = destination_open_block(local_context);
+    uint64_t output_bytes = bytes;
+    if (local_context->requantise) {
+        const char* data = block;
+        if (local_context->corner_turn) {
+            corner_turn_apply(local_context->corner_turn, data, local_context->stage_scratch, bytes);
+            data = local_context->stage_scratch;
+        }
+        output_bytes = requantise_apply(local_context->requantise, data, destination, bytes);
+    } else if (local_context->corner_turn) {
+        corner_turn_apply(local_context->corner_turn, block, destination, bytes);
+    } else {
+        memcpy(destination, block, bytes);
     }
+    destination_close_block(local_context, output_bytes);
+}
 
-    multilog(log,LOG_INFO,"Socket bind ok\n");
 
-    // set a socket timeout to detect no packets comming
-    tv.tv_sec = 5; // 5 second
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-    int size = 32 * 1024 * 1024; // 2MB
-    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, (socklen_t)sizeof(int));
+void transform_stage(void* context, pipeline_block_t* block) {
+    transform_block((local_context_t*)context, block->data, block->bytes);
+}
 
-    //    int disable = 1;
-    //    setsockopt(sock, SOL_SOCKET, SO_NO_CHECK, (void*)&disable, sizeof(disable));
+
+void write_stage(void* context, pipeline_block_t* block) {
+    write_block((local_context_t*)context, block->data, block->bytes);
+}
 
 
-    // read and ignore a bunch of packets at the start
-    for (unsigned i = 0; i < 100000 ; ++i ){
-        unsigned char* packet_buffer = context->buffer + (context->buffer_write_position%NUM_PACKET_BUFFERS)*PACKET_BUFFER_SIZE;
-        ssize_t size = recv(sock, (void*)packet_buffer,PACKET_BUFFER_SIZE,0);
+char* destination_open_block(local_context_t* local_context) {
+    if (local_context->disk) {
+        return dada_disk_open_block(local_context->disk);
     }
+    if (local_context->spill) {
+        return spill_open_block(local_context->spill);
+    }
+    uint64_t block_id;
+    return ipcio_open_block_write(local_context->hdu->data_block, &block_id);
+}
 
 
+void destination_close_block(local_context_t* local_context, uint64_t bytes) {
+    if (local_context->disk) {
+        dada_disk_close_block(local_context->disk, bytes);
+    } else if (local_context->spill) {
+        spill_close_block(local_context->spill, bytes);
+    } else {
+        ipcio_close_block_write(local_context->hdu->data_block, bytes);
+    }
+}
 
-    // Can try using recvmmsg may be more efficient
-    //       struct mmsghdr msgs[VLEN];
-    //       struct iovec iovecs[VLEN];
-    while(1) {
-        // find the next location in the ring buffer
-        unsigned char* packet_buffer = context->buffer + (context->buffer_write_position%NUM_PACKET_BUFFERS)*PACKET_BUFFER_SIZE;
-        ssize_t retval = recv(sock, (void*)packet_buffer,PACKET_BUFFER_SIZE,0);
-        /*           memset(msgs, 0, sizeof(msgs));
-                     for (int i=0; i < VLEN; ++i){
-                     iovecs[i].iov_base         = context->buffer + ((context->buffer_write_position+i)%NUM_PACKET_BUFFERS)*PACKET_BUFFER_SIZE;
-                     iovecs[i].iov_len          = PACKET_BUFFER_SIZE;
-                     msgs[i].msg_hdr.msg_iov    = &iovecs[i];
-                     msgs[i].msg_hdr.msg_iovlen = 1;
-                     }
-                     int retval = recvmmsg(sock, msgs, VLEN, 0, &tv);
-                     */
-        if (retval == -1 ){
-            if (errno==EAGAIN) {
-                multilog(log,LOG_WARNING,"No packets recieved within 5 seconds... [ERRNO=%d '%s']\n",errno,strerror(errno));
-                continue;
-            } else {
-                multilog(log,LOG_ERR,"error getting packet ERRNO=%d %s\n",errno,strerror(errno));
-                continue;
-            }
+
+/*
+ * Write out any packets in the reorder window that follow on from what has been written already.
+ */
+void drain_reorder_window(local_context_t* local_context, uint64_t* expected_frame_counter,
+        uint64_t frame_increment, uint64_t data_size) {
+    reorder_window_t* window = local_context->reorder_window;
+    while (window->held && local_context->packet_count < local_context->packets_to_read) {
+        char* data = reorder_window_take(window, *expected_frame_counter/frame_increment);
+        if (data == NULL) {
+            break;
         }
-        //context->buffer_write_position += retval;
-        ++(context->buffer_write_position);
+        write_packet(local_context, data, data_size);
+        *expected_frame_counter += frame_increment;
     }
+}
 
 
-    return NULL;
+/*
+ * Move the reorder window on until frame_counter fits in it. Packets it held are written out,
+ * and any that never arrived are declared lost and replaced with fill, a whole run at a time.
+ */
+void advance_reorder_window(local_context_t* local_context, uint64_t* expected_frame_counter,
+        uint64_t frame_counter, uint64_t frame_increment, uint64_t data_size) {
+    reorder_window_t* window = local_context->reorder_window;
+    const uint64_t depth = window->depth;
+
+    while ((frame_counter - *expected_frame_counter)/frame_increment >= depth
+            && local_context->packet_count < local_context->packets_to_read) {
+        const uint64_t expected_packet = *expected_frame_counter/frame_increment;
+
+        // the missing run ends at the next packet we are holding, or where frame_counter fits in the window.
+        uint64_t ndropped = (frame_counter - *expected_frame_counter)/frame_increment - depth + 1;
+        for (uint64_t i = 1; window->held && i < ndropped && i < depth; ++i) {
+            if (reorder_window_holds(window, expected_packet + i)) {
+                ndropped = i;
+                break;
+            }
+        }
+        if (ndropped > local_context->packets_to_read - local_context->packet_count) {
+            // the gap runs past the end of the observation.
+            ndropped = local_context->packets_to_read - local_context->packet_count;
+        }
+
+        local_context->dropped_packets += ndropped;
+        // write fill data where the packets were dropped, all in one go.
+        packet_fill_write(local_context->fill, output_write, local_context, ndropped);
+        if (local_context->mask) {
+            missing_mask_mark(local_context->mask, local_context->packet_count, ndropped);
+        }
+        multilog(local_context->log,LOG_WARNING,"Filled %"PRIu64" missing packets with %s... %"PRIu64"/%"PRIu64"\n",
+                ndropped,packet_fill_policy_name(local_context->fill_policy),frame_counter,*expected_frame_counter);
+        local_context->packet_count += ndropped;
+        *expected_frame_counter += ndropped*frame_increment;
 
+        drain_reorder_window(local_context, expected_frame_counter, frame_increment, data_size);
+    }
 }
 
 
-unsigned char* get_next_packet_buffer(local_context_t* local_context){
-    while (local_context->buffer_read_position >= local_context->buffer_write_position) {
-        usleep(4); // wait 4 microseconds for a new packet.
+/*
+ * Publish the monitor variables to the shared memory statistics segment.
+ */
+void publish_stats(char* state, local_context_t* context) {
+    udpdb_stats_data_t data;
+    memset(&data,0,sizeof(data));
+    struct timespec now;
+
+    data.magic = UDPDB_STATS_MAGIC;
+    data.version = UDPDB_STATS_VERSION;
+    data.size = sizeof(data);
+    data.pid = getpid();
+    data.dada_key = context->dada_key;
+    data.stream_index = context->stream_index;
+    if (strcmp(state,"WAITING") == 0) {
+        data.state = UDPDB_STATE_WAITING;
+    } else if (strcmp(state,"RUNNING") == 0) {
+        data.state = UDPDB_STATE_RUNNING;
+    } else if (strcmp(state,"FINISHED") == 0) {
+        data.state = UDPDB_STATE_FINISHED;
+    } else if (strcmp(state,"IDLE") == 0) {
+        data.state = UDPDB_STATE_IDLE;
+    } else if (strcmp(state,"ERROR") == 0) {
+        data.state = UDPDB_STATE_ERROR;
+    } else {
+        data.state = UDPDB_STATE_STARTING;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    data.update_time_ns = now.tv_sec*1000000000LL + now.tv_nsec;
+    data.updates = ++(context->stats_updates);
+
+    data.packet_count = context->packet_count;
+    data.dropped_packets = context->dropped_packets;
+    data.block_count = context->block_count;
+    data.packets_to_read = context->packets_to_read;
+    data.seconds_per_packet = context->seconds_per_packet;
+
+    data.buffer_lag = context->buffer_lag;
+    data.max_buffer_lag = context->max_buffer_lag;
+    data.recent_buffer_lag = context->recent_buffer_lag;
+    data.number_of_overruns = context->number_of_overruns;
+    data.ring_slots = context->ring_slots;
+    memcpy(data.lag_histogram, context->lag_histogram, sizeof(data.lag_histogram));
+
+    data.packets_received = context->packets_received;
+    data.receive_syscalls = context->receive_syscalls;
+    data.reordered_packets = context->reordered_packets;
+    data.late_packets = context->late_packets;
+    data.duplicate_packets = context->duplicate_packets;
+
+    // this is called from the capture thread.
+    data.capture_cpu = sched_getcpu();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    data.capture_cpu_time_ns = now.tv_sec*1000000000LL + now.tv_nsec;
+    data.socket_cpu = -1;
+    // with several socket threads, the first one's core and the CPU time of them all.
+    for (int i = 0; i < context->nreceivers; ++i) {
+        receiver_t* receiver = &context->receivers[i];
+        if (receiver->have_thread_clock && clock_gettime(receiver->thread_clock, &now) == 0) {
+            if (data.socket_cpu < 0) {
+                data.socket_cpu = receiver->core;
+            }
+            data.socket_cpu_time_ns += now.tv_sec*1000000000LL + now.tv_nsec;
+        }
     }
 
-    // monitoring stuff to check max buffer lag
-    local_context->buffer_lag = (local_context->buffer_write_position)-(local_context->buffer_read_position);
-    local_context->max_buffer_lag = MAX(local_context->buffer_lag,local_context->max_buffer_lag); // MAX macro
-    local_context->recent_buffer_lag = MAX(local_context->buffer_lag,local_context->recent_buffer_lag);
-
-    int overrun = local_context->buffer_lag/NUM_PACKET_BUFFERS;
+    if (context->pipeline) {
+        update_pipeline_stats(context);
+    }
+    data.pipeline_nstages = context->pipeline_nstages;
+    data.pipeline_source_waits = context->pipeline_source_waits;
+    data.pipeline_source_wait_ns = context->pipeline_source_wait_ns;
+    memcpy(data.pipeline_stages, context->pipeline_stages, sizeof(data.pipeline_stages));
+
+    if (context->filterbank) {
+        context->filterbank_blocks = context->filterbank->submitted;
+        context->filterbank_dropped_blocks = context->filterbank->dropped_blocks;
+    }
+    data.filterbank_blocks = context->filterbank_blocks;
+    data.filterbank_dropped_blocks = context->filterbank_dropped_blocks;
+
+    if (context->spill) {
+        // written by whichever thread writes the blocks; a snapshot a block out of date is fine.
+        data.spill_slots = context->spill->nslots;
+        data.spill_depth = atomic_load_explicit(&context->spill->depth, memory_order_relaxed);
+        data.spill_max_depth = atomic_load_explicit(&context->spill->max_depth, memory_order_relaxed);
+        data.spill_blocks = atomic_load_explicit(&context->spill->spilled_blocks, memory_order_relaxed);
+        data.spill_dropped_blocks = atomic_load_explicit(&context->spill->dropped_blocks, memory_order_relaxed);
+        data.spill_dropped_bytes = atomic_load_explicit(&context->spill->dropped_bytes, memory_order_relaxed);
+    }
 
-    if (overrun) {
-        multilog(local_context->log,LOG_WARNING,"OVERRUN!!! %"PRIdFAST64" - %"PRIdFAST64" = %d\n",local_context->buffer_write_position,local_context->buffer_read_position,(local_context->buffer_write_position)-(local_context->buffer_read_position));
+    if (context->spectral_kurtosis) {
+        data.sk_windows = context->spectral_kurtosis->windows;
+        data.sk_flagged_windows = context->spectral_kurtosis->flagged_windows;
+        data.sk_block_flagged_fraction = context->spectral_kurtosis->block_flagged_fraction;
     }
 
-    local_context->buffer_read_position += overrun * NUM_PACKET_BUFFERS;
-    local_context->number_of_overruns += overrun;
+    data.observations = context->observations;
+
+    if (context->timing) {
+        _Static_assert(PACKET_TIMING_BINS == UDPDB_STATS_TIMING_BINS, "timing histograms differ in size");
+        data.timestamp_source = context->timing->source;
+        memcpy(data.receive_latency_histogram, context->timing->receive_latency, sizeof(data.receive_latency_histogram));
+        memcpy(data.ring_latency_histogram, context->timing->ring_latency, sizeof(data.ring_latency_histogram));
+        memcpy(data.packet_gap_histogram, context->timing->packet_gap, sizeof(data.packet_gap_histogram));
+        // the socket threads each keep their own receive histograms.
+        for (int i = 0; i < context->nreceivers; ++i) {
+            const packet_timing_t* timing = context->receivers[i].timing;
+            for (int bin = 0; timing && bin < UDPDB_STATS_TIMING_BINS; ++bin) {
+                data.receive_latency_histogram[bin] += timing->receive_latency[bin];
+                data.packet_gap_histogram[bin] += timing->packet_gap[bin];
+            }
+        }
+        data.pps_arrival_ns = context->pps_arrival_ns;
+        data.pps_offset_ns = context->pps_offset_ns;
+    }
 
-    unsigned char* packet_buffer = local_context->buffer + (local_context->buffer_read_position%NUM_PACKET_BUFFERS)*PACKET_BUFFER_SIZE;
-    ++(local_context->buffer_read_position);
-    return packet_buffer;
+    udpdb_stats_publish(context->stats, &data);
 }
 
 
-unsigned char* get_random_packet_buffer(local_context_t* local_context){
-    int64_t random_bufpos = rand()%NUM_PACKET_BUFFERS;
-    unsigned char* packet_buffer = local_context->buffer + random_bufpos*PACKET_BUFFER_SIZE;
-    return packet_buffer;
+void update_pipeline_stats(local_context_t* context) {
+    pipeline_t* pipeline = context->pipeline;
+    context->pipeline_nstages = MIN(pipeline->nstages, UDPDB_STATS_MAX_STAGES);
+    context->pipeline_source_waits = atomic_load(&pipeline->source_waits);
+    context->pipeline_source_wait_ns = atomic_load(&pipeline->source_wait_ns);
+    for (int i = 0; i < context->pipeline_nstages; ++i) {
+        const pipeline_stage_t* stage = &pipeline->stages[i];
+        udpdb_stats_stage_t* out = &context->pipeline_stages[i];
+        strncpy(out->name, stage->name, sizeof(out->name)-1);
+        out->core = stage->core;
+        out->blocks = atomic_load(&stage->blocks);
+        out->busy_ns = atomic_load(&stage->busy_ns);
+        out->idle_ns = atomic_load(&stage->idle_ns);
+        out->queue_depth = pipeline_queue_depth(pipeline, i);
+        out->max_queue_depth = atomic_load(&stage->max_queue_depth);
+    }
 }
 
 
+/*
+ * Report progress: to the shared memory statistics, and as a line of text to the monitor pipe if there is one.
+ */
 void monitor(int monitor_fd, char* state, local_context_t* context){
+    if (context->stats) {
+        publish_stats(state, context);
+    }
     if (monitor_fd > 0) {
+        // each stream writes whole lines, which are short enough that writes to the pipe are atomic.
+        char monitor_string[STRLEN];
         // fill string
-        snprintf(monitor_string, STRLEN, "%s %"PRId64" %"PRId64" %"PRId64" %"PRId64" %lf %"PRId64" %"PRId64" %"PRId64" %"PRId64" %d\n",
+        const int_fast64_t syscalls = context->receive_syscalls;
+        const int_fast64_t packets_received = context->packets_received;
+        const double packets_per_syscall = syscalls ? (double)packets_received/(double)syscalls : 0.0;
+        snprintf(monitor_string, STRLEN, "%s %"PRId64" %"PRId64" %"PRId64" %"PRId64" %lf %"PRId64" %"PRId64" %"PRId64" %"PRId64" %d %"PRIdFAST64" %lf %d %"PRId64" %"PRId64" %"PRId64"\n",
                 state,
                 context->packet_count, context->dropped_packets,
                 context->block_count,context->packets_to_read, context->seconds_per_packet,
                 context->buffer_lag, context->max_buffer_lag, context->recent_buffer_lag,
-                context->number_of_overruns,NUM_PACKET_BUFFERS);
+                context->number_of_overruns,(int)context->ring_slots,
+                syscalls, packets_per_syscall, context->stream_index,
+                context->reordered_packets, context->late_packets, context->duplicate_packets);
         monitor_string[STRLEN-1]='\0';
         // write string
         write(monitor_fd,monitor_string,strlen(monitor_string));
     }
 }
-
-
-int band_select_to_frames_per_heap(uint64_t band_select) {
-    //https://drive.google.com/file/d/1Dcp3hzQ37FaQsrmJCuuU-ry1TO9biQ90/view?usp=sharing
-    switch (band_select){
-        case 0:
-            return 64;
-        case 2:
-            return 74;
-        case 4:
-            return 86;
-        case 6:
-            return 103;
-        case 8:
-            return 128;
-        case 10:
-            return 171;
-        case 12:
-            return 256;
-        case 14:
-            return 512;
-        default:
-            return -1;
-    }
-}
-int band_select_to_data_size(uint64_t band_select) {
-    int words_per_frame = 8-band_select/2;
-    return band_select_to_frames_per_heap(band_select) * words_per_frame*8; // 
-}
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE // for recvmmsg
 #include "decode_spead.h"
+#include "byte_stats.h"
 
 // these definitely are:
 #include <stdlib.h>
@@ -6,6 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -19,17 +22,31 @@
 #define STRLEN 1024
 
 #define PACKET_BUFFER_SIZE 8192
+// default and largest number of packets read by one recvmmsg call.
+#define DEFAULT_RECV_BATCH 64
+#define MAX_RECV_BATCH 1024
+
+#define SECONDS_PER_FRAME 0.0625e-6
 
 
 //******
 //
-// Read packets from a port and wait for the frame counter to reset before
-// copying them into a DADA buffer. Copy until specified number of seconds
-// has elapsed.
+// Read packets from a port for the requested time and report the distribution of sample values,
+// overall and for each channel and polarisation. Used to set RequantGain and ADCAttenuation.
+//
+// Every packet in the requested time is counted, so this needs to keep up with the full
+// stream on one core: packets are read with recvmmsg and histogrammed per byte position
+// (see byte_stats.h), which is a few times faster than the line rate.
 //
 //******
 
 
+double cpu_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
 
 int main (int argc, char **argv)
 {
@@ -40,11 +57,10 @@ int main (int argc, char **argv)
     char verbose = 0;
     char arg;
     struct timeval tv;
+    int batch_size = DEFAULT_RECV_BATCH;
 
     double time_to_sample=10; // seconds
 
-    unsigned char* packet_buffer = malloc(PACKET_BUFFER_SIZE);
-
     strncpy(ip_address,"10.0.3.1",128);
 
 
@@ -54,11 +70,18 @@ int main (int argc, char **argv)
 
     multilog(log,LOG_DEBUG,"Debug verbosity\n");
 
-    while ((arg = getopt(argc, argv, "p:vI:T:")) != -1) {
+    while ((arg = getopt(argc, argv, "p:vB:I:T:")) != -1) {
         switch (arg) {
             case 'v':
                 verbose=1;
                 break;
+            case 'B':
+                sscanf(optarg,"%d",&batch_size);
+                if (batch_size < 1 || batch_size > MAX_RECV_BATCH) {
+                    multilog(log,LOG_ERR, "receive batch size must be between 1 and %d\n", MAX_RECV_BATCH);
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'I':
                 strncpy(ip_address,optarg,128);
                 break;
@@ -70,12 +93,10 @@ int main (int argc, char **argv)
                 break;
         }
     }
-    multilog(log,LOG_INFO,"Read approx %lf seconds of data\n",time_to_sample);
-
-
-    double packets_per_second = 100e3; // approx 400MBps / 4kB packets..
+    multilog(log,LOG_INFO,"Read %lf seconds of data\n",time_to_sample);
 
-    uint64_t packets_to_read = time_to_sample*packets_per_second;
+    // stop once the frame counter has moved on by this much, so we see exactly the requested time.
+    const uint64_t frames_to_read = time_to_sample / SECONDS_PER_FRAME;
 
     // Part 1. Initialise everything ...
 
@@ -104,21 +125,48 @@ int main (int argc, char **argv)
     tv.tv_sec = 5; // 5 second
     tv.tv_usec = 0;
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    int rcvbuf = 32 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, (socklen_t)sizeof(int));
+
+    unsigned char* packet_buffers = malloc((size_t)batch_size*PACKET_BUFFER_SIZE);
+    struct mmsghdr* msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    struct iovec* iovecs = calloc(batch_size, sizeof(struct iovec));
+    for (int i=0; i < batch_size; ++i){
+        iovecs[i].iov_base         = packet_buffers + (size_t)i*PACKET_BUFFER_SIZE;
+        iovecs[i].iov_len          = PACKET_BUFFER_SIZE;
+        msgs[i].msg_hdr.msg_iov    = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    uint_fast8_t* byte_value_histogram = malloc(sizeof(uint_fast8_t)*256);
-    memset(byte_value_histogram,0,sizeof(uint_fast8_t)*256);
+    byte_stats_t* stats = NULL;
+    uint64_t bytes_per_frame=0;
+    uint64_t expected_frame_counter=0;
+    uint64_t frames_elapsed=0; // including lost packets
     uint64_t frame_counter=0;
     uint64_t band_select=0;
     uint64_t data_size=0;
     char const* data_pointer=0;
+    unsigned char const* last_packet=0;
+    char const* last_data=0;
+    uint64_t last_data_size=0;
     ssize_t size=0;
+    spead_layout_t spead_layout;
+    spead_layout_init(&spead_layout);
+
+    uint64_t packets_counted=0;
+    uint64_t packets_lost=0;
+    uint64_t packets_skipped=0; // out of order, or a different band_select to the first packet.
+    uint64_t syscalls=0;
+    char finished=0;
+    double cpu_start = 0;
+    struct timeval start_time, end_time;
 
 
-    multilog(log,LOG_INFO,"Collect %"PRIu64" packets\n",packets_to_read);
-    for (uint64_t packet_counter = 0; packet_counter < packets_to_read; ++packet_counter) {
+    multilog(log,LOG_INFO,"Collect %"PRIu64" frames, reading up to %d packets per call\n",frames_to_read,batch_size);
+    while (!finished) {
 
-        size = recv(sock, (void*)packet_buffer,PACKET_BUFFER_SIZE,0);
-        if (size == -1 ){
+        int npackets = recvmmsg(sock, msgs, batch_size, MSG_WAITFORONE, NULL);
+        if (npackets == -1 ){
             if (errno==EAGAIN) {
                 multilog(log,LOG_WARNING,"No packets recieved within 5 seconds... [ERRNO=%d '%s']\n",errno,strerror(errno));
                 break;
@@ -127,30 +175,122 @@ int main (int argc, char **argv)
                 break;
             }
         }
-        data_pointer = decode_roach2_spead_packet(packet_buffer, &data_size, &frame_counter, &band_select);
-        for (uint64_t i =0; i < data_size; ++i){
-            ++byte_value_histogram[(int)data_pointer[i]+128];
+        ++syscalls;
+
+        for (int i=0; i < npackets && !finished; ++i) {
+            unsigned char* packet_buffer = iovecs[i].iov_base;
+            data_pointer = decode_roach2_spead_packet_fast(&spead_layout, packet_buffer, &data_size, &frame_counter, &band_select);
+            if (data_pointer == NULL) {
+                continue;
+            }
+
+            if (stats == NULL) {
+                // words_per_frame as in band_select_to_data_size.
+                bytes_per_frame = (8 - band_select/2) * 8;
+                stats = byte_stats_create(bytes_per_frame);
+                if (stats == NULL) {
+                    multilog(log,LOG_ERR,"Cannot handle band_select=%"PRIu64"\n",band_select);
+                    return EXIT_FAILURE;
+                }
+                expected_frame_counter = frame_counter;
+                multilog(log,LOG_INFO,"band_select=%"PRIu64" data_size=%"PRIu64" bytes_per_frame=%"PRIu64"\n",band_select,data_size,bytes_per_frame);
+                gettimeofday(&start_time,NULL);
+                cpu_start = cpu_seconds();
+            }
+
+            if (frame_counter == 0 && expected_frame_counter > 0) {
+                // the 1PPS has reset the frame counter.
+                expected_frame_counter = 0;
+            }
+            if ((8 - band_select/2) * 8 != bytes_per_frame || frame_counter < expected_frame_counter) {
+                ++packets_skipped;
+                continue;
+            }
+            const uint64_t frames_per_packet = data_size / bytes_per_frame;
+            if (frame_counter > expected_frame_counter) {
+                packets_lost += (frame_counter - expected_frame_counter) / frames_per_packet;
+            }
+            frames_elapsed += frame_counter + frames_per_packet - expected_frame_counter;
+            expected_frame_counter = frame_counter + frames_per_packet;
+
+            byte_stats_add(stats, data_pointer, frames_per_packet);
+            ++packets_counted;
+            last_packet = packet_buffer;
+            last_data = data_pointer;
+            last_data_size = data_size;
+            size = msgs[i].msg_len;
+
+            if (frames_elapsed >= frames_to_read) {
+                finished=1;
+            }
         }
     }
 
+    if (stats == NULL) {
+        multilog(log,LOG_ERR,"No valid packets recieved\n");
+        return EXIT_FAILURE;
+    }
+    gettimeofday(&end_time,NULL);
+    const double cpu_used = cpu_seconds() - cpu_start;
+    const double elapsed = (end_time.tv_sec - start_time.tv_sec) + 1e-6*(end_time.tv_usec - start_time.tv_usec);
+
+    multilog(log,LOG_INFO,"Counted %"PRIu64" packets (%.3lf s of data) in %.3lf s using %.3lf s of CPU. lost: %"PRIu64" skipped: %"PRIu64" packets/syscall: %.1lf\n",
+            packets_counted,stats->frames*SECONDS_PER_FRAME,elapsed,cpu_used,packets_lost,packets_skipped,
+            (double)(packets_counted+packets_skipped)/syscalls);
+    if (!finished) {
+        multilog(log,LOG_WARNING,"Stopped before the requested %lf seconds of data\n",time_to_sample);
+    }
+
+    uint64_t byte_value_histogram[256];
+    byte_stats_histogram(stats, byte_value_histogram);
+
+    printf("---\n");
+    for (int i =-128; i < 128; ++i){
+        printf("% 4d %"PRIu64"\n",i,byte_value_histogram[i+128]);
+    }
+
+    // per channel and polarisation, combining the real and imaginary parts.
     printf("---\n");
-    for (int i =-128; i < 127; ++i){
-        printf("% 4d %"PRIdFAST8"\n",i,byte_value_histogram[i+128]);
+    printf("# chan pol     mean_re     mean_im         rms    kurtosis   clipped%%\n");
+    for (unsigned chan = 0; chan < bytes_per_frame/4; ++chan) {
+        for (unsigned pol = 0; pol < 2; ++pol) {
+            const unsigned re = (chan*2 + pol)*2;
+            const unsigned both[2] = {re, re+1};
+            byte_moments_t moments_re, moments_im, moments;
+            byte_stats_moments(stats, &both[0], 1, &moments_re);
+            byte_stats_moments(stats, &both[1], 1, &moments_im);
+            byte_stats_moments(stats, both, 2, &moments);
+            printf("%6u %3u % 11.4lf % 11.4lf % 11.4lf % 11.4lf % 10.5lf\n",chan,pol,
+                    moments_re.mean,moments_im.mean,moments.rms,moments.kurtosis,100.0*moments.clipped);
+        }
+    }
+    for (unsigned pol = 0; pol < 2; ++pol) {
+        unsigned positions[BYTE_STATS_MAX_FRAME_BYTES];
+        unsigned npositions = 0;
+        for (unsigned chan = 0; chan < bytes_per_frame/4; ++chan) {
+            positions[npositions++] = (chan*2 + pol)*2;
+            positions[npositions++] = (chan*2 + pol)*2 + 1;
+        }
+        byte_moments_t moments;
+        byte_stats_moments(stats, positions, npositions, &moments);
+        printf("#  all %3u % 11.4lf %11s % 11.4lf % 11.4lf % 10.5lf\n",pol,moments.mean,"",moments.rms,moments.kurtosis,100.0*moments.clipped);
     }
 
     FILE* dumpf = fopen("pkt.dmp","wb");
-    fwrite(packet_buffer,1,size,dumpf);
+    fwrite(last_packet,1,size,dumpf);
     fclose(dumpf);
     dumpf = fopen("data.dmp","wb");
 
-    fwrite(data_pointer,1,data_size,dumpf);
+    fwrite(last_data,1,last_data_size,dumpf);
     fclose(dumpf);
 
 
 
     // free local memory
-    free(packet_buffer);
-    free(byte_value_histogram);
+    byte_stats_destroy(stats);
+    free(packet_buffers);
+    free(msgs);
+    free(iovecs);
 
     return EXIT_SUCCESS;
 }
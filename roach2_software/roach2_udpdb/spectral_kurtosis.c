@@ -0,0 +1,213 @@
+/*
+ * Spectral kurtosis RFI excision on the capture side. See spectral_kurtosis.h.
+ */
+#include "spectral_kurtosis.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <immintrin.h>
+
+
+int spectral_kurtosis_parse(const char* spec, spectral_kurtosis_config_t* config) {
+    memset(config, 0, sizeof(spectral_kurtosis_config_t));
+    config->nsigma = SPECTRAL_KURTOSIS_DEFAULT_NSIGMA;
+    config->mode = SK_ZERO;
+
+    char* end;
+    config->m = strtoull(spec, &end, 10);
+    if (end == spec || config->m < 2 || config->m > SPECTRAL_KURTOSIS_MAX_M) {
+        return -1;
+    }
+    spec = end;
+    while (*spec == ':') {
+        ++spec;
+        if (strncmp(spec, "zero", 4) == 0) {
+            config->mode = SK_ZERO;
+            spec += 4;
+        } else if (strncmp(spec, "replace", 7) == 0) {
+            config->mode = SK_REPLACE;
+            spec += 7;
+        } else {
+            config->nsigma = strtod(spec, &end);
+            if (end == spec || config->nsigma <= 0) {
+                return -1;
+            }
+            spec = end;
+        }
+    }
+    return *spec == '\0' ? 0 : -1;
+}
+
+
+spectral_kurtosis_t* spectral_kurtosis_create(const spectral_kurtosis_config_t* config, uint64_t nchan,
+        const char* flags_filename, multilog_t* log) {
+    spectral_kurtosis_t* sk = malloc(sizeof(spectral_kurtosis_t));
+    memset(sk,0,sizeof(spectral_kurtosis_t));
+    sk->config = *config;
+    sk->nchan = nchan;
+    sk->log = log;
+    const double m = config->m;
+    const double sigma = sqrt(4.0*m*m / ((m-1)*(m+2)*(m+3)));
+    sk->lower = 1 - config->nsigma*sigma;
+    sk->upper = 1 + config->nsigma*sigma;
+    sk->s1 = calloc(nchan*2, sizeof(uint32_t));
+    sk->s2 = calloc(nchan*2, sizeof(uint64_t));
+    if (config->mode == SK_REPLACE) {
+        sk->clean = calloc(nchan*config->m*4, 1);
+    }
+    sk->use_avx2 = __builtin_cpu_supports("avx2") && nchan % 4 == 0;
+
+    if (flags_filename) {
+        sk->flags_file = fopen(flags_filename, "wb");
+        if (sk->flags_file == NULL) {
+            multilog(log,LOG_ERR,"Could not open spectral kurtosis flags file '%s' ERRNO=%d %s\n",flags_filename,errno,strerror(errno));
+            spectral_kurtosis_destroy(sk);
+            return NULL;
+        }
+        spectral_kurtosis_file_header_t header;
+        memset(&header,0,sizeof(header));
+        memcpy(header.magic, SPECTRAL_KURTOSIS_FLAGS_MAGIC, sizeof(header.magic));
+        header.nchan = nchan;
+        header.m = config->m;
+        header.nsigma = config->nsigma;
+        header.lower = sk->lower;
+        header.upper = sk->upper;
+        fwrite(&header, sizeof(header), 1, sk->flags_file);
+        multilog(log,LOG_INFO,"Writing spectral kurtosis flags to %s\n",flags_filename);
+    }
+
+    multilog(log,LOG_INFO,"Spectral kurtosis over %"PRIu64" samples, %s windows outside %.4lf..%.4lf%s\n",config->m,
+            config->mode == SK_REPLACE ? "replacing" : "zeroing",sk->lower,sk->upper,sk->use_avx2 ? ", with AVX2" : "");
+    return sk;
+}
+
+
+void spectral_kurtosis_destroy(spectral_kurtosis_t* sk) {
+    if (sk->flags_file) {
+        fclose(sk->flags_file);
+    }
+    free(sk->s1);
+    free(sk->s2);
+    free(sk->flags);
+    free(sk->clean);
+    free(sk);
+}
+
+
+// sums of power and power squared over the m samples of a window, for each channel and polarisation.
+static void accumulate_scalar(spectral_kurtosis_t* sk, const int8_t* window) {
+    const uint64_t npol = sk->nchan*2;
+    memset(sk->s1, 0, npol*sizeof(uint32_t));
+    memset(sk->s2, 0, npol*sizeof(uint64_t));
+    for (uint64_t t = 0; t < sk->config.m; ++t) {
+        const int8_t* frame = window + t*npol*2;
+        for (uint64_t cp = 0; cp < npol; ++cp) {
+            const uint32_t power = frame[cp*2]*frame[cp*2] + frame[cp*2+1]*frame[cp*2+1];
+            sk->s1[cp] += power;
+            sk->s2[cp] += (uint64_t)power*power;
+        }
+    }
+}
+
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(spectral_kurtosis_t* sk, const int8_t* window) {
+    const uint64_t frame_size = sk->nchan*4;
+    const __m256i low = _mm256_set1_epi64x(0xffffffff);
+    // each 16 bytes is 8 channels and polarisations.
+    for (uint64_t k = 0; k < frame_size/16; ++k) {
+        __m256i s1 = _mm256_setzero_si256();
+        __m256i s2_even = _mm256_setzero_si256();
+        __m256i s2_odd = _mm256_setzero_si256();
+        const int8_t* column = window + k*16;
+        for (uint64_t t = 0; t < sk->config.m; ++t) {
+            const __m256i values = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(column + t*frame_size)));
+            // re^2 + im^2, at most 2^15, so its square fits in 32 bits.
+            const __m256i power = _mm256_madd_epi16(values, values);
+            const __m256i power2 = _mm256_mullo_epi32(power, power);
+            s1 = _mm256_add_epi32(s1, power);
+            s2_even = _mm256_add_epi64(s2_even, _mm256_and_si256(power2, low));
+            s2_odd = _mm256_add_epi64(s2_odd, _mm256_srli_epi64(power2, 32));
+        }
+        uint64_t even[4], odd[4];
+        _mm256_storeu_si256((__m256i*)(sk->s1 + k*8), s1);
+        _mm256_storeu_si256((__m256i*)even, s2_even);
+        _mm256_storeu_si256((__m256i*)odd, s2_odd);
+        for (int i = 0; i < 4; ++i) {
+            sk->s2[k*8 + i*2] = even[i];
+            sk->s2[k*8 + i*2 + 1] = odd[i];
+        }
+    }
+}
+
+
+static char is_flagged(const spectral_kurtosis_t* sk, uint64_t channel) {
+    const double m = sk->config.m;
+    for (uint64_t cp = channel*2; cp < channel*2 + 2; ++cp) {
+        if (sk->s1[cp] == 0) {
+            continue;
+        }
+        const double s1 = sk->s1[cp];
+        const double estimate = (m+1)/(m-1) * (m*sk->s2[cp]/(s1*s1) - 1);
+        if (estimate < sk->lower || estimate > sk->upper) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+uint64_t spectral_kurtosis_apply(spectral_kurtosis_t* sk, char* block, uint64_t bytes) {
+    const uint64_t nchan = sk->nchan;
+    const uint64_t m = sk->config.m;
+    const uint64_t frame_size = nchan*4;
+    const uint64_t nwindows = bytes / frame_size / m;
+    if (nwindows > sk->max_windows) {
+        sk->flags = realloc(sk->flags, nwindows*nchan);
+        sk->max_windows = nwindows;
+    }
+
+    uint64_t flagged = 0;
+    for (uint64_t w = 0; w < nwindows; ++w) {
+        char* window = block + w*m*frame_size;
+        if (sk->use_avx2) {
+            accumulate_avx2(sk, (const int8_t*)window);
+        } else {
+            accumulate_scalar(sk, (const int8_t*)window);
+        }
+        for (uint64_t c = 0; c < nchan; ++c) {
+            const char flag = is_flagged(sk, c);
+            sk->flags[w*nchan + c] = flag;
+            char* clean = sk->clean ? sk->clean + c*m*4 : NULL;
+            if (flag) {
+                ++flagged;
+                for (uint64_t t = 0; t < m; ++t) {
+                    if (clean) {
+                        memcpy(window + t*frame_size + c*4, clean + t*4, 4);
+                    } else {
+                        memset(window + t*frame_size + c*4, 0, 4);
+                    }
+                }
+            } else if (clean) {
+                for (uint64_t t = 0; t < m; ++t) {
+                    memcpy(clean + t*4, window + t*frame_size + c*4, 4);
+                }
+            }
+        }
+    }
+
+    sk->windows += nwindows*nchan;
+    sk->flagged_windows += flagged;
+    sk->block_flagged_fraction = nwindows ? (double)flagged / (nwindows*nchan) : 0;
+    if (sk->flags_file) {
+        spectral_kurtosis_record_t record;
+        record.block_index = sk->block_index;
+        record.nwindows = nwindows;
+        fwrite(&record, sizeof(record), 1, sk->flags_file);
+        fwrite(sk->flags, 1, nwindows*nchan, sk->flags_file);
+    }
+    ++(sk->block_index);
+    return flagged;
+}
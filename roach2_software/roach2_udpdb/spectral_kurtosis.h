@@ -0,0 +1,90 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <multilog.h>
+
+#define SPECTRAL_KURTOSIS_FLAGS_MAGIC "R2SKFL01"
+#define SPECTRAL_KURTOSIS_DEFAULT_NSIGMA 3.0
+// the sum of power over a window has to fit in 32 bits.
+#define SPECTRAL_KURTOSIS_MAX_M 65536
+
+/*
+ * Spectral kurtosis RFI excision on 8-bit TFP blocks as they arrive from the ROACH2, done in place
+ * before any reordering or requantisation, so that neither the requantiser's statistics nor any
+ * downstream software see the RFI.
+ *
+ * Each block is cut into windows of m time samples. For each window, channel and polarisation
+ * the sums S1 and S2 of the power P = re^2 + im^2 and of P^2 give the estimator
+ *
+ *     SK = (m+1)/(m-1) * (m*S2/S1^2 - 1)
+ *
+ * which is 1 for Gaussian noise, with a variance of 4m^2/((m-1)(m+2)(m+3)) (Nita & Gary 2010). If
+ * SK for either polarisation is more than nsigma standard deviations from 1, the window of that
+ * channel is flagged, and both polarisations are either set to zero or, with replace, overwritten
+ * by the last window of the same channel that was not flagged. A window with no power at all,
+ * e.g. from missing packets, is never flagged. Samples at the end of a block that do not make a
+ * whole window are left alone.
+ *
+ * The flags can be written to a file, starting with a spectral_kurtosis_file_header_t, followed
+ * for every block by a spectral_kurtosis_record_t and then uint8_t flags[nwindows][nchan], 1 where
+ * the window was flagged. Channels are numbered as they arrive, before any reordering.
+ *
+ * With AVX2 the power sums are done for 8 channels and polarisations at a time, if nchan is a
+ * multiple of 4.
+ */
+typedef enum spectral_kurtosis_mode_t {
+    SK_ZERO,
+    SK_REPLACE
+} spectral_kurtosis_mode_t;
+
+typedef struct spectral_kurtosis_config_t {
+    uint64_t m; // samples per window
+    double nsigma;
+    spectral_kurtosis_mode_t mode;
+} spectral_kurtosis_config_t;
+
+typedef struct spectral_kurtosis_file_header_t {
+    char magic[8]; // SPECTRAL_KURTOSIS_FLAGS_MAGIC
+    uint64_t nchan;
+    uint64_t m;
+    double nsigma;
+    double lower; // SK thresholds
+    double upper;
+} spectral_kurtosis_file_header_t;
+
+typedef struct spectral_kurtosis_record_t {
+    uint64_t block_index;
+    uint64_t nwindows;
+} spectral_kurtosis_record_t;
+
+typedef struct spectral_kurtosis_t {
+    spectral_kurtosis_config_t config;
+    uint64_t nchan;
+    double lower, upper;
+
+    uint32_t* s1; // [nchan*2] for the current window
+    uint64_t* s2;
+    uint8_t* flags; // [nwindows][nchan] for the current block
+    uint64_t max_windows; // allocated size of flags
+    char* clean; // [nchan][m*4] last window of each channel not flagged, for replace
+
+    // totals, counting each channel of each window.
+    uint64_t block_index;
+    uint64_t windows;
+    uint64_t flagged_windows;
+    double block_flagged_fraction; // of the last block
+
+    FILE* flags_file;
+    char use_avx2;
+    multilog_t* log;
+} spectral_kurtosis_t;
+
+// parse m[:nsigma][:zero|replace]. Returns -1 if not understood.
+int spectral_kurtosis_parse(const char* spec, spectral_kurtosis_config_t* config);
+
+// flags_filename may be NULL.
+spectral_kurtosis_t* spectral_kurtosis_create(const spectral_kurtosis_config_t* config, uint64_t nchan,
+        const char* flags_filename, multilog_t* log);
+void spectral_kurtosis_destroy(spectral_kurtosis_t* sk);
+
+// flag and excise bytes (a multiple of nchan*4) of TFP data in place. Returns the number of windows flagged.
+uint64_t spectral_kurtosis_apply(spectral_kurtosis_t* sk, char* block, uint64_t bytes);
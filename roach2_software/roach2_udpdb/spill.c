@@ -0,0 +1,215 @@
+/*
+ * Spill-over for the output blocks when the DADA buffer is full. See spill.h
+ */
+#include "numa_memory.h"
+#include "spill.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+int spill_parse(const char* spec, uint64_t* bytes, char* dir, size_t dir_size) {
+    char* end;
+    const double megabytes = strtod(spec, &end);
+    if (end == spec || megabytes <= 0) {
+        return -1;
+    }
+    *bytes = megabytes*1024*1024;
+    dir[0] = '\0';
+    if (*end == ':') {
+        if (end[1] == '\0' || strlen(end + 1) >= dir_size) {
+            return -1;
+        }
+        strcpy(dir, end + 1);
+    } else if (*end != '\0') {
+        return -1;
+    }
+    return 0;
+}
+
+
+static char* map_spill_file(const char* dir, const char* name, size_t size, multilog_t* log) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/roach2_udpdb_spill_%s_XXXXXX", dir, name);
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        multilog(log,LOG_ERR,"Could not create spill file %s errno=%d %s\n",path,errno,strerror(errno));
+        return NULL;
+    }
+    char* data = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        multilog(log,LOG_ERR,"Could not map %"PRIu64" bytes of spill file %s errno=%d %s\n",(uint64_t)size,path,errno,strerror(errno));
+    }
+    // nobody else needs to find it, and it goes away with us.
+    unlink(path);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+
+spill_t* spill_create(ipcio_t* data_block, uint64_t block_size, uint64_t bytes, const char* dir, const char* name,
+        const memory_policy_t* memory, multilog_t* log) {
+    const uint64_t nslots = bytes/block_size > 0 ? bytes/block_size : 1;
+    // the scratch block for drops is after the slots.
+    const size_t size = (nslots + 1)*block_size;
+
+    spill_t* spill = calloc(1, sizeof(spill_t));
+    spill->data_block = data_block;
+    spill->block_size = block_size;
+    spill->nslots = nslots;
+    spill->log = log;
+    if (dir != NULL && dir[0] != '\0') {
+        spill->slots = map_spill_file(dir, name, size, log);
+        spill->map_size = size;
+        spill->file_backed = 1;
+    } else {
+        spill->slots = memory_alloc(size, memory, "spill", &spill->map_size, log);
+    }
+    if (spill->slots == NULL) {
+        free(spill);
+        return NULL;
+    }
+    // data entries and the runs of drops between them.
+    spill->queue_size = 2*nslots + 2;
+    spill->queue = calloc(spill->queue_size, sizeof(spill_entry_t));
+    multilog(log,LOG_INFO,"Spill of %"PRIu64" blocks of %"PRIu64" bytes %s%s\n",nslots,block_size,
+            spill->file_backed ? "in a file in " : "in memory", spill->file_backed ? dir : "");
+    return spill;
+}
+
+
+void spill_destroy(spill_t* spill) {
+    if (spill->file_backed) {
+        munmap(spill->slots, spill->map_size);
+    } else {
+        memory_free(spill->slots, spill->map_size);
+    }
+    free(spill->queue);
+    free(spill);
+}
+
+
+static uint64_t clear_blocks(spill_t* spill) {
+    return ipcbuf_get_nclear((ipcbuf_t*)spill->data_block);
+}
+
+
+/*
+ * Write up to max waiting blocks into the DADA buffer, oldest first. Without wait, stop as soon as
+ * it has no clear block.
+ */
+static void drain(spill_t* spill, uint64_t max, char wait) {
+    for (uint64_t n = 0; n < max && spill->queue_tail != spill->queue_head; ++n) {
+        if (!wait && clear_blocks(spill) == 0) {
+            break;
+        }
+        spill_entry_t* entry = &spill->queue[spill->queue_tail % spill->queue_size];
+        uint64_t block_id;
+        char* block = ipcio_open_block_write(spill->data_block, &block_id);
+        if (entry->dropped) {
+            memset(block, 0, entry->bytes);
+        } else {
+            memcpy(block, spill->slots + spill->first_slot*spill->block_size, entry->bytes);
+            spill->first_slot = (spill->first_slot + 1) % spill->nslots;
+            --(spill->slots_used);
+            atomic_fetch_add_explicit(&spill->drained_blocks, 1, memory_order_relaxed);
+        }
+        ipcio_close_block_write(spill->data_block, entry->bytes);
+        atomic_fetch_sub_explicit(&spill->depth, 1, memory_order_relaxed);
+        if (--(entry->count) == 0) {
+            ++(spill->queue_tail);
+        }
+    }
+    if (spill->waiting && atomic_load_explicit(&spill->depth, memory_order_relaxed) == 0) {
+        multilog(spill->log,LOG_INFO,"DADA buffer caught up, nothing left waiting in the spill\n");
+        spill->waiting = 0;
+    }
+}
+
+
+static void end_drop_run(spill_t* spill) {
+    if (spill->dropping) {
+        multilog(spill->log,LOG_WARNING,"Dropped output blocks %"PRIu64" to %"PRIu64" (%"PRIu64" blocks), they will be zeros\n",
+                spill->drop_run_start, spill->output_blocks - 1, spill->output_blocks - spill->drop_run_start);
+        spill->dropping = 0;
+    }
+}
+
+
+char* spill_open_block(spill_t* spill) {
+    drain(spill, SPILL_DRAIN_BLOCKS, 0);
+    if (spill->queue_tail == spill->queue_head && clear_blocks(spill) > 0) {
+        end_drop_run(spill);
+        spill->open = SPILL_BLOCK_DADA;
+        uint64_t block_id;
+        return ipcio_open_block_write(spill->data_block, &block_id);
+    }
+    if (!spill->waiting) {
+        multilog(spill->log,LOG_WARNING,"DADA buffer full at output block %"PRIu64", spilling\n",spill->output_blocks);
+        spill->waiting = 1;
+    }
+    if (spill->slots_used < spill->nslots) {
+        end_drop_run(spill);
+        spill->open = SPILL_BLOCK_SLOT;
+        return spill->slots + ((spill->first_slot + spill->slots_used) % spill->nslots)*spill->block_size;
+    }
+    if (!spill->dropping) {
+        multilog(spill->log,LOG_WARNING,"Spill full at output block %"PRIu64", dropping blocks\n",spill->output_blocks);
+        spill->dropping = 1;
+        spill->drop_run_start = spill->output_blocks;
+    }
+    spill->open = SPILL_BLOCK_DROPPED;
+    return spill->slots + spill->nslots*spill->block_size;
+}
+
+
+void spill_close_block(spill_t* spill, uint64_t bytes) {
+    if (spill->open == SPILL_BLOCK_DADA) {
+        ipcio_close_block_write(spill->data_block, bytes);
+    } else if (spill->open == SPILL_BLOCK_SLOT) {
+        spill_entry_t* entry = &spill->queue[spill->queue_head++ % spill->queue_size];
+        entry->dropped = 0;
+        entry->bytes = bytes;
+        entry->count = 1;
+        ++(spill->slots_used);
+        atomic_fetch_add_explicit(&spill->spilled_blocks, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&spill->depth, 1, memory_order_relaxed);
+    } else if (spill->open == SPILL_BLOCK_DROPPED) {
+        spill_entry_t* last = &spill->queue[(spill->queue_head - 1) % spill->queue_size];
+        if (spill->queue_head != spill->queue_tail && last->dropped && last->bytes == bytes) {
+            ++(last->count);
+        } else {
+            spill_entry_t* entry = &spill->queue[spill->queue_head++ % spill->queue_size];
+            entry->dropped = 1;
+            entry->bytes = bytes;
+            entry->count = 1;
+        }
+        atomic_fetch_add_explicit(&spill->dropped_blocks, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&spill->dropped_bytes, bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&spill->depth, 1, memory_order_relaxed);
+    }
+    const uint64_t depth = atomic_load_explicit(&spill->depth, memory_order_relaxed);
+    if (depth > atomic_load_explicit(&spill->max_depth, memory_order_relaxed)) {
+        atomic_store_explicit(&spill->max_depth, depth, memory_order_relaxed);
+    }
+    spill->open = SPILL_BLOCK_NONE;
+    ++(spill->output_blocks);
+}
+
+
+void spill_flush(spill_t* spill) {
+    end_drop_run(spill);
+    const uint64_t depth = atomic_load_explicit(&spill->depth, memory_order_relaxed);
+    if (depth > 0) {
+        multilog(spill->log,LOG_INFO,"Waiting to write %"PRIu64" blocks from the spill into the DADA buffer\n",depth);
+    }
+    drain(spill, UINT64_MAX, 1);
+    spill->output_blocks = 0;
+}
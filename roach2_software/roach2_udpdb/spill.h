@@ -0,0 +1,92 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <multilog.h>
+#include <dada_hdu.h>
+
+// memory_policy_t comes from numa_memory.h, which must be included first.
+
+// spilled blocks written into the DADA buffer for each block opened, so the spill empties at one
+// block per block once the reader has caught up.
+#define SPILL_DRAIN_BLOCKS 2
+
+/*
+ * Spill-over for the output blocks when the DADA buffer is full, so that a reader that stalls for
+ * a while does not make the capture wait in ipcio_open_block_write and overrun its packet rings.
+ *
+ * Before opening a DADA block we check that the buffer has a clear one. If it does not, or if
+ * there are already blocks waiting, the block is filled in a slot of the spill instead: a bounded
+ * set of blocks in RAM, or in a file on a fast local disk. The waiting blocks are written into the
+ * DADA buffer in order, a few each time a block is opened, as space frees up.
+ *
+ * If the spill is full as well, the block is dropped whole. So that everything after it keeps the
+ * right time, a block of zeros of the same size takes its place in the DADA buffer once there is
+ * room. Every dropped run is logged with the indices of the blocks in the output, and counted.
+ */
+typedef enum spill_block_t {
+    SPILL_BLOCK_NONE = 0,
+    SPILL_BLOCK_DADA, // opened in the DADA buffer
+    SPILL_BLOCK_SLOT, // in a spill slot, to be written out later
+    SPILL_BLOCK_DROPPED // in the scratch block, to be replaced with zeros
+} spill_block_t;
+
+// a block waiting for the DADA buffer. A run of dropped blocks of the same size takes one entry.
+typedef struct spill_entry_t {
+    char dropped;
+    uint64_t bytes;
+    uint64_t count;
+} spill_entry_t;
+
+typedef struct spill_t {
+    ipcio_t* data_block;
+    uint64_t block_size;
+    uint64_t nslots;
+    char* slots; // nslots blocks, and a scratch block after them for dropped blocks.
+    size_t map_size;
+    char file_backed;
+    multilog_t* log;
+
+    // waiting blocks, oldest first. Slots are used and freed in the same order, so the slot of the
+    // n'th waiting data block is (first_slot + n) % nslots.
+    spill_entry_t* queue;
+    uint64_t queue_size;
+    uint64_t queue_head; // entries added
+    uint64_t queue_tail; // entries written out
+    uint64_t slots_used;
+    uint64_t first_slot;
+    spill_block_t open; // where the block handed out by spill_open_block is.
+
+    uint64_t output_blocks; // blocks handed out, i.e. the index in the output of the next one.
+    // counts, for the statistics. Written only by the thread writing the output, which is the
+    // pipeline's last stage with -J, and read by the capture thread.
+    atomic_uint_fast64_t spilled_blocks;
+    atomic_uint_fast64_t drained_blocks;
+    atomic_uint_fast64_t depth; // blocks waiting, spilled or dropped.
+    atomic_uint_fast64_t max_depth;
+    atomic_uint_fast64_t dropped_blocks;
+    atomic_uint_fast64_t dropped_bytes;
+    uint64_t drop_run_start; // output index of the first block of the current run of drops.
+    char dropping;
+    char waiting; // there have been blocks waiting since the DADA buffer was last caught up with.
+} spill_t;
+
+/*
+ * Spill of bytes (rounded down to whole blocks, at least one) for blocks of block_size. With dir,
+ * the slots are in a file there, removed as soon as it is mapped; otherwise in memory from
+ * memory_alloc. Returns NULL on failure.
+ */
+spill_t* spill_create(ipcio_t* data_block, uint64_t block_size, uint64_t bytes, const char* dir, const char* name,
+        const memory_policy_t* memory, multilog_t* log);
+void spill_destroy(spill_t* spill);
+
+// the next output block to fill in place, never waiting for the DADA buffer.
+char* spill_open_block(spill_t* spill);
+// hand it back with bytes of data in it.
+void spill_close_block(spill_t* spill, uint64_t bytes);
+
+// write everything still waiting into the DADA buffer, waiting for space. Called at the end of an
+// observation, after which output block indices start again from zero.
+void spill_flush(spill_t* spill);
+
+// parse size_mb[:dir]. Returns -1 if not understood.
+int spill_parse(const char* spec, uint64_t* bytes, char* dir, size_t dir_size);
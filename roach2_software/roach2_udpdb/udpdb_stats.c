@@ -0,0 +1,55 @@
+/*
+ * Writer side of the shared memory statistics segment. See udpdb_stats.h
+ */
+
+#include "udpdb_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+udpdb_stats_segment_t* udpdb_stats_create(uint32_t dada_key) {
+    char name[64];
+    snprintf(name, sizeof(name), UDPDB_STATS_NAME_FORMAT, dada_key);
+
+    int fd = shm_open(name, O_CREAT|O_RDWR, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(udpdb_stats_segment_t)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    udpdb_stats_segment_t* segment = mmap(NULL, sizeof(udpdb_stats_segment_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        return NULL;
+    }
+
+    // a previous run may have left its numbers here, so start again from an even sequence.
+    atomic_store_explicit(&segment->sequence, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memset(&segment->data, 0, sizeof(udpdb_stats_data_t));
+    atomic_store_explicit(&segment->sequence, 2, memory_order_release);
+    return segment;
+}
+
+
+void udpdb_stats_publish(udpdb_stats_segment_t* segment, const udpdb_stats_data_t* data) {
+    const uint64_t sequence = atomic_load_explicit(&segment->sequence, memory_order_relaxed);
+    atomic_store_explicit(&segment->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&segment->data, data, sizeof(udpdb_stats_data_t));
+    atomic_store_explicit(&segment->sequence, sequence + 2, memory_order_release);
+}
+
+
+/*
+ * Unmap the segment. It is left in place so that the final numbers can still be read; the next run
+ * on the same key reuses it.
+ */
+void udpdb_stats_destroy(udpdb_stats_segment_t* segment) {
+    munmap(segment, sizeof(udpdb_stats_segment_t));
+}
@@ -0,0 +1,139 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+
+/*
+ * Shared memory statistics published by roach2_udpdb, one segment per stream.
+ *
+ * The segment is a POSIX shared memory object called /roach2_udpdb_<key> (key in hex, e.g.
+ * /dev/shm/roach2_udpdb_dada). The writer updates it under a seqlock: the sequence number is odd
+ * whilst an update is in progress, so a reader copies the data, checks the sequence number did not
+ * change and was even, and tries again otherwise. The writer never waits for readers, and readers
+ * can sample as often as they like.
+ *
+ * Readers should use udpdb_stats_attach/udpdb_stats_read from libudpdb_stats.so, which check the
+ * magic number and version. Fields are only ever added to the end of udpdb_stats_data_t; anything
+ * else changes UDPDB_STATS_VERSION.
+ */
+
+#define UDPDB_STATS_MAGIC 0x52325354 // "R2ST"
+#define UDPDB_STATS_VERSION 1
+#define UDPDB_STATS_NAME_FORMAT "/roach2_udpdb_%x"
+#define UDPDB_STATS_MAX_STAGES 4
+// lag histogram bin i counts packets read with a lag of [2^(i-1), 2^i) packets, bin 0 is no lag.
+#define UDPDB_STATS_LAG_BINS 32
+// timing histogram bin i counts intervals of [2^(i-1), 2^i) ns, see packet_timing.h.
+#define UDPDB_STATS_TIMING_BINS 32
+
+enum udpdb_stats_state {
+    UDPDB_STATE_STARTING = 0,
+    UDPDB_STATE_WAITING = 1, // waiting for the 1PPS
+    UDPDB_STATE_RUNNING = 2,
+    UDPDB_STATE_FINISHED = 3,
+    UDPDB_STATE_ERROR = 4,
+    UDPDB_STATE_IDLE = 5 // daemon waiting for a START command
+};
+
+typedef struct udpdb_stats_stage_t {
+    char name[16];
+    int32_t core;
+    int32_t padding;
+    int64_t blocks;
+    int64_t busy_ns; // time spent working on blocks
+    int64_t idle_ns; // time spent waiting for them
+    int64_t queue_depth; // blocks waiting for this stage
+    int64_t max_queue_depth;
+} udpdb_stats_stage_t;
+
+typedef struct udpdb_stats_data_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // sizeof(udpdb_stats_data_t) in the writer
+    int64_t pid;
+    uint32_t dada_key;
+    int32_t stream_index;
+    int32_t state; // enum udpdb_stats_state
+    int32_t padding;
+    int64_t update_time_ns; // CLOCK_REALTIME of the last update
+    uint64_t updates; // number of updates so far
+
+    // progress
+    int64_t packet_count;
+    int64_t dropped_packets;
+    int64_t block_count;
+    int64_t packets_to_read;
+    double seconds_per_packet;
+
+    // internal buffer
+    int64_t buffer_lag;
+    int64_t max_buffer_lag;
+    int64_t recent_buffer_lag;
+    int64_t number_of_overruns;
+    int64_t ring_slots;
+    int64_t lag_histogram[UDPDB_STATS_LAG_BINS];
+
+    // receiving
+    int64_t packets_received;
+    int64_t receive_syscalls;
+    int64_t reordered_packets;
+    int64_t late_packets;
+    int64_t duplicate_packets;
+
+    // threads
+    int32_t capture_cpu; // core the capture thread last ran on
+    int32_t socket_cpu; // core the socket thread is bound to, -1 if there is none
+    int64_t capture_cpu_time_ns; // CPU time used by the capture thread
+    int64_t socket_cpu_time_ns; // CPU time used by the socket thread
+
+    // spectral kurtosis, counting each channel of each window. All zero without -K.
+    int64_t sk_windows;
+    int64_t sk_flagged_windows;
+    double sk_block_flagged_fraction; // in the last block written
+
+    // filterbank, see filterbank.h. Zero without -G.
+    int64_t filterbank_blocks;
+    int64_t filterbank_dropped_blocks;
+
+    // pipeline stages, see pipeline.h. pipeline_nstages is zero without -J.
+    int32_t pipeline_nstages;
+    int32_t pipeline_padding;
+    int64_t pipeline_source_waits; // times the capture thread waited for a free block
+    int64_t pipeline_source_wait_ns;
+    udpdb_stats_stage_t pipeline_stages[UDPDB_STATS_MAX_STAGES];
+
+    // observations completed by this process, which can be more than one with -d.
+    int64_t observations;
+
+    // kernel receive timestamps, see packet_timing.h. All zero without -U.
+    int32_t timestamp_source; // 1 software, 2 hardware
+    int32_t timing_padding;
+    int64_t receive_latency_histogram[UDPDB_STATS_TIMING_BINS]; // from the NIC until the packet is in the ring
+    int64_t ring_latency_histogram[UDPDB_STATS_TIMING_BINS]; // from the ring until it is copied towards the DADA block
+    int64_t packet_gap_histogram[UDPDB_STATS_TIMING_BINS]; // between the arrival of one packet and the next
+    int64_t pps_arrival_ns; // arrival of the last frame counter reset packet, ns since the epoch
+    int64_t pps_offset_ns; // of that arrival from the nearest UTC second
+
+    // spill-over for when the DADA buffer is full, see spill.h. All zero without -o.
+    int64_t spill_slots; // blocks the spill can hold
+    int64_t spill_depth; // blocks waiting for the DADA buffer, spilled or dropped
+    int64_t spill_max_depth;
+    int64_t spill_blocks; // blocks that have been through the spill
+    int64_t spill_dropped_blocks; // blocks dropped because the spill was full, written as zeros
+    int64_t spill_dropped_bytes;
+} udpdb_stats_data_t;
+
+typedef struct udpdb_stats_segment_t {
+    _Alignas(64) atomic_uint_fast64_t sequence;
+    _Alignas(64) udpdb_stats_data_t data;
+} udpdb_stats_segment_t;
+
+// writer, in roach2_udpdb. Returns NULL and sets errno on failure.
+udpdb_stats_segment_t* udpdb_stats_create(uint32_t dada_key);
+void udpdb_stats_publish(udpdb_stats_segment_t* segment, const udpdb_stats_data_t* data);
+void udpdb_stats_destroy(udpdb_stats_segment_t* segment);
+
+// reader, in libudpdb_stats.so
+typedef struct udpdb_stats_reader_t udpdb_stats_reader_t;
+udpdb_stats_reader_t* udpdb_stats_attach(uint32_t dada_key);
+int udpdb_stats_read(udpdb_stats_reader_t* reader, udpdb_stats_data_t* data);
+void udpdb_stats_detach(udpdb_stats_reader_t* reader);
+uint64_t udpdb_stats_data_size(void);
@@ -0,0 +1,83 @@
+/*
+ * Reader side of the shared memory statistics segment, built as libudpdb_stats.so so that it can be
+ * used from python (see nunabe/udpdb_stats.py). See udpdb_stats.h
+ */
+
+#include "udpdb_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+// give up if the writer is always part way through an update.
+#define READ_ATTEMPTS 1000
+
+struct udpdb_stats_reader_t {
+    const udpdb_stats_segment_t* segment;
+};
+
+
+udpdb_stats_reader_t* udpdb_stats_attach(uint32_t dada_key) {
+    char name[64];
+    snprintf(name, sizeof(name), UDPDB_STATS_NAME_FORMAT, dada_key);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    const udpdb_stats_segment_t* segment = mmap(NULL, sizeof(udpdb_stats_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        return NULL;
+    }
+
+    udpdb_stats_reader_t* reader = malloc(sizeof(udpdb_stats_reader_t));
+    reader->segment = segment;
+    return reader;
+}
+
+
+/*
+ * Copy a consistent snapshot of the statistics. Returns 0 on success, -1 if no consistent copy could
+ * be made or the segment is from an incompatible version, and 1 if nothing has been published yet.
+ */
+int udpdb_stats_read(udpdb_stats_reader_t* reader, udpdb_stats_data_t* data) {
+    udpdb_stats_segment_t* segment = (udpdb_stats_segment_t*)reader->segment;
+    for (unsigned attempt = 0; attempt < READ_ATTEMPTS; ++attempt) {
+        const uint64_t before = atomic_load_explicit(&segment->sequence, memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(data, (const void*)&segment->data, sizeof(udpdb_stats_data_t));
+        atomic_thread_fence(memory_order_acquire);
+        const uint64_t after = atomic_load_explicit(&segment->sequence, memory_order_relaxed);
+        if (before != after) {
+            continue;
+        }
+
+        if (data->magic == 0) {
+            return 1;
+        }
+        if (data->magic != UDPDB_STATS_MAGIC || data->version != UDPDB_STATS_VERSION) {
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+
+void udpdb_stats_detach(udpdb_stats_reader_t* reader) {
+    munmap((void*)reader->segment, sizeof(udpdb_stats_segment_t));
+    free(reader);
+}
+
+
+uint64_t udpdb_stats_data_size(void) {
+    return sizeof(udpdb_stats_data_t);
+}